@@ -11,10 +11,12 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
 #include "cmsys.h"
 #include "cmbbs.h"
 #include "common.h"
 #include "var.h"
+#include "fnv_hash.h"
 
 #include "modes.h" // for DEBUGSLEEPING
 
@@ -156,28 +158,146 @@ attach_check_SHM(int version, int SHM_t_size)
  * 
  * the bbs exits if it can't attach to the shared memory or the hash is not
  * loaded yet.
+ *
+ * SHM->uhash is an open addressed (linear probing) table of (hash, uid)
+ * slots, 8 per cache line. SHM->uhash_key[] runs parallel to the slots and
+ * keeps the lowercased, zero padded userid, so a candidate is verified with
+ * one fixed width compare whose address does not depend on the slot content
+ * (both loads can be in flight together). Deletion shifts the following
+ * cluster back, no tombstones.
+ *
+ * Free passwd slots (userid "") would all share one home slot and make a
+ * long cluster, so they are kept in the bitmap SHM->uhash_free[] instead,
+ * where dosearchuser("") finds one.
  */
 
+#if (1<<UHASH_BITS) < MAX_USERS*3/2
+#error "UHASH_BITS is too small for MAX_USERS, open addressing needs spare slots."
+#endif
+#if UHASH_KEYLEN < IDLEN + 1
+#error "UHASH_KEYLEN must hold IDLEN."
+#endif
+
+#define UHASH_MASK  ((1<<UHASH_BITS) - 1)
+
+/**
+ * Builds the lowercased, zero padded key of userid and returns its hash,
+ * the same value as StringHash(userid), in one pass.
+ */
+static unsigned int
+uhash_make_key(char *key, const char *userid)
+{
+    unsigned int h = FNV1_32_INIT;
+    unsigned char c;
+    int i;
+
+    memset(key, 0, UHASH_KEYLEN);
+    for (i = 0; i < IDLEN && (c = userid[i]); i++) {
+	if (c >= 'a' && c <= 'z')
+	    c -= 'a' - 'A';
+	h = (h ^ c) * FNV_32_PRIME;
+	key[i] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+    return h;
+}
+
+static inline int
+uhash_key_equal(const char *a, const char *b)
+{
+    uint64_t a0, a1, b0, b1;
+    memcpy(&a0, a, 8); memcpy(&a1, a + 8, 8);
+    memcpy(&b0, b, 8); memcpy(&b1, b + 8, 8);
+    return a0 == b0 && a1 == b1;
+}
+
+/* marks slot n free (userid "") or not */
+void
+uhash_set_free(int n, int isfree)
+{
+    uint32_t bit = 1U << (n % 32);
+    uint32_t old;
+
+    if (isfree) {
+	old = __sync_fetch_and_or(&SHM->uhash_free[n / 32], bit);
+	if (!(old & bit))
+	    __sync_add_and_fetch(&SHM->uhash_nfree, 1);
+    } else {
+	old = __sync_fetch_and_and(&SHM->uhash_free[n / 32], ~bit);
+	if (old & bit)
+	    __sync_sub_and_fetch(&SHM->uhash_nfree, 1);
+    }
+}
+
+int
+uhash_is_free(int n)
+{
+    return (SHM->uhash_free[n / 32] >> (n % 32)) & 1;
+}
+
+/* returns the uid of a free slot, or 0 */
+static int
+uhash_find_free(void)
+{
+    int i;
+
+    if (SHM->uhash_nfree <= 0)
+	return 0;
+    for (i = 0; i < (MAX_USERS + 31) / 32; i++)
+	if (SHM->uhash_free[i])
+	    return i * 32 + __builtin_ctz(SHM->uhash_free[i]) + 1;
+    return 0;
+}
+
 void
 add_to_uhash(int n, const char *id)
 {
-    int            *p, h = StringHash(id)%(1<<HASH_BITS);
+    char            key[UHASH_KEYLEN];
+    unsigned int    h, i;
     int             times;
     strlcpy(SHM->userid[n], id, sizeof(SHM->userid[n]));
+    if (!SHM->userid[n][0]) {
+	uhash_set_free(n, 1);
+	return;
+    }
+    h = uhash_make_key(key, SHM->userid[n]);
+    i = h & UHASH_MASK;
 
-    p = &(SHM->hash_head[h]);
-
-    for (times = 0; times < MAX_USERS && *p != -1; ++times)
-	p = &(SHM->next_in_hash[*p]);
+    for (times = 0; times <= UHASH_MASK && SHM->uhash[i].uid; ++times)
+	i = (i + 1) & UHASH_MASK;
 
-    if (times >= MAX_USERS)
+    if (times > UHASH_MASK)
     {
 	// abort_bbs(0);
 	fprintf(stderr, "add_to_uhash: exceed max users.\r\n");
 	exit(0);
     }
 
-    SHM->next_in_hash[*p = n] = -1;
+    memcpy(SHM->uhash_key[i], key, UHASH_KEYLEN);
+    SHM->uhash[i].tag = h;
+    SHM->uhash[i].uid = n + 1;
+}
+
+/**
+ * Removes slot i from uhash, moving back entries of the same probe cluster
+ * that would become unreachable.
+ */
+void
+remove_uhash_slot(unsigned int i)
+{
+    unsigned int j = i, home;
+
+    for (j = (j + 1) & UHASH_MASK; SHM->uhash[j].uid; j = (j + 1) & UHASH_MASK) {
+	home = SHM->uhash[j].tag & UHASH_MASK;
+	// move j back to the hole unless its home lies in (i, j]
+	if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+	    SHM->uhash[i] = SHM->uhash[j];
+	    memcpy(SHM->uhash_key[i], SHM->uhash_key[j], UHASH_KEYLEN);
+	    i = j;
+	}
+    }
+    SHM->uhash[i].uid = 0;
+    SHM->uhash[i].tag = 0;
+    memset(SHM->uhash_key[i], 0, UHASH_KEYLEN);
 }
 
 void
@@ -187,45 +307,59 @@ remove_from_uhash(int n)
  * note: after remove_from_uhash(), you should add_to_uhash() (likely with a
  * different name)
  */
-    int             h = StringHash(SHM->userid[n])%(1<<HASH_BITS);
-    int            *p = &(SHM->hash_head[h]);
+    char            key[UHASH_KEYLEN];
+    unsigned int    i;
     int             times;
 
-    for (times = 0; times < MAX_USERS && (*p != -1 && *p != n); ++times)
-	p = &(SHM->next_in_hash[*p]);
+    if (!SHM->userid[n][0]) {
+	uhash_set_free(n, 0);
+	return;
+    }
+    i = uhash_make_key(key, SHM->userid[n]) & UHASH_MASK;
+    for (times = 0; times <= UHASH_MASK && SHM->uhash[i].uid &&
+	 SHM->uhash[i].uid != n + 1; ++times)
+	i = (i + 1) & UHASH_MASK;
 
-    if (times >= MAX_USERS)
+    if (times > UHASH_MASK)
     {
 	// abort_bbs(0);
 	fprintf(stderr, "remove_from_uhash: current SHM exceed max users.\r\n");
 	exit(0);
     }
 
-    if (*p == n)
-	*p = SHM->next_in_hash[n];
+    if (SHM->uhash[i].uid == n + 1)
+	remove_uhash_slot(i);
 }
 
-#if (1<<HASH_BITS)*10 < MAX_USERS
-#warning "Suggest to use bigger HASH_BITS for better searchuser() performance,"
-#warning "searchuser() average chaining MAX_USERS/(1<<HASH_BITS) times."
-#endif
-
 int
 dosearchuser(const char *userid, char *rightid)
 {
-    int             h, p, times;
+    char            key[UHASH_KEYLEN];
+    unsigned int    h, i;
+    int             times, uid;
     STATINC(STAT_SEARCHUSER);
-    h = StringHash(userid)%(1<<HASH_BITS);
-    p = SHM->hash_head[h];
 
-    for (times = 0; times < MAX_USERS && p != -1 && p < MAX_USERS ; ++times) {
-	if (strcasecmp(SHM->userid[p], userid) == 0) {
-	    if(userid[0] && rightid) strcpy(rightid, SHM->userid[p]);
-	    return p + 1;
+    if (strnlen(userid, IDLEN + 1) > IDLEN)
+	return 0;
+    if (!userid[0])
+	return uhash_find_free();
+    BEGINLAT(LAT_SEARCHUSER);
+    h = uhash_make_key(key, userid);
+
+    for (i = h & UHASH_MASK, times = 0; times <= UHASH_MASK;
+	 i = (i + 1) & UHASH_MASK, ++times) {
+	if (!(uid = SHM->uhash[i].uid))
+	    break;
+	if (SHM->uhash[i].tag != h || uid > MAX_USERS)
+	    continue;
+	if (uhash_key_equal(SHM->uhash_key[i], key)) {
+	    if (rightid) strcpy(rightid, SHM->userid[uid - 1]);
+	    ENDLAT(LAT_SEARCHUSER);
+	    return uid;
 	}
-	p = SHM->next_in_hash[p];
     }
 
+    ENDLAT(LAT_SEARCHUSER);
     return 0;
 }
 
@@ -259,114 +393,492 @@ setuserid(int num, const char *userid)
     }
 }
 
-userinfo_t     *
-search_ulist_pid(int pid)
+/*
+ * section - utmp index
+ *
+ * SHM->UTMPidx[type][0..UTMPidxnumber-1] keeps uinfo[] slots sorted by
+ * userid, uid and pid. Writers (login/logout) serialize on UTMPidxlock and
+ * bump UTMPidxseq around each change; readers never lock but retry a lookup
+ * if the sequence moved, so a fresh login is visible immediately instead of
+ * after the next utmpsortd pass.
+ */
+
+#define UTMPIDX_READ_RETRY  (64)
+
+static int
+utmpindex_cmp(int type, const userinfo_t *u, const char *userid, int key)
 {
-    register int    i = 0, j, start = 0, end = SHM->UTMPnumber - 1;
-    int *ulist;
-    register userinfo_t *u;
-    if (end == -1)
-	return NULL;
-    ulist = SHM->sorted[SHM->currsorted][8];
-    for (i = ((start + end) / 2);; i = (start + end) / 2) {
-	u = &SHM->uinfo[ulist[i]];
-	j = pid - u->pid;
-	if (!j) {
-	    return u;
-	}
-	if (end == start) {
-	    break;
-	} else if (i == start) {
-	    i = end;
-	    start = end;
-	} else if (j > 0)
-	    start = i;
+    switch (type) {
+	case UTMPIDX_USERID:
+	    return strcasecmp(u->userid, userid);
+	case UTMPIDX_UID:
+	    return (u->uid > key) - (u->uid < key);
+	default:
+	    return (u->pid > key) - (u->pid < key);
+    }
+}
+
+// first position in index whose key is >= (or > if upper) the given one.
+static int
+utmpindex_bound(int type, int n, const char *userid, int key, int upper)
+{
+    const int *list = SHM->UTMPidx[type];
+    int lo = 0, hi = n, mid, j, r;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	j = list[mid];
+	// a slot may be torn while a writer is moving it; the caller
+	// retries on sequence change so any direction is fine here.
+	if (!VALID_USHM_ENTRY(j))
+	    r = -1;
 	else
-	    end = i;
+	    r = utmpindex_cmp(type, &SHM->uinfo[j], userid, key);
+	if (r < 0 || (upper && r == 0))
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * pid based spin lock living in SHM, shared by all processes.
+ * @return 1 if the lock was taken over from a holder that died, so the data
+ *         it protects may be half updated.
+ */
+int
+shm_spin_lock(volatile int *lock)
+{
+    int self = getpid(), owner, spin = 0;
+
+    while (!__sync_bool_compare_and_swap(lock, 0, self)) {
+	if (++spin % 64) {
+	    sched_yield();
+	    continue;
+	}
+	owner = *lock;
+	if (owner > 0 && kill(owner, 0) < 0 && errno == ESRCH &&
+	    __sync_bool_compare_and_swap(lock, owner, self))
+	    return 1;
+	usleep(1000);
     }
     return 0;
 }
 
+void
+shm_spin_unlock(volatile int *lock)
+{
+    __sync_lock_release(lock);
+}
+
+static void utmpindex_rebuild_locked(void);
+
+static void
+utmpindex_lock(void)
+{
+    // writer died while holding the lock: resync.
+    if (shm_spin_lock(&SHM->UTMPidxlock))
+	utmpindex_rebuild_locked();
+}
+
+static void
+utmpindex_unlock(void)
+{
+    shm_spin_unlock(&SHM->UTMPidxlock);
+}
+
+static void
+utmpindex_write_begin(void)
+{
+    // an odd sequence left by a dead writer is already "in update"
+    if (!(SHM->UTMPidxseq & 1))
+	SHM->UTMPidxseq++;
+    __sync_synchronize();
+}
+
+static void
+utmpindex_write_end(void)
+{
+    __sync_synchronize();
+    SHM->UTMPidxseq++;
+}
+
+static int
+utmpindex_find_slot(int type, int n)
+{
+    const int *list = SHM->UTMPidx[type];
+    int i;
+    for (i = 0; i < SHM->UTMPidxnumber; i++)
+	if (list[i] == n)
+	    return i;
+    return -1;
+}
+
+void
+utmpindex_add(int n)
+{
+    const userinfo_t *u;
+    int type, pos, count;
+
+    if (!VALID_USHM_ENTRY(n))
+	return;
+    u = &SHM->uinfo[n];
+
+    utmpindex_lock();
+    count = SHM->UTMPidxnumber;
+    if (count >= USHM_SIZE || utmpindex_find_slot(UTMPIDX_PID, n) >= 0) {
+	utmpindex_unlock();
+	return;
+    }
+
+    utmpindex_write_begin();
+    for (type = 0; type < UTMPIDX_MAX; type++) {
+	int *list = SHM->UTMPidx[type];
+	pos = utmpindex_bound(type, count, u->userid,
+			      type == UTMPIDX_UID ? u->uid : u->pid, 1);
+	memmove(list + pos + 1, list + pos, sizeof(int) * (count - pos));
+	list[pos] = n;
+    }
+    SHM->UTMPidxnumber = count + 1;
+    utmpindex_write_end();
+    utmpindex_unlock();
+}
+
+void
+utmpindex_remove(int n)
+{
+    int type, pos, count;
+
+    if (!VALID_USHM_ENTRY(n))
+	return;
+
+    utmpindex_lock();
+    count = SHM->UTMPidxnumber;
+    // keys of a dying entry may be garbage, so look up by slot number.
+    if (utmpindex_find_slot(UTMPIDX_PID, n) < 0) {
+	utmpindex_unlock();
+	return;
+    }
+
+    utmpindex_write_begin();
+    for (type = 0; type < UTMPIDX_MAX; type++) {
+	int *list = SHM->UTMPidx[type];
+	if ((pos = utmpindex_find_slot(type, n)) < 0)
+	    continue;
+	memmove(list + pos, list + pos + 1, sizeof(int) * (count - pos - 1));
+    }
+    SHM->UTMPidxnumber = count - 1;
+    utmpindex_write_end();
+    utmpindex_unlock();
+}
+
+static int
+cmputmpidx_userid(const void *i, const void *j)
+{
+    return strcasecmp(SHM->uinfo[*(int*)i].userid,
+		      SHM->uinfo[*(int*)j].userid);
+}
+
+static int
+cmputmpidx_uid(const void *i, const void *j)
+{
+    return SHM->uinfo[*(int*)i].uid - SHM->uinfo[*(int*)j].uid;
+}
+
+static int
+cmputmpidx_pid(const void *i, const void *j)
+{
+    return SHM->uinfo[*(int*)i].pid - SHM->uinfo[*(int*)j].pid;
+}
+
+static void
+utmpindex_rebuild_locked(void)
+{
+    int i, count = 0;
+
+    utmpindex_write_begin();
+    for (i = 0; i < USHM_SIZE; i++)
+	if (SHM->uinfo[i].pid)
+	    SHM->UTMPidx[UTMPIDX_USERID][count++] = i;
+    memcpy(SHM->UTMPidx[UTMPIDX_UID], SHM->UTMPidx[UTMPIDX_USERID],
+	   sizeof(int) * count);
+    memcpy(SHM->UTMPidx[UTMPIDX_PID], SHM->UTMPidx[UTMPIDX_USERID],
+	   sizeof(int) * count);
+    qsort(SHM->UTMPidx[UTMPIDX_USERID], count, sizeof(int), cmputmpidx_userid);
+    qsort(SHM->UTMPidx[UTMPIDX_UID], count, sizeof(int), cmputmpidx_uid);
+    qsort(SHM->UTMPidx[UTMPIDX_PID], count, sizeof(int), cmputmpidx_pid);
+    SHM->UTMPidxnumber = count;
+    utmpindex_write_end();
+}
+
+/**
+ * Rebuilds all live indexes from uinfo[], for recovery (utmpfix) and
+ * daemon startup.
+ */
+void
+utmpindex_rebuild(void)
+{
+    utmpindex_lock();
+    utmpindex_rebuild_locked();
+    utmpindex_unlock();
+}
+
+/**
+ * Copies a consistent snapshot of index 'type' into list.
+ * @return number of entries copied.
+ */
+int
+utmpindex_snapshot(int type, int *list)
+{
+    unsigned int seq;
+    int count, tries = 0;
+
+    do {
+	seq = SHM->UTMPidxseq;
+	__sync_synchronize();
+	count = SHM->UTMPidxnumber;
+	if (count < 0 || count > USHM_SIZE)
+	    count = 0;
+	memcpy(list, SHM->UTMPidx[type], sizeof(int) * count);
+	__sync_synchronize();
+    } while ((seq & 1 || seq != SHM->UTMPidxseq) &&
+	     ++tries < UTMPIDX_READ_RETRY && sched_yield() == 0);
+
+    return count;
+}
+
 userinfo_t     *
-search_ulistn(int uid, int unum)
+search_ulist_pid(int pid)
 {
-    register int    i = 0, j, start = 0, end = SHM->UTMPnumber - 1;
-    int *ulist;
-    register userinfo_t *u;
-    if (end == -1)
+    unsigned int seq;
+    int i, n, tries = 0;
+    userinfo_t *u = NULL;
+
+    if (pid <= 0)
 	return NULL;
-    ulist = SHM->sorted[SHM->currsorted][7];
-    for (i = ((start + end) / 2);; i = (start + end) / 2) {
-	u = &SHM->uinfo[ulist[i]];
-	j = uid - u->uid;
-	if (j == 0) {
-	    for (; i > 0 && uid == SHM->uinfo[ulist[i - 1]].uid; --i)
-		;/* Ĥ@ */
-	    // piaip Tue Jan  8 09:28:03 CST 2008
-	    // many people bugged about that their utmp have invalid
-	    // entry on record.
-	    // we found them caused by crash process (DEBUGSLEEPING) which
-	    // may occupy utmp entries even after process was killed.
-	    // because the memory is invalid, it is not safe for those process
-	    // to wipe their utmp entry. it should be done by some external
-	    // daemon.
-	    // however, let's make a little workaround here...
-	    for (; unum > 0 && i >= 0 && ulist[i] >= 0 &&
-		    SHM->uinfo[ulist[i]].uid == uid; unum--, i++)
-	    {
-		if (SHM->uinfo[ulist[i]].mode == DEBUGSLEEPING)
-		    unum ++;
-	    }
-	    if (unum == 0 && i > 0 && ulist[i-1] >= 0 &&
-		    SHM->uinfo[ulist[i-1]].uid == uid)
-		return &SHM->uinfo[ulist[i-1]];
-	    /*
-	    if ( i + unum - 1 >= 0 &&
-		 (ulist[i + unum - 1] >= 0 &&
-		  uid == SHM->uinfo[ulist[i + unum - 1]].uid ) )
-		return &SHM->uinfo[ulist[i + unum - 1]];
-		*/
-	    break;		/* WLd */
+    do {
+	seq = SHM->UTMPidxseq;
+	__sync_synchronize();
+	n = SHM->UTMPidxnumber;
+	i = utmpindex_bound(UTMPIDX_PID, n, NULL, pid, 0);
+	u = (i < n && VALID_USHM_ENTRY(SHM->UTMPidx[UTMPIDX_PID][i])) ?
+	    &SHM->uinfo[SHM->UTMPidx[UTMPIDX_PID][i]] : NULL;
+	__sync_synchronize();
+    } while ((seq & 1 || seq != SHM->UTMPidxseq) &&
+	     ++tries < UTMPIDX_READ_RETRY && sched_yield() == 0);
+
+    return (u && u->pid == pid) ? u : NULL;
+}
+
+userinfo_t     *
+search_ulistn(int uid, int unum)
+{
+    unsigned int seq;
+    int i, n, k, tries = 0;
+    const int *ulist = SHM->UTMPidx[UTMPIDX_UID];
+    userinfo_t *u;
+
+    do {
+	u = NULL;
+	seq = SHM->UTMPidxseq;
+	__sync_synchronize();
+	n = SHM->UTMPidxnumber;
+	i = utmpindex_bound(UTMPIDX_UID, n, NULL, uid, 0);
+
+	// piaip Tue Jan  8 09:28:03 CST 2008
+	// many people bugged about that their utmp have invalid
+	// entry on record.
+	// we found them caused by crash process (DEBUGSLEEPING) which
+	// may occupy utmp entries even after process was killed.
+	// because the memory is invalid, it is not safe for those process
+	// to wipe their utmp entry. it should be done by some external
+	// daemon.
+	// however, let's make a little workaround here...
+	for (k = unum; k > 0 && i < n && VALID_USHM_ENTRY(ulist[i]) &&
+		SHM->uinfo[ulist[i]].uid == uid; k--, i++)
+	{
+	    if (SHM->uinfo[ulist[i]].mode == DEBUGSLEEPING)
+		k ++;
 	}
-	if (end == start) {
-	    break;
-	} else if (i == start) {
-	    i = end;
-	    start = end;
-	} else if (j > 0)
-	    start = i;
-	else
-	    end = i;
-    }
-    return 0;
+	if (k == 0 && i > 0 && VALID_USHM_ENTRY(ulist[i-1]))
+	    u = &SHM->uinfo[ulist[i-1]];
+	__sync_synchronize();
+    } while ((seq & 1 || seq != SHM->UTMPidxseq) &&
+	     ++tries < UTMPIDX_READ_RETRY && sched_yield() == 0);
+
+    return (u && u->uid == uid) ? u : NULL;
 }
 
 userinfo_t     *
 search_ulist_userid(const char *userid)
 {
-    register int    i = 0, j, start = 0, end = SHM->UTMPnumber - 1;
-    int *ulist;
-    register userinfo_t * u;
-    if (end == -1)
-	return NULL;
-    ulist = SHM->sorted[SHM->currsorted][0];
-    for (i = ((start + end) / 2);; i = (start + end) / 2) {
-	u = &SHM->uinfo[ulist[i]];
-	j = strcasecmp(userid, u->userid);
-	if (!j) {
-	    return u;
+    unsigned int seq;
+    int i, n, tries = 0;
+    userinfo_t *u = NULL;
+
+    do {
+	seq = SHM->UTMPidxseq;
+	__sync_synchronize();
+	n = SHM->UTMPidxnumber;
+	i = utmpindex_bound(UTMPIDX_USERID, n, userid, 0, 0);
+	u = (i < n && VALID_USHM_ENTRY(SHM->UTMPidx[UTMPIDX_USERID][i])) ?
+	    &SHM->uinfo[SHM->UTMPidx[UTMPIDX_USERID][i]] : NULL;
+	__sync_synchronize();
+    } while ((seq & 1 || seq != SHM->UTMPidxseq) &&
+	     ++tries < UTMPIDX_READ_RETRY && sched_yield() == 0);
+
+    return (u && strcasecmp(u->userid, userid) == 0) ? u : NULL;
+}
+
+/*
+ * section - reverse friend index
+ *
+ * For each uid, SHM->FREFhead[uid] starts a doubly linked list of the
+ * online sessions that have uid in their myfriend[] or reject[]. The nodes
+ * are preallocated per session: node k of uinfo[n] is FREF_PER_UTMP * n + k.
+ * Links are stored as node+1 (0 = none); the prev link of a list head is
+ * -uid, so a node can be unlinked without knowing its key, even after the
+ * session reloaded its friend lists.
+ */
+
+#define FREF_NODES  (USHM_SIZE * FREF_PER_UTMP)
+#define FREF_NEXT(e) (SHM->FREFnext[(e) / FREF_PER_UTMP][(e) % FREF_PER_UTMP])
+#define FREF_PREV(e) (SHM->FREFprev[(e) / FREF_PER_UTMP][(e) % FREF_PER_UTMP])
+
+static void
+friendref_insert(int e, int uid)
+{
+    int h = SHM->FREFhead[uid];
+
+    FREF_NEXT(e) = h;
+    FREF_PREV(e) = -uid;
+    if (h > 0 && h <= FREF_NODES)
+	FREF_PREV(h - 1) = e + 1;
+    SHM->FREFhead[uid] = e + 1;
+}
+
+static void
+friendref_remove(int e)
+{
+    int p = FREF_PREV(e), nx = FREF_NEXT(e);
+
+    if (p < 0 && -p <= MAX_USERS)
+	SHM->FREFhead[-p] = nx;
+    else if (p > 0 && p <= FREF_NODES)
+	FREF_NEXT(p - 1) = nx;
+    if (nx > 0 && nx <= FREF_NODES)
+	FREF_PREV(nx - 1) = p;
+    FREF_PREV(e) = FREF_NEXT(e) = 0;
+}
+
+static void
+friendref_unlink_locked(int n)
+{
+    int k;
+    for (k = 0; k < FREF_PER_UTMP; k++)
+	if (SHM->FREFprev[n][k])
+	    friendref_remove(n * FREF_PER_UTMP + k);
+}
+
+static void
+friendref_link_locked(int n)
+{
+    const userinfo_t *u = &SHM->uinfo[n];
+    int k, uid;
+
+    friendref_unlink_locked(n);
+    for (k = 0; k < u->nFriends && k < MAX_FRIEND; k++)
+	if ((uid = u->myfriend[k]) > 0 && uid <= MAX_USERS)
+	    friendref_insert(n * FREF_PER_UTMP + k, uid);
+    for (k = 0; k < MAX_REJECT && (uid = u->reject[k]); k++)
+	if (uid > 0 && uid <= MAX_USERS)
+	    friendref_insert(n * FREF_PER_UTMP + MAX_FRIEND + k, uid);
+}
+
+static void
+friendref_lock(void)
+{
+    int n;
+
+    if (!shm_spin_lock(&SHM->FREFlock))
+	return;
+    // previous holder died in the middle of an update; rebuild.
+    memset(SHM->FREFhead, 0, sizeof(SHM->FREFhead));
+    memset(SHM->FREFnext, 0, sizeof(SHM->FREFnext));
+    memset(SHM->FREFprev, 0, sizeof(SHM->FREFprev));
+    for (n = 0; n < USHM_SIZE; n++)
+	if (SHM->uinfo[n].pid)
+	    friendref_link_locked(n);
+}
+
+/**
+ * (Re-)indexes the friend and reject lists of uinfo[n].
+ */
+void
+friendref_link(int n)
+{
+    if (!VALID_USHM_ENTRY(n))
+	return;
+    friendref_lock();
+    friendref_link_locked(n);
+    shm_spin_unlock(&SHM->FREFlock);
+}
+
+void
+friendref_unlink(int n)
+{
+    if (!VALID_USHM_ENTRY(n))
+	return;
+    friendref_lock();
+    friendref_unlink_locked(n);
+    shm_spin_unlock(&SHM->FREFlock);
+}
+
+/* Whether node e still stands for uid in the lists of its session. */
+static int
+friendref_valid(int e, int uid)
+{
+    const userinfo_t *u = &SHM->uinfo[e / FREF_PER_UTMP];
+    int k = e % FREF_PER_UTMP;
+
+    if (!u->pid)
+	return 0;
+    if (k < MAX_FRIEND)
+	return k < u->nFriends && u->myfriend[k] == uid;
+    return u->reject[k - MAX_FRIEND] == uid;
+}
+
+/**
+ * Finds online sessions having uid as friend or reject, each once.
+ * Nodes left by sessions that are gone or changed their lists without
+ * friendref_link() are dropped on the way.
+ * @return number of uinfo[] indexes stored in list (at most max; a list of
+ *         USHM_SIZE always holds all of them).
+ */
+int
+friendref_lookup(int uid, int *list, int max)
+{
+    int e, next, n = 0, guard = 0;
+
+    if (uid <= 0 || uid > MAX_USERS)
+	return 0;
+    friendref_lock();
+    for (e = SHM->FREFhead[uid]; e > 0 && e <= FREF_NODES && n < max &&
+	 guard++ < FREF_NODES; e = next) {
+	next = FREF_NEXT(e - 1);
+	if (!friendref_valid(e - 1, uid)) {
+	    friendref_remove(e - 1);
+	    continue;
 	}
-	if (end == start) {
-	    break;
-	} else if (i == start) {
-	    i = end;
-	    start = end;
-	} else if (j > 0)
-	    start = i;
-	else
-	    end = i;
+	// the nodes of a session are linked together, so a session having
+	// uid in more than one list shows up in a row.
+	if (n > 0 && list[n - 1] == (e - 1) / FREF_PER_UTMP)
+	    continue;
+	list[n++] = (e - 1) / FREF_PER_UTMP;
     }
-    return 0;
+    shm_spin_unlock(&SHM->FREFlock);
+    return n;
 }
 
 /*
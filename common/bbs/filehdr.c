@@ -1,6 +1,10 @@
+#include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "cmsys.h"
 #include "cmbbs.h"
+#include "common.h"
 
 static int
 _is_same_fhdr_filename(const void *ptr1, const void *ptr2) {
@@ -19,6 +23,132 @@ substitute_fileheader(const char *dir_path,
 int
 delete_fileheader(const char *dir_path, const void *rptr, int id)
 {
-    return delete_record2(dir_path, rptr, sizeof(fileheader_t),
-                          id, _is_same_fhdr_filename);
+    // the select_read() index renumbers its postings after the deletion
+    int sri = srindex_delete_begin(dir_path);
+    int ret = delete_record2(dir_path, rptr, sizeof(fileheader_t),
+                             id, _is_same_fhdr_filename);
+
+    srindex_delete_end(sri, dir_path, ret == 0 ? id : 0);
+    return ret;
+}
+
+/**
+ * Maps dir_path and sets *pfh to its first record (zero copy).
+ * @return number of records, or -1 on error.
+ */
+int
+fileheader_view(const char *dir_path, const fileheader_t **pfh)
+{
+    return record_view(dir_path, sizeof(fileheader_t), (const void **)pfh);
+}
+
+// records checked around the binary search landing point
+#define FHDR_FIND_WINDOW (64)
+
+static int
+_fhdr_match(const fileheader_t *fh, const char *fn, int prefix)
+{
+    int l;
+
+    return strcmp(fh->filename, fn) == 0 ||
+	(prefix && (l = strlen(fh->filename)) > 6 &&
+	 strncmp(fh->filename, fn, l) == 0);
+}
+
+// post time in "M.<time>.A.xxx" (0 if none)
+static unsigned long
+_fhdr_stamp(const char *filename)
+{
+    if (!filename[0] || filename[1] != '.')
+	return 0;
+    return strtoul(filename + 2, NULL, 10);
+}
+
+/**
+ * Finds article fn in dir_path. Filenames carry the post time and .DIR
+ * is appended in time order, so this binary searches by the time and
+ * only looks at FHDR_FIND_WINDOW records on each side of where it lands;
+ * records moved further out of order (undelete, move) are not found.
+ * With prefix, a filename that is a prefix of fn also matches (AIDs of
+ * articles without the random suffix).
+ * @return index of the first match not marked FILE_BOTTOM, else of the
+ *         last match, or -1.
+ */
+int
+fileheader_find(const char *dir_path, const char *fn, int prefix)
+{
+    const fileheader_t *fhs;
+    unsigned long stamp = _fhdr_stamp(fn);
+    int total, lo, hi, mid, i, lastpos = -1;
+
+    if ((total = fileheader_view(dir_path, &fhs)) <= 0)
+	return -1;
+
+    lo = 0;
+    hi = total;
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (_fhdr_stamp(fhs[mid].filename) < stamp)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    hi = lo + FHDR_FIND_WINDOW;
+    lo = lo - FHDR_FIND_WINDOW;
+    if (lo < 0)
+	lo = 0;
+    if (hi > total)
+	hi = total;
+    for (i = lo; i < hi; i++)
+	if (_fhdr_match(&fhs[i], fn, prefix)) {
+	    if (!(fhs[i].filemode & FILE_BOTTOM))
+		return i;
+	    lastpos = i;
+	}
+    return lastpos;
+}
+
+/**
+ * Adds delta to the recommend count of record ent (1-based) in dir_path,
+ * clamped to +-MAX_RECOMMENDS, and sets its modified time if modified > 0.
+ * The record is read and written under a lock on its range, so concurrent
+ * updates are applied one after another and none is lost. Nothing is
+ * written if the record is no longer fn (deleted or moved meanwhile).
+ * @param precommend	if not NULL, gets the new count.
+ * @return 0 on success, -1 on error.
+ */
+int
+fileheader_add_recommend(const char *dir_path, int ent, const char *fn,
+			 int delta, time4_t modified, int *precommend)
+{
+    fileheader_t fhdr;
+    off_t off = (off_t)sizeof(fileheader_t) * (ent - 1);
+    int fd, recommend, ret = -1;
+
+    if (ent <= 0 || (fd = open(dir_path, O_RDWR)) < 0)
+	return -1;
+
+    PttLock(fd, off, sizeof(fhdr), F_WRLCK);
+    if (pread(fd, &fhdr, sizeof(fhdr), off) == sizeof(fhdr) &&
+	strcmp(fhdr.filename, fn) == 0) {
+	recommend = fhdr.recommend + delta;
+	if (recommend > MAX_RECOMMENDS)
+	    recommend = MAX_RECOMMENDS;
+	else if (recommend < -MAX_RECOMMENDS)
+	    recommend = -MAX_RECOMMENDS;
+	fhdr.recommend = recommend;
+	if (modified > 0)
+	    fhdr.modified = modified;
+
+	if (pwrite(fd, &fhdr, sizeof(fhdr), off) == sizeof(fhdr)) {
+	    if (precommend)
+		*precommend = recommend;
+	    ret = 0;
+	}
+    }
+    PttLock(fd, off, sizeof(fhdr), F_UNLCK);
+
+    close(fd);
+    return ret;
 }
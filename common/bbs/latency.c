@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "cmsys.h"
+#include "cmbbs.h"
+#include "var.h"
+
+/* names for shmctl and munin, in the order of LAT_* */
+const char * const latency_name[LAT_NUM] = {
+    "login",
+    "readpost",
+    "dopost",
+    "recommend",
+    "selectread",
+    "searchuser",
+    "doupdate",
+};
+
+/**
+ * Adds the time since begin to the histogram of op (LAT_*).
+ * Lock free; each process writes its own stripe most of the time.
+ */
+void
+latency_add(int op, const struct timeval *begin)
+{
+    static int stripe = -1;
+    static pid_t stripe_pid;
+    struct timeval end;
+    long usec;
+    int b;
+
+    if (!SHM || SHM->version != SHM_VERSION || op < 0 || op >= LAT_NUM)
+	return;
+
+    gettimeofday(&end, NULL);
+    usec = (end.tv_sec - begin->tv_sec) * 1000000L +
+	(end.tv_usec - begin->tv_usec);
+
+    // log2, rounded down
+    for (b = 0; usec > 1 && b < LAT_BUCKETS - 1; b++)
+	usec >>= 1;
+
+    // pid changes after fork()
+    if (stripe < 0 || stripe_pid != getpid()) {
+	stripe_pid = getpid();
+	stripe = stripe_pid % LAT_STRIPES;
+    }
+    __sync_fetch_and_add(&SHM->latency[stripe][op][b], 1);
+}
+
+/**
+ * Sums up the stripes of all histograms into hist.
+ */
+void
+latency_merge(unsigned int hist[LAT_MAX][LAT_BUCKETS])
+{
+    int s, op, b;
+
+    memset(hist, 0, sizeof(unsigned int) * LAT_MAX * LAT_BUCKETS);
+    for (s = 0; s < LAT_STRIPES; s++)
+	for (op = 0; op < LAT_NUM; op++)
+	    for (b = 0; b < LAT_BUCKETS; b++)
+		hist[op][b] += SHM->latency[s][op][b];
+}
+
+unsigned int
+latency_count(const unsigned int *buckets)
+{
+    unsigned int n = 0;
+    int b;
+
+    for (b = 0; b < LAT_BUCKETS; b++)
+	n += buckets[b];
+    return n;
+}
+
+/**
+ * Estimates the q quantile (0 < q <= 1) of a merged histogram, in
+ * microseconds, interpolating within the bucket it falls in.
+ * @return 0 if the histogram is empty.
+ */
+double
+latency_percentile(const unsigned int *buckets, double q)
+{
+    double rank, lo, hi;
+    unsigned int n = latency_count(buckets), seen = 0;
+    int b;
+
+    if (n == 0)
+	return 0;
+
+    rank = q * n;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+	if (buckets[b] && seen + buckets[b] >= rank) {
+	    lo = b ? (double)(1ULL << b) : 0;
+	    hi = (double)(1ULL << (b + 1));
+	    return lo + (hi - lo) * (rank - seen) / buckets[b];
+	}
+	seen += buckets[b];
+    }
+    return (double)(1ULL << (LAT_BUCKETS - 1));
+}
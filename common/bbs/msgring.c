@@ -0,0 +1,128 @@
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include "cmsys.h"
+#include "cmbbs.h"
+
+/*
+ * Waterball queue of each session (userinfo_t.msgring).
+ *
+ * Senders claim a position by CAS on head, copy the message in and then
+ * mark the slot full in seq[]; the owner takes in order from tail and marks
+ * the slot free for the next turn. Nobody locks and no message is taken
+ * half written. Positions wrap at 2^32, which a session never reaches.
+ *
+ * The owner reads the queue from its input loop. Before it sleeps it sets
+ * waiting (msgring_wait_begin()); the first sender after that clears it and
+ * sends a SIGUSR2 to interrupt the sleep, so a broadcast costs at most one
+ * signal per sleeping session instead of one per message.
+ */
+
+#define SEQ_FREE(pos)   (((pos) / MAX_MSGS) * 2)
+#define SEQ_FULL(pos)   (((pos) / MAX_MSGS) * 2 + 1)
+
+/**
+ * Adds msg to the queue of uentp and wakes it up if needed.
+ * @return number of messages queued, or -1 if the queue is full.
+ */
+int
+msgring_send(userinfo_t *uentp, const msgque_t *msg)
+{
+    msgring_t *ring = &uentp->msgring;
+    unsigned int pos, slot, seq;
+
+    pos = ring->head;
+    for (;;) {
+	slot = pos % MAX_MSGS;
+	seq = *(volatile unsigned int *)&ring->seq[slot];
+	if (seq == SEQ_FREE(pos)) {
+	    if (__sync_bool_compare_and_swap(&ring->head, pos, pos + 1))
+		break;
+	} else if ((int)(seq - SEQ_FREE(pos)) < 0) {
+	    // the owner has not taken the message of the last turn yet
+	    return -1;
+	}
+	pos = *(volatile unsigned int *)&ring->head;
+    }
+
+    memcpy(&ring->msgs[slot], msg, sizeof(msgque_t));
+    __sync_synchronize();
+    ring->seq[slot] = SEQ_FULL(pos);
+
+#ifdef NOKILLWATERBALL
+    uentp->wbtime = (time4_t)time(NULL);
+#else
+    if (ring->waiting &&
+	__sync_bool_compare_and_swap(&ring->waiting, 1, 0) &&
+	uentp->pid > 0)
+	kill(uentp->pid, SIGUSR2);
+#endif
+    return msgring_count(ring);
+}
+
+/**
+ * @return number of messages in queue, including those still being added.
+ */
+int
+msgring_count(const msgring_t *ring)
+{
+    int n = (int)(*(volatile unsigned int *)&ring->head - ring->tail);
+
+    if (n < 0)
+	return 0;
+    return n > MAX_MSGS ? MAX_MSGS : n;
+}
+
+/**
+ * Copies the i-th message from the tail to msg. Owner only.
+ * @return 1 if there is one, 0 if not (or not completely added yet).
+ */
+int
+msgring_peek(const msgring_t *ring, int i, msgque_t *msg)
+{
+    unsigned int pos = ring->tail + i;
+
+    if (i < 0 || i >= MAX_MSGS ||
+	*(volatile const unsigned int *)&ring->seq[pos % MAX_MSGS] !=
+	SEQ_FULL(pos))
+	return 0;
+    __sync_synchronize();
+    memcpy(msg, &ring->msgs[pos % MAX_MSGS], sizeof(msgque_t));
+    return 1;
+}
+
+/**
+ * Drops the message at the tail, which must have been peeked. Owner only.
+ */
+void
+msgring_pop(msgring_t *ring)
+{
+    unsigned int pos = ring->tail;
+
+    __sync_synchronize();
+    ring->seq[pos % MAX_MSGS] = SEQ_FREE(pos + MAX_MSGS);
+    ring->tail = pos + 1;
+}
+
+/**
+ * Tells senders that the owner is going to sleep. Owner only.
+ * @param shown: messages the owner already knows about.
+ * @return 1 if more messages came meanwhile and it should not sleep.
+ */
+int
+msgring_wait_begin(msgring_t *ring, int shown)
+{
+    ring->waiting = 1;
+    __sync_synchronize();
+    if (msgring_count(ring) > shown) {
+	ring->waiting = 0;
+	return 1;
+    }
+    return 0;
+}
+
+void
+msgring_wait_end(msgring_t *ring)
+{
+    ring->waiting = 0;
+}
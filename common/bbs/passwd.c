@@ -7,9 +7,13 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sys/sem.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
 #include "cmbbs.h"
 #include "common.h"
 #include "uflags.h"
@@ -102,6 +106,198 @@ passwd_unlock(void)
     }
 }
 
+// mmap'ed PASSWD (USE_PASSWD_MMAP)
+//
+// .PASSWD is mapped shared, so a record is read with a memcpy and updated
+// in place. Every record has a seqlock in SHM->PASSWDseq[] (odd while
+// being written); readers retry until they see the same even sequence
+// before and after the copy. Writers take the spin lock of the record's
+// stripe, SHM->PASSWDlock[], so writers of different users do not wait
+// for each other. Dirty pages are msync()ed in batches.
+//
+// Without SHM attached or with a .PASSWD shorter than MAX_USERS records
+// (the mapping would fault past EOF), the read/write path below is used.
+// It takes a record lock on the file, and its writes also take the seqlock
+// when SHM is attached, as other processes may have the file mapped.
+
+#ifndef PASSWD_MSYNC_BATCH
+#define PASSWD_MSYNC_BATCH  (64)    // updates between two msync()
+#endif
+
+#ifdef USE_PASSWD_MMAP
+static userec_t *passwd_map = NULL;
+static int       passwd_map_writable;
+static int       passwd_map_failed;
+static int       passwd_dirty_lo, passwd_dirty_hi, passwd_ndirty;
+
+// returns the mapping, or NULL if it is not usable.
+static userec_t *
+passwd_mmap(void)
+{
+    int fd, prot = PROT_READ | PROT_WRITE;
+    struct stat st;
+    void *p;
+
+    if (passwd_map || passwd_map_failed)
+	return passwd_map;
+    // the seqlocks live in SHM; try again after attach_SHM()
+    if (!SHM)
+	return NULL;
+
+    passwd_map_writable = 1;
+    if ((fd = open(fn_passwd, O_RDWR)) < 0) {
+	prot = PROT_READ;
+	passwd_map_writable = 0;
+	fd = open(fn_passwd, O_RDONLY);
+    }
+    if (fd < 0 || fstat(fd, &st) < 0 ||
+	st.st_size < (off_t)sizeof(userec_t) * MAX_USERS ||
+	(p = mmap(NULL, sizeof(userec_t) * MAX_USERS, prot, MAP_SHARED,
+		  fd, 0)) == MAP_FAILED) {
+	if (fd >= 0)
+	    close(fd);
+	passwd_map_failed = 1;
+	return NULL;
+    }
+    close(fd);
+    passwd_map = (userec_t *)p;
+    if (passwd_map_writable)
+	atexit(passwd_flush);
+    return passwd_map;
+}
+
+// is someone (alive) holding the write lock of num's stripe?
+static int
+passwd_stripe_busy(int num)
+{
+    int owner = SHM->PASSWDlock[(num - 1) % PASSWD_LOCK_STRIPES];
+    return owner > 0 && !(kill(owner, 0) < 0 && errno == ESRCH);
+}
+
+static void
+passwd_mmap_read(int num, userec_t *buf)
+{
+    volatile unsigned int *seq = &SHM->PASSWDseq[num - 1];
+    unsigned int s;
+    int spin = 0;
+
+    for (;;) {
+	s = *seq;
+	__sync_synchronize();
+	memcpy(buf, passwd_map + num - 1, sizeof(userec_t));
+	__sync_synchronize();
+	if (!(s & 1) && s == *seq)
+	    return;
+	// the writer may have died in the middle, then take what is there.
+	if (++spin % 1024 == 0 && !passwd_stripe_busy(num))
+	    return;
+	sched_yield();
+    }
+}
+
+static void
+passwd_write_begin(int num)
+{
+    volatile unsigned int *seq = &SHM->PASSWDseq[num - 1];
+
+    shm_spin_lock(&SHM->PASSWDlock[(num - 1) % PASSWD_LOCK_STRIPES]);
+    // an odd sequence left by a dead writer is already "in update"
+    if (!(*seq & 1))
+	(*seq)++;
+    __sync_synchronize();
+}
+
+static void
+passwd_write_end(int num)
+{
+    __sync_synchronize();
+    SHM->PASSWDseq[num - 1]++;
+    shm_spin_unlock(&SHM->PASSWDlock[(num - 1) % PASSWD_LOCK_STRIPES]);
+}
+
+static void
+passwd_mmap_write(int num, size_t offset, const void *data, size_t len)
+{
+    char *rec = (char *)(passwd_map + num - 1);
+
+    passwd_write_begin(num);
+    memcpy(rec + offset, data, len);
+    passwd_write_end(num);
+
+    if (!passwd_ndirty || num < passwd_dirty_lo)
+	passwd_dirty_lo = num;
+    if (!passwd_ndirty || num > passwd_dirty_hi)
+	passwd_dirty_hi = num;
+    if (++passwd_ndirty >= PASSWD_MSYNC_BATCH)
+	passwd_flush();
+}
+#endif
+
+// Locks [pos, pos + len) of fd for the read/write path. PttLock() keeps its
+// struct flock in a static and process wide fcntl() locks are dropped by
+// any close() of the file in the process, so threads (logind auth workers)
+// would undo each other's locks. Where there are open file description
+// locks they are used instead: they belong to this open() only.
+#ifdef F_OFD_SETLKW
+#define PASSWD_SETLKW	F_OFD_SETLKW
+#else
+#define PASSWD_SETLKW	F_SETLKW
+#endif
+
+static void
+passwd_file_lock(int fd, off_t pos, size_t len, short type)
+{
+    struct flock lk;
+
+    memset(&lk, 0, sizeof(lk));
+    lk.l_whence = SEEK_SET;
+    lk.l_start = pos;
+    lk.l_len = len;
+    lk.l_type = type;
+    while (fcntl(fd, PASSWD_SETLKW, &lk) < 0 && errno == EINTR)
+	;
+}
+
+// writes len bytes at offset of record num with write(), see above.
+static void
+passwd_file_write(int num, size_t offset, const void *data, size_t len)
+{
+    int  pwdfd;
+    off_t pos = sizeof(userec_t) * (num - 1) + offset;
+
+    if ((pwdfd = open(fn_passwd, O_WRONLY)) < 0)
+	exit(1);
+    passwd_file_lock(pwdfd, pos, len, F_WRLCK);
+#ifdef USE_PASSWD_MMAP
+    if (SHM)
+	passwd_write_begin(num);
+#endif
+    pwrite(pwdfd, data, len, pos);
+#ifdef USE_PASSWD_MMAP
+    if (SHM)
+	passwd_write_end(num);
+#endif
+    passwd_file_lock(pwdfd, pos, len, F_UNLCK);
+    close(pwdfd);
+}
+
+// schedules write back of the records updated in place.
+void
+passwd_flush(void)
+{
+#ifdef USE_PASSWD_MMAP
+    long pagesize = sysconf(_SC_PAGESIZE);
+    size_t lo, hi;
+
+    if (!passwd_map || !passwd_ndirty)
+	return;
+    lo = sizeof(userec_t) * (passwd_dirty_lo - 1) / pagesize * pagesize;
+    hi = sizeof(userec_t) * passwd_dirty_hi;
+    msync((char *)passwd_map + lo, hi - lo, MS_ASYNC);
+    passwd_ndirty = 0;
+#endif
+}
+
 // updateing passwd/userec_t
 
 int
@@ -109,34 +305,37 @@ passwd_update_money(int num)
 /* update money only 
    Ptt: don't call it directly, call deumoney() */
 {
-    int  pwdfd;
     int  money=moneyof(num);
     userec_t u;
     if (num < 1 || num > MAX_USERS)
         return -1;
 
-    if ((pwdfd = open(fn_passwd, O_WRONLY)) < 0)
-        exit(1);
-    lseek(pwdfd, sizeof(userec_t) * (num - 1) +
-	  ((char *)&u.money - (char *)&u), SEEK_SET);
-    write(pwdfd, &money, sizeof(int));
-    close(pwdfd);
+#ifdef USE_PASSWD_MMAP
+    if (passwd_mmap() && passwd_map_writable) {
+	passwd_mmap_write(num, (char *)&u.money - (char *)&u,
+			  &money, sizeof(int));
+	return 0;
+    }
+#endif
+
+    passwd_file_write(num, (char *)&u.money - (char *)&u, &money, sizeof(int));
     return 0;
 }
 
 int
 passwd_update(int num, userec_t * buf)
 {
-    int  pwdfd;
     if (num < 1 || num > MAX_USERS)
 	return -1;
 
-    if ((pwdfd = open(fn_passwd, O_WRONLY)) < 0)
-	exit(1);
-    lseek(pwdfd, sizeof(userec_t) * (num - 1), SEEK_SET);
-    write(pwdfd, buf, sizeof(userec_t));
-    close(pwdfd);
+#ifdef USE_PASSWD_MMAP
+    if (passwd_mmap() && passwd_map_writable) {
+	passwd_mmap_write(num, 0, buf, sizeof(userec_t));
+	return 0;
+    }
+#endif
 
+    passwd_file_write(num, 0, buf, sizeof(userec_t));
     return 0;
 }
 
@@ -144,12 +343,22 @@ int
 passwd_query(int num, userec_t * buf)
 {
     int             pwdfd;
+    off_t           pos = sizeof(userec_t) * (num - 1);
     if (num < 1 || num > MAX_USERS)
 	return -1;
+
+#ifdef USE_PASSWD_MMAP
+    if (passwd_mmap()) {
+	passwd_mmap_read(num, buf);
+	return 0;
+    }
+#endif
+
     if ((pwdfd = open(fn_passwd, O_RDONLY)) < 0)
 	exit(1);
-    lseek(pwdfd, sizeof(userec_t) * (num - 1), SEEK_SET);
-    read(pwdfd, buf, sizeof(userec_t));
+    passwd_file_lock(pwdfd, pos, sizeof(userec_t), F_RDLCK);
+    pread(pwdfd, buf, sizeof(userec_t), pos);
+    passwd_file_lock(pwdfd, pos, sizeof(userec_t), F_UNLCK);
     close(pwdfd);
 
     return 0;
@@ -190,6 +399,19 @@ passwd_fast_apply(void *ctx, int(*fptr)(void *ctx, int, userec_t *))
 {
     int i, fd;
     userec_t user;
+
+#ifdef USE_PASSWD_MMAP
+    // callbacks may scribble on the record, so hand them a copy
+    if (passwd_mmap()) {
+	for (i = 0; i < MAX_USERS; i++) {
+	    passwd_mmap_read(i + 1, &user);
+	    if ((*fptr) (ctx, i, &user) < 0)
+		return -1;
+	}
+	return 0;
+    }
+#endif
+
     if ((fd = open(fn_passwd, O_RDONLY)) < 0)
         exit(1);
     for (i = 0; i < MAX_USERS; i++) {
@@ -214,10 +436,10 @@ int
 checkpasswd(const char *passwd, char *plain)
 {
     int             ok;
-    char           *pw;
+    char           *pw, buf[PASSLEN];
 
     ok = 0;
-    pw = fcrypt(plain, passwd);
+    pw = fcrypt_r(plain, passwd, buf);
     if(pw && strcmp(pw, passwd)==0)
 	ok = 1;
     memset(plain, 0, strlen(plain));
@@ -250,31 +472,50 @@ genpasswd(char *pw)
 }
 
 
+static void
+logattempt_write(LOGBUF *lb, const char *fn, const char *msg, int len)
+{
+    int fd;
+
+    if (lb) {
+	logbuf_add(lb, fn, msg, len);
+	return;
+    }
+    if ((fd = OpenCreate(fn, O_WRONLY | O_APPEND)) >= 0) {
+	write(fd, msg, len);
+	close(fd);
+    }
+}
+
+/**
+ * logattempt(), but lines are added to lb instead of written if lb is set.
+ */
 void
-logattempt(const char *uid, char type, time4_t now, const char *loghost)
+logattempt_to(LOGBUF *lb, const char *uid, char type, time4_t now,
+	      const char *loghost)
 {
     char fname[PATHLEN];
-    int  fd, len;
+    int  len;
     char genbuf[200];
 
     snprintf(genbuf, sizeof(genbuf), "%c%-12s[%s] ?@%s\n", type, uid,
 	    Cdate(&now), loghost);
     len = strlen(genbuf);
     // log to public (BBSHOME)
-    if ((fd = OpenCreate(FN_BADLOGIN, O_WRONLY | O_APPEND)) >= 0) {
-	write(fd, genbuf, len);
-	close(fd);
-    }
+    logattempt_write(lb, FN_BADLOGIN, genbuf, len);
     // log to user private log
     if (type == '-') {
 	snprintf(genbuf, sizeof(genbuf),
 		 "[%s] %s\n", Cdate(&now), loghost);
 	len = strlen(genbuf);
 	sethomefile(fname, uid, FN_BADLOGIN);
-	if ((fd = OpenCreate(fname, O_WRONLY | O_APPEND)) >= 0) {
-	    write(fd, genbuf, len);
-	    close(fd);
-	}
+	logattempt_write(lb, fname, genbuf, len);
     }
 }
 
+void
+logattempt(const char *uid, char type, time4_t now, const char *loghost)
+{
+    logattempt_to(NULL, uid, type, now, loghost);
+}
+
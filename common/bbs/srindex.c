@@ -0,0 +1,512 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cmsys.h"
+#include "cmbbs.h"
+
+/*
+ * Search index for select_read(), kept beside the board index as
+ * <.DIR>.sri: inverted lists of the character bigrams (Big5 aware, ASCII
+ * case folded, same as DBCS_strcasestr) of each post's author and title.
+ *
+ * The file is a header and a list of segments. Each segment is a sorted
+ * key table and its postings (0 based .DIR record numbers, ascending).
+ * New posts and retitled ones are added as new segments, so existing data
+ * is never rewritten. Records deleted by delete_fileheader() are logged in
+ * the header and the postings of older segments are renumbered as they are
+ * read. The whole file is rebuilt when the log is full (by the deletion
+ * that finds it so), and by a search when .DIR was shrunk or reordered some
+ * other way or there are too many small segments.
+ *
+ * Postings only nominate candidates: the caller still has to match every
+ * record, so stale postings are harmless.
+ */
+
+#define SRI_MAGIC	"SRI2"
+#define SRI_SEGRECS	(8192)	// records per segment in a full build
+#define SRI_TAIL	(256)	// uncovered records left to the caller
+#define SRI_MAXSEG	(32)	// small segments before a rebuild
+#define SRI_MAXDEL	(64)	// logged deletions before a rebuild
+#define SRI_RECBITS	(30)
+#define SRI_ALIGN(x)	(((x) + 7) & ~(size_t)7)
+
+typedef struct {
+    uint32_t pos;	    // 0 based record number when it was deleted
+    uint32_t nseg;	    // segments before it, which still count it
+} sri_delete_t;
+
+typedef struct {
+    char     magic[4];
+    uint32_t nrecs;	    // .DIR records covered
+    uint32_t nseg;
+    uint32_t size;	    // bytes in use, including this header
+    char     lastfn[FNLEN];  // filename of record nrecs - 1
+    uint32_t ndel;
+    sri_delete_t del[SRI_MAXDEL];   // in the order they were made
+} sri_header_t;
+
+typedef struct {
+    uint32_t nkeys;
+    uint32_t nposts;
+} sri_segment_t;	    // followed by sri_key_t[nkeys], uint32_t[nposts]
+
+typedef struct {
+    uint64_t key;	    // field << 32 | bigram
+    uint32_t off;	    // first posting, relative to this segment
+    uint32_t cnt;
+} sri_key_t;
+
+static void
+sri_path(char *buf, size_t sz, const char *dir_path)
+{
+    snprintf(buf, sz, "%s.sri", dir_path);
+}
+
+/**
+ * Appends the bigram keys of s[0..len) to keys. A DBCS character cut in
+ * half at the end (titles are cut at TTLEN bytes) is left out.
+ * @return number of keys.
+ */
+static int
+sri_keys(int field, const char *s, size_t len, uint64_t *keys)
+{
+    unsigned int c, prev = 0;
+    size_t i = 0;
+    int n = 0, nchars = 0;
+
+    while (i < len && s[i]) {
+	if (IS_DBCSLEAD(s[i])) {
+	    if (i + 1 >= len || !s[i + 1])
+		break;
+	    c = ((unsigned char)s[i] << 8) | (unsigned char)s[i + 1];
+	    i += 2;
+	} else {
+	    c = tolower((unsigned char)s[i]);
+	    i++;
+	}
+	if (nchars++)
+	    keys[n++] = ((uint64_t)field << 32) | (prev << 16) | c;
+	prev = c;
+    }
+    return n;
+}
+
+static int
+sri_cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int
+sri_cmp_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * Writes a segment with the postings of records [from, to) at h->size.
+ * Updates h->size and h->nseg, but not the header on disk.
+ */
+static int
+sri_append(int fd, sri_header_t *h, const fileheader_t *fhs, int from, int to)
+{
+    // keys per record: owner IDLEN+2 and title TTLEN+1 bytes
+    const int maxkeys = IDLEN + 2 + TTLEN + 1;
+    uint64_t *pairs, keys[IDLEN + 2 + TTLEN + 1];
+    size_t npairs = 0, nkeys = 0, i, j, segsz;
+    sri_segment_t *seg;
+    sri_key_t *kt;
+    uint32_t *posts;
+    char *buf;
+    int rec, k, n;
+
+    if (to <= from)
+	return 0;
+    if ((pairs = malloc(sizeof(uint64_t) * maxkeys * (to - from))) == NULL)
+	return -1;
+
+    for (rec = from; rec < to; rec++) {
+	n = sri_keys(SRI_AUTHOR, fhs[rec].owner, sizeof(fhs[rec].owner), keys);
+	n += sri_keys(SRI_TITLE, fhs[rec].title, sizeof(fhs[rec].title),
+		      keys + n);
+	for (k = 0; k < n; k++)
+	    pairs[npairs++] = (keys[k] << SRI_RECBITS) | (uint64_t)rec;
+    }
+
+    // sort by key then record, and drop duplicates
+    qsort(pairs, npairs, sizeof(uint64_t), sri_cmp_u64);
+    for (i = j = 0; i < npairs; i++)
+	if (j == 0 || pairs[i] != pairs[j - 1])
+	    pairs[j++] = pairs[i];
+    npairs = j;
+    for (i = 0; i < npairs; i++)
+	if (i == 0 || (pairs[i] >> SRI_RECBITS) != (pairs[i-1] >> SRI_RECBITS))
+	    nkeys++;
+
+    segsz = SRI_ALIGN(sizeof(sri_segment_t) + sizeof(sri_key_t) * nkeys +
+		      sizeof(uint32_t) * npairs);
+    if ((buf = calloc(1, segsz)) == NULL) {
+	free(pairs);
+	return -1;
+    }
+    seg = (sri_segment_t *)buf;
+    kt = (sri_key_t *)(seg + 1);
+    posts = (uint32_t *)(kt + nkeys);
+    seg->nkeys = nkeys;
+    seg->nposts = npairs;
+
+    for (i = 0, j = (size_t)-1; i < npairs; i++) {
+	uint64_t key = pairs[i] >> SRI_RECBITS;
+	if (j == (size_t)-1 || kt[j].key != key) {
+	    j++;
+	    kt[j].key = key;
+	    kt[j].off = (char *)(posts + i) - buf;
+	    kt[j].cnt = 0;
+	}
+	kt[j].cnt++;
+	posts[i] = pairs[i] & ((1 << SRI_RECBITS) - 1);
+    }
+    free(pairs);
+
+    if (pwrite(fd, buf, segsz, h->size) != (ssize_t)segsz) {
+	free(buf);
+	return -1;
+    }
+    free(buf);
+    h->size += segsz;
+    h->nseg++;
+    return 0;
+}
+
+static int
+sri_write_header(int fd, const sri_header_t *h)
+{
+    return pwrite(fd, h, sizeof(*h), 0) == sizeof(*h) ? 0 : -1;
+}
+
+static int
+sri_read_header(int fd, sri_header_t *h)
+{
+    struct stat st;
+
+    if (pread(fd, h, sizeof(*h), 0) != sizeof(*h) ||
+	memcmp(h->magic, SRI_MAGIC, sizeof(h->magic)) != 0 ||
+	h->ndel > SRI_MAXDEL ||
+	fstat(fd, &st) < 0 || st.st_size < h->size)
+	return -1;
+    return 0;
+}
+
+static void
+sri_cover(sri_header_t *h, const fileheader_t *fhs, int nrecs)
+{
+    h->nrecs = nrecs;
+    memset(h->lastfn, 0, sizeof(h->lastfn));
+    if (nrecs > 0)
+	strlcpy(h->lastfn, fhs[nrecs - 1].filename, sizeof(h->lastfn));
+}
+
+/**
+ * Rebuilds the index from scratch. Segments are written before the
+ * header, so a crash leaves an empty (but valid) index behind.
+ * Records are only appended to .DIR or rewritten in place, except for
+ * deletions and expire, which are caught by the lastfn check.
+ */
+static int
+sri_rebuild(int fd, const fileheader_t *fhs, int ndir)
+{
+    sri_header_t h;
+    int from;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SRI_MAGIC, sizeof(h.magic));
+    h.size = SRI_ALIGN(sizeof(h));
+    if (ftruncate(fd, 0) < 0 || sri_write_header(fd, &h) < 0)
+	return -1;
+
+    for (from = 0; from < ndir; from += SRI_SEGRECS)
+	if (sri_append(fd, &h, fhs, from,
+		       from + SRI_SEGRECS < ndir ? from + SRI_SEGRECS : ndir) < 0)
+	    return -1;
+    sri_cover(&h, fhs, ndir);
+    return sri_write_header(fd, &h);
+}
+
+/**
+ * Brings the index up to date with .DIR. Caller holds LOCK_EX.
+ * @return 0 if nothing had to be done, 1 if updated, -1 on error.
+ */
+static int
+sri_update(int fd, const fileheader_t *fhs, int ndir)
+{
+    sri_header_t h;
+
+    if (sri_read_header(fd, &h) < 0 || (int)h.nrecs > ndir ||
+	(h.nrecs > 0 &&
+	 strncmp(fhs[h.nrecs - 1].filename, h.lastfn, FNLEN) != 0) ||
+	h.nseg > h.nrecs / SRI_SEGRECS + SRI_MAXSEG)
+	return sri_rebuild(fd, fhs, ndir) < 0 ? -1 : 1;
+
+    if (ndir - (int)h.nrecs <= SRI_TAIL)
+	return 0;
+
+    // new posts
+    if (ftruncate(fd, h.size) < 0 ||
+	sri_append(fd, &h, fhs, h.nrecs, ndir) < 0)
+	return -1;
+    sri_cover(&h, fhs, ndir);
+    return sri_write_header(fd, &h) < 0 ? -1 : 1;
+}
+
+/**
+ * Renumbers record rec of segment seg after the deletions logged since.
+ * @return the current record number, or -1 if it was deleted.
+ */
+static int
+sri_renumber(const sri_header_t *h, uint32_t seg, int rec)
+{
+    uint32_t i;
+
+    for (i = 0; i < h->ndel; i++) {
+	if (h->del[i].nseg <= seg)
+	    continue;
+	if (rec == (int)h->del[i].pos)
+	    return -1;
+	if (rec > (int)h->del[i].pos)
+	    rec--;
+    }
+    return rec;
+}
+
+/**
+ * Collects the postings of key from all segments into *v (sorted, unique).
+ * @return number of records.
+ */
+static int
+sri_postings(const char *base, size_t size, uint64_t key, int **pv)
+{
+    const sri_header_t *h = (const sri_header_t *)base;
+    size_t off = SRI_ALIGN(sizeof(*h));
+    int *v = NULL, n = 0, cap = 0, i, j, rec;
+    uint32_t s, ndel = h->ndel;
+
+    for (s = 0; s < h->nseg; s++) {
+	const sri_segment_t *seg = (const sri_segment_t *)(base + off);
+	const sri_key_t *kt = (const sri_key_t *)(seg + 1);
+	int lo = 0, hi;
+	size_t segsz;
+
+	if (off + sizeof(*seg) > size)
+	    break;
+	segsz = SRI_ALIGN(sizeof(*seg) + sizeof(sri_key_t) * seg->nkeys +
+			  sizeof(uint32_t) * seg->nposts);
+	if (off + segsz > size)
+	    break;
+
+	hi = (int)seg->nkeys - 1;
+	while (lo <= hi) {
+	    int mid = (lo + hi) / 2;
+	    if (kt[mid].key == key) {
+		const uint32_t *p = (const uint32_t *)((const char *)seg +
+						       kt[mid].off);
+		if (kt[mid].off + sizeof(uint32_t) * kt[mid].cnt > segsz)
+		    break;
+		if (n + (int)kt[mid].cnt > cap) {
+		    cap = (n + kt[mid].cnt) * 2;
+		    v = realloc(v, sizeof(int) * cap);
+		}
+		for (i = 0; i < (int)kt[mid].cnt; i++)
+		    if (!ndel)
+			v[n++] = p[i];
+		    else if ((rec = sri_renumber(h, s, p[i])) >= 0)
+			v[n++] = rec;
+		break;
+	    } else if (kt[mid].key < key)
+		lo = mid + 1;
+	    else
+		hi = mid - 1;
+	}
+	off += segsz;
+    }
+
+    // segments added by srindex_touch() are out of order
+    if (n > 1) {
+	qsort(v, n, sizeof(int), sri_cmp_int);
+	for (i = j = 1; i < n; i++)
+	    if (v[i] != v[j - 1])
+		v[j++] = v[i];
+	n = j;
+    }
+    *pv = v;
+    return n;
+}
+
+/**
+ * Finds the records of dir_path whose author (SRI_AUTHOR) or title
+ * (SRI_TITLE) may contain key, as DBCS_strcasestr() would. Builds or
+ * updates the index as needed.
+ * @param precs	receives a malloc()ed array of 0 based record numbers,
+ *		ascending; may contain false positives and records past the
+ *		current end of dir_path.
+ * @return number of records, or -1 if the index can't answer (key shorter
+ *	   than two characters, I/O errors): scan dir_path instead.
+ */
+int
+srindex_search(const char *dir_path, int field, const char *key, int **precs)
+{
+    uint64_t keys[TTLEN + 1];
+    const fileheader_t *fhs;
+    char path[PATHLEN];
+    sri_header_t h;
+    void *map;
+    int *cand = NULL, *v, nkeys, ncand = -1, ndir, fd, i, j, k, m, n;
+
+    *precs = NULL;
+    if (strlen(key) > TTLEN ||
+	(nkeys = sri_keys(field, key, strlen(key), keys)) <= 0)
+	return -1;
+
+    sri_path(path, sizeof(path), dir_path);
+    if ((fd = open(path, O_RDWR | O_CREAT, DEFAULT_FILE_CREATE_PERM)) < 0)
+	return -1;
+
+    flock(fd, LOCK_EX);
+    if ((ndir = fileheader_view(dir_path, &fhs)) < 0 ||
+	sri_update(fd, fhs, ndir) < 0 ||
+	sri_read_header(fd, &h) < 0) {
+	flock(fd, LOCK_UN);
+	close(fd);
+	return -1;
+    }
+    // readers only need the file to stay put
+    flock(fd, LOCK_SH);
+
+    map = mmap(NULL, h.size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+	flock(fd, LOCK_UN);
+	close(fd);
+	return -1;
+    }
+
+    // intersect the postings of all bigrams
+    for (k = 0; k < nkeys && ncand != 0; k++) {
+	n = sri_postings(map, h.size, keys[k], &v);
+	if (ncand < 0) {
+	    cand = v;
+	    ncand = n;
+	    continue;
+	}
+	for (i = j = m = 0; i < ncand && j < n; ) {
+	    if (cand[i] < v[j])
+		i++;
+	    else if (cand[i] > v[j])
+		j++;
+	    else
+		cand[m++] = cand[i++], j++;
+	}
+	ncand = m;
+	free(v);
+    }
+    munmap(map, h.size);
+
+    // and the records not covered yet
+    if (ndir > (int)h.nrecs) {
+	cand = realloc(cand, sizeof(int) * (ncand + ndir - h.nrecs));
+	for (i = h.nrecs; i < ndir; i++)
+	    cand[ncand++] = i;
+    }
+
+    flock(fd, LOCK_UN);
+    close(fd);
+    *precs = cand;
+    return ncand;
+}
+
+/**
+ * Adds the current author and title of record ent (1 based) to the index
+ * of dir_path, if it has one covering ent. Call after changing them in
+ * place; the old postings are left behind as false positives.
+ */
+int
+srindex_touch(const char *dir_path, int ent)
+{
+    const fileheader_t *fhs;
+    char path[PATHLEN];
+    sri_header_t h;
+    int fd, ndir, ret = 0;
+
+    sri_path(path, sizeof(path), dir_path);
+    if ((fd = open(path, O_RDWR)) < 0)
+	return 0;
+
+    flock(fd, LOCK_EX);
+    if (sri_read_header(fd, &h) == 0 && ent > 0 && ent <= (int)h.nrecs &&
+	(ndir = fileheader_view(dir_path, &fhs)) >= ent) {
+	if (ftruncate(fd, h.size) < 0 ||
+	    sri_append(fd, &h, fhs, ent - 1, ent) < 0 ||
+	    sri_write_header(fd, &h) < 0)
+	    ret = -1;
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    return ret;
+}
+
+/**
+ * Locks the index of dir_path against searches before record ent (1 based)
+ * is deleted, so that deletions are logged in the order they are made.
+ * @return a descriptor for srindex_delete_end(), or -1 if there is no index.
+ */
+int
+srindex_delete_begin(const char *dir_path)
+{
+    char path[PATHLEN];
+    int fd;
+
+    sri_path(path, sizeof(path), dir_path);
+    if ((fd = open(path, O_RDWR)) < 0)
+	return -1;
+    flock(fd, LOCK_EX);
+    return fd;
+}
+
+/**
+ * Logs the deletion of record ent (1 based; 0 if nothing was deleted) and
+ * unlocks. If .DIR does not look like the index less that record, the log
+ * is left alone and the next search rebuilds the index.
+ */
+void
+srindex_delete_end(int fd, const char *dir_path, int ent)
+{
+    const fileheader_t *fhs;
+    sri_header_t h;
+    int ndir;
+
+    if (fd < 0)
+	return;
+    if (ent > 0 && sri_read_header(fd, &h) == 0 && ent <= (int)h.nrecs &&
+	(ndir = fileheader_view(dir_path, &fhs)) >= (int)h.nrecs - 1 &&
+	// the last record covered moved down by one, if it was not deleted
+	(ent == (int)h.nrecs ||
+	 strncmp(fhs[h.nrecs - 2].filename, h.lastfn, FNLEN) == 0)) {
+	if (h.ndel >= SRI_MAXDEL) {
+	    sri_rebuild(fd, fhs, ndir);
+	} else {
+	    h.del[h.ndel].pos = ent - 1;
+	    h.del[h.ndel].nseg = h.nseg;
+	    h.ndel++;
+	    sri_cover(&h, fhs, h.nrecs - 1);
+	    sri_write_header(fd, &h);
+	}
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+}
@@ -11,6 +11,7 @@ print """#include <stdint.h>
 extern const uint16_t b2u_table[];
 extern const uint16_t u2b_table[];
 extern const uint8_t b2u_ambiguous_width[];
+extern const uint8_t b2u_utf8_table[][4];
 """
 print "const uint16_t b2u_table[0x10000] = {"
 for i in range(0x10000):
@@ -19,6 +20,22 @@ for i in range(0x10000):
         print ''
 print "};\n"
 
+# b2u, already in UTF-8: 3 bytes (zero padded) and the length
+def utf8(ucs):
+    if ucs < 0x80:
+        return [ucs]
+    if ucs < 0x800:
+        return [0xC0 | (ucs >> 6), 0x80 | (ucs & 0x3F)]
+    return [0xE0 | (ucs >> 12), 0x80 | ((ucs >> 6) & 0x3F), 0x80 | (ucs & 0x3F)]
+
+print "const uint8_t b2u_utf8_table[0x10000][4] = {"
+for i in range(0x10000):
+    u = utf8(i if i not in b2u else b2u[i])
+    print '{%s},' % ','.join(['0x%02x' % c for c in u + [0] * (3 - len(u)) + [len(u)]]),
+    if i % 4 == 3:
+        print ''
+print "};\n"
+
 # u2b
 u2b = open('uao250-u2b.big5.txt', 'r').readlines()
 u2b = [line.strip().split(' ')
@@ -521,24 +521,15 @@ static unsigned const char cov_2char[64]={
 0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7A
 };
 
-#ifdef PERL5
-char *des_crypt(buf,salt)
-#else
-char *fcrypt(buf, salt)
-char *buf;
-char *salt;
-          
-           
-#endif
-     
-      
+/* fcrypt() into the caller's result (at least 14 bytes), for threads */
+char *fcrypt_r(const char *buf, const char *salt, char *result)
 	{
 	unsigned int i,j,x,y;
 	unsigned long Eswap0=0,Eswap1=0;
 	unsigned long out[2],ll;
 	des_cblock key;
 	des_key_schedule ks;
-	static unsigned char buff[20];
+	unsigned char *buff=(unsigned char *)result;
 	unsigned char bb[9];
 	unsigned char *b=bb;
 	unsigned char c,u;
@@ -593,6 +584,19 @@ char *salt;
 	return((char *)buff);
 	}
 
+#ifdef PERL5
+char *des_crypt(buf,salt)
+#else
+char *fcrypt(buf, salt)
+const char *buf;
+const char *salt;
+#endif
+	{
+	static char buff[20];
+
+	return(fcrypt_r(buf,salt,buff));
+	}
+
 static int body(out0, out1, ks, Eswap0, Eswap1)
 unsigned long *out0;
 unsigned long *out1;
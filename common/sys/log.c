@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/time.h>
 
 #include "cmsys.h"
 #include "config.h" // for DEFAULT_FILE_CREATE_PERM
@@ -57,3 +58,210 @@ log_file(const char *fn, int log_flag, const char *msg)
     return 0;
 }
 
+
+/* ----------------------------------------------------- */
+/* logbuf: lines for many files, written together        */
+/* ----------------------------------------------------- */
+
+/*
+ * A daemon logging lot of lines (e.g. logattempts of logind) adds them to
+ * a LOGBUF instead of open/append/close for each line. Lines of the same
+ * file are kept in order and written by one write() when the buffer of the
+ * file is full, or when the oldest of them has waited for delay_ms; the
+ * owner must call logbuf_flush() in time for the latter.
+ */
+
+#define LOGBUF_HASH_SIZE    (256)
+
+struct logbuf_file {
+    struct logbuf_file *hnext;  // hash chain
+    struct logbuf_file *prev, *next;    // flush queue, oldest first
+    struct timeval first;       // when the oldest line in buf came
+    char   *buf;
+    size_t len, size;
+    char   path[1];
+};
+
+static int
+logbuf_ms_since(const struct timeval *tv, const struct timeval *now)
+{
+    return (now->tv_sec - tv->tv_sec) * 1000 +
+	(now->tv_usec - tv->tv_usec) / 1000;
+}
+
+void
+logbuf_init(LOGBUF *lb, size_t bufsize, int delay_ms)
+{
+    memset(lb, 0, sizeof(LOGBUF));
+    lb->hash = (struct logbuf_file **)calloc(LOGBUF_HASH_SIZE,
+					     sizeof(struct logbuf_file *));
+    lb->bufsize = bufsize;
+    lb->delay_ms = delay_ms;
+}
+
+static int
+logbuf_write(LOGBUF *lb, const char *path, const char *msg, size_t len)
+{
+    int fd = open(path, O_APPEND | O_WRONLY | O_CREAT,
+		  DEFAULT_FILE_CREATE_PERM);
+
+    if (fd < 0)
+	return -1;
+    lb->writes++;
+    if (write(fd, msg, len) < 0) {
+	close(fd);
+	return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+static void
+logbuf_unqueue(LOGBUF *lb, struct logbuf_file *f)
+{
+    if (f->prev)
+	f->prev->next = f->next;
+    else
+	lb->head = f->next;
+    if (f->next)
+	f->next->prev = f->prev;
+    else
+	lb->tail = f->prev;
+    f->prev = f->next = NULL;
+}
+
+// writes what f has and forgets f; *pf is the hash slot of f.
+static void
+logbuf_drop(LOGBUF *lb, struct logbuf_file **pf, const struct timeval *now)
+{
+    struct logbuf_file *f = *pf;
+    int delay = logbuf_ms_since(&f->first, now);
+
+    if (delay > lb->max_delay_ms)
+	lb->max_delay_ms = delay;
+    logbuf_write(lb, f->path, f->buf, f->len);
+    lb->buffered -= f->len;
+
+    logbuf_unqueue(lb, f);
+    *pf = f->hnext;
+    free(f->buf);
+    free(f);
+}
+
+static struct logbuf_file **
+logbuf_find(LOGBUF *lb, const char *path)
+{
+    struct logbuf_file **pf;
+    unsigned int h = 0;
+    const char *s;
+
+    for (s = path; *s; s++)
+	h = h * 31 + (unsigned char)*s;
+    for (pf = &lb->hash[h % LOGBUF_HASH_SIZE]; *pf; pf = &(*pf)->hnext)
+	if (strcmp((*pf)->path, path) == 0)
+	    break;
+    return pf;
+}
+
+/**
+ * Appends msg (len bytes) to file path, created if needed.
+ * @return 0 if buffered or written, -1 on error.
+ */
+int
+logbuf_add(LOGBUF *lb, const char *path, const char *msg, size_t len)
+{
+    struct logbuf_file **pf = logbuf_find(lb, path), *f = *pf;
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    lb->lines++;
+    if (f && f->len + len > lb->bufsize) {
+	// the new line starts again at the tail of the queue
+	logbuf_drop(lb, pf, &now);
+	f = NULL;
+    }
+    if (len > lb->bufsize)
+	return logbuf_write(lb, path, msg, len);
+
+    if (!f) {
+	if ((f = (struct logbuf_file *)malloc(
+			sizeof(struct logbuf_file) + strlen(path))) == NULL)
+	    return logbuf_write(lb, path, msg, len);
+	memset(f, 0, sizeof(struct logbuf_file));
+	strcpy(f->path, path);
+	f->hnext = *pf;
+	*pf = f;
+    }
+    if (f->len + len > f->size) {
+	size_t size = f->size ? f->size : 256;
+	char *buf;
+
+	while (size < f->len + len)
+	    size *= 2;
+	if (size > lb->bufsize)
+	    size = lb->bufsize;
+	if ((buf = (char *)realloc(f->buf, size)) == NULL) {
+	    if (!f->len) {
+		// just created; files in hash always have lines
+		*pf = f->hnext;
+		free(f->buf);
+		free(f);
+	    }
+	    return logbuf_write(lb, path, msg, len);
+	}
+	f->buf = buf;
+	f->size = size;
+    }
+
+    if (!f->len) {
+	f->first = now;
+	f->prev = lb->tail;
+	if (lb->tail)
+	    lb->tail->next = f;
+	else
+	    lb->head = f;
+	lb->tail = f;
+    }
+    memcpy(f->buf + f->len, msg, len);
+    f->len += len;
+    lb->buffered += len;
+    return 0;
+}
+
+/**
+ * Writes files of which the oldest line has waited for delay_ms, or all if
+ * force is set; files written are forgotten.
+ * @return milliseconds until the next call is due, or -1 if nothing left.
+ */
+int
+logbuf_flush(LOGBUF *lb, int force)
+{
+    struct logbuf_file *f;
+    struct timeval now;
+    int wait;
+
+    gettimeofday(&now, NULL);
+    // too much in memory; happens only with lots of different files.
+    if (lb->buffered > lb->bufsize * LOGBUF_HASH_SIZE)
+	force = 1;
+
+    while ((f = lb->head) != NULL) {
+	if (!force &&
+	    (wait = lb->delay_ms - logbuf_ms_since(&f->first, &now)) > 0)
+	    return wait;
+
+	logbuf_drop(lb, logbuf_find(lb, f->path), &now);
+    }
+    return -1;
+}
+
+/**
+ * Writes everything and frees lb.
+ */
+void
+logbuf_delete(LOGBUF *lb)
+{
+    logbuf_flush(lb, 1);
+    free(lb->hash);
+    lb->hash = NULL;
+}
@@ -249,6 +249,69 @@ int toconnect3(const char *addr, int timeout, int microseconds)
     return sock;
 }
 
+// Starts connecting to addr without waiting: the socket is returned in
+// non-blocking mode, possibly still connecting (poll it for writing).
+int toconnect_nonblock(const char *addr)
+{
+    int sock;
+#ifdef SO_NOSIGPIPE
+    int n = 1;
+#endif
+    assert(addr && *addr);
+
+    if (!isdigit(addr[0]) && addr[0] != ':' && addr[0] != '*') {
+	struct sockaddr_un serv_name;
+
+	if ( (sock = socket(PF_UNIX, SOCK_STREAM, 0)) < 0 )
+	    return -1;
+#ifdef SO_NOSIGPIPE
+        setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &n, sizeof(n));
+#endif
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, NULL) | O_NONBLOCK);
+
+	serv_name.sun_family = AF_UNIX;
+	strlcpy(serv_name.sun_path, addr, sizeof(serv_name.sun_path));
+
+	if (connect(sock, (struct sockaddr *)&serv_name, sizeof(serv_name)) < 0) {
+	    close(sock);
+	    return -1;
+	}
+    }
+    else {
+	char buf[64], *port;
+	struct sockaddr_in serv_name;
+
+	if( (sock = socket(PF_INET, SOCK_STREAM, 0)) < 0 )
+	    return -1;
+#ifdef SO_NOSIGPIPE
+        setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &n, sizeof(n));
+#endif
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, NULL) | O_NONBLOCK);
+
+	strlcpy(buf, addr, sizeof(buf));
+	if ( (port = strchr(buf, ':')) != NULL)
+	    *port++ = '\0';
+
+	assert(port && atoi(port) != 0);
+
+	if (!buf[0] || buf[0] == '*')
+	    serv_name.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	else
+	    serv_name.sin_addr.s_addr = inet_addr(buf);
+
+	serv_name.sin_port = htons(atoi(port));
+	serv_name.sin_family = AF_INET;
+
+	if (connect(sock, (struct sockaddr*)&serv_name, sizeof(serv_name)) < 0 &&
+	    errno != EINPROGRESS) {
+	    close(sock);
+	    return -1;
+	}
+    }
+
+    return sock;
+}
+
 int is_to_readwrite_again(int s)
 {
     if (s >= 0)
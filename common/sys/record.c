@@ -6,10 +6,15 @@
 #include <fcntl.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <limits.h>
 #include "cmsys.h"
 
 #define BUFSIZE 512
 
+#ifndef RECORD_VIEW_SLOTS
+#define RECORD_VIEW_SLOTS 8
+#endif
+
 /* Functions for fixed size record operations */
 
 int
@@ -332,3 +337,101 @@ int bsearch_record(const char *fpath, const void *key,
   close(fd);
   return found ? (found - addr) / size : -1;
 }
+
+/* Memory mapped, read only views of record files.
+ *
+ * record_view() maps the whole file (MAP_SHARED, PROT_READ) and keeps the
+ * mapping in a small per process (per thread) cache, so walking an index
+ * costs one stat() instead of one lseek+read pair per record.  Records
+ * rewritten in place show through the shared mapping, so a cached view is
+ * only re-mapped when the file is replaced or its size changes.
+ *
+ * The returned pointer stays valid until the next record_view() call in the
+ * same thread, which may evict or re-map it. */
+
+typedef struct RecordView {
+    char    path[PATH_MAX];
+    dev_t   dev;
+    ino_t   ino;
+    off_t   size;
+    void   *addr;
+    size_t  len;
+    unsigned int lru;
+} RecordView;
+
+static __thread RecordView record_views[RECORD_VIEW_SLOTS];
+static __thread unsigned int record_view_tick;
+
+static void
+record_view_unmap(RecordView *v)
+{
+    if (v->addr)
+	munmap(v->addr, v->len);
+    v->addr = NULL;
+    v->len = 0;
+    v->path[0] = 0;
+}
+
+int
+record_view(const char *fpath, size_t size, const void **pbase)
+{
+    struct stat st;
+    RecordView *v = NULL, *victim = &record_views[0];
+    int i, fd;
+
+    assert(fpath && pbase && size > 0);
+    *pbase = NULL;
+
+    if (stat(fpath, &st) == -1)
+	return -1;
+
+    for (i = 0; i < RECORD_VIEW_SLOTS; i++) {
+	RecordView *p = &record_views[i];
+	if (p->path[0] && strcmp(p->path, fpath) == 0) {
+	    v = p;
+	    break;
+	}
+	if (!p->path[0] || p->lru < victim->lru)
+	    victim = p;
+    }
+
+    if (v && v->dev == st.st_dev && v->ino == st.st_ino &&
+	v->size == st.st_size) {
+	v->lru = ++record_view_tick;
+	*pbase = v->addr;
+	return v->len / size;
+    }
+    if (!v)
+	v = victim;
+    record_view_unmap(v);
+
+    if (st.st_size < (off_t)size)
+	return 0;
+
+    if ((fd = open(fpath, O_RDONLY)) < 0)
+	return -1;
+    // refresh after open, the file may have been replaced in between.
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)size) {
+	close(fd);
+	return st.st_size < (off_t)size ? 0 : -1;
+    }
+    // only whole records; a partial tail is being appended.
+    v->len = st.st_size - st.st_size % size;
+    v->addr = mmap(NULL, v->len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (v->addr == MAP_FAILED) {
+	v->addr = NULL;
+	v->len = 0;
+	return -1;
+    }
+
+    strlcpy(v->path, fpath, sizeof(v->path));
+    v->dev = st.st_dev;
+    v->ino = st.st_ino;
+    v->size = st.st_size;
+    v->lru = ++record_view_tick;
+
+    *pbase = v->addr;
+    return v->len / size;
+}
@@ -1,6 +1,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <stdint.h>
 #include "fnv_hash.h"
 
 #include "ansi.h"
@@ -111,6 +112,176 @@ reduce_blank(char *cbuf, const char *buf) {
     return 0;
 }
 
+/* ----------------------------------------------------- */
+/* string scanning kernels                               */
+/* ----------------------------------------------------- */
+/*
+ * str_span(s, c1, c2, stop_high, max): length of the leading run of s
+ * without NUL, c1, c2 and (if stop_high) bytes >= 0x80, at most max.
+ * This is the inner loop of the ANSI and DBCS functions below; the SIMD
+ * versions test 16 or 32 bytes at a time. They only load aligned blocks,
+ * so they never cross into a page the string doesn't touch.
+ */
+#define STR_SPAN_INLINE (16)	// bytes checked before calling the kernel
+
+typedef size_t (*str_span_func)(const char *s, int c1, int c2, int stop_high,
+				size_t max);
+
+static size_t
+str_span_scalar(const char *s, int c1, int c2, int stop_high, size_t max)
+{
+    const unsigned char *p = (const unsigned char *)s;
+    size_t n;
+
+    for (n = 0; n < max; n++) {
+	if (!p[n] || p[n] == (unsigned char)c1 || p[n] == (unsigned char)c2 ||
+	    (stop_high && p[n] >= 0x80))
+	    break;
+    }
+    return n;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_STR_SPAN_SIMD
+
+__attribute__((target("sse2")))
+static size_t
+str_span_sse2(const char *s, int c1, int c2, int stop_high, size_t max)
+{
+    const char *p = (const char *)((uintptr_t)s & ~(uintptr_t)15);
+    const __m128i z = _mm_setzero_si128(),
+	  v1 = _mm_set1_epi8((char)c1), v2 = _mm_set1_epi8((char)c2);
+    const unsigned int high = stop_high ? 0xFFFF : 0;
+    unsigned int mask, skip = s - p;
+    size_t n;
+
+    for (;; p += 16, skip = 0) {
+	__m128i x = _mm_load_si128((const __m128i *)p);
+	mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, z),
+			_mm_or_si128(_mm_cmpeq_epi8(x, v1),
+				     _mm_cmpeq_epi8(x, v2))));
+	mask |= _mm_movemask_epi8(x) & high;
+	mask = (mask >> skip) << skip;
+	if (mask) {
+	    n = p + __builtin_ctz(mask) - s;
+	    return n < max ? n : max;
+	}
+	if ((size_t)(p + 16 - s) >= max)
+	    return max;
+    }
+}
+
+__attribute__((target("avx2")))
+static size_t
+str_span_avx2(const char *s, int c1, int c2, int stop_high, size_t max)
+{
+    const char *p = (const char *)((uintptr_t)s & ~(uintptr_t)31);
+    const __m256i z = _mm256_setzero_si256(),
+	  v1 = _mm256_set1_epi8((char)c1), v2 = _mm256_set1_epi8((char)c2);
+    const unsigned int high = stop_high ? 0xFFFFFFFFu : 0;
+    unsigned int mask, skip = s - p;
+    size_t n;
+
+    for (;; p += 32, skip = 0) {
+	__m256i x = _mm256_load_si256((const __m256i *)p);
+	mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(x, z),
+			_mm256_or_si256(_mm256_cmpeq_epi8(x, v1),
+					_mm256_cmpeq_epi8(x, v2))));
+	mask |= (unsigned int)_mm256_movemask_epi8(x) & high;
+	mask = (mask >> skip) << skip;
+	if (mask) {
+	    n = p + __builtin_ctz(mask) - s;
+	    return n < max ? n : max;
+	}
+	if ((size_t)(p + 32 - s) >= max)
+	    return max;
+    }
+}
+#endif
+
+static const char * const str_kernel_names[] = { "scalar", "sse2", "avx2" };
+static int str_kernel = STR_KERNEL_AUTO;	// not selected yet
+static str_span_func str_span_impl = str_span_scalar;
+
+/**
+ * Selects the string kernels; STR_KERNEL_AUTO picks the best one the CPU
+ * supports. Done implicitly on first use.
+ * @return 0 on success, -1 if the kernel is not available.
+ */
+int
+str_kernel_set(int kernel)
+{
+#ifdef HAVE_STR_SPAN_SIMD
+    __builtin_cpu_init();
+    if (kernel == STR_KERNEL_AUTO)
+	kernel = __builtin_cpu_supports("avx2") ? STR_KERNEL_AVX2 :
+		 __builtin_cpu_supports("sse2") ? STR_KERNEL_SSE2 :
+		 STR_KERNEL_SCALAR;
+
+    switch (kernel) {
+	case STR_KERNEL_AVX2:
+	    if (!__builtin_cpu_supports("avx2"))
+		return -1;
+	    str_span_impl = str_span_avx2;
+	    break;
+	case STR_KERNEL_SSE2:
+	    if (!__builtin_cpu_supports("sse2"))
+		return -1;
+	    str_span_impl = str_span_sse2;
+	    break;
+	case STR_KERNEL_SCALAR:
+	    str_span_impl = str_span_scalar;
+	    break;
+	default:
+	    return -1;
+    }
+#else
+    if (kernel == STR_KERNEL_AUTO)
+	kernel = STR_KERNEL_SCALAR;
+    if (kernel != STR_KERNEL_SCALAR)
+	return -1;
+#endif
+    str_kernel = kernel;
+    return 0;
+}
+
+const char *
+str_kernel_name(void)
+{
+    if (str_kernel == STR_KERNEL_AUTO)
+	str_kernel_set(STR_KERNEL_AUTO);
+    return str_kernel_names[str_kernel];
+}
+
+static inline size_t
+str_span(const char *s, int c1, int c2, int stop_high, size_t max)
+{
+    const unsigned char *p = (const unsigned char *)s;
+    size_t n;
+
+    // most runs are short; don't pay for the call on those
+    for (n = 0; n < STR_SPAN_INLINE && n < max; n++)
+	if (!p[n] || p[n] == (unsigned char)c1 || p[n] == (unsigned char)c2 ||
+	    (stop_high && p[n] >= 0x80))
+	    return n;
+    if (n == max)
+	return n;
+
+    if (str_kernel == STR_KERNEL_AUTO)
+	str_kernel_set(STR_KERNEL_AUTO);
+    return n + str_span_impl(s + n, c1, c2, stop_high, max - n);
+}
+
+/**
+ * Length of the leading run of 7-bit, non-NUL bytes in s, at most max.
+ */
+size_t
+str_ascii_span(const char *s, size_t max)
+{
+    return str_span(s, 0, 0, 1, max);
+}
+
 static const char EscapeFlag[] = {
     /*  0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
     /* 10 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 ,0, 0, 0, 0, 0,
@@ -143,14 +314,19 @@ int
 strip_ansi(char *dst, const char *src, enum STRIP_FLAG mode)
 {
     register int    count = 0;
-#define isEscapeParam(X) (EscapeFlag[(int)(X)] & 1)
-#define isEscapeCommand(X) (EscapeFlag[(int)(X)] & 2)
+#define isEscapeParam(X) (EscapeFlag[(unsigned char)(X)] & 1)
+#define isEscapeCommand(X) (EscapeFlag[(unsigned char)(X)] & 2)
 
     for(; *src; ++src)
 	if( *src != ESC_CHR ){
-	    if( dst )
-		*dst++ = *src;
-	    ++count;
+	    // copy everything up to the next escape at once
+	    size_t len = str_span(src, ESC_CHR, ESC_CHR, 0, SIZE_MAX);
+	    if( dst ){
+		memmove(dst, src, len);
+		dst += len;
+	    }
+	    count += len;
+	    src += len - 1;
 	}else{
 	    const char* p = src + 1;
 	    if( *p != '[' ){
@@ -220,44 +396,34 @@ strat_ansi(int count, const char *s)
     return s - os;
 }
 
-int 
+int
 strlen_noansi(const char *s)
 {
-    // XXX this is almost identical to
-    // strip_ansi(NULL, s, STRIP_ALL)
-    register int count = 0, mode = 0;
+    // same as strip_ansi(NULL, s, STRIP_ALL)
+    register int count = 0;
+    size_t len;
 
-    if (!s || !*s)
+    if (!s)
 	return 0;
 
-    for (; *s; ++s)
+    while (*s)
     {
-	// 0 - no ansi, 1 - [, 2 - param+cmd
-	switch (mode)
-	{
-	    case 0:
-		if (*s == ESC_CHR)
-		    mode = 1;
-		else
-		    count ++;
-		break;
-
-	    case 1:
-		if (*s == '[')
-		    mode = 2;
-		else
-		    mode = 0; // unknown command
-		break;
-
-	    case 2:
-		if (isEscapeParam(*s))
-		    continue;
-		else if (isEscapeCommand(*s))
-		    mode = 0;
-		else
-		    mode = 0;
-		break;
+	if (*s != ESC_CHR) {
+	    len = str_span(s, ESC_CHR, ESC_CHR, 0, SIZE_MAX);
+	    count += len;
+	    s += len;
+	    continue;
 	}
+
+	// ESC: eat one char, or a [param+cmd sequence
+	if (!*++s)
+	    break;
+	if (*s++ != '[')
+	    continue;
+	while (isEscapeParam(*s))
+	    s++;
+	if (*s)
+	    s++;
     }
     return count;
 }
@@ -379,16 +545,30 @@ DBCS_NextStatus(char c, int prev_status) {
  */
 int DBCS_Status(const char *dbcstr, int pos)
 {
-    int sts = DBCS_ASCII;
-    char c;
-
-    while (pos-- >= 0) {
-        c = *dbcstr++;
-        sts = DBCS_NextStatus(c, sts);
-        if (c == 0)
-            break;
+    size_t len;
+
+    while (pos >= 0) {
+	if (IS_DBCSLEAD(*dbcstr)) {
+	    // a whole character
+	    if (pos == 0)
+		return DBCS_LEADING;
+	    if (pos == 1 || !dbcstr[1])
+		return DBCS_TRAILING;
+	    dbcstr += 2;
+	    pos -= 2;
+	    continue;
+	}
+	if (!*dbcstr)
+	    break;
+
+	// a run of ASCII
+	len = str_span(dbcstr, 0, 0, 1, (size_t)pos + 1);
+	if (len > (size_t)pos)
+	    break;
+	dbcstr += len;
+	pos -= len;
     }
-    return sts;
+    return DBCS_ASCII;
 }
 
 void DBCS_safe_trim(char *dbcstr)
@@ -408,10 +588,32 @@ DBCS_strcasestr(const char* pool, const char *ptr)
     // TODO rewrite this with DBCS_Status
     int i = 0, i2 = 0, found = 0,
         szpool = strlen(pool),
-        szptr  = strlen(ptr);
+        szptr  = strlen(ptr),
+        last = szpool - szptr;
+    int c1 = 0, c2 = 0;
+
+    // bytes that may start a match in an ASCII run
+    if (!IS_DBCSLEAD(ptr[0]))
+    {
+        c1 = tolower((unsigned char)ptr[0]);
+        c2 = toupper(c1);
+    }
 
-    for (i = 0; i <= szpool-szptr; i++)
+    for (i = 0; i <= last; i++)
     {
+        if (szptr && !IS_DBCSLEAD(pool[i]))
+        {
+            // skip the ASCII characters that can't start a match
+            i += str_span(pool + i, c1, c2, 1, last - i + 1);
+            if (i > last)
+                break;
+            if (IS_DBCSLEAD(pool[i]) && !IS_DBCSLEAD(ptr[0]))
+            {
+                i++;
+                continue;
+            }
+        }
+
         found = 1;
 
         // compare szpool[i..szptr] with ptr
@@ -423,7 +625,6 @@ DBCS_strcasestr(const char* pool, const char *ptr)
                 if (ptr[i2]   != pool[i+i2] ||
                     ptr[i2+1] != pool[i+i2+1])
                 {
-		    // printf("break on non-ascii (i=%d, i2=%d).\n", i, i2);
                     found = 0;
                     break;
                 }
@@ -433,7 +634,6 @@ DBCS_strcasestr(const char* pool, const char *ptr)
                 if (IS_DBCSLEAD(ptr[i2]) ||
 		    tolower(ptr[i2]) != tolower(pool[i+i2]))
                 {
-		    // printf("break on ascii (i=%d, i2=%d).\n", i, i2);
                     found = 0;
                     break;
                 }
@@ -2,6 +2,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdint.h>
+#include "cmsys.h"
 
 int ucs2utf(uint16_t ucs2, uint8_t *utf8) {
     // assume utf8 has enough space.
@@ -51,6 +52,91 @@ int utf2ucs(uint8_t *utf8, uint16_t *pucs) {
     return 1;
 }
 
+/*
+ * Block converters for client streams. A multibyte character split
+ * across two calls is carried in st; zero st before the first call.
+ * Runs of ASCII are copied at once (str_ascii_span finds their end).
+ */
+
+/**
+ * Converts len bytes of Big5 (UAO) in src to UTF-8 in dst, which must
+ * hold BIG5_TO_UTF8_MAXLEN(len) bytes.
+ * @return bytes written to dst.
+ */
+size_t
+big5_to_utf8_block(ConvState *st, const char *src, size_t len, char *dst)
+{
+    const uint8_t *s = (const uint8_t *)src, *end = s + len, *u;
+    char *d = dst;
+    size_t n;
+
+    if (st->npending && s < end) {
+	u = b2u_utf8_table[(st->pending[0] << 8) | *s++];
+	memcpy(d, u, 3);
+	d += u[3];
+	st->npending = 0;
+    }
+
+    while (s < end) {
+	if (*s < 0x80) {
+	    // NUL stops the span, but is copied as well
+	    if ((n = str_ascii_span((const char *)s, end - s)) == 0)
+		n = 1;
+	    memcpy(d, s, n);
+	    d += n;
+	    s += n;
+	    continue;
+	}
+	if (s + 1 == end) {
+	    st->pending[0] = *s++;
+	    st->npending = 1;
+	    break;
+	}
+	u = b2u_utf8_table[(s[0] << 8) | s[1]];
+	memcpy(d, u, 3);
+	d += u[3];
+	s += 2;
+    }
+    return d - dst;
+}
+
+/**
+ * Converts len bytes of UTF-8 in src to Big5 (UAO) in dst, which must
+ * hold UTF8_TO_BIG5_MAXLEN(len) bytes.
+ * @return bytes written to dst.
+ */
+size_t
+utf8_to_big5_block(ConvState *st, const char *src, size_t len, char *dst)
+{
+    const uint8_t *s = (const uint8_t *)src, *end = s + len;
+    uint8_t *d = (uint8_t *)dst;
+    uint16_t ucs;
+    size_t n;
+
+    while (s < end) {
+	if (st->npending) {
+	    st->pending[st->npending++] = *s++;
+	    // TODO this may create invalid chars.
+	    if (utf2ucs(st->pending, &ucs) > st->npending)
+		continue;
+	    ucs = u2b_table[ucs];
+	    *d++ = ucs >> 8;
+	    *d++ = ucs & 0xFF;
+	    st->npending = 0;
+	} else if (*s < 0x80) {
+	    if ((n = str_ascii_span((const char *)s, end - s)) == 0)
+		n = 1;
+	    memcpy(d, s, n);
+	    d += n;
+	    s += n;
+	} else {
+	    st->pending[0] = *s++;
+	    st->npending = 1;
+	}
+    }
+    return d - (uint8_t *)dst;
+}
+
 #ifdef _TEST_MAIN_
 
 const char * print_bits(uint8_t c) {
@@ -25,6 +25,7 @@
 #include <signal.h>
 #include <time.h>
 #include <limits.h>
+#include <sys/time.h>
 #include <event.h>
 #include "bbs.h"
 #include "daemons.h"
@@ -72,6 +73,13 @@ static int debug = 0;
 #define ANGELBEATS_ACTIVITY_MERGE_PERIOD    (15)
 #endif
 
+// Angel states are cached. After logins/logouts (SHM->UTMPidxseq changed)
+// re-read them from utmp at most once in every X seconds; pause changes are
+// notified by mbbsd (ANGELBEATS_REQ_UPDATE_STATE).
+#ifndef ANGELBEATS_RESYNC_PERIOD
+#define ANGELBEATS_RESYNC_PERIOD    (10)
+#endif
+
 #ifndef ANGELBEATS_PERF_OUTPUT_FILE
 #define ANGELBEATS_PERF_OUTPUT_FILE BBSHOME "/log/angel_perf.txt"
 #endif
@@ -120,15 +128,42 @@ typedef struct {
     int uid;
     int masters;            // counter of who have this one as angel
     char userid[IDLEN+1];
+
+    // cached online state, see angel_state_refresh()
+    int logins;
+    int pause;
+    // position in g_angel_heap, -1 if not available for new masters
+    int heap_pos;
+    // sort key of last_assigned, see angel_assign_key()
+    time_t sort_assigned;
+    unsigned int ticket;        // order for ANGELBEATS_ASSIGN_BY_RANDOM
+    unsigned int missed_since;  // g_suggests when it became available
+    // list of angels still in probation, ordered by last_assigned
+    int in_probation;
+    int probation_prev, probation_next;
 } AngelInfo;
 
 AngelInfo *g_angel_list;
 size_t g_angel_list_capacity, g_angel_list_size;   // capacity and current size
 
+// available angels (online and not paused), as indexes to g_angel_list
+// in a binary heap ordered by the assignment policy.
+int *g_angel_heap;
+size_t g_angel_heap_size;
+int g_probation_head = -1, g_probation_tail = -1;
+unsigned int g_suggests;    // number of suggestions made for masters
+unsigned int g_utmp_seq;    // SHM->UTMPidxseq of last sync
+time_t g_utmp_synced;
+
 struct timeval g_perf_timer_duration = { .tv_sec = ANGELBEATS_PERF_MIN_PERIOD };
 struct event g_perf_timer_event;
 GlobalPerfData g_perf;
 
+// request latency: g_req_latency[op][b] counts requests served in
+// [2^b, 2^(b+1)) microseconds, same buckets as the LAT_* histograms.
+unsigned int g_req_latency[ANGELBEATS_REQ_MAX][LAT_BUCKETS];
+long g_req_latency_max[ANGELBEATS_REQ_MAX];
+
 // quick sort stubs
 
 int angel_list_comp_uid(const void *pva, const void *pvb) {
@@ -146,17 +181,25 @@ int angel_list_comp_masters(const void *pva, const void *pvb) {
     return pa->masters - pb->masters;
 }
 
+int angel_in_probation(const AngelInfo *kanade, time_t now) {
+    return (now - kanade->last_assigned < ANGELBEATS_ASSIGN_PROBATION_PERIOD &&
+            kanade->last_activity < kanade->last_assigned);
+}
+
+// Angels assigned in same period are equal, unless still in probation.
+time_t angel_assign_key(const AngelInfo *kanade, time_t now) {
+    time_t assigned = kanade->last_assigned;
+
+    if (!angel_in_probation(kanade, now))
+        assigned -= assigned % ANGELBEATS_REASSIGN_PERIOD;
+    return assigned;
+}
+
 int angel_list_comp_advanced(const void *pva, const void *pvb) {
     AngelInfo *pa = (AngelInfo*) pva, *pb = (AngelInfo*) pvb;
     time_t now = time(0),
-           assign_a = pa->last_assigned, assign_b = pb->last_assigned;
-
-    if (now - assign_a >= ANGELBEATS_ASSIGN_PROBATION_PERIOD ||
-        pa->last_activity >= assign_a)
-        assign_a -= assign_a % ANGELBEATS_REASSIGN_PERIOD;
-    if (now - assign_b >= ANGELBEATS_ASSIGN_PROBATION_PERIOD ||
-        pb->last_activity >= assign_b)
-        assign_b -= assign_b % ANGELBEATS_REASSIGN_PERIOD;
+           assign_a = angel_assign_key(pa, now),
+           assign_b = angel_assign_key(pb, now);
 
     if (assign_a != assign_b)
         return assign_a > assign_b ? 1 : -1;
@@ -165,6 +208,11 @@ int angel_list_comp_advanced(const void *pva, const void *pvb) {
     return pa->masters - pb->masters;
 }
 
+int angel_list_comp_advanced_ptr(const void *pva, const void *pvb) {
+    return angel_list_comp_advanced(*(AngelInfo* const*)pva,
+                                    *(AngelInfo* const*)pvb);
+}
+
 // search stubs
 
 AngelInfo *
@@ -202,7 +250,9 @@ angel_list_preserve(size_t newsz) {
         g_angel_list_capacity += ANGEL_LIST_INIT_SIZE;
     g_angel_list = (AngelInfo*) realloc (
             g_angel_list, g_angel_list_capacity * sizeof(AngelInfo));
-    assert(g_angel_list);
+    g_angel_heap = (int*) realloc (
+            g_angel_heap, g_angel_list_capacity * sizeof(int));
+    assert(g_angel_list && g_angel_heap);
 }
 
 void 
@@ -222,6 +272,8 @@ angel_list_add(const char *userid, int uid) {
     kanade = &(g_angel_list[g_angel_list_size++]);
     memset(kanade, 0, sizeof(*kanade));
     kanade->uid = uid;
+    kanade->heap_pos = -1;
+    kanade->probation_prev = kanade->probation_next = -1;
     strlcpy(kanade->userid, userid, sizeof(kanade->userid));
     return kanade;
 }
@@ -233,6 +285,155 @@ angel_list_get_index(AngelInfo *kanade) {
     return idx;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+// Available angels
+//
+// The heap keeps who suggest_online_angel() should pick first on top.
+// Keys only change on our own requests (assign, link removal, heartbeat),
+// except that an angel leaving probation gets an earlier sort_assigned;
+// the probation list is ordered by last_assigned so expiring is O(1) each.
+
+int
+angel_heap_before(const AngelInfo *pa, const AngelInfo *pb) {
+#ifdef ANGELBEATS_ASSIGN_BY_RANDOM
+    return pa->ticket < pb->ticket;
+#else
+    if (pa->sort_assigned != pb->sort_assigned)
+        return pa->sort_assigned < pb->sort_assigned;
+    if (pa->last_activity != pb->last_activity)
+        return pa->last_activity < pb->last_activity;
+    return pa->masters < pb->masters;
+#endif
+}
+
+static void
+angel_heap_set(size_t pos, int idx) {
+    g_angel_heap[pos] = idx;
+    g_angel_list[idx].heap_pos = pos;
+}
+
+static void
+angel_heap_sift(size_t pos) {
+    int idx = g_angel_heap[pos];
+    AngelInfo *kanade = g_angel_list + idx;
+    size_t child;
+
+    while (pos > 0 &&
+           angel_heap_before(kanade, g_angel_list + g_angel_heap[(pos-1)/2])) {
+        angel_heap_set(pos, g_angel_heap[(pos-1)/2]);
+        pos = (pos-1)/2;
+    }
+    while ((child = pos * 2 + 1) < g_angel_heap_size) {
+        if (child + 1 < g_angel_heap_size &&
+            angel_heap_before(g_angel_list + g_angel_heap[child+1],
+                              g_angel_list + g_angel_heap[child]))
+            child++;
+        if (!angel_heap_before(g_angel_list + g_angel_heap[child], kanade))
+            break;
+        angel_heap_set(pos, g_angel_heap[child]);
+        pos = child;
+    }
+    angel_heap_set(pos, idx);
+}
+
+static void
+angel_heap_push(AngelInfo *kanade) {
+    assert(kanade->heap_pos < 0);
+    angel_heap_set(g_angel_heap_size++, angel_list_get_index(kanade));
+    angel_heap_sift(kanade->heap_pos);
+}
+
+static void
+angel_heap_erase(AngelInfo *kanade) {
+    size_t pos = kanade->heap_pos;
+
+    assert(kanade->heap_pos >= 0);
+    kanade->heap_pos = -1;
+    if (pos == --g_angel_heap_size)
+        return;
+    angel_heap_set(pos, g_angel_heap[g_angel_heap_size]);
+    angel_heap_sift(pos);
+}
+
+static void
+angel_probation_remove(AngelInfo *kanade) {
+    if (!kanade->in_probation)
+        return;
+    if (kanade->probation_prev >= 0)
+        g_angel_list[kanade->probation_prev].probation_next =
+            kanade->probation_next;
+    else
+        g_probation_head = kanade->probation_next;
+    if (kanade->probation_next >= 0)
+        g_angel_list[kanade->probation_next].probation_prev =
+            kanade->probation_prev;
+    else
+        g_probation_tail = kanade->probation_prev;
+    kanade->probation_prev = kanade->probation_next = -1;
+    kanade->in_probation = 0;
+}
+
+// caller must append in order of last_assigned.
+static void
+angel_probation_append(AngelInfo *kanade) {
+    int idx = angel_list_get_index(kanade);
+
+    angel_probation_remove(kanade);
+    kanade->in_probation = 1;
+    kanade->probation_prev = g_probation_tail;
+    kanade->probation_next = -1;
+    if (g_probation_tail >= 0)
+        g_angel_list[g_probation_tail].probation_next = idx;
+    else
+        g_probation_head = idx;
+    g_probation_tail = idx;
+}
+
+int
+angel_available(const AngelInfo *kanade) {
+    return kanade->logins > 0 && !kanade->pause;
+}
+
+int
+angel_missed_assign(const AngelInfo *kanade) {
+    if (kanade->heap_pos < 0)
+        return kanade->missed_assign;
+    return kanade->missed_assign + (g_suggests - kanade->missed_since);
+}
+
+// Re-sorts kanade after its state or any field of the sort key changed.
+void
+angel_update(AngelInfo *kanade, time_t now) {
+    kanade->sort_assigned = angel_assign_key(kanade, now);
+    if (!angel_in_probation(kanade, now))
+        angel_probation_remove(kanade);
+
+    if (angel_available(kanade)) {
+        if (kanade->heap_pos < 0) {
+            kanade->missed_since = g_suggests;
+#ifdef ANGELBEATS_ASSIGN_BY_RANDOM
+            kanade->ticket = rand();
+#endif
+            angel_heap_push(kanade);
+        } else {
+            angel_heap_sift(kanade->heap_pos);
+        }
+    } else if (kanade->heap_pos >= 0) {
+        kanade->missed_assign = angel_missed_assign(kanade);
+        angel_heap_erase(kanade);
+    }
+}
+
+void
+angel_probation_expire(time_t now) {
+    while (g_probation_head >= 0) {
+        AngelInfo *kanade = g_angel_list + g_probation_head;
+        if (now - kanade->last_assigned < ANGELBEATS_ASSIGN_PROBATION_PERIOD)
+            break;
+        angel_update(kanade, now);
+    }
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // Main Operations
 
@@ -240,16 +441,14 @@ int get_angel_state(const AngelInfo *kanade,
                     int *p_pause,
                     int *p_logins) {
     userinfo_t *astat;
-    int is_pause = 0, logins = 0;
+    int is_pause = 0, logins = 0, i;
 
     // we have to take care of multi-login sessions,
     // so it's better to reject if any of the sessions wants to reject.
-    for (astat = search_ulistn(kanade->uid, 1); 
-         astat && strcasecmp(astat->userid, kanade->userid) == 0; 
-         astat++) {
-        // ignore all dead processes
-        if (astat->mode == DEBUGSLEEPING)
-            continue;
+    // (search_ulistn already skips dead processes)
+    for (i = 1; (astat = search_ulistn(kanade->uid, i)) != NULL; i++) {
+        if (strcasecmp(astat->userid, kanade->userid) != 0)
+            break;
         logins++;
         // no longer an angel!?
         if (!(astat->userlevel & PERM_ANGEL)) {
@@ -264,10 +463,68 @@ int get_angel_state(const AngelInfo *kanade,
     return logins > 0;
 }
 
+void
+angel_state_refresh(AngelInfo *kanade, time_t now) {
+    get_angel_state(kanade, &kanade->pause, &kanade->logins);
+    angel_update(kanade, now);
+}
+
+// Re-reads states of all angels if anyone logged in or out since last time,
+// but not more often than ANGELBEATS_RESYNC_PERIOD unless forced.
+void
+angel_state_sync(int force) {
+    unsigned int seq = SHM->UTMPidxseq;
+    time_t now = time(0);
+    size_t i;
+
+    if (!force && (seq == g_utmp_seq ||
+                   now - g_utmp_synced < ANGELBEATS_RESYNC_PERIOD))
+        return;
+
+    g_utmp_seq = seq;
+    g_utmp_synced = now;
+    for (i = 0; i < g_angel_list_size; i++)
+        angel_state_refresh(g_angel_list + i, now);
+}
+
+static int
+angel_list_comp_last_assigned(const void *pva, const void *pvb) {
+    const AngelInfo *pa = g_angel_list + *(const int*)pva,
+                    *pb = g_angel_list + *(const int*)pvb;
+    if (pa->last_assigned != pb->last_assigned)
+        return pa->last_assigned > pb->last_assigned ? 1 : -1;
+    return 0;
+}
+
+// Rebuilds the heap and probation list from scratch.
+void
+angel_heap_rebuild() {
+    size_t i, n = 0;
+    time_t now = time(0);
+    int *probation = (int*) malloc (sizeof(int) * (g_angel_list_size + 1));
+    AngelInfo *kanade = g_angel_list;
+
+    assert(probation);
+    g_angel_heap_size = 0;
+    g_probation_head = g_probation_tail = -1;
+    for (i = 0; i < g_angel_list_size; i++, kanade++) {
+        kanade->heap_pos = -1;
+        kanade->in_probation = 0;
+        kanade->probation_prev = kanade->probation_next = -1;
+        if (angel_in_probation(kanade, now))
+            probation[n++] = i;
+    }
+    qsort(probation, n, sizeof(int), angel_list_comp_last_assigned);
+    for (i = 0; i < n; i++)
+        angel_probation_append(g_angel_list + probation[i]);
+    free(probation);
+
+    angel_state_sync(1);
+}
+
 void
 perf_angels() {
     size_t i;
-    int is_pause, logins;
     time4_t clk = time4(0);
     AngelInfo *kanade = g_angel_list;
 
@@ -276,79 +533,57 @@ perf_angels() {
         g_perf.start = clk;
     g_perf.samples++;
 
+    angel_state_sync(0);
     for (i = 0; i < g_angel_list_size; i++, kanade++) {
 
-        if (!get_angel_state(kanade, &is_pause, &logins))
+        if (!kanade->logins)
             continue;
 
         kanade->perf.samples++;
-        kanade->perf.pause1 += (is_pause == 1);
-        kanade->perf.pause2 += (is_pause == 2);
+        kanade->perf.pause1 += (kanade->pause == 1);
+        kanade->perf.pause2 += (kanade->pause == 2);
     }
 }
 
 int 
 suggest_online_angel(int master_uid) {
-    size_t i;
-    int is_pause, logins;
     int uid = 0;
-#ifdef TRACE_ANGEL_SELECTION
-    time_t clk = time(0);
-    int found = 0;
-#endif
-    AngelInfo *kanade = g_angel_list;
+    time_t now = time(0);
+    AngelInfo *kanade, *master = NULL;
 
-#ifdef ANGELBEATS_ASSIGN_BY_RANDOM
-    int random_uids[ANGELBEATS_RANDOM_RANGE];
-    int crandom_uids = 0;
-#endif
+    angel_state_sync(0);
+    angel_probation_expire(now);
+    if (master_uid)
+        g_suggests++;
 
-    for (i = 0; i < g_angel_list_size; i++, kanade++) {
+    while (g_angel_heap_size > 0) {
+        kanade = g_angel_list + g_angel_heap[0];
 
         // skip the master himself
-        if (kanade->uid == master_uid)
-            continue;
-
-        if (!get_angel_state(kanade, &is_pause, &logins))
+        if (kanade->uid == master_uid) {
+            master = kanade;
+            angel_heap_erase(kanade);
             continue;
+        }
 
-        if (is_pause)
+        // the cached state may be out of date for a while after logout.
+        angel_state_refresh(kanade, now);
+        if (kanade->heap_pos < 0)
             continue;
 
-        if (master_uid)
-            kanade->missed_assign++;
 #ifdef TRACE_ANGEL_SELECTION
-        log("\n %d.%*s(missed=%d,masters=%d,act=%d,assigned=%d%s) ",
-            ++found, IDLEN,
-            kanade->userid, kanade->missed_assign, kanade->masters,
-            (int)(clk - kanade->last_activity),
-            (int)(clk - kanade->last_assigned),
-            ((int)(clk - kanade->last_assigned) <
-             ANGELBEATS_ASSIGN_PROBATION_PERIOD &&
-             kanade->last_activity < kanade->last_assigned) ?
-            "[probation]" : "");
-#endif
-
-#if defined(ANGELBEATS_ASSIGN_BY_LAST_ACTIVITY)
-        if (!uid)
-            uid = kanade->uid;
-#ifndef TRACE_ANGEL_SELECTION
-        if (uid)
-            break;
+        log("\n %*s(missed=%d,masters=%d,act=%d,assigned=%d%s) ",
+            IDLEN, kanade->userid, angel_missed_assign(kanade),
+            kanade->masters,
+            (int)(now - kanade->last_activity),
+            (int)(now - kanade->last_assigned),
+            kanade->in_probation ? "[probation]" : "");
 #endif
-
-#elif defined(ANGELBEATS_ASSIGN_BY_RANDOM)
-        random_uids[crandom_uids++] = kanade->uid;
-        if (crandom_uids >= ANGELBEATS_RANDOM_RANGE)
-            break;
-#endif
-    }
-#ifdef ANGELBEATS_ASSIGN_BY_RANDOM
-    if (crandom_uids > 0) {
-        // Yes I didn't do srand. That's good enough.
-        uid = random_uids[rand() % crandom_uids];
+        uid = kanade->uid;
+        break;
     }
-#endif
+    if (master)
+        angel_heap_push(master);
     return uid;
 }
 
@@ -362,6 +597,12 @@ inc_angel_master(int uid, int master_uid) {
     kanade->last_assigned = now;
     kanade->last_assigned_master = master_uid;
     kanade->missed_assign = 0;
+    kanade->missed_since = g_suggests;
+#ifdef ANGELBEATS_ASSIGN_BY_RANDOM
+    kanade->ticket = rand();
+#endif
+    angel_probation_append(kanade);
+    angel_update(kanade, now);
     return 1;
 }
 
@@ -376,6 +617,7 @@ dec_angel_master(int uid) {
         return 0;
     }
     kanade->masters--;
+    angel_update(kanade, time(0));
     return 1;
 }
 
@@ -389,6 +631,7 @@ touch_angel_activity(int uid) {
         return 0;
 
     kanade->last_activity = now;
+    angel_update(kanade, now);
     return 1;
 }
 
@@ -458,13 +701,14 @@ init_angel_list() {
     g_angel_list_size = 0;
     passwd_fast_apply(NULL, init_angel_list_callback);
     angel_list_sort();
+    angel_heap_rebuild();
     return 0;
 }
 
 int
 create_angel_report(int myuid, angel_beats_report *prpt) {
     size_t i;
-    AngelInfo *kanade = g_angel_list;
+    AngelInfo *kanade, **order;
     int from_cmd = (!myuid);
 #if 0
     time4_t now = time4(0);
@@ -478,9 +722,20 @@ create_angel_report(int myuid, angel_beats_report *prpt) {
     prpt->missed_assign = 0;
     prpt->inactive_days = ANGELBEATS_INACTIVE_TIME / DAY_SECONDS;
 
-    for (i = 0; i < g_angel_list_size; i++, kanade++) {
+    // rank angels in the order they would be assigned.
+    angel_state_sync(0);
+    order = (AngelInfo**) malloc (sizeof(AngelInfo*) * (g_angel_list_size + 1));
+    assert(order);
+    for (i = 0; i < g_angel_list_size; i++)
+        order[i] = g_angel_list + i;
+    qsort(order, g_angel_list_size, sizeof(AngelInfo*),
+          angel_list_comp_advanced_ptr);
+
+    for (i = 0; i < g_angel_list_size; i++) {
         int is_pause, logins;
-        get_angel_state(kanade, &is_pause, &logins);
+        kanade = order[i];
+        is_pause = kanade->pause;
+        logins = kanade->logins;
 
         // Print state information.
         if (from_cmd) {
@@ -532,12 +787,13 @@ create_angel_report(int myuid, angel_beats_report *prpt) {
         prpt->min_masters_of_active_angels = 0;
     if (prpt->min_masters_of_online_angels == SHRT_MAX)
         prpt->min_masters_of_online_angels = 0;
+    free(order);
     // report my information
     if (myuid > 0 && (kanade = angel_list_find_by_uid(myuid))) {
         prpt->my_active_masters = kanade->masters;
         prpt->last_assigned = kanade->last_assigned;
         prpt->last_assigned_master = kanade->last_assigned_master;
-        prpt->missed_assign = kanade->missed_assign;
+        prpt->missed_assign = angel_missed_assign(kanade);
     }
     return 0;
 }
@@ -546,17 +802,16 @@ int
 fill_online_angel_list(angel_beats_uid_list *list) {
     static size_t i = 0;
     size_t iter = 0;
-    int is_pause, logins;
     AngelInfo *kanade;
 
+    angel_state_sync(0);
     list->angels = 0;
     for (iter = 0;
          iter < g_angel_list_size && list->angels < ANGELBEATS_UID_LIST_SIZE;
          iter++, i++) {
         i %= g_angel_list_size;
         kanade = g_angel_list + i;
-        get_angel_state(kanade, &is_pause, &logins);
-        if (!logins)
+        if (!kanade->logins)
             continue;
         list->uids[list->angels++] = kanade->uid;
     }
@@ -640,6 +895,47 @@ void save_state_data() {
     Rename(fname_new, ANGEL_STATE_FILE);
 }
 
+static const char * const req_name[ANGELBEATS_REQ_MAX] = {
+    "invalid", "report", "reload", "suggest", "suggest_and_link",
+    "remove_link", "heartbeat", "get_online_list", "export_perf",
+    "reg_new", "blame", "save_state", "update_state",
+};
+
+void req_latency_add(int op, const struct timeval *begin) {
+    struct timeval end;
+    long usec;
+    int b;
+
+    if (op <= ANGELBEATS_REQ_INVALID || op >= ANGELBEATS_REQ_MAX)
+        return;
+    gettimeofday(&end, NULL);
+    usec = (end.tv_sec - begin->tv_sec) * 1000000L +
+           (end.tv_usec - begin->tv_usec);
+    if (usec > g_req_latency_max[op])
+        g_req_latency_max[op] = usec;
+    for (b = 0; usec > 1 && b < LAT_BUCKETS - 1; b++)
+        usec >>= 1;
+    g_req_latency[op][b]++;
+}
+
+void export_req_latency(FILE *fp) {
+    int op;
+    unsigned int n;
+
+    fprintf(fp, "# Request latency (us)\n# %-16s %8s %8s %8s %8s\n",
+            "Request", "Count", "p50", "p99", "Max");
+    print_dash(fp, 52, "# ");
+    for (op = ANGELBEATS_REQ_INVALID + 1; op < ANGELBEATS_REQ_MAX; op++) {
+        if (!(n = latency_count(g_req_latency[op])))
+            continue;
+        fprintf(fp, "# %-16s %8u %8.0f %8.0f %8ld\n", req_name[op], n,
+                latency_percentile(g_req_latency[op], 0.5),
+                latency_percentile(g_req_latency[op], 0.99),
+                g_req_latency_max[op]);
+    }
+    print_dash(fp, 52, "# ");
+}
+
 void export_perf_data(FILE *fp) {
     size_t i = 0;
     time4_t clk = time4(0);
@@ -655,6 +951,7 @@ void export_perf_data(FILE *fp) {
                 kanade->perf.samples, kanade->perf.pause1, kanade->perf.pause2);
     }
     print_dash(fp, 70, "# ");
+    export_req_latency(fp);
 }
 
 void reset_perf_data() {
@@ -666,6 +963,8 @@ void reset_perf_data() {
     for (i = 0; i < g_angel_list_size; i++, kanade++) {
         memset(&kanade->perf, 0, sizeof(kanade->perf));
     }
+    memset(g_req_latency, 0, sizeof(g_req_latency));
+    memset(g_req_latency_max, 0, sizeof(g_req_latency_max));
 }
 
 
@@ -691,6 +990,8 @@ client_cb(int fd, short event, void *arg) {
     char *uid;
     angel_beats_data data ={0};
     time4_t clk = time4(NULL);
+    struct timeval begin = {0};
+    AngelInfo *kanade;
 
     // ignore clients that timeout or sending invalid request
     if (event & EV_TIMEOUT)
@@ -699,6 +1000,7 @@ client_cb(int fd, short event, void *arg) {
 	goto end;
     if (data.cb != sizeof(data))
         goto end;
+    gettimeofday(&begin, NULL);
 
     debug("%s request: op=%d, mid=%d, aid=%d\n", Cdatelite(&clk),
           data.operation, data.master_uid, data.angel_uid);
@@ -732,29 +1034,31 @@ client_cb(int fd, short event, void *arg) {
                 inc_angel_master(data.angel_uid, data.master_uid);
                 uid = getuserid(data.angel_uid);
                 strlcpy(angel_uid, uid, sizeof(angel_uid));
-                angel_list_sort();
             }
             log("result: [%s]\n", data.angel_uid > 0 ?  angel_uid : "<none>");
             break;
         case ANGELBEATS_REQ_REMOVE_LINK:
             log("%s master [%s] request remove link with angel [%s]\n",
                 Cdatelite(&clk), master_uid, angel_uid);
-            if (dec_angel_master(data.angel_uid))
-                angel_list_sort();
+            dec_angel_master(data.angel_uid);
             break;
         case ANGELBEATS_REQ_HEARTBEAT:
             log("%s master [%s] update angel activity with angel [%s]\n",
                 Cdatelite(&clk), master_uid, angel_uid);
-            if (touch_angel_activity(data.angel_uid))
-                angel_list_sort();
+            touch_angel_activity(data.angel_uid);
+            break;
+        case ANGELBEATS_REQ_UPDATE_STATE:
+            debug("%s angel [%s] changed state\n", Cdatelite(&clk), angel_uid);
+            if ((kanade = angel_list_find_by_uid(data.angel_uid)))
+                angel_state_refresh(kanade, time(0));
             break;
         case ANGELBEATS_REQ_REG_NEW:
             log("%s admin [%s] register new angel [%s]\n",
                 Cdatelite(&clk), master_uid, angel_uid);
             // Note: Angel permission may be not set yet.
             if (*angel_uid) {
-                angel_list_add(angel_uid, data.angel_uid);
-                angel_list_sort();
+                kanade = angel_list_add(angel_uid, data.angel_uid);
+                angel_state_refresh(kanade, time(0));
             }
             break;
         case ANGELBEATS_REQ_EXPORT_PERF:
@@ -805,6 +1109,8 @@ client_cb(int fd, short event, void *arg) {
     write(fd, &data, sizeof(data));
 
 end:
+    if (begin.tv_sec)
+        req_latency_add(data.operation, &begin);
     // cleanup
     close(fd);
     free(arg);
@@ -876,6 +1182,7 @@ main(int argc, char *argv[]) {
     log("initializing angel list...\n");
     init_angel_list();
     load_state_data();
+    angel_heap_rebuild();
     if (go_daemon)
         daemonize(BBSHOME "/run/angelbeats.pid", BBSHOME "/log/angelbeats.log");
 
@@ -0,0 +1,303 @@
+// Big5 -> UTF-8 converter benchmark: bulk b2u_convert() vs. the old
+// byte-at-a-time evbuffer converter it replaced.
+//
+// usage: b2u_bench [-n rounds] [article files...]
+//
+// Without files, a synthetic article with ASCII, DBCS and in-character
+// ANSI codes is used. Both outputs are compared byte by byte.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <event2/buffer.h>
+
+#include <cmsys.h>
+
+#include "boardd.h"
+
+static double
+now_sec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// ---- the old converter, kept for comparison ----
+
+static int
+move_string_end(char **buf)
+{
+    int n = 0;
+    while (**buf != '\0') {
+	(*buf)++;
+	n++;
+    }
+    return n;
+}
+
+static void
+make_ansi_ctrl(char *buf, int size, int fg, int bg, int bright)
+{
+    int sep = 0;
+    strncpy(buf, "\033[", size);
+    size -= move_string_end(&buf);
+    if (bright >= 0) {
+	snprintf(buf, size, "%s%d", sep ? ";" : "", bright);
+	size -= move_string_end(&buf);
+	sep = 1;
+    }
+    if (fg >= 0) {
+	snprintf(buf, size, "%s%d", sep ? ";" : "", fg);
+	size -= move_string_end(&buf);
+	sep = 1;
+    }
+    if (bg >= 0) {
+	snprintf(buf, size, "%s%d", sep ? ";" : "", bg);
+	size -= move_string_end(&buf);
+	sep = 1;
+    }
+    snprintf(buf, size, "m");
+}
+
+static int
+evbuffer_add_ansi_escape_code(struct evbuffer *destination, int fg, int bg, int bright)
+{
+    char ansicode[16];
+    make_ansi_ctrl(ansicode, sizeof(ansicode), fg, bg, bright);
+    return evbuffer_add_printf(destination, ansicode, strlen(ansicode));
+}
+
+static struct evbuffer *
+old_evbuffer_b2u(struct evbuffer *source)
+{
+    unsigned char c[16];
+    int out = 0;
+
+    if (evbuffer_get_length(source) == 0)
+	return source;
+
+    struct evbuffer *destination = evbuffer_new();
+
+    while (evbuffer_copyout(source, c, 1) > 0) {
+	if (isascii(c[0])) {
+	    if (evbuffer_add(destination, c, 1) < 0)
+		break;
+	    evbuffer_drain(source, 1);
+	    out++;
+	} else {
+	    int todrain = 2;
+	    int fg = -1, bg = -1, bright = -1;
+	    int n = evbuffer_copyout(source, c, sizeof(c));
+	    if (n < 2)
+		break;
+	    while (c[1] == '\033') {
+		c[n - 1] = '\0';
+		if (n < 4 || c[2] != '[')
+		    break;
+
+		unsigned char *p = c + 3;
+		if (*p == 'm') {
+		    fg = 7;
+		    bg = 0;
+		    bright = 0;
+		}
+		while (1) {
+		    int v = (int) strtol((char *)p, (char **)&p, 10);
+		    if (*p != 'm' && *p != ';')
+			break;
+
+		    if (v == 0)
+			bright = 0;
+		    else if (v == 1)
+			bright = 1;
+		    else if (v >= 30 && v <= 37)
+			fg = v;
+		    else if (v >= 40 && v <= 47)
+			bg = v;
+
+		    if (*p == 'm')
+			break;
+		    p++;
+		}
+		if (*p != 'm') {
+		    fg = bg = bright = -1;
+		    break;
+		} else {
+		    evbuffer_drain(source, p - c + 1);
+		    todrain = 1;
+		    n = evbuffer_copyout(source, c + 1, sizeof(c) - 1);
+		    if (n < 1)
+			break;
+		    n++;
+		}
+	    }
+	    if (n < 2)
+		break;
+
+	    uint8_t utf8[4];
+	    int len = ucs2utf(b2u_table[c[0] << 8 | c[1]], utf8);
+	    utf8[len] = 0;
+
+	    if (evbuffer_add(destination, utf8, len) < 0)
+		break;
+
+	    if (fg >= 0 || bg >= 0 || bright >= 0) {
+		int dlen = evbuffer_add_ansi_escape_code(destination, fg, bg, bright);
+		if (dlen < 0)
+		    break;
+		out += dlen;
+	    }
+
+	    evbuffer_drain(source, todrain);
+	    out += len;
+	}
+    }
+
+    if (evbuffer_get_length(source) == 0 && out) {
+	evbuffer_free(source);
+	return destination;
+    }
+
+    evbuffer_free(source);
+    evbuffer_free(destination);
+    return NULL;
+}
+
+// ---- input ----
+
+static char *
+make_article(int *plen)
+{
+    static const char *ansi[] = { "\033[m", "\033[1;33m", "\033[31m",
+				  "\033[0;37;40m", "\033[44m" };
+    int size = 256 * 1024, len = 0, i;
+    char *buf = malloc(size);
+
+    srandom(1);
+    while (len < size - 64) {
+	int r = random() % 100;
+	if (r < 40) {
+	    // ASCII words
+	    for (i = 0; i < 8; i++)
+		buf[len++] = 'a' + random() % 26;
+	    buf[len++] = (random() % 8) ? ' ' : '\n';
+	} else if (r < 97) {
+	    // common Big5 hanzi
+	    buf[len++] = 0xA4 + random() % 0x25;
+	    buf[len++] = 0x40 + random() % 0x3F;
+	} else {
+	    // half-colored character
+	    const char *a = ansi[random() % 5];
+	    buf[len++] = 0xA4 + random() % 0x25;
+	    memcpy(buf + len, a, strlen(a));
+	    len += strlen(a);
+	    buf[len++] = 0x40 + random() % 0x3F;
+	}
+    }
+    buf[len++] = '\n';
+    *plen = len;
+    return buf;
+}
+
+static char *
+read_articles(int argc, char **argv, int *plen)
+{
+    int i, len = 0;
+    char *buf = NULL;
+
+    for (i = 0; i < argc; i++) {
+	FILE *fp = fopen(argv[i], "rb");
+	char chunk[8192];
+	size_t n;
+
+	if (!fp) {
+	    perror(argv[i]);
+	    exit(1);
+	}
+	while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+	    buf = realloc(buf, len + n);
+	    memcpy(buf + len, chunk, n);
+	    len += n;
+	}
+	fclose(fp);
+    }
+    *plen = len;
+    return buf;
+}
+
+int
+main(int argc, char **argv)
+{
+    int ch, i, len, rounds = 200;
+    char *src;
+    double t_old, t_new;
+    struct evbuffer *ref = NULL, *out = NULL;
+
+    while ((ch = getopt(argc, argv, "n:")) != -1)
+	switch (ch) {
+	    case 'n':
+		rounds = atoi(optarg);
+		break;
+	    default:
+		fprintf(stderr, "Usage: %s [-n rounds] [article files...]\n",
+			argv[0]);
+		return 1;
+	}
+    if (rounds <= 0)
+	rounds = 1;
+
+    src = (optind < argc) ? read_articles(argc - optind, argv + optind, &len)
+			  : make_article(&len);
+    if (len <= 0) {
+	fprintf(stderr, "no input\n");
+	return 1;
+    }
+
+    t_old = now_sec();
+    for (i = 0; i < rounds; i++) {
+	struct evbuffer *buf = evbuffer_new();
+	evbuffer_add(buf, src, len);
+	if (ref)
+	    evbuffer_free(ref);
+	ref = old_evbuffer_b2u(buf);
+    }
+    t_old = now_sec() - t_old;
+
+    t_new = now_sec();
+    for (i = 0; i < rounds; i++) {
+	if (out)
+	    evbuffer_free(out);
+	out = evbuffer_new();
+	if (evbuffer_add_b2u(out, src, len) != 0) {
+	    evbuffer_free(out);
+	    out = NULL;
+	}
+    }
+    t_new = now_sec() - t_new;
+
+    printf("input: %d bytes x %d rounds\n", len, rounds);
+    printf("old (bytewise evbuffer): %8.1f MB/s\n",
+	   len * (double)rounds / t_old / 1e6);
+    printf("new (table, bulk):       %8.1f MB/s\n",
+	   len * (double)rounds / t_new / 1e6);
+
+    if (!ref || !out) {
+	printf("conversion failed: old %s, new %s\n",
+	       ref ? "ok" : "failed", out ? "ok" : "failed");
+	return (!ref && !out) ? 0 : 1;
+    }
+    if (evbuffer_get_length(ref) != evbuffer_get_length(out) ||
+	memcmp(evbuffer_pullup(ref, -1), evbuffer_pullup(out, -1),
+	       evbuffer_get_length(ref)) != 0) {
+	printf("output MISMATCH (%zu vs %zu bytes)\n",
+	       evbuffer_get_length(ref), evbuffer_get_length(out));
+	return 1;
+    }
+    printf("outputs identical (%zu bytes)\n", evbuffer_get_length(out));
+    return 0;
+}
@@ -17,6 +17,8 @@
 #include <string.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#include <arpa/inet.h>
 
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
@@ -25,6 +27,7 @@
 #include <cmbbs.h>
 #include <var.h>
 #include <perm.h>
+#include <fnv_hash.h>
 
 #include "boardd.h"
 
@@ -41,10 +44,11 @@ static int g_convert_to_utf8 = 1;
 static void
 dir_list(struct evbuffer *buf, const char *path, int offset, int length)
 {
-    int total, fd = -1;
+    int total;
+    const fileheader_t *fhs;
     fileheader_t fhdr;
 
-    total = get_num_records(path, sizeof(fileheader_t));
+    total = fileheader_view(path, &fhs);
 
     if (total <= 0)
 	return;
@@ -53,18 +57,17 @@ dir_list(struct evbuffer *buf, const char *path, int offset, int length)
 	offset += total;
 
     while (length < 0 || length-- > 0) {
-	if (get_records_keep(path, &fhdr, sizeof(fhdr), ++offset, 1, &fd) <= 0)
+	if (offset >= total)
 	    break;
 
+	// copy out: title is trimmed in place.
+	fhdr = fhs[offset++];
 	DBCS_safe_trim(fhdr.title);
 
 	evbuffer_add_printf(buf, "%d,%s,%s,%d,%d,%s,%s\n",
 		offset, fhdr.filename, fhdr.date, fhdr.recommend,
 		fhdr.filemode, fhdr.owner, fhdr.title);
     }
-
-    if (fd >= 0)
-	close(fd);
 }
 
 static void
@@ -89,6 +92,17 @@ is_valid_article_filename(const char *filename)
     return !strncmp(filename, "M.", 2);
 }
 
+static int
+check_cache_key(const struct stat *st, const char *ck, int cklen)
+{
+    char ckbuf[128];
+
+    if (!ck || !cklen)
+	return 1;
+    snprintf(ckbuf, sizeof(ckbuf), "%d-%d", (int) st->st_dev, (int) st->st_ino);
+    return strncmp(ck, ckbuf, cklen) == 0;
+}
+
 static int
 answer_file(struct evbuffer *buf, const char *path, struct stat *st,
 	    const char *ck, int cklen, int offset, int maxlen)
@@ -102,12 +116,8 @@ answer_file(struct evbuffer *buf, const char *path, struct stat *st,
     if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, st) < 0)
 	goto answer_file_errout;
 
-    if (ck && cklen) {
-	char ckbuf[128];
-	snprintf(ckbuf, sizeof(ckbuf), "%d-%d", (int) st->st_dev, (int) st->st_ino);
-	if (strncmp(ck, ckbuf, cklen) != 0)
-	    goto answer_file_errout;
-    }
+    if (!check_cache_key(st, ck, cklen))
+	goto answer_file_errout;
 
     if (offset < 0)
 	offset += st->st_size;
@@ -246,11 +256,274 @@ evbuffer_slice(struct evbuffer *buf, int offset, int size)
     return -1;
 }
 
+// Converted article cache
+//
+// Answers of the article* keys are cached already converted to UTF-8, so
+// popular articles are converted once and then served by reference.
+// Entries are keyed on the file identity (dev, ino, mtime, size) and the
+// requested part, and evicted in LRU order past g_cache_limit bytes.
+
+enum {
+    ARTICLE_WHOLE,
+    ARTICLE_PART,
+    ARTICLE_HEAD,
+    ARTICLE_TAIL,
+};
+
+typedef struct {
+    dev_t   dev;
+    ino_t   ino;
+    time_t  mtime;
+    off_t   size;
+    int	    kind;
+    int	    offset;
+    int	    maxlen;
+} article_key_t;
+
+typedef struct article_entry_t {
+    article_key_t key;
+    struct article_entry_t *hnext;	    // hash chain
+    struct article_entry_t *prev, *next;    // LRU list, head is newest
+    int	    refcnt;	// 1 for the cache + 1 per evbuffer reference
+    int	    sel_offset, sel_size;
+    int	    len;
+    char    data[];
+} article_entry_t;
+
+#define ARTICLE_CACHE_BUCKETS (4096)
+
+static struct {
+    pthread_mutex_t lock;
+    article_entry_t *hash[ARTICLE_CACHE_BUCKETS];
+    article_entry_t *head, *tail;
+    size_t bytes;
+} g_cache = { PTHREAD_MUTEX_INITIALIZER, };
+
+static size_t g_cache_limit = (size_t)ARTICLE_CACHE_MB * 1024 * 1024;
+
+static void
+article_key_init(article_key_t *k, const struct stat *st,
+		 int kind, int offset, int maxlen)
+{
+    // zero the padding too, keys are hashed and compared as bytes
+    memset(k, 0, sizeof(*k));
+    k->dev = st->st_dev;
+    k->ino = st->st_ino;
+    k->mtime = st->st_mtime;
+    k->size = st->st_size;
+    k->kind = kind;
+    k->offset = offset;
+    k->maxlen = maxlen;
+}
+
+static article_entry_t **
+article_cache_bucket(const article_key_t *k)
+{
+    return &g_cache.hash[fnv_32_buf(k, sizeof(*k), FNV1_32_INIT) %
+			 ARTICLE_CACHE_BUCKETS];
+}
+
+static void
+article_cache_unref_locked(article_entry_t *e)
+{
+    if (--e->refcnt == 0)
+	free(e);
+}
+
+static void
+article_cache_lru_unlink(article_entry_t *e)
+{
+    if (e->prev)
+	e->prev->next = e->next;
+    else
+	g_cache.head = e->next;
+    if (e->next)
+	e->next->prev = e->prev;
+    else
+	g_cache.tail = e->prev;
+}
+
+static void
+article_cache_lru_push(article_entry_t *e)
+{
+    e->prev = NULL;
+    e->next = g_cache.head;
+    if (g_cache.head)
+	g_cache.head->prev = e;
+    else
+	g_cache.tail = e;
+    g_cache.head = e;
+}
+
+static void
+article_cache_evict_locked(article_entry_t *e)
+{
+    article_entry_t **p = article_cache_bucket(&e->key);
+
+    while (*p != e)
+	p = &(*p)->hnext;
+    *p = e->hnext;
+    article_cache_lru_unlink(e);
+    g_cache.bytes -= sizeof(*e) + e->len;
+    article_cache_unref_locked(e);
+}
+
+// Returns the entry with a reference held, or NULL.
+static article_entry_t *
+article_cache_get(const article_key_t *k)
+{
+    article_entry_t *e;
+
+    pthread_mutex_lock(&g_cache.lock);
+    for (e = *article_cache_bucket(k); e; e = e->hnext)
+	if (memcmp(&e->key, k, sizeof(*k)) == 0)
+	    break;
+    if (e) {
+	article_cache_lru_unlink(e);
+	article_cache_lru_push(e);
+	e->refcnt++;
+    }
+    pthread_mutex_unlock(&g_cache.lock);
+    return e;
+}
+
+// Moves the content of buf into a new entry. Returns the entry with a
+// reference held, or NULL if it is too large to be cached.
+static article_entry_t *
+article_cache_put(const article_key_t *k, struct evbuffer *buf,
+		  int sel_offset, int sel_size)
+{
+    article_entry_t *e, **p;
+    int len = evbuffer_get_length(buf);
+
+    if (!g_cache_limit || (size_t)len > g_cache_limit / 16)
+	return NULL;
+    if ((e = malloc(sizeof(*e) + len)) == NULL)
+	return NULL;
+    e->key = *k;
+    e->refcnt = 2;
+    e->sel_offset = sel_offset;
+    e->sel_size = sel_size;
+    e->len = evbuffer_remove(buf, e->data, len);
+
+    pthread_mutex_lock(&g_cache.lock);
+    // another thread may have converted the same article meanwhile
+    for (p = article_cache_bucket(k); *p; p = &(*p)->hnext)
+	if (memcmp(&(*p)->key, k, sizeof(*k)) == 0) {
+	    article_cache_evict_locked(*p);
+	    break;
+	}
+    p = article_cache_bucket(k);
+    e->hnext = *p;
+    *p = e;
+    article_cache_lru_push(e);
+    g_cache.bytes += sizeof(*e) + e->len;
+    while (g_cache.bytes > g_cache_limit && g_cache.tail != e)
+	article_cache_evict_locked(g_cache.tail);
+    pthread_mutex_unlock(&g_cache.lock);
+    return e;
+}
+
+static void
+article_cache_release(const void *data GCC_UNUSED, size_t datalen GCC_UNUSED,
+		      void *extra)
+{
+    pthread_mutex_lock(&g_cache.lock);
+    article_cache_unref_locked((article_entry_t *)extra);
+    pthread_mutex_unlock(&g_cache.lock);
+}
+
+// Appends the entry to buf by reference, passing on the held reference.
+static void
+evbuffer_add_article_entry(struct evbuffer *buf, article_entry_t *e)
+{
+    if (e->len == 0 ||
+	evbuffer_add_reference(buf, e->data, e->len,
+			       article_cache_release, e) != 0)
+	article_cache_release(e->data, e->len, e);
+}
+
 typedef int (*select_part_func)(const char *data, int len, int *offset, int *size, void *ctx);
 
+static void
+evbuffer_add_article_meta(struct evbuffer *buf, const struct stat *st,
+			  int sel_offset, int sel_size)
+{
+    evbuffer_add_printf(buf, "%d-%d,%lu,%d,%d\n",
+			(int) st->st_dev, (int) st->st_ino, st->st_size,
+			sel_offset, sel_size);
+}
+
+// Reads the requested part of an article and converts the slice chosen by
+// sfunc into utf8. st is updated to the file actually read.
+static int
+convert_article(struct evbuffer *utf8, const char *path, struct stat *st,
+		const char *ck, int cklen, int offset, int maxlen,
+		select_part_func sfunc, void *ctx, int *sel_offset, int *sel_size)
+{
+    struct evbuffer *raw = evbuffer_new();
+    const char *data;
+    int len, ret = -1;
+
+    if (answer_file(raw, path, st, ck, cklen, offset, maxlen) == 0) {
+	len = evbuffer_get_length(raw);
+	data = (const char *)evbuffer_pullup(raw, len);
+	if (sfunc(data, len, sel_offset, sel_size, ctx) == 0 &&
+	    *sel_offset + *sel_size <= len &&
+	    evbuffer_add_b2u(utf8, data + *sel_offset, *sel_size) == 0)
+	    ret = 0;
+    }
+    evbuffer_free(raw);
+    return ret;
+}
+
+// Answers (a selected part of) an article in UTF-8, from the converted
+// article cache if possible. The meta line is only added if with_meta.
+static int
+answer_article_utf8(struct evbuffer *buf, const char *path,
+		    const char *ck, int cklen, int offset, int maxlen,
+		    select_part_func sfunc, void *ctx, int kind, int with_meta)
+{
+    article_key_t key;
+    article_entry_t *e;
+    struct stat st;
+
+    if (stat(path, &st) < 0 || !check_cache_key(&st, ck, cklen))
+	return -1;
+    article_key_init(&key, &st, kind, offset, maxlen);
+
+    if ((e = article_cache_get(&key)) == NULL) {
+	struct evbuffer *utf8 = evbuffer_new();
+	int sel_offset, sel_size;
+	int ret = convert_article(utf8, path, &st, ck, cklen, offset, maxlen,
+				  sfunc, ctx, &sel_offset, &sel_size);
+
+	if (ret == 0) {
+	    // the file may have changed since stat()
+	    article_key_init(&key, &st, kind, offset, maxlen);
+	    e = article_cache_put(&key, utf8, sel_offset, sel_size);
+	    if (e == NULL) {
+		// not cacheable, answer the converted buffer directly
+		if (with_meta)
+		    evbuffer_add_article_meta(buf, &st, sel_offset, sel_size);
+		evbuffer_add_buffer(buf, utf8);
+	    }
+	}
+	evbuffer_free(utf8);
+	if (e == NULL)
+	    return ret;
+    }
+
+    if (with_meta)
+	evbuffer_add_article_meta(buf, &st, e->sel_offset, e->sel_size);
+    evbuffer_add_article_entry(buf, e);
+    return 0;
+}
+
 static int
 answer_articleselect(struct evbuffer *buf, const boardheader_t *bptr,
-		     const char *rest_key, select_part_func sfunc, void *ctx)
+		     const char *rest_key, select_part_func sfunc, void *ctx,
+		     int kind)
 {
     char path[PATH_MAX];
     const char *ck, *filename;
@@ -264,6 +537,10 @@ answer_articleselect(struct evbuffer *buf, const boardheader_t *bptr,
 	return -1;
 
     setbfile(path, bptr->brdname, filename);
+    if (g_convert_to_utf8)
+	return answer_article_utf8(buf, path, ck, cklen, offset, maxlen,
+				   sfunc, ctx, kind, 1);
+
     if (answer_file(buf, path, &st, ck, cklen, offset, maxlen) < 0)
 	return -1;
 
@@ -274,121 +551,263 @@ answer_articleselect(struct evbuffer *buf, const boardheader_t *bptr,
 	return -1;
 
     struct evbuffer *meta = evbuffer_new();
-    evbuffer_add_printf(meta, "%d-%d,%lu,%d,%d\n",
-			(int) st.st_dev, (int) st.st_ino, st.st_size, sel_offset, sel_size);
+    evbuffer_add_article_meta(meta, &st, sel_offset, sel_size);
     evbuffer_prepend_buffer(buf, meta);
     evbuffer_free(meta);
     return 0;
 }
 
-static void
-answer_key(struct evbuffer *buf, const char *key)
-{
-    int bid;
-    boardheader_t *bptr;
+// Board keys: "<bid>.<field>" or "<bid>.<field>.<arg>". The field names
+// are looked up in a hash table built once by board_field_init(), and the
+// same field ids are used by the binary protocol (see boardd.h).
 
-    if (isdigit(*key)) {
-	char *p;
+static const struct {
+    const char *name;
+    int has_arg;    // text key takes ".<arg>", binary tuple not supported
+		    // if the arg is a string
+} board_fields[BF_MAX] = {
+    [BF_ISBOARD]	= { "isboard", 0 },
+    [BF_OVER18]		= { "over18", 0 },
+    [BF_HIDDEN]		= { "hidden", 0 },
+    [BF_BRDNAME]	= { "brdname", 0 },
+    [BF_TITLE]		= { "title", 0 },
+    [BF_CLASS]		= { "class", 0 },
+    [BF_BM]		= { "BM", 0 },
+    [BF_PARENT]		= { "parent", 0 },
+    [BF_COUNT]		= { "count", 0 },
+    [BF_CHILDREN]	= { "children", 0 },
+    [BF_BOTTOMS]	= { "bottoms", 0 },
+    [BF_ARTICLES]	= { "articles", 1 },
+    [BF_ARTICLE]	= { "article", 1 },
+    [BF_ARTICLESTAT]	= { "articlestat", 1 },
+    [BF_ARTICLEPART]	= { "articlepart", 1 },
+    [BF_ARTICLEHEAD]	= { "articlehead", 1 },
+    [BF_ARTICLETAIL]	= { "articletail", 1 },
+    [BF_ARTICLEINDEX]	= { "articleindex", 1 },
+};
 
-	if ((bid = atoi(key)) == 0 || bid > MAX_BOARD)
-	    return;
+#define BOARD_FIELD_HASH_SIZE (64)
 
-	if ((p = strchr(key, '.')) == NULL)
-	    return;
+// field id + 1, 0 for empty
+static unsigned char board_field_hash[BOARD_FIELD_HASH_SIZE];
 
-	bptr = getbcache(bid);
+static void
+board_field_init(void)
+{
+    int i;
+    unsigned int h;
+
+    for (i = 0; i < BF_MAX; i++) {
+	const char *name = board_fields[i].name;
+	h = fnv_32_buf(name, strlen(name), FNV1_32_INIT);
+	while (board_field_hash[h % BOARD_FIELD_HASH_SIZE])
+	    h++;
+	board_field_hash[h % BOARD_FIELD_HASH_SIZE] = i + 1;
+    }
+}
 
-	if (!bptr->brdname[0] || BOARD_HIDDEN(bptr))
-	    return;
+// Returns the field id of name[0..len), or -1.
+static int
+board_field_lookup(const char *name, int len)
+{
+    unsigned int h = fnv_32_buf(name, len, FNV1_32_INIT);
+    int f;
+
+    while ((f = board_field_hash[h % BOARD_FIELD_HASH_SIZE]) != 0) {
+	f--;
+	if (strncmp(board_fields[f].name, name, len) == 0 &&
+	    board_fields[f].name[len] == '\0')
+	    return f;
+	h++;
+    }
+    return -1;
+}
 
-	key = p + 1;
+static boardheader_t *
+get_visible_board(int bid)
+{
+    boardheader_t *bptr;
 
-	if (strcmp(key, "isboard") == 0)
+    if (bid <= 0 || bid > MAX_BOARD)
+	return NULL;
+    bptr = getbcache(bid);
+    if (!bptr->brdname[0] || BOARD_HIDDEN(bptr))
+	return NULL;
+    return bptr;
+}
+
+// Answers one field of a board. arg is the text argument of the fields
+// taking one (NULL from the binary protocol); offset and length are the
+// range of BF_ARTICLES.
+// Returns 1 if the answer in buf is already converted to UTF-8.
+static int
+answer_board_field(struct evbuffer *buf, boardheader_t *bptr, int field,
+		   const char *arg, int offset, int length)
+{
+    int bid;
+
+    switch (field) {
+	case BF_ISBOARD:
 	    evbuffer_add_printf(buf, "%d", (bptr->brdattr & BRD_GROUPBOARD) ? 0 : 1);
-	else if (strcmp(key, "over18") == 0)
+	    break;
+	case BF_OVER18:
 	    evbuffer_add_printf(buf, "%d", (bptr->brdattr & BRD_OVER18) ? 1 : 0);
-	else if (strcmp(key, "hidden") == 0)
+	    break;
+	case BF_HIDDEN:
 	    evbuffer_add_printf(buf, "%d", BOARD_HIDDEN(bptr) ? 1 : 0);
-	else if (strcmp(key, "brdname") == 0)
+	    break;
+	case BF_BRDNAME:
 	    evbuffer_add(buf, bptr->brdname, strlen(bptr->brdname));
-	else if (strcmp(key, "title") == 0)
+	    break;
+	case BF_TITLE:
 	    evbuffer_add(buf, bptr->title + 7, strlen(bptr->title) - 7);
-	else if (strcmp(key, "class") == 0)
+	    break;
+	case BF_CLASS:
 	    evbuffer_add(buf, bptr->title, 4);
-	else if (strcmp(key, "BM") == 0)
+	    break;
+	case BF_BM:
 	    evbuffer_add(buf, bptr->BM, strlen(bptr->BM));
-	else if (strcmp(key, "parent") == 0)
+	    break;
+	case BF_PARENT:
 	    evbuffer_add_printf(buf, "%d", bptr->parent);
-	else if (strcmp(key, "count") == 0) {
+	    break;
+	case BF_COUNT: {
 	    char path[PATH_MAX];
 	    setbfile(path, bptr->brdname, FN_DIR);
 	    evbuffer_add_printf(buf, "%d", get_num_records(path, sizeof(fileheader_t)));
-	} else if (strcmp(key, "children") == 0) {
+	    break;
+	}
+	case BF_CHILDREN:
 	    if (!(bptr->brdattr & BRD_GROUPBOARD))
-		return;
+		return 0;
 
 	    for (bid = bptr->firstchild[1]; bid > 0; bid = bptr->next[1]) {
 		bptr = getbcache(bid);
 		evbuffer_add_printf(buf, "%d,", bid);
 	    }
-	} else if (strcmp(key, "bottoms") == 0) {
+	    break;
+	case BF_BOTTOMS:
 	    bottom_article_list(buf, bptr);
-	} else if (strncmp(key, "articles.", 9) == 0) {
-	    int offset, length;
-
-	    key += 9;
-
-	    if (!isdigit(*key) && *key != '-')
-		return;
-
-	    offset = atoi(key);
-	    p = strchr(key, '.');
-
-	    if (!p || (length = atoi(p+1)) == 0)
+	    break;
+	case BF_ARTICLES:
+	    if (length == 0)
 		length = DEFAULT_ARTICLE_LIST;
-
 	    article_list(buf, bptr, offset, length);
-	} else if (strncmp(key, "article.", 8) == 0) {
-	    if (!is_valid_article_filename(key + 8))
-		return;
+	    break;
+	case BF_ARTICLE: {
+	    if (!arg || !is_valid_article_filename(arg))
+		return 0;
 
 	    char path[PATH_MAX];
 	    struct stat st;
 	    int fd;
 
-	    setbfile(path, bptr->brdname, key + 8);
+	    setbfile(path, bptr->brdname, arg);
+	    if (g_convert_to_utf8) {
+		answer_article_utf8(buf, path, NULL, 0, 0, -1,
+				    select_article_part, NULL, ARTICLE_WHOLE, 0);
+		return 1;
+	    }
 	    if ((fd = open(path, O_RDONLY)) < 0)
-		return;
+		return 0;
 	    if (fstat(fd, &st) < 0 ||
 		st.st_size == 0 ||
 		evbuffer_add_file(buf, fd, 0, st.st_size) != 0)
 		close(fd);
-	} else if (strncmp(key, "articlestat.", 12) == 0) {
-	    if (!is_valid_article_filename(key + 12))
-		return;
+	    break;
+	}
+	case BF_ARTICLESTAT: {
+	    if (!arg || !is_valid_article_filename(arg))
+		return 0;
 
 	    char path[PATH_MAX];
 	    struct stat st;
 
-	    setbfile(path, bptr->brdname, key + 12);
+	    setbfile(path, bptr->brdname, arg);
 	    if (stat(path, &st) < 0)
-		return;
+		return 0;
 
 	    evbuffer_add_printf(buf, "%d-%d,%ld", (int) st.st_dev, (int) st.st_ino, st.st_size);
-	} else if (strncmp(key, "articlepart.", 12) == 0) {
-	    answer_articleselect(buf, bptr, key + 12, select_article_part, NULL);
-	} else if (strncmp(key, "articlehead.", 12) == 0) {
-	    answer_articleselect(buf, bptr, key + 12, select_article_head, NULL);
-	} else if (strncmp(key, "articletail.", 12) == 0) {
-	    answer_articleselect(buf, bptr, key + 12, select_article_tail, NULL);
-	} else
-	    return;
+	    break;
+	}
+	case BF_ARTICLEPART:
+	    if (!arg)
+		return 0;
+	    answer_articleselect(buf, bptr, arg, select_article_part, NULL,
+				 ARTICLE_PART);
+	    return g_convert_to_utf8;
+	case BF_ARTICLEHEAD:
+	    if (!arg)
+		return 0;
+	    answer_articleselect(buf, bptr, arg, select_article_head, NULL,
+				 ARTICLE_HEAD);
+	    return g_convert_to_utf8;
+	case BF_ARTICLETAIL:
+	    if (!arg)
+		return 0;
+	    answer_articleselect(buf, bptr, arg, select_article_tail, NULL,
+				 ARTICLE_TAIL);
+	    return g_convert_to_utf8;
+	case BF_ARTICLEINDEX: {
+	    // position of an article (by filename, as made from an AID) in
+	    // .DIR, same numbering as "articles"
+	    if (!arg || !is_valid_article_filename(arg))
+		return 0;
+
+	    char path[PATH_MAX];
+	    int n;
+
+	    setbfile(path, bptr->brdname, FN_DIR);
+	    if ((n = fileheader_find(path, arg, 0)) < 0)
+		return 0;
+	    evbuffer_add_printf(buf, "%d", n + 1);
+	    break;
+	}
+    }
+    return 0;
+}
+
+// Returns 1 if the answer in buf is already converted to UTF-8.
+static int
+answer_key(struct evbuffer *buf, const char *key)
+{
+    int bid;
+    boardheader_t *bptr;
+
+    if (isdigit(*key)) {
+	const char *name, *arg;
+	int field, offset = 0, length = 0;
+
+	if ((name = strchr(key, '.')) == NULL)
+	    return 0;
+	if ((bptr = get_visible_board(atoi(key))) == NULL)
+	    return 0;
+
+	name++;
+	if ((arg = strchr(name, '.')) != NULL)
+	    arg++;
+	field = board_field_lookup(name, arg ? arg - 1 - name : (int)strlen(name));
+	if (field < 0 || board_fields[field].has_arg != (arg != NULL))
+	    return 0;
+
+	if (field == BF_ARTICLES) {
+	    // articles.<offset>[.<length>]
+	    const char *p;
+
+	    if (!isdigit(*arg) && *arg != '-')
+		return 0;
+
+	    offset = atoi(arg);
+	    if ((p = strchr(arg, '.')) != NULL)
+		length = atoi(p + 1);
+	}
+	return answer_board_field(buf, bptr, field, arg, offset, length);
     } else if (strncmp(key, "tobid.", 6) == 0) {
 	bid = getbnum(key + 6);
 	bptr = getbcache(bid);
 
 	if (!bptr->brdname[0] || BOARD_HIDDEN(bptr))
-	    return;
+	    return 0;
 
 	evbuffer_add_printf(buf, "%d", bid);
 #if HOTBOARDCACHE
@@ -401,201 +820,7 @@ answer_key(struct evbuffer *buf, const char *key)
 	}
 #endif
     }
-}
-
-static int
-move_string_end(char **buf)
-{
-    int n = 0;
-    while (**buf != '\0') {
-	(*buf)++;
-	n++;
-    }
-    return n;
-}
-
-// Make ANSI control code
-//   fg, bg, bright are the original color code (eg. 30, 42, 1)
-//   provide -1 means no change
-//   all -1 means reset
-static void
-make_ansi_ctrl(char *buf, int size, int fg, int bg, int bright)
-{
-    int sep = 0;
-    strncpy(buf, "\033[", size);
-    size -= move_string_end(&buf);
-    if (bright >= 0) {
-	snprintf(buf, size, "%s%d", sep ? ";" : "", bright);
-	size -= move_string_end(&buf);
-	sep = 1;
-    }
-    if (fg >= 0) {
-	snprintf(buf, size, "%s%d", sep ? ";" : "", fg);
-	size -= move_string_end(&buf);
-	sep = 1;
-    }
-    if (bg >= 0) {
-	snprintf(buf, size, "%s%d", sep ? ";" : "", bg);
-	size -= move_string_end(&buf);
-	sep = 1;
-    }
-    snprintf(buf, size, "m");
-}
-
-// Make extended ANSI control code
-//   1 ==> 111, 0 ==> 110,
-//   3x ==> 13x, 4y ==> 14y.
-//   provide -1 means no change
-//   all -1 means reset
-static void
-make_ext_ansi_ctrl(char *buf, int size, int fg, int bg, int bright)
-{
-    make_ansi_ctrl(buf, size,
-                   fg >= 0 ? 100 + fg : fg,
-                   bg >= 0 ? 100 + bg : bg,
-                   bright >= 0 ? 110 + bright : bright);
-}
-
-static int
-evbuffer_add_ansi_escape_code(struct evbuffer *destination, int fg, int bg, int bright)
-{
-    char ansicode[16];
-    make_ansi_ctrl(ansicode, sizeof(ansicode), fg, bg, bright);
-    return evbuffer_add_printf(destination, ansicode, strlen(ansicode));
-}
-
-static int
-evbuffer_add_ext_ansi_escape_code(struct evbuffer *destination, int fg, int bg, int bright)
-{
-    char ansicode[24];
-    make_ext_ansi_ctrl(ansicode, sizeof(ansicode), fg, bg, bright);
-    return evbuffer_add_printf(destination, ansicode, strlen(ansicode));
-}
-
-// Converts given evbuffer contents to UTF-8 and returns the new buffer.
-// The original buffer is freed. Returns NULL on error
-
-struct evbuffer *
-evbuffer_b2u(struct evbuffer *source)
-{
-    unsigned char c[16];
-    int out = 0;
-
-    if (evbuffer_get_length(source) == 0)
-	return source;
-
-    struct evbuffer *destination = evbuffer_new();
-
-    // Peek at first byte
-    while (evbuffer_copyout(source, c, 1) > 0) {
-	if (isascii(c[0])) {
-	    if (evbuffer_add(destination, c, 1) < 0)
-		break;
-
-	    // Remove byte from source buffer
-	    evbuffer_drain(source, 1);
-	    out++;
-	} else {
-	    // Big5
-	    int todrain = 2;
-
-	    // Handle in-character colors
-	    int fg = -1, bg = -1, bright = -1;
-	    int n = evbuffer_copyout(source, c, sizeof(c));
-	    if (n < 2)
-		break;
-	    while (c[1] == '\033') {
-		c[n - 1] = '\0';
-
-		// At least have \033[m
-		if (n < 4 || c[2] != '[')
-		    break;
-
-		unsigned char *p = c + 3;
-		if (*p == 'm') {
-		    // ANSI reset
-		    fg = 7;
-		    bg = 0;
-		    bright = 0;
-		}
-		while (1) {
-		    int v = (int) strtol((char *)p, (char **)&p, 10);
-		    if (*p != 'm' && *p != ';')
-			break;
-
-		    if (v == 0)
-			bright = 0;
-		    else if (v == 1)
-			bright = 1;
-		    else if (v >= 30 && v <= 37)
-			fg = v;
-		    else if (v >= 40 && v <= 47)
-			bg = v;
-
-		    if (*p == 'm')
-			break;
-		    p++;
-		}
-		if (*p != 'm') {
-		    // Skip malicious or unsupported codes
-		    fg = bg = bright = -1;
-		    break;
-		} else {
-		    evbuffer_drain(source, p - c + 1);
-		    todrain = 1; // We keep a byte on buffer, so fix offset
-		    n = evbuffer_copyout(source, c + 1, sizeof(c) - 1);
-		    if (n < 1)
-			break;
-		    n++;
-		}
-	    }
-#ifdef EXTENDED_INCHAR_ANSI
-	    // Output control codes before the Big5 character
-	    if (fg >= 0 || bg >= 0 || bright >= 0) {
-                int dlen = evbuffer_add_ext_ansi_escape_code(destination, fg, bg, bright);
-                if (dlen < 0)
-                    break;
-                out += dlen;
-	    }
-#endif
-
-	    // n may be changed, check again
-	    if (n < 2)
-		break;
-
-	    uint8_t utf8[4];
-	    int len = ucs2utf(b2u_table[c[0] << 8 | c[1]], utf8);
-	    utf8[len] = 0;
-
-	    if (evbuffer_add(destination, utf8, len) < 0)
-		break;
-
-#ifndef EXTENDED_INCHAR_ANSI
-            // Output in-char control codes to make state consistent
-            if (fg >= 0 || bg >= 0 || bright >= 0) {
-                int dlen = evbuffer_add_ansi_escape_code(destination, fg, bg, bright);
-                if (dlen < 0)
-                    break;
-                out += dlen;
-            }
-#endif
-
-	    // Remove DBCS character from source buffer
-	    evbuffer_drain(source, todrain);
-	    out += len;
-	}
-    }
-
-    if (evbuffer_get_length(source) == 0 && out) {
-	// Success
-	evbuffer_free(source);
-	return destination;
-    }
-
-    // Fail
-    evbuffer_free(source);
-    evbuffer_free(destination);
-    return NULL;
+    return 0;
 }
 
 // Command functions
@@ -611,10 +836,10 @@ cmd_get(struct evbuffer *output, void *ctx, int argc, char **argv)
     }
 
     do {
-	answer_key(buf, *argv);
+	int is_utf8 = answer_key(buf, *argv);
 	if (evbuffer_get_length(buf) == 0)
 	    continue;
-	if (g_convert_to_utf8) {
+	if (g_convert_to_utf8 && !is_utf8) {
 	    buf = evbuffer_b2u(buf);
 	    if (buf == NULL) {
 		// Failed to convert
@@ -705,6 +930,54 @@ process_line(struct evbuffer *output, void *ctx, char *line)
     return result;
 }
 
+static uint32_t
+get_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// Answers one binary multi-get frame of size bytes (see boardd.h); the
+// frame has been checked complete by the caller.
+int
+process_binary(struct evbuffer *output, void *ctx GCC_UNUSED,
+	       const unsigned char *frame, int size)
+{
+    struct evbuffer *buf = evbuffer_new();
+    int i, count = frame[2] << 8 | frame[3];
+    unsigned char hdr[BINARY_HEADER_SIZE] = {
+	BINARY_MAGIC, BINARY_VERSION, frame[2], frame[3] };
+
+    if (frame[0] != BINARY_MAGIC || frame[1] != BINARY_VERSION ||
+	size != BINARY_FRAME_SIZE(count)) {
+	evbuffer_free(buf);
+	return -1;
+    }
+
+    evbuffer_add(output, hdr, sizeof(hdr));
+    for (i = 0; i < count; i++) {
+	const unsigned char *t = frame + BINARY_FRAME_SIZE(i);
+	int field = t[4] << 8 | t[5];
+	boardheader_t *bptr = get_visible_board(get_u32(t));
+	int is_utf8 = 0;
+	uint32_t len;
+
+	if (bptr && field < BF_MAX &&
+	    (field == BF_ARTICLES || !board_fields[field].has_arg))
+	    is_utf8 = answer_board_field(buf, bptr, field, NULL,
+					 (int32_t)get_u32(t + 8),
+					 (int32_t)get_u32(t + 12));
+	if (g_convert_to_utf8 && !is_utf8 && evbuffer_get_length(buf) > 0 &&
+	    (buf = evbuffer_b2u(buf)) == NULL)
+	    buf = evbuffer_new();
+
+	len = htonl(evbuffer_get_length(buf));
+	evbuffer_add(output, &len, sizeof(len));
+	evbuffer_add_buffer(output, buf);
+    }
+    evbuffer_free(buf);
+    return 0;
+}
+
 void
 setup_program()
 {
@@ -713,27 +986,34 @@ setup_program()
     chdir(BBSHOME);
 
     attach_SHM();
+    board_field_init();
 }
 
 int main(int argc, char *argv[])
 {
-    int ch, run_as_daemon = 1;
+    int ch, run_as_daemon = 1, nthreads = 0;
     const char *iface_ip = "127.0.0.1:5150";
 
-    while ((ch = getopt(argc, argv, "5Dl:h")) != -1)
+    while ((ch = getopt(argc, argv, "5c:Dl:t:h")) != -1)
 	switch (ch) {
 	    case '5':
 		g_convert_to_utf8 = 0;
 		break;
+	    case 'c':
+		g_cache_limit = (size_t)atoi(optarg) * 1024 * 1024;
+		break;
 	    case 'D':
 		run_as_daemon = 0;
 		break;
 	    case 'l':
 		iface_ip = optarg;
 		break;
+	    case 't':
+		nthreads = atoi(optarg);
+		break;
 	    case 'h':
 	    default:
-		fprintf(stderr, "Usage: %s [-5] [-D] [-l interface_ip:port]\n", argv[0]);
+		fprintf(stderr, "Usage: %s [-5] [-c cache_mb] [-D] [-l interface_ip:port] [-t threads]\n", argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
@@ -750,7 +1030,7 @@ int main(int argc, char *argv[])
     char *ipport = strdup(iface_ip);
     char *ip = strtok(ipport, ":");
     char *port = strtok(NULL, ":");
-    start_server(ip, atoi(port));
+    start_server(ip, atoi(port), nthreads);
     free(ipport);
 
     return 0;
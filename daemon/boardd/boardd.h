@@ -2,7 +2,60 @@
 #   define _BOARDD_H
 
 int process_line(struct evbuffer *output, void *ctx, char *line);
-void start_server(const char *host, unsigned short port);
+int process_binary(struct evbuffer *output, void *ctx,
+		   const unsigned char *frame, int size);
+// nthreads <= 0: one thread per core
+void start_server(const char *host, unsigned short port, int nthreads);
+
+// convert.c
+int b2u_convert(char *dst, const char *src, int len);
+int evbuffer_add_b2u(struct evbuffer *destination, const char *src, int len);
+struct evbuffer *evbuffer_b2u(struct evbuffer *source);
+
+// worst case output size of b2u_convert() for len bytes of input
+#define B2U_MAXLEN(len) (4 * (len) + 16)
+
+// Binary multi-get protocol. All integers are in network byte order.
+//
+// request:  header { u8 magic = BINARY_MAGIC; u8 version; u16 count; }
+//           count tuples { u32 bid; u16 field; u16 reserved;
+//                          i32 offset; i32 length; }
+// response: header { u8 magic; u8 version; u16 count; }
+//           count answers { u32 len; u8 data[len]; }, in request order.
+//
+// field is one of the BF_* below; offset and length are only used by
+// BF_ARTICLES (as in "<bid>.articles.<offset>.<length>"). The fields whose
+// text key takes a string argument (article file names) are not available
+// and answer empty, as do hidden or nonexistent boards.
+#define BINARY_MAGIC	    0xB0
+#define BINARY_VERSION	    1
+#define BINARY_HEADER_SIZE  4
+#define BINARY_TUPLE_SIZE   16
+#define BINARY_FRAME_SIZE(count) \
+    (BINARY_HEADER_SIZE + (count) * BINARY_TUPLE_SIZE)
+
+// board fields; the values are part of the binary protocol.
+enum {
+    BF_ISBOARD = 0,
+    BF_OVER18 = 1,
+    BF_HIDDEN = 2,
+    BF_BRDNAME = 3,
+    BF_TITLE = 4,
+    BF_CLASS = 5,
+    BF_BM = 6,
+    BF_PARENT = 7,
+    BF_COUNT = 8,
+    BF_CHILDREN = 9,
+    BF_BOTTOMS = 10,
+    BF_ARTICLES = 11,
+    BF_ARTICLE = 12,
+    BF_ARTICLESTAT = 13,
+    BF_ARTICLEPART = 14,
+    BF_ARTICLEHEAD = 15,
+    BF_ARTICLETAIL = 16,
+    BF_ARTICLEINDEX = 17,
+    BF_MAX
+};
 
 #ifndef NUM_THREADS
 #define NUM_THREADS 8
@@ -12,4 +65,8 @@ void start_server(const char *host, unsigned short port);
 #define MAX_ARGS 100
 #endif
 
+#ifndef ARTICLE_CACHE_MB
+#define ARTICLE_CACHE_MB 64
+#endif
+
 #endif
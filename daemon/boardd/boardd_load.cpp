@@ -0,0 +1,260 @@
+// Load generator for boardd (or any memcached text protocol server).
+//
+// usage: boardd_load [-c conns] [-d depth] [-t seconds] [-k keys_per_get]
+//                    [-s host:port] keyfile
+//
+// Replays the keys in keyfile (one per line, eg. "1.articles.-1" or
+// "123.article.M.1234567890.A.ABC") as "get" requests. Each connection
+// runs in its own thread and keeps up to depth requests in flight
+// (pipelined). Reports requests/s and the latency percentiles.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+using Clock = std::chrono::steady_clock;
+
+static std::vector<std::string> g_keys;
+static std::atomic<bool> g_stop(false);
+
+struct Stats {
+    std::vector<double> latency_us;
+    long bytes = 0;
+    long errors = 0;
+};
+
+static int
+connect_to(const std::string &host, const std::string &port)
+{
+    struct addrinfo hints, *res, *ai;
+    int fd = -1, one = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+	return -1;
+    for (ai = res; ai; ai = ai->ai_next) {
+	if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+	    continue;
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+	    break;
+	close(fd);
+	fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0)
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// Buffered reader of memcached "get" replies.
+class Reader {
+  public:
+    explicit Reader(int fd) : fd_(fd) { }
+
+    // Reads one whole reply (VALUE blocks up to END). Returns its size,
+    // or -1 on error.
+    long ReadReply() {
+	long total = 0;
+	std::string line;
+	while (true) {
+	    if (!ReadLine(line))
+		return -1;
+	    total += line.size() + 2;
+	    if (line == "END")
+		return total;
+	    unsigned long len;
+	    if (sscanf(line.c_str(), "VALUE %*s %*u %lu", &len) != 1)
+		return -1;
+	    if (!Skip(len + 2))
+		return -1;
+	    total += len + 2;
+	}
+    }
+
+  private:
+    bool Fill() {
+	if (pos_ > 0) {
+	    buf_.erase(0, pos_);
+	    pos_ = 0;
+	}
+	char tmp[65536];
+	ssize_t n = read(fd_, tmp, sizeof(tmp));
+	if (n <= 0)
+	    return false;
+	buf_.append(tmp, n);
+	return true;
+    }
+
+    bool ReadLine(std::string &line) {
+	size_t p;
+	while ((p = buf_.find("\r\n", pos_)) == std::string::npos)
+	    if (!Fill())
+		return false;
+	line.assign(buf_, pos_, p - pos_);
+	pos_ = p + 2;
+	return true;
+    }
+
+    bool Skip(size_t n) {
+	while (buf_.size() - pos_ < n) {
+	    n -= buf_.size() - pos_;
+	    pos_ = buf_.size();
+	    if (!Fill())
+		return false;
+	}
+	pos_ += n;
+	return true;
+    }
+
+    int fd_;
+    std::string buf_;
+    size_t pos_ = 0;
+};
+
+static void
+client(const std::string &host, const std::string &port, int id,
+       int depth, int keys_per_get, Stats *stats)
+{
+    int fd = connect_to(host, port);
+    if (fd < 0) {
+	stats->errors++;
+	return;
+    }
+    Reader reader(fd);
+    std::vector<Clock::time_point> sent;
+    size_t next = (size_t)id * 7919 % g_keys.size(), done = 0;
+
+    auto send_one = [&]() {
+	std::string req = "get";
+	for (int i = 0; i < keys_per_get; i++) {
+	    req += ' ';
+	    req += g_keys[next++ % g_keys.size()];
+	}
+	req += "\r\n";
+	sent.push_back(Clock::now());
+	return write(fd, req.data(), req.size()) == (ssize_t)req.size();
+    };
+
+    for (int i = 0; i < depth; i++)
+	if (!send_one()) {
+	    stats->errors++;
+	    close(fd);
+	    return;
+	}
+    while (done < sent.size()) {
+	long n = reader.ReadReply();
+	if (n < 0) {
+	    stats->errors++;
+	    break;
+	}
+	auto us = std::chrono::duration<double, std::micro>(
+		Clock::now() - sent[done++]).count();
+	stats->latency_us.push_back(us);
+	stats->bytes += n;
+	if (!g_stop && !send_one()) {
+	    stats->errors++;
+	    break;
+	}
+    }
+    close(fd);
+}
+
+static double
+percentile(const std::vector<double> &v, double p)
+{
+    if (v.empty())
+	return 0;
+    size_t i = std::min(v.size() - 1, (size_t)(p / 100 * v.size()));
+    return v[i];
+}
+
+int
+main(int argc, char **argv)
+{
+    int ch, conns = 16, depth = 4, seconds = 10, keys_per_get = 1;
+    std::string server = "127.0.0.1:5150";
+
+    while ((ch = getopt(argc, argv, "c:d:t:k:s:")) != -1)
+	switch (ch) {
+	    case 'c': conns = atoi(optarg); break;
+	    case 'd': depth = atoi(optarg); break;
+	    case 't': seconds = atoi(optarg); break;
+	    case 'k': keys_per_get = atoi(optarg); break;
+	    case 's': server = optarg; break;
+	    default:
+		goto usage;
+	}
+    if (optind != argc - 1 || conns <= 0 || depth <= 0 || seconds <= 0 ||
+	keys_per_get <= 0)
+	goto usage;
+
+    {
+	std::ifstream in(argv[optind]);
+	std::string key;
+	while (std::getline(in, key))
+	    if (!key.empty() && key[0] != '#')
+		g_keys.push_back(key);
+    }
+    if (g_keys.empty()) {
+	std::cerr << "no keys in " << argv[optind] << std::endl;
+	return 1;
+    }
+
+    {
+	size_t colon = server.rfind(':');
+	std::string host = server.substr(0, colon);
+	std::string port = colon == std::string::npos ? "5150" :
+	    server.substr(colon + 1);
+	std::vector<Stats> stats(conns);
+	std::vector<std::thread> threads;
+
+	auto start = Clock::now();
+	for (int i = 0; i < conns; i++)
+	    threads.emplace_back(client, host, port, i, depth, keys_per_get,
+				 &stats[i]);
+	std::this_thread::sleep_for(std::chrono::seconds(seconds));
+	g_stop = true;
+	for (auto &t : threads)
+	    t.join();
+	double elapsed = std::chrono::duration<double>(
+		Clock::now() - start).count();
+
+	std::vector<double> all;
+	long bytes = 0, errors = 0;
+	for (auto &s : stats) {
+	    all.insert(all.end(), s.latency_us.begin(), s.latency_us.end());
+	    bytes += s.bytes;
+	    errors += s.errors;
+	}
+	std::sort(all.begin(), all.end());
+
+	printf("%d conns x depth %d, %d keys/get, %.1f s\n",
+	       conns, depth, keys_per_get, elapsed);
+	printf("requests: %zu (%.0f req/s, %.1f MB/s), errors: %ld\n",
+	       all.size(), all.size() / elapsed, bytes / elapsed / 1e6, errors);
+	printf("latency us: p50 %.0f  p90 %.0f  p99 %.0f  max %.0f\n",
+	       percentile(all, 50), percentile(all, 90), percentile(all, 99),
+	       all.empty() ? 0 : all.back());
+	return errors ? 1 : 0;
+    }
+
+usage:
+    fprintf(stderr, "Usage: %s [-c conns] [-d depth] [-t seconds] "
+	    "[-k keys_per_get] [-s host:port] keyfile\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,219 @@
+// Big5 (UAO) to UTF-8 conversion for boardd output
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/buffer.h>
+
+#include <cmsys.h>
+
+#include "boardd.h"
+
+static int
+move_string_end(char **buf)
+{
+    int n = 0;
+    while (**buf != '\0') {
+	(*buf)++;
+	n++;
+    }
+    return n;
+}
+
+// Make ANSI control code
+//   fg, bg, bright are the original color code (eg. 30, 42, 1)
+//   provide -1 means no change
+//   all -1 means reset
+static void
+make_ansi_ctrl(char *buf, int size, int fg, int bg, int bright)
+{
+    int sep = 0;
+    strncpy(buf, "\033[", size);
+    size -= move_string_end(&buf);
+    if (bright >= 0) {
+	snprintf(buf, size, "%s%d", sep ? ";" : "", bright);
+	size -= move_string_end(&buf);
+	sep = 1;
+    }
+    if (fg >= 0) {
+	snprintf(buf, size, "%s%d", sep ? ";" : "", fg);
+	size -= move_string_end(&buf);
+	sep = 1;
+    }
+    if (bg >= 0) {
+	snprintf(buf, size, "%s%d", sep ? ";" : "", bg);
+	size -= move_string_end(&buf);
+	sep = 1;
+    }
+    snprintf(buf, size, "m");
+}
+
+#ifdef EXTENDED_INCHAR_ANSI
+// Make extended ANSI control code
+//   1 ==> 111, 0 ==> 110,
+//   3x ==> 13x, 4y ==> 14y.
+//   provide -1 means no change
+//   all -1 means reset
+static void
+make_ext_ansi_ctrl(char *buf, int size, int fg, int bg, int bright)
+{
+    make_ansi_ctrl(buf, size,
+                   fg >= 0 ? 100 + fg : fg,
+                   bg >= 0 ? 100 + bg : bg,
+                   bright >= 0 ? 110 + bright : bright);
+}
+#endif
+
+// Parses an in-character "\033[...m" at s[0], which must end before s[lim].
+// Returns the length of the sequence, or 0 if it is malicious or unsupported.
+static int
+parse_inchar_ansi(const uint8_t *s, int lim, int *fg, int *bg, int *bright)
+{
+    int p = 2;
+
+    if (s[p] == 'm' && p < lim) {
+	// ANSI reset
+	*fg = 7;
+	*bg = 0;
+	*bright = 0;
+    }
+    while (1) {
+	int v = 0;
+	while (p < lim && s[p] >= '0' && s[p] <= '9') {
+	    if (v < 1000)
+		v = v * 10 + s[p] - '0';
+	    p++;
+	}
+	if (p >= lim || (s[p] != 'm' && s[p] != ';'))
+	    return 0;
+
+	if (v == 0)
+	    *bright = 0;
+	else if (v == 1)
+	    *bright = 1;
+	else if (v >= 30 && v <= 37)
+	    *fg = v;
+	else if (v >= 40 && v <= 47)
+	    *bg = v;
+
+	if (s[p++] == 'm')
+	    return p;
+    }
+}
+
+// Converts len bytes of Big5 at src into dst, which must have room for
+// B2U_MAXLEN(len) bytes. ASCII runs are copied in bulk and DBCS characters
+// are looked up in b2u_utf8_table[]. Returns the output length, or -1 on
+// truncated input.
+//
+// ANSI codes inside a DBCS character ("half-colored" characters) are
+// moved out of it: the colors are emitted after the character, or before
+// it in extended form if EXTENDED_INCHAR_ANSI is defined.
+int
+b2u_convert(char *dst, const char *src, int len)
+{
+    const uint8_t *s = (const uint8_t *)src;
+    uint8_t *d = (uint8_t *)dst;
+    int i = 0, j, n;
+
+    while (i < len) {
+	// ASCII run
+	for (j = i; j < len && s[j] < 0x80; j++);
+	memcpy(d, s + i, j - i);
+	d += j - i;
+	if ((i = j) >= len)
+	    break;
+
+	// Big5, s[i] is the lead byte
+	int fg = -1, bg = -1, bright = -1;
+	uint8_t trail;
+
+	if (len - i < 2)
+	    return -1;
+	for (j = i + 1; j < len && s[j] == '\033'; j += n) {
+	    // Same window as the old peek based parser: up to 15 bytes after
+	    // the lead byte, and the sequence may not take the last byte.
+	    int lim = (len - j < 15 ? len - j : 15) - 1;
+
+	    // At least have \033[m
+	    if (lim < 2 || s[j + 1] != '[')
+		break;
+	    if ((n = parse_inchar_ansi(s + j, lim, &fg, &bg, &bright)) == 0) {
+		// Skip malicious or unsupported codes
+		fg = bg = bright = -1;
+		break;
+	    }
+	}
+	if (j >= len)
+	    return -1;
+	trail = (j == len - 1 && s[j] == '\033') ? 0 : s[j];
+
+#ifdef EXTENDED_INCHAR_ANSI
+	// Output control codes before the Big5 character
+	if (fg >= 0 || bg >= 0 || bright >= 0) {
+	    make_ext_ansi_ctrl((char *)d, 24, fg, bg, bright);
+	    d += strlen((char *)d);
+	}
+#endif
+
+	n = b2u_utf8_table[s[i] << 8 | trail][3];
+	memcpy(d, b2u_utf8_table[s[i] << 8 | trail], 4);
+	d += n;
+
+#ifndef EXTENDED_INCHAR_ANSI
+	// Output in-char control codes to make state consistent
+	if (fg >= 0 || bg >= 0 || bright >= 0) {
+	    make_ansi_ctrl((char *)d, 16, fg, bg, bright);
+	    d += strlen((char *)d);
+	}
+#endif
+	i = j + 1;
+    }
+    return d - (uint8_t *)dst;
+}
+
+// Converts len bytes of Big5 at src and appends them to destination,
+// written in place into one reserved chunk. Returns 0 on success.
+int
+evbuffer_add_b2u(struct evbuffer *destination, const char *src, int len)
+{
+    struct evbuffer_iovec v;
+    int n;
+
+    if (len <= 0)
+	return len;
+    if (evbuffer_reserve_space(destination, B2U_MAXLEN(len), &v, 1) < 1)
+	return -1;
+    if ((n = b2u_convert(v.iov_base, src, len)) < 0)
+	return -1;
+    v.iov_len = n;
+    return evbuffer_commit_space(destination, &v, 1);
+}
+
+// Converts given evbuffer contents to UTF-8 and returns the new buffer.
+// The original buffer is freed. Returns NULL on error
+
+struct evbuffer *
+evbuffer_b2u(struct evbuffer *source)
+{
+    int len = evbuffer_get_length(source);
+
+    if (len == 0)
+	return source;
+
+    struct evbuffer *destination = evbuffer_new();
+
+    if (evbuffer_add_b2u(destination, (char *)evbuffer_pullup(source, len),
+			 len) == 0) {
+	// Success
+	evbuffer_free(source);
+	return destination;
+    }
+
+    // Fail
+    evbuffer_free(source);
+    evbuffer_free(destination);
+    return NULL;
+}
@@ -3,8 +3,7 @@
 #include <iostream>
 #include <memory>
 #include <functional>
-#include <future>
-#include <mutex>
+#include <thread>
 #include <vector>
 #include <boost/asio.hpp>
 extern "C" {
@@ -17,6 +16,14 @@ namespace asio = boost::asio;
 using boost::system::error_code;
 using boost::asio::ip::tcp;
 
+// Each connection belongs to one io_service, which is run by exactly one
+// thread, so a connection never needs locking.
+//
+// Requests are text lines or binary multi-get frames (see boardd.h).
+// They are pipelined: requests keep being read and processed into
+// pending_output_ while the previous replies (writing_output_) are still
+// being written. Replies are written straight from the evbuffer chain as
+// scatter-gather buffers, without copying them into one block.
 class Conn : public std::enable_shared_from_this<Conn> {
   public:
     using Ptr = std::shared_ptr<Conn>;
@@ -27,13 +34,13 @@ class Conn : public std::enable_shared_from_this<Conn> {
 
     virtual ~Conn() {
 	evbuffer_free(pending_output_);
+	evbuffer_free(writing_output_);
     }
 
     tcp::socket& Socket() { return socket_; }
 
     void Start() {
-	std::lock_guard<std::mutex> lk(mutex_);
-	ReadLine();
+	ReadMore();
 	ResetTimer(true);
     }
 
@@ -41,58 +48,115 @@ class Conn : public std::enable_shared_from_this<Conn> {
     Conn(asio::io_service &io_service)
       : socket_(io_service)
       , timer_(io_service)
-      , pending_output_(evbuffer_new()) { }
+      , pending_output_(evbuffer_new())
+      , writing_output_(evbuffer_new()) { }
 
-    void ReadLine() {
-	asio::async_read_until(socket_, buffer_, '\n',
-			       std::bind(&Conn::OnReadLines,
-					 shared_from_this(),
-					 std::placeholders::_1,
-					 std::placeholders::_2));
+    void ReadMore() {
+	reading_ = true;
+	socket_.async_read_some(buffer_.prepare(kReadSize),
+				std::bind(&Conn::OnRead,
+					  shared_from_this(),
+					  std::placeholders::_1,
+					  std::placeholders::_2));
     }
 
-    void OnReadLines(const error_code &ec, size_t bytes) {
-	std::lock_guard<std::mutex> lk(mutex_);
+    void OnRead(const error_code &ec, size_t bytes) {
+	reading_ = false;
 	if (ec) {
-	    Close();
+	    // let the replies already processed go out first
+	    if (writing_)
+		closing_ = true;
+	    else
+		Close();
 	    return;
 	}
+	buffer_.commit(bytes);
 	ResetTimer();
-	std::string line;
-	size_t i = 0, consumed = 0;
-	auto data = buffer_.data();
-	for (auto it = asio::buffers_begin(data),
-	     end = asio::buffers_end(data);
-	     it != end;
-	     ++it) {
-	    const char c = *it;
-	    ++i;
-	    line.push_back(c);
-	    if (c == '\n') {
-		consumed = i;
-		process_line(pending_output_, nullptr, strdup(line.c_str()));
-		line.clear();
+	ProcessInput();
+
+	Flush();
+	if (closing_) {
+	    if (!writing_)
+		Close();
+	} else if (evbuffer_get_length(pending_output_) < kMaxPendingOutput) {
+	    ReadMore();
+	}
+	// else: the client reads slower than it asks, resume reading
+	// once the current write completes.
+    }
+
+    // Processes all complete requests in buffer_: text lines, or binary
+    // frames starting with BINARY_MAGIC.
+    void ProcessInput() {
+	while (!closing_ && buffer_.size() > 0) {
+	    const unsigned char *data =
+		asio::buffer_cast<const unsigned char *>(buffer_.data());
+	    size_t size = buffer_.size(), used;
+
+	    if (data[0] == BINARY_MAGIC) {
+		if (size < BINARY_HEADER_SIZE)
+		    break;
+		used = BINARY_FRAME_SIZE(data[2] << 8 | data[3]);
+		if (size < used)
+		    break;
+		if (process_binary(pending_output_, nullptr, data, used) < 0)
+		    closing_ = true;
+	    } else {
+		auto eol = static_cast<const unsigned char *>(
+		    memchr(data, '\n', size));
+		if (!eol)
+		    break;
+		used = eol - data + 1;
+		if (process_line(pending_output_, nullptr,
+				 strndup((const char *)data, used)) < 0)
+		    closing_ = true;
 	    }
+	    buffer_.consume(used);
 	}
-	buffer_.consume(consumed);
-
-	size_t total = evbuffer_get_length(pending_output_);
-	asio::const_buffers_1 output(
-	    evbuffer_pullup(pending_output_, total), total);
-	async_write(socket_, output,
-		    std::bind(&Conn::OnWriteCompleted, shared_from_this(),
-			      std::placeholders::_1, std::placeholders::_2));
+	// a request that can never complete
+	if (buffer_.size() >= kMaxRequestSize)
+	    closing_ = true;
+    }
+
+    // Starts writing pending_output_ if no write is in progress.
+    void Flush() {
+	if (writing_ || evbuffer_get_length(pending_output_) == 0)
+	    return;
+
+	// moves the chains, no copy
+	evbuffer_add_buffer(writing_output_, pending_output_);
+
+	int n = evbuffer_peek(writing_output_, -1, NULL, NULL, 0);
+	iovecs_.resize(n);
+	evbuffer_peek(writing_output_, -1, NULL, iovecs_.data(), n);
+	write_buffers_.clear();
+	write_buffers_.reserve(n);
+	for (const auto &v : iovecs_)
+	    write_buffers_.emplace_back(v.iov_base, v.iov_len);
+
+	writing_ = true;
+	asio::async_write(socket_, write_buffers_,
+			  std::bind(&Conn::OnWriteCompleted, shared_from_this(),
+				    std::placeholders::_1, std::placeholders::_2));
 	ResetTimer();
     }
 
-    void OnWriteCompleted(const error_code &ec, size_t bytes) {
-	std::lock_guard<std::mutex> lk(mutex_);
+    void OnWriteCompleted(const error_code &ec, size_t /*bytes*/) {
+	writing_ = false;
 	if (ec) {
 	    Close();
 	    return;
 	}
-	evbuffer_drain(pending_output_, evbuffer_get_length(pending_output_));
-	ReadLine();
+	evbuffer_drain(writing_output_, evbuffer_get_length(writing_output_));
+	Flush();
+	if (closing_) {
+	    if (!writing_)
+		Close();
+	    return;
+	}
+	if (!reading_ &&
+	    evbuffer_get_length(pending_output_) < kMaxPendingOutput)
+	    ReadMore();
 	ResetTimer();
     }
 
@@ -107,36 +171,73 @@ class Conn : public std::enable_shared_from_this<Conn> {
     }
 
     void OnTimeout(const error_code &ec) {
-	std::lock_guard<std::mutex> lk(mutex_);
 	if (ec != asio::error::operation_aborted) {
 	    Close();
 	}
     }
 
     void Close() {
-	socket_.close();
+	error_code ignored;
+	socket_.close(ignored);
+	timer_.cancel(ignored);
     }
 
-    std::mutex mutex_;
     tcp::socket socket_;
     asio::deadline_timer timer_;
     asio::streambuf buffer_;
     evbuffer *pending_output_;
+    evbuffer *writing_output_;
+    std::vector<evbuffer_iovec> iovecs_;
+    std::vector<asio::const_buffer> write_buffers_;
+    bool reading_ = false;
+    bool writing_ = false;
+    bool closing_ = false;
 
     static const int kTimeoutSeconds = 60;
+    static const size_t kMaxPendingOutput = 4 * 1024 * 1024;
+    static const size_t kReadSize = 64 * 1024;
+    static const size_t kMaxRequestSize = BINARY_FRAME_SIZE(65535) + 1;
 };
 
+// SO_REUSEPORT that balances connections among the listening sockets.
+#if defined(SO_REUSEPORT_LB)
+using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT_LB>;
+#define HAVE_REUSE_PORT
+#elif defined(__linux__) && defined(SO_REUSEPORT)
+using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#define HAVE_REUSE_PORT
+#endif
+
 class Server {
   public:
+    // Accepts on its own listening socket if shard is set (one Server per
+    // thread, SO_REUSEPORT), otherwise hands out the connections to the
+    // given io_services round robin.
     Server(asio::io_service &io_service,
-	   const std::string &bind, unsigned short port)
-      : acceptor_(io_service,
-		  tcp::endpoint(asio::ip::address::from_string(bind), port))
-    { StartAccept(); }
+	   std::vector<std::unique_ptr<asio::io_service>> &workers,
+	   const std::string &bind, unsigned short port, bool shard)
+      : acceptor_(io_service)
+      , workers_(workers)
+      , io_service_(io_service)
+      , shard_(shard)
+    {
+	tcp::endpoint ep(asio::ip::address::from_string(bind), port);
+	acceptor_.open(ep.protocol());
+	acceptor_.set_option(tcp::acceptor::reuse_address(true));
+#ifdef HAVE_REUSE_PORT
+	if (shard_)
+	    acceptor_.set_option(reuse_port(true));
+#endif
+	acceptor_.bind(ep);
+	acceptor_.listen();
+	StartAccept();
+    }
 
   private:
     void StartAccept() {
-	auto conn = Conn::Create(acceptor_.get_io_service());
+	asio::io_service &io = shard_ ? io_service_ :
+	    *workers_[next_worker_++ % workers_.size()];
+	auto conn = Conn::Create(io);
 	acceptor_.async_accept(conn->Socket(),
 			       std::bind(&Server::HandleAccept,
 					 this, conn, std::placeholders::_1));
@@ -144,12 +245,18 @@ class Server {
 
     void HandleAccept(Conn::Ptr conn, const error_code &ec) {
 	if (!ec) {
-	    conn->Start();
+	    // Start() on the thread owning the connection
+	    asio::post(conn->Socket().get_executor(),
+		       std::bind(&Conn::Start, conn));
 	}
 	StartAccept();
     }
 
     tcp::acceptor acceptor_;
+    std::vector<std::unique_ptr<asio::io_service>> &workers_;
+    asio::io_service &io_service_;
+    bool shard_;
+    size_t next_worker_ = 0;
 };
 
 void ServiceThread(asio::io_service &io_service) {
@@ -161,20 +268,48 @@ void ServiceThread(asio::io_service &io_service) {
     }
 }
 
-void start_server(const char *host, unsigned short port) {
-    std::cerr << "boardd: built with mulit-threading, "
-	<< NUM_THREADS << " threads." << std::endl;
+void start_server(const char *host, unsigned short port, int nthreads) {
+    if (nthreads <= 0)
+	nthreads = std::thread::hardware_concurrency();
+    if (nthreads <= 0)
+	nthreads = NUM_THREADS;
 
-    asio::io_service io_service;
-    Server server(io_service, host, port);
-    std::vector<std::future> futures;
-    futures.reserve(NUM_THREADS);
-    for (std::size_t i = 0; i < NUM_THREADS; ++i) {
-	futures.emplace_back(
-		std::async(std::launch::async,
-		           ServiceThread,std::ref(io_service)));
-    }
-    for (auto &fut : futures) {	//TODO remove the for loop after C++14 (it is redundant)
-	fut.get();
+#ifdef HAVE_REUSE_PORT
+    const bool shard = true;
+#else
+    const bool shard = false;
+#endif
+    std::cerr << "boardd: " << nthreads << " threads, "
+	<< (shard ? "SO_REUSEPORT sharded" : "single acceptor")
+	<< "." << std::endl;
+
+    std::vector<std::unique_ptr<asio::io_service>> workers;
+    std::vector<std::unique_ptr<Server>> servers;
+    for (int i = 0; i < nthreads; ++i)
+	workers.emplace_back(new asio::io_service(1));
+
+    try {
+	if (shard) {
+	    for (auto &io : workers)
+		servers.emplace_back(new Server(*io, workers, host, port, true));
+	} else {
+	    servers.emplace_back(new Server(*workers[0], workers, host, port,
+					    false));
+	}
+    } catch (std::exception &ex) {
+	std::cerr << "boardd: " << ex.what() << std::endl;
+	exit(1);
     }
+
+    // keep the workers without a listening socket running
+    std::vector<std::unique_ptr<asio::io_service::work>> works;
+    for (auto &io : workers)
+	works.emplace_back(new asio::io_service::work(*io));
+
+    std::vector<std::thread> threads;
+    threads.reserve(nthreads);
+    for (auto &io : workers)
+	threads.emplace_back(ServiceThread, std::ref(*io));
+    for (auto &t : threads)
+	t.join();
 }
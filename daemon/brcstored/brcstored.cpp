@@ -0,0 +1,540 @@
+// brcstored: Board RC (brc) storage daemon.
+//
+// Keeps the BRC of each user ("userid#firstlogin") for mbbsd with
+// USE_REMOTE_BRC, so that mbbsd on several hosts share read marks. See
+// daemons.h for the protocol; a connection is kept by mbbsd for its session.
+//
+// Everything is kept in one append-only file. A whole BRC (w) or the boards
+// changed (u) is appended as a record, and an index in memory points each
+// key to its last whole BRC and the updates after it. Reading applies the
+// updates; a key with too many updates gets a whole BRC written again. The
+// file is read to build the index at start. It is rewritten without the
+// records no longer needed when they are more than those needed, at start
+// and while running; the rewrite blocks all clients for as long as it takes
+// to copy the records needed, which happens at most once for each as many
+// bytes written.
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <errno.h>
+#include <netinet/tcp.h>
+extern "C" {
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include "bbs.h"
+#include "daemons.h"
+#include "server.h"
+}
+
+#ifndef BRCSTORED_DB_PATH
+#define BRCSTORED_DB_PATH   BBSHOME "/brcstore/brc.db"
+#endif
+
+namespace {
+
+const size_t kMaxKey = 64;
+const int32_t kMaxData = 1024 * 1024;
+// updates kept after a whole BRC before writing it again
+const size_t kMaxUpdates = 16;
+// unused bytes before the file is compacted while running
+const uint64_t kMinGarbage = 64 * 1024 * 1024;
+
+struct RecordHeader {
+    uint32_t size;      // of key and data
+    uint32_t sum;       // fnv_32_buf() of key and data
+    uint8_t type;       // BRCSTORED_REQ_WRITE or BRCSTORED_REQ_UPDATE
+    uint8_t keylen;
+    uint16_t reserved;
+};
+
+typedef std::map<brcbid_t, std::vector<brc_rec>> Boards;
+
+// Calls fn(bid, num, recs) for each board of BRCSTORED_REQ_UPDATE data.
+// Returns false if data is malformed, before calling fn for anything.
+template <typename Fn>
+bool ForEachUpdate(const char *data, size_t len, Fn fn) {
+    for (int pass = 0; pass < 2; pass++) {
+	const char *p = data, *end = data + len;
+	while (p < end) {
+	    brcbid_t bid;
+	    brcnbrd_t num;
+	    if (end - p < (ptrdiff_t)(sizeof(bid) + sizeof(num)))
+		return false;
+	    memcpy(&bid, p, sizeof(bid));
+	    memcpy(&num, p + sizeof(bid), sizeof(num));
+	    p += sizeof(bid) + sizeof(num);
+	    if ((size_t)(end - p) < num * sizeof(brc_rec))
+		return false;
+	    if (pass)
+		fn(bid, num, p);
+	    p += num * sizeof(brc_rec);
+	}
+    }
+    return true;
+}
+
+// Same checks as brc_load_v4() in mbbsd.
+bool ParseV4(const std::string &blob, Boards *boards) {
+    brc4_header h;
+    if (blob.size() < sizeof(h))
+	return false;
+    memcpy(&h, blob.data(), sizeof(h));
+    if (memcmp(h.magic, BRC4_MAGIC, sizeof(h.magic)) != 0 ||
+	h.nboards > (uint32_t)kMaxData || h.nrecs > (uint32_t)kMaxData ||
+	blob.size() != sizeof(h) + h.nboards * sizeof(brc4_dirent) +
+		       h.nrecs * sizeof(brc_rec))
+	return false;
+
+    const char *dir = blob.data() + sizeof(h);
+    const char *recs = dir + h.nboards * sizeof(brc4_dirent);
+    brc4_dirent d, prev;
+    for (uint32_t i = 0; i < h.nboards; i++) {
+	memcpy(&d, dir + i * sizeof(d), sizeof(d));
+	if ((i > 0 && d.bid <= prev.bid) || d.num == 0 || d.num > d.cap ||
+	    d.offset > h.nrecs || d.cap > h.nrecs - d.offset)
+	    return false;
+	if (boards) {
+	    std::vector<brc_rec> &v = (*boards)[d.bid];
+	    v.resize(d.num);
+	    memcpy(v.data(), recs + d.offset * sizeof(brc_rec),
+		   d.num * sizeof(brc_rec));
+	}
+	prev = d;
+    }
+    return true;
+}
+
+std::string SerializeV4(const Boards &boards) {
+    brc4_header h;
+    size_t nrecs = 0;
+    for (const auto &b : boards)
+	nrecs += b.second.size();
+    memcpy(h.magic, BRC4_MAGIC, sizeof(h.magic));
+    h.nboards = boards.size();
+    h.nrecs = nrecs;
+
+    std::string blob(sizeof(h) + h.nboards * sizeof(brc4_dirent) +
+		     h.nrecs * sizeof(brc_rec), '\0');
+    char *p = &blob[0], *recs = p + sizeof(h) + h.nboards * sizeof(brc4_dirent);
+    memcpy(p, &h, sizeof(h));
+    p += sizeof(h);
+    uint32_t offset = 0;
+    for (const auto &b : boards) {
+	brc4_dirent d;
+	d.bid = b.first;
+	d.num = d.cap = b.second.size();
+	d.offset = offset;
+	memcpy(p, &d, sizeof(d));
+	p += sizeof(d);
+	memcpy(recs + offset * sizeof(brc_rec), b.second.data(),
+	       d.num * sizeof(brc_rec));
+	offset += d.num;
+    }
+    return blob;
+}
+
+class Store {
+  public:
+    enum Result { kOk, kNotFound, kNeedWrite, kError };
+
+    bool Open(const char *path);
+
+    Result Read(const std::string &key, std::string *blob);
+    Result Write(const std::string &key, const char *data, size_t len);
+    Result Update(const std::string &key, const char *data, size_t len);
+
+  private:
+    struct Segment {
+	off_t offset;   // of the data, after the header and key
+	uint32_t len;
+    };
+    struct Entry {
+	bool v4;                        // updates can be applied
+	std::vector<Segment> segs;      // a whole BRC, then updates
+    };
+
+    bool Append(uint8_t type, const std::string &key, const char *data,
+		size_t len, Segment *seg);
+    bool ReadSegment(const Segment &seg, std::string *data);
+    bool Load();
+    bool Compact();
+    void MaybeCompact();
+    void Drop(const std::string &key, Entry *entry);
+
+    std::string path_;
+    int fd_ = -1;
+    off_t end_ = 0;
+    uint64_t live_ = 0, garbage_ = 0;   // bytes of records
+    uint64_t compact_at_ = kMinGarbage; // garbage_ to try compacting at
+    std::unordered_map<std::string, Entry> index_;
+};
+
+bool Store::Open(const char *path) {
+    path_ = path;
+    if ((fd_ = open(path, O_RDWR | O_CREAT, 0600)) < 0) {
+	perror(path);
+	return false;
+    }
+    if (!Load())
+	return false;
+    fprintf(stderr, "brcstored: %zu keys, %llu bytes, %llu unused\n",
+	    index_.size(), (unsigned long long)live_,
+	    (unsigned long long)garbage_);
+    if (garbage_ > live_ && !Compact())
+	return false;
+    return true;
+}
+
+// Builds the index from the file. A record cut short by a crash and all
+// after it are dropped.
+bool Store::Load() {
+    RecordHeader h;
+    char key[kMaxKey + 1];
+    std::string data;
+    off_t off = 0;
+
+    index_.clear();
+    live_ = garbage_ = 0;
+    while (pread(fd_, &h, sizeof(h), off) == sizeof(h)) {
+	size_t recsize = sizeof(h) + h.size;
+	if (h.keylen == 0 || h.keylen > kMaxKey || h.size < h.keylen ||
+	    h.size > kMaxData + kMaxKey ||
+	    (h.type != BRCSTORED_REQ_WRITE && h.type != BRCSTORED_REQ_UPDATE))
+	    break;
+	data.resize(h.size);
+	if (pread(fd_, &data[0], h.size, off + sizeof(h)) != (ssize_t)h.size ||
+	    fnv_32_buf(data.data(), h.size, FNV1_32_INIT) != h.sum)
+	    break;
+	memcpy(key, data.data(), h.keylen);
+	key[h.keylen] = 0;
+
+	Segment seg = { (off_t)(off + sizeof(h) + h.keylen), h.size - h.keylen };
+	auto it = index_.find(key);
+	if (h.type == BRCSTORED_REQ_WRITE) {
+	    if (it == index_.end())
+		it = index_.insert(std::make_pair(key, Entry())).first;
+	    Drop(it->first, &it->second);
+	    it->second.v4 = ParseV4(data.substr(h.keylen), NULL);
+	} else if (it == index_.end() || !it->second.v4) {
+	    // cannot happen unless the file is broken
+	    garbage_ += recsize;
+	    off += recsize;
+	    continue;
+	}
+	it->second.segs.push_back(seg);
+	live_ += recsize;
+	off += recsize;
+    }
+
+    end_ = lseek(fd_, 0, SEEK_END);
+    if (off < end_) {
+	fprintf(stderr, "brcstored: dropped broken records after %lld\n",
+		(long long)off);
+	if (ftruncate(fd_, off) < 0) {
+	    perror("ftruncate");
+	    return false;
+	}
+	end_ = off;
+    }
+    return true;
+}
+
+// Rewrites the file with only the records in the index.
+bool Store::Compact() {
+    std::string tmp = path_ + ".tmp", data;
+    Store fresh;
+
+    unlink(tmp.c_str());
+    fresh.path_ = tmp;
+    if ((fresh.fd_ = open(tmp.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+	perror(tmp.c_str());
+	return false;
+    }
+    for (const auto &kv : index_) {
+	Entry &e = fresh.index_[kv.first];
+	e.v4 = kv.second.v4;
+	for (size_t i = 0; i < kv.second.segs.size(); i++) {
+	    Segment seg;
+	    if (!ReadSegment(kv.second.segs[i], &data) ||
+		!fresh.Append(i ? BRCSTORED_REQ_UPDATE : BRCSTORED_REQ_WRITE,
+			      kv.first, data.data(), data.size(), &seg)) {
+		close(fresh.fd_);
+		unlink(tmp.c_str());
+		return false;
+	    }
+	    e.segs.push_back(seg);
+	}
+    }
+    if (fsync(fresh.fd_) < 0 || rename(tmp.c_str(), path_.c_str()) < 0) {
+	perror(tmp.c_str());
+	close(fresh.fd_);
+	unlink(tmp.c_str());
+	return false;
+    }
+
+    fprintf(stderr, "brcstored: compacted %llu bytes to %llu\n",
+	    (unsigned long long)(live_ + garbage_),
+	    (unsigned long long)fresh.live_);
+    close(fd_);
+    fd_ = fresh.fd_;
+    end_ = fresh.end_;
+    live_ = fresh.live_;
+    garbage_ = 0;
+    index_.swap(fresh.index_);
+    fresh.fd_ = -1;
+    return true;
+}
+
+// Compacts when most of the file is unused. Called when no reference into
+// index_ is held, as compacting replaces it.
+void Store::MaybeCompact() {
+    if (garbage_ <= live_ || garbage_ < compact_at_)
+	return;
+    if (!Compact()) {
+	// the file is still good; try again when it has grown some more
+	fprintf(stderr, "brcstored: compaction failed, going on\n");
+	compact_at_ = garbage_ * 2;
+	return;
+    }
+    compact_at_ = kMinGarbage;
+}
+
+bool Store::Append(uint8_t type, const std::string &key, const char *data,
+		   size_t len, Segment *seg) {
+    RecordHeader h;
+    std::string rec(sizeof(h) + key.size() + len, '\0');
+
+    memset(&h, 0, sizeof(h));
+    h.type = type;
+    h.keylen = key.size();
+    h.size = key.size() + len;
+    memcpy(&rec[sizeof(h)], key.data(), key.size());
+    memcpy(&rec[sizeof(h) + key.size()], data, len);
+    h.sum = fnv_32_buf(rec.data() + sizeof(h), h.size, FNV1_32_INIT);
+    memcpy(&rec[0], &h, sizeof(h));
+
+    if (pwrite(fd_, rec.data(), rec.size(), end_) != (ssize_t)rec.size()) {
+	perror("brcstored: pwrite");
+	// a partial record is dropped at next start; don't append after it
+	if (ftruncate(fd_, end_) < 0)
+	    perror("brcstored: ftruncate");
+	return false;
+    }
+    seg->offset = end_ + sizeof(h) + key.size();
+    seg->len = len;
+    end_ += rec.size();
+    live_ += rec.size();
+    return true;
+}
+
+bool Store::ReadSegment(const Segment &seg, std::string *data) {
+    data->resize(seg.len);
+    return pread(fd_, &(*data)[0], seg.len, seg.offset) == (ssize_t)seg.len;
+}
+
+// Counts the records of entry as garbage and clears it.
+void Store::Drop(const std::string &key, Entry *entry) {
+    for (const Segment &seg : entry->segs) {
+	uint64_t size = sizeof(RecordHeader) + key.size() + seg.len;
+	live_ -= size;
+	garbage_ += size;
+    }
+    entry->segs.clear();
+}
+
+Store::Result Store::Read(const std::string &key, std::string *blob) {
+    auto it = index_.find(key);
+    if (it == index_.end() || it->second.segs.empty())
+	return kNotFound;
+
+    const Entry &e = it->second;
+    if (!ReadSegment(e.segs[0], blob))
+	return kError;
+    if (e.segs.size() == 1)
+	return kOk;
+
+    Boards boards;
+    std::string data;
+    if (!ParseV4(*blob, &boards))
+	return kError;
+    for (size_t i = 1; i < e.segs.size(); i++) {
+	if (!ReadSegment(e.segs[i], &data))
+	    return kError;
+	ForEachUpdate(data.data(), data.size(),
+		      [&](brcbid_t bid, brcnbrd_t num, const char *recs) {
+	    if (!num) {
+		boards.erase(bid);
+		return;
+	    }
+	    std::vector<brc_rec> &v = boards[bid];
+	    v.resize(num);
+	    memcpy(v.data(), recs, num * sizeof(brc_rec));
+	});
+    }
+    *blob = SerializeV4(boards);
+    return kOk;
+}
+
+Store::Result Store::Write(const std::string &key, const char *data,
+			   size_t len) {
+    Segment seg;
+    if (!Append(BRCSTORED_REQ_WRITE, key, data, len, &seg))
+	return kError;
+
+    Entry &e = index_[key];
+    Drop(key, &e);
+    e.v4 = ParseV4(std::string(data, len), NULL);
+    e.segs.push_back(seg);
+    MaybeCompact();
+    return kOk;
+}
+
+Store::Result Store::Update(const std::string &key, const char *data,
+			    size_t len) {
+    auto it = index_.find(key);
+    if (it == index_.end() || it->second.segs.empty() || !it->second.v4)
+	return kNeedWrite;
+    if (!ForEachUpdate(data, len, [](brcbid_t, brcnbrd_t, const char *) {}))
+	return kError;
+
+    Segment seg;
+    if (!Append(BRCSTORED_REQ_UPDATE, key, data, len, &seg))
+	return kError;
+    it->second.segs.push_back(seg);
+    if (it->second.segs.size() <= kMaxUpdates) {
+	MaybeCompact();
+	return kOk;
+    }
+
+    // too many updates to apply at each read; write the result instead.
+    std::string blob;
+    if (Read(key, &blob) != kOk)
+	return kError;
+    return Write(key, blob.data(), blob.size());
+}
+
+Store g_store;
+
+// A request being received: the line, then for w and u the length and data.
+struct Conn {
+    char cmd = 0;
+    std::string key;
+    int32_t len = -1;
+};
+
+void Reply(struct bufferevent *bev, char c) {
+    bufferevent_write(bev, &c, sizeof(c));
+}
+
+// Returns false if the connection should be closed.
+bool ProcessRequest(struct bufferevent *bev, Conn *conn) {
+    struct evbuffer *input = bufferevent_get_input(bev);
+
+    if (!conn->cmd) {
+	size_t n;
+	char *line = evbuffer_readln(input, &n, EVBUFFER_EOL_LF);
+	if (!line)
+	    return evbuffer_get_length(input) <= kMaxKey + 1;
+	conn->cmd = line[0];
+	conn->key.assign(n ? line + 1 : line, n ? n - 1 : 0);
+	free(line);
+	if (conn->key.empty() || conn->key.size() > kMaxKey)
+	    return false;
+    }
+
+    switch (conn->cmd) {
+	case BRCSTORED_REQ_READ: {
+	    std::string blob;
+	    int32_t len = -1;
+	    Store::Result r = g_store.Read(conn->key, &blob);
+	    if (r == Store::kError)
+		return false;
+	    if (r == Store::kOk)
+		len = blob.size();
+	    bufferevent_write(bev, &len, sizeof(len));
+	    if (len > 0)
+		bufferevent_write(bev, blob.data(), blob.size());
+	    break;
+	}
+
+	case BRCSTORED_REQ_WRITE:
+	case BRCSTORED_REQ_UPDATE: {
+	    if (conn->len < 0) {
+		if (evbuffer_get_length(input) < sizeof(conn->len))
+		    return true;
+		evbuffer_remove(input, &conn->len, sizeof(conn->len));
+		if (conn->len < 0 || conn->len > kMaxData)
+		    return false;
+	    }
+	    if (evbuffer_get_length(input) < (size_t)conn->len)
+		return true;
+
+	    const char *data = (const char *)evbuffer_pullup(input, conn->len);
+	    Store::Result r = conn->cmd == BRCSTORED_REQ_WRITE ?
+		g_store.Write(conn->key, data, conn->len) :
+		g_store.Update(conn->key, data, conn->len);
+	    evbuffer_drain(input, conn->len);
+	    if (r == Store::kError)
+		return false;
+	    Reply(bev, r == Store::kOk ? BRCSTORED_OK : BRCSTORED_NEED_WRITE);
+	    break;
+	}
+
+	default:
+	    return false;
+    }
+
+    *conn = Conn();
+    return true;
+}
+
+}  // namespace
+
+void
+client_read_cb(struct bufferevent *bev, void *ctx)
+{
+    Conn *conn = (Conn *)ctx;
+    struct evbuffer *input = bufferevent_get_input(bev);
+    size_t before;
+
+    do {
+	before = evbuffer_get_length(input);
+	if (!ProcessRequest(bev, conn)) {
+	    delete conn;
+	    bufferevent_free(bev);
+	    return;
+	}
+    } while (evbuffer_get_length(input) && evbuffer_get_length(input) < before);
+}
+
+void
+client_event_cb(struct bufferevent *bev, short events, void *ctx)
+{
+    if (events & (BEV_EVENT_EOF | BEV_EVENT_TIMEOUT | BEV_EVENT_ERROR)) {
+	delete (Conn *)ctx;
+	bufferevent_free(bev);
+    }
+}
+
+void
+setup_client(struct event_base *base, evutil_socket_t fd,
+	struct sockaddr *address GCC_UNUSED, int socklen GCC_UNUSED)
+{
+    int on = 1;
+    // replies are small or end with a small segment; don't wait for ACKs
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    struct bufferevent *bev = bufferevent_socket_new(base, fd,
+	    BEV_OPT_CLOSE_ON_FREE);
+    bufferevent_setcb(bev, client_read_cb, NULL, client_event_cb, new Conn());
+    bufferevent_set_timeouts(bev, common_timeout, common_timeout);
+    bufferevent_enable(bev, EV_READ|EV_WRITE);
+}
+
+void
+setup_program()
+{
+    if (!g_store.Open(BRCSTORED_DB_PATH))
+	exit(EXIT_FAILURE);
+}
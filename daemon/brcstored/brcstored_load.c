@@ -0,0 +1,223 @@
+// $Id$
+#include "bbs.h"
+#include "daemons.h"
+#include <sys/time.h>
+
+// Load and consistency test for brcstored: keeps a connection for each of
+// many users like mbbsd sessions do, writes a whole BRC for each, then sends
+// rounds of changed boards and reads the BRC back now and then, which must
+// be what the changes make of it. Keys are made up ("brcload<n>#<pid>") and
+// stay in the store.
+
+#define NBOARDS     (400)   // bids 1 .. NBOARDS
+#define MAXNUM      (80)
+
+typedef struct {
+    int     fd;
+    char    key[32];
+    int     num[NBOARDS + 1];
+    brc_rec recs[NBOARDS + 1][MAXNUM];
+} user_t;
+
+static double
+now_sec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// the v4 BRC brcstored should have: slots exactly num records, by bid
+static int
+serialize(const user_t *u, char *buf)
+{
+    brc4_header h;
+    brc4_dirent d;
+    char *p = buf + sizeof(h), *recs;
+    int bid;
+
+    memcpy(h.magic, BRC4_MAGIC, sizeof(h.magic));
+    h.nboards = h.nrecs = 0;
+    for (bid = 1; bid <= NBOARDS; bid++)
+	if (u->num[bid]) {
+	    h.nboards++;
+	    h.nrecs += u->num[bid];
+	}
+    memcpy(buf, &h, sizeof(h));
+    recs = p + h.nboards * sizeof(d);
+    d.offset = 0;
+    for (bid = 1; bid <= NBOARDS; bid++) {
+	if (!u->num[bid])
+	    continue;
+	d.bid = bid;
+	d.num = d.cap = u->num[bid];
+	memcpy(p, &d, sizeof(d));
+	p += sizeof(d);
+	memcpy(recs + d.offset * sizeof(brc_rec), u->recs[bid],
+	       d.num * sizeof(brc_rec));
+	d.offset += d.num;
+    }
+    return recs + h.nrecs * sizeof(brc_rec) - buf;
+}
+
+static void
+random_board(user_t *u, int bid)
+{
+    int i, num = random() % 5 ? 1 + random() % MAXNUM : 0;
+    time4_t t = 1400000000 + random() % 100000000;
+
+    u->num[bid] = num;
+    for (i = 0; i < num; i++) {
+	u->recs[bid][i].create = t - i * 3600;
+	u->recs[bid][i].modified = t - i * 3600 + random() % 60;
+    }
+}
+
+static int
+request(user_t *u, char cmd, const void *data, int32_t len,
+	void *reply, int rlen)
+{
+    static char req[64 + sizeof(len) + sizeof(((user_t *)0)->recs)];
+    int size = snprintf(req, 64, "%c%s\n", cmd, u->key);
+
+    // in one write like mbbsd does, or each waits for a delayed ACK
+    if (data) {
+	memcpy(req + size, &len, sizeof(len));
+	memcpy(req + size + sizeof(len), data, len);
+	size += sizeof(len) + len;
+    }
+    if (towrite(u->fd, req, size) < 0 || toread(u->fd, reply, rlen) < 0)
+	return -1;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int nusers = 100, rounds = 50, nchange = 3, ch, i, r, k;
+    int errors = 0, nreq = 0, nlat = 0;
+    size_t sent_update = 0, sent_whole = 0;
+    static char buf[NBOARDS * (sizeof(brc4_dirent) + MAXNUM * sizeof(brc_rec)) +
+		    sizeof(brc4_header)], got[sizeof(buf)];
+    const char *addr = BRCSTORED_ADDR;
+    double start, t, *lat;
+    user_t *users;
+    int32_t len;
+    char reply;
+
+    while ((ch = getopt(argc, argv, "n:r:c:")) != -1) {
+	switch (ch) {
+	    case 'n': nusers = atoi(optarg); break;
+	    case 'r': rounds = atoi(optarg); break;
+	    case 'c': nchange = atoi(optarg); break;
+	    default: nusers = 0; break;
+	}
+    }
+    if (optind < argc)
+	addr = argv[optind];
+    if (nusers <= 0 || rounds <= 0 || nchange <= 0 || nchange > NBOARDS) {
+	fprintf(stderr, "Usage: %s [-n users] [-r rounds] [-c boards_changed] "
+		"[host:port]\n", argv[0]);
+	return 1;
+    }
+
+    Signal(SIGPIPE, SIG_IGN);
+    srandom(getpid());
+    users = calloc(nusers, sizeof(user_t));
+    lat = calloc((size_t)nusers * rounds * 2, sizeof(double));
+
+    start = now_sec();
+    for (i = 0; i < nusers; i++) {
+	user_t *u = &users[i];
+	snprintf(u->key, sizeof(u->key), "brcload%d#%d", i, (int)getpid());
+	if ((u->fd = toconnectex(addr, 5)) < 0) {
+	    fprintf(stderr, "cannot connect to %s\n", addr);
+	    return 1;
+	}
+	// an unknown key cannot be updated
+	if (request(u, BRCSTORED_REQ_UPDATE, "", 0, &reply, 1) < 0 ||
+	    reply != BRCSTORED_NEED_WRITE) {
+	    fprintf(stderr, "%s: update of unknown key accepted\n", u->key);
+	    errors++;
+	}
+	for (k = 1; k <= NBOARDS; k++)
+	    if (random() % 4 == 0)
+		random_board(u, k);
+	len = serialize(u, buf);
+	if (request(u, BRCSTORED_REQ_WRITE, buf, len, &reply, 1) < 0 ||
+	    reply != BRCSTORED_OK) {
+	    fprintf(stderr, "%s: write failed\n", u->key);
+	    return 1;
+	}
+	nreq += 2;
+    }
+
+    for (r = 0; r < rounds; r++) {
+	for (i = 0; i < nusers; i++) {
+	    user_t *u = &users[i];
+	    char *p = buf;
+
+	    for (k = 0; k < nchange; k++) {
+		brcbid_t bid = 1 + random() % NBOARDS;
+		brcnbrd_t num;
+		random_board(u, bid);
+		num = u->num[bid];
+		memcpy(p, &bid, sizeof(bid));
+		p += sizeof(bid);
+		memcpy(p, &num, sizeof(num));
+		p += sizeof(num);
+		memcpy(p, u->recs[bid], num * sizeof(brc_rec));
+		p += num * sizeof(brc_rec);
+	    }
+	    sent_update += p - buf;
+	    sent_whole += serialize(u, got);
+
+	    t = now_sec();
+	    if (request(u, BRCSTORED_REQ_UPDATE, buf, p - buf, &reply, 1) < 0 ||
+		reply != BRCSTORED_OK) {
+		fprintf(stderr, "%s: update failed\n", u->key);
+		return 1;
+	    }
+	    lat[nlat++] = now_sec() - t;
+	    nreq++;
+
+	    if (r % 10 != 9 && r != rounds - 1)
+		continue;
+	    len = serialize(u, buf);
+	    t = now_sec();
+	    if (request(u, BRCSTORED_REQ_READ, NULL, 0, &k, sizeof(k)) < 0 ||
+		(k > 0 && (k > (int)sizeof(got) || toread(u->fd, got, k) < 0))) {
+		fprintf(stderr, "%s: read failed\n", u->key);
+		return 1;
+	    }
+	    lat[nlat++] = now_sec() - t;
+	    nreq++;
+	    if (k != len || memcmp(buf, got, len) != 0) {
+		fprintf(stderr, "%s: round %d: read %d bytes, expected %d\n",
+			u->key, r, k, len);
+		errors++;
+	    }
+	}
+    }
+    t = now_sec() - start;
+
+    printf("%d users x %d rounds: %d requests in %.2fs, %.0f req/s\n",
+	   nusers, rounds, nreq, t, nreq / t);
+    printf("sent %zu bytes of changed boards instead of %zu of whole BRC\n",
+	   sent_update, sent_whole);
+    if (nlat) {
+	qsort(lat, nlat, sizeof(double), cmp_double);
+	printf("latency p50 %.2fms p99 %.2fms max %.2fms\n",
+	       lat[nlat / 2] * 1e3, lat[nlat * 99 / 100] * 1e3,
+	       lat[nlat - 1] * 1e3);
+    }
+    if (errors)
+	printf("%d errors\n", errors);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,264 @@
+// commentd: comments daemon.
+//
+// Keeps the comments of posts for mbbsd with USE_COMMENTD; see daemons.h for
+// the protocol, which is that of commentd.py with QUERY_RANGE added.
+//
+// Comments are appended to the segment file of the board (segstore.h), and
+// an index in memory has the offsets of the comments of each file, so that
+// a range of them is read by one pread() for each run of comments next to
+// each other in the file. Deleting appends a record with the number of the
+// comment deleted.
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <netinet/tcp.h>
+extern "C" {
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include "bbs.h"
+#include "daemons.h"
+#include "server.h"
+}
+#include "segstore.h"
+
+#ifndef COMMENTD_DB_PATH
+#define COMMENTD_DB_PATH    BBSHOME "/commentd"
+#endif
+
+namespace {
+
+enum {
+    kRecComment = 'c',      // CommentBodyReq
+    kRecDelete = 'd',       // uint32_t number of the comment deleted
+};
+
+const uint32_t kTypeDeleted = 0x80000000;
+const uint64_t kOffsetDeleted = 1ULL << 63;
+
+// offsets of the comments of each file of each board, | kOffsetDeleted
+typedef std::vector<uint64_t> Comments;
+std::unordered_map<std::string,
+		   std::unordered_map<std::string, Comments>> g_index;
+SegmentStore g_store;
+
+void LoadRecord(const std::string &board, const SegmentStore::Record &r) {
+    Comments &c = g_index[board][r.key];
+    if (r.type == kRecComment && r.len == sizeof(CommentBodyReq)) {
+	c.push_back(r.offset);
+    } else if (r.type == kRecDelete && r.len == sizeof(uint32_t)) {
+	uint32_t i;
+	memcpy(&i, r.data, sizeof(i));
+	if (i < c.size())
+	    c[i] |= kOffsetDeleted;
+    }
+}
+
+// Returns the comments of key, or NULL if there are none.
+Comments *Find(const CommentKeyReq &key) {
+    auto b = g_index.find(key.board);
+    if (b == g_index.end())
+	return NULL;
+    auto f = b->second.find(key.file);
+    return f == b->second.end() ? NULL : &f->second;
+}
+
+// Reads n comments of key from start, all of which exist.
+bool ReadComments(const CommentKeyReq &key, const Comments &c, uint32_t start,
+		  uint32_t n, CommentBodyReq *out) {
+    const size_t stride = SegmentStore::RecordSize(strlen(key.file),
+						   sizeof(CommentBodyReq));
+    std::vector<char> buf;
+    uint32_t i = start, end = start + n;
+
+    while (i < end) {
+	uint64_t first = c[i] & ~kOffsetDeleted;
+	uint32_t j = i + 1;
+	while (j < end && (c[j] & ~kOffsetDeleted) == first + (j - i) * stride)
+	    j++;
+
+	size_t len = (j - i - 1) * stride + sizeof(CommentBodyReq);
+	buf.resize(len);
+	if (!g_store.Read(key.board, first, len, buf.data()))
+	    return false;
+	for (uint32_t k = i; k < j; k++, out++) {
+	    memcpy(out, buf.data() + (k - i) * stride, sizeof(*out));
+	    if (c[k] & kOffsetDeleted)
+		out->type = (int32_t)((uint32_t)out->type | kTypeDeleted);
+	}
+	i = j;
+    }
+    return true;
+}
+
+bool ValidKey(CommentKeyReq *key) {
+    key->board[sizeof(key->board) - 1] = 0;
+    key->file[sizeof(key->file) - 1] = 0;
+    return SegmentStore::ValidBoard(key->board) && key->file[0] &&
+	!strchr(key->file, '/');
+}
+
+size_t RequestSize(short operation) {
+    switch (operation) {
+	case COMMENTD_REQ_ADD:
+	    return sizeof(CommentAddRequest);
+	case COMMENTD_REQ_QUERY_COUNT:
+	case COMMENTD_REQ_QUERY_BODY:
+	case COMMENTD_REQ_MARK_DELETED:
+	    return sizeof(CommentQueryRequest);
+	case COMMENTD_REQ_QUERY_RANGE:
+	    return sizeof(CommentRangeRequest);
+    }
+    return 0;
+}
+
+// Returns false if the connection should be closed.
+bool ProcessRequest(struct bufferevent *bev) {
+    struct evbuffer *input = bufferevent_get_input(bev);
+    union {
+	struct {
+	    short cb;
+	    short operation;
+	} h;
+	CommentAddRequest add;
+	CommentQueryRequest query;
+	CommentRangeRequest range;
+    } req;
+
+    if (evbuffer_get_length(input) < sizeof(req.h))
+	return true;
+    evbuffer_copyout(input, &req.h, sizeof(req.h));
+    size_t size = RequestSize(req.h.operation);
+    if (!size || req.h.cb != (short)size)
+	return false;
+    if (evbuffer_get_length(input) < size)
+	return true;
+    evbuffer_remove(input, &req, size);
+
+    switch (req.h.operation) {
+	case COMMENTD_REQ_ADD: {
+	    uint64_t offset;
+	    if (!ValidKey(&req.add.key))
+		return false;
+	    // kept as sent; the strings are padded with zeros by mbbsd
+	    req.add.comment.userid[IDLEN] = 0;
+	    req.add.comment.msg[COMMENTLEN] = 0;
+	    if (!g_store.Append(req.add.key.board, kRecComment,
+				req.add.key.file, &req.add.comment,
+				sizeof(req.add.comment), &offset))
+		return false;
+	    g_index[req.add.key.board][req.add.key.file].push_back(offset);
+	    break;
+	}
+
+	case COMMENTD_REQ_QUERY_COUNT: {
+	    if (!ValidKey(&req.query.key))
+		return false;
+	    const Comments *c = Find(req.query.key);
+	    uint32_t num = c ? c->size() : 0;
+	    bufferevent_write(bev, &num, sizeof(num));
+	    break;
+	}
+
+	case COMMENTD_REQ_QUERY_BODY: {
+	    CommentBodyReq body;
+	    uint16_t size = 0;
+	    if (!ValidKey(&req.query.key))
+		return false;
+	    const Comments *c = Find(req.query.key);
+	    if (c && req.query.start < c->size()) {
+		if (!ReadComments(req.query.key, *c, req.query.start, 1, &body))
+		    return false;
+		size = sizeof(body);
+	    }
+	    bufferevent_write(bev, &size, sizeof(size));
+	    if (size)
+		bufferevent_write(bev, &body, sizeof(body));
+	    break;
+	}
+
+	case COMMENTD_REQ_QUERY_RANGE: {
+	    std::vector<CommentBodyReq> bodies;
+	    uint32_t n = 0;
+	    if (!ValidKey(&req.range.key))
+		return false;
+	    const Comments *c = Find(req.range.key);
+	    if (c && req.range.start < c->size()) {
+		n = std::min<uint32_t>(c->size() - req.range.start,
+				       req.range.count);
+		n = std::min<uint32_t>(n, COMMENTD_MAX_RANGE);
+		bodies.resize(n);
+		if (n && !ReadComments(req.range.key, *c, req.range.start, n,
+				       bodies.data()))
+		    return false;
+	    }
+	    bufferevent_write(bev, &n, sizeof(n));
+	    if (n)
+		bufferevent_write(bev, bodies.data(), n * sizeof(bodies[0]));
+	    break;
+	}
+
+	case COMMENTD_REQ_MARK_DELETED: {
+	    int32_t result = 0;
+	    uint64_t offset;
+	    if (!ValidKey(&req.query.key))
+		return false;
+	    Comments *c = Find(req.query.key);
+	    uint32_t i = req.query.start;
+	    if (!c || i >= c->size())
+		result = -1;
+	    else if ((*c)[i] & kOffsetDeleted)
+		result = -2;
+	    else if (!g_store.Append(req.query.key.board, kRecDelete,
+				     req.query.key.file, &i, sizeof(i),
+				     &offset))
+		return false;
+	    else
+		(*c)[i] |= kOffsetDeleted;
+	    bufferevent_write(bev, &result, sizeof(result));
+	    break;
+	}
+    }
+    return true;
+}
+
+}  // namespace
+
+void
+client_read_cb(struct bufferevent *bev, void *ctx GCC_UNUSED)
+{
+    struct evbuffer *input = bufferevent_get_input(bev);
+    size_t before;
+    bool ok;
+
+    do {
+	before = evbuffer_get_length(input);
+	ok = ProcessRequest(bev);
+    } while (ok && evbuffer_get_length(input) &&
+	     evbuffer_get_length(input) < before);
+
+    // all that came in is written before anything more is read
+    g_store.Flush();
+    if (!ok)
+	bufferevent_free(bev);
+}
+
+void
+setup_client(struct event_base *base, evutil_socket_t fd,
+	struct sockaddr *address GCC_UNUSED, int socklen GCC_UNUSED)
+{
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    struct bufferevent *bev = bufferevent_socket_new(base, fd,
+	    BEV_OPT_CLOSE_ON_FREE);
+    bufferevent_setcb(bev, client_read_cb, NULL, client_event_cb, NULL);
+    bufferevent_set_timeouts(bev, common_timeout, common_timeout);
+    bufferevent_enable(bev, EV_READ|EV_WRITE);
+}
+
+void
+setup_program()
+{
+    if (!g_store.Open("commentd", COMMENTD_DB_PATH, LoadRecord))
+	exit(EXIT_FAILURE);
+}
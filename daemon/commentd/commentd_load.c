@@ -0,0 +1,218 @@
+// $Id$
+#include "bbs.h"
+#include "daemons.h"
+#include <sys/time.h>
+
+// Load and consistency test for commentd: adds comments to some files of a
+// board on one connection, interleaved so that the comments of a file are
+// not next to each other in the store, deletes some and reads each file back
+// both one comment per connection (as mbbsd did) and by QUERY_RANGE, which
+// must give what was added. Files are made up ("M.<pid>.A.<n>") and stay in
+// the store.
+
+static double
+now_sec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+make_key(CommentKeyReq *key, const char *board, int f)
+{
+    memset(key, 0, sizeof(*key));
+    strlcpy(key->board, board, sizeof(key->board));
+    snprintf(key->file, sizeof(key->file), "M.%d.A.%03d", (int)getpid(), f);
+}
+
+static void
+make_comment(CommentBodyReq *c, int f, int i)
+{
+    memset(c, 0, sizeof(*c));
+    c->time = 1400000000 + i;
+    c->ipv4 = 0x0100007f;
+    c->userref = f;
+    c->type = i % 3;
+    snprintf(c->userid, sizeof(c->userid), "load%d", i % 97);
+    snprintf(c->msg, sizeof(c->msg), "comment %d of file %d", i, f);
+}
+
+// one request on a new connection, as mbbsd sends them
+static int
+request(const char *addr, const void *req, int size, void *reply, int rlen)
+{
+    int s = toconnectex(addr, 5);
+    if (s < 0)
+	return -1;
+    if (towrite(s, req, size) < 0 || (rlen && toread(s, reply, rlen) < 0)) {
+	close(s);
+	return -1;
+    }
+    close(s);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int nfiles = 4, ncomments = 3000, ch, f, i, s, errors = 0;
+    const char *addr = COMMENTD_ADDR, *board = "cmload";
+    double t, t_add = 0, t_body = 0, t_range = 0;
+    CommentBodyReq *got, want;
+    CommentAddRequest add;
+    CommentQueryRequest query;
+    CommentRangeRequest range;
+    uint32_t num;
+    uint16_t size;
+    int32_t result;
+
+    while ((ch = getopt(argc, argv, "f:n:b:")) != -1) {
+	switch (ch) {
+	    case 'f': nfiles = atoi(optarg); break;
+	    case 'n': ncomments = atoi(optarg); break;
+	    case 'b': board = optarg; break;
+	    default: nfiles = 0; break;
+	}
+    }
+    if (optind < argc)
+	addr = argv[optind];
+    if (nfiles <= 0 || ncomments <= 0 || nfiles > 999) {
+	fprintf(stderr, "Usage: %s [-f files] [-n comments_per_file] "
+		"[-b board] [host:port]\n", argv[0]);
+	return 1;
+    }
+
+    Signal(SIGPIPE, SIG_IGN);
+    got = calloc(ncomments, sizeof(*got));
+
+    memset(&add, 0, sizeof(add));
+    add.cb = sizeof(add);
+    add.operation = COMMENTD_REQ_ADD;
+    t = now_sec();
+    if ((s = toconnectex(addr, 5)) < 0) {
+	fprintf(stderr, "cannot connect to %s\n", addr);
+	return 1;
+    }
+    for (i = 0; i < ncomments; i++)
+	for (f = 0; f < nfiles; f++) {
+	    make_key(&add.key, board, f);
+	    make_comment(&add.comment, f, i);
+	    if (towrite(s, &add, sizeof(add)) < 0) {
+		fprintf(stderr, "cannot add to %s\n", addr);
+		return 1;
+	    }
+	}
+    // a query after the adds returns when they are done
+    memset(&query, 0, sizeof(query));
+    query.cb = sizeof(query);
+    query.operation = COMMENTD_REQ_QUERY_COUNT;
+    make_key(&query.key, board, 0);
+    if (towrite(s, &query, sizeof(query)) < 0 ||
+	toread(s, &num, sizeof(num)) < 0) {
+	fprintf(stderr, "cannot add to %s\n", addr);
+	return 1;
+    }
+    close(s);
+    t_add = now_sec() - t;
+
+    for (f = 0; f < nfiles; f++) {
+	make_key(&query.key, board, f);
+	query.operation = COMMENTD_REQ_MARK_DELETED;
+	for (i = f % 7; i < ncomments; i += 7) {
+	    query.start = i;
+	    if (request(addr, &query, sizeof(query), &result,
+			sizeof(result)) < 0 || result != 0) {
+		fprintf(stderr, "%s: cannot delete %d\n", query.key.file, i);
+		errors++;
+	    }
+	}
+	query.start = f % 7;
+	if (request(addr, &query, sizeof(query), &result, sizeof(result)) < 0 ||
+	    result != -2) {
+	    fprintf(stderr, "%s: deleted %d twice\n", query.key.file, f % 7);
+	    errors++;
+	}
+	query.start = ncomments;
+	if (request(addr, &query, sizeof(query), &result, sizeof(result)) < 0 ||
+	    result != -1) {
+	    fprintf(stderr, "%s: deleted one past the end\n", query.key.file);
+	    errors++;
+	}
+
+	query.operation = COMMENTD_REQ_QUERY_COUNT;
+	query.start = 0;
+	if (request(addr, &query, sizeof(query), &num, sizeof(num)) < 0 ||
+	    num != (uint32_t)ncomments) {
+	    fprintf(stderr, "%s: count %u, expected %d\n", query.key.file, num,
+		    ncomments);
+	    errors++;
+	}
+    }
+
+    for (f = 0; f < nfiles; f++) {
+	// one comment per connection
+	make_key(&query.key, board, f);
+	query.operation = COMMENTD_REQ_QUERY_BODY;
+	t = now_sec();
+	for (i = 0; i <= ncomments; i++) {
+	    query.start = i;
+	    if ((s = toconnectex(addr, 5)) < 0 ||
+		towrite(s, &query, sizeof(query)) < 0 ||
+		toread(s, &size, sizeof(size)) < 0 ||
+		(size && (size != sizeof(*got) || i == ncomments ||
+			  toread(s, &got[i], sizeof(*got)) < 0))) {
+		fprintf(stderr, "%s: query %d failed\n", query.key.file, i);
+		return 1;
+	    }
+	    close(s);
+	    if (!size)
+		break;
+	}
+	t_body += now_sec() - t;
+	if (i != ncomments) {
+	    fprintf(stderr, "%s: %d comments by QUERY_BODY, expected %d\n",
+		    query.key.file, i, ncomments);
+	    errors++;
+	}
+
+	// all in one round trip
+	memset(&range, 0, sizeof(range));
+	range.cb = sizeof(range);
+	range.operation = COMMENTD_REQ_QUERY_RANGE;
+	range.key = query.key;
+	range.count = ncomments;
+	t = now_sec();
+	memset(got, 0, ncomments * sizeof(*got));
+	for (num = 0; (int)range.start < ncomments; range.start += num) {
+	    if ((s = toconnectex(addr, 5)) < 0 ||
+		towrite(s, &range, sizeof(range)) < 0 ||
+		toread(s, &num, sizeof(num)) < 0 || !num ||
+		(int)(range.start + num) > ncomments ||
+		toread(s, &got[range.start], num * sizeof(*got)) < 0) {
+		fprintf(stderr, "%s: range query failed\n", range.key.file);
+		return 1;
+	    }
+	    close(s);
+	}
+	t_range += now_sec() - t;
+
+	for (i = 0; i < ncomments; i++) {
+	    make_comment(&want, f, i);
+	    if (i % 7 == f % 7)
+		want.type |= 0x80000000;
+	    if (memcmp(&want, &got[i], sizeof(want)) != 0) {
+		fprintf(stderr, "%s: comment %d differs\n", query.key.file, i);
+		errors++;
+		break;
+	    }
+	}
+    }
+
+    printf("%d files x %d comments: added %.0f/s\n", nfiles, ncomments,
+	   nfiles * ncomments / t_add);
+    printf("read a file by QUERY_BODY in %.1fms, by QUERY_RANGE in %.2fms\n",
+	   t_body * 1e3 / nfiles, t_range * 1e3 / nfiles);
+    if (errors)
+	printf("%d errors\n", errors);
+    return errors ? 1 : 0;
+}
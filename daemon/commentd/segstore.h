@@ -0,0 +1,296 @@
+// Append-only segment files for commentd and postd.
+//
+// Each board has a file <dir>/<board>.seg of records, a header and then the
+// key (the file name of the post) and data. The daemon keeps its own index
+// in memory of where the data of each key is: Open() calls a function for
+// each record to build it, and Append() returns where the data went.
+//
+// Appends are buffered and written when Flush() is called, or when a board
+// has kMaxPending bytes waiting, so that a stream of many records takes a
+// few large writes. Reads see what is buffered too. A record cut short by a
+// crash and all after it are dropped at start.
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+
+class SegmentStore {
+  public:
+    static const size_t kMaxKey = FNLEN;
+    static const uint32_t kMaxData = 64 * 1024 * 1024;
+
+    struct Record {
+	uint8_t type;
+	std::string key;
+	const char *data;
+	uint32_t len;
+	uint64_t offset;    // of the data
+    };
+    typedef std::function<void(const std::string &board, const Record &)>
+	LoadFn;
+
+    // Returns bytes of a record, to tell if records are next to each other.
+    static size_t RecordSize(size_t keylen, size_t len) {
+	return sizeof(Header) + keylen + len;
+    }
+
+    // Board names go into file names; only those mbbsd allows are taken.
+    static bool ValidBoard(const char *board) {
+	if (!*board || *board == '.' || strlen(board) > IDLEN)
+	    return false;
+	for (const char *p = board; *p; p++)
+	    if (!isalnum((unsigned char)*p) && !strchr("_-.", *p))
+		return false;
+	return true;
+    }
+
+    bool Open(const char *name, const char *dir, LoadFn fn);
+    bool Append(const std::string &board, uint8_t type, const std::string &key,
+		const void *data, size_t len, uint64_t *offset);
+    bool Append(const std::string &board, uint8_t type, const std::string &key,
+		const std::vector<std::pair<const void *, size_t>> &parts,
+		uint64_t *offset);
+    bool Read(const std::string &board, uint64_t offset, size_t len,
+	      char *buf);
+    void Flush();
+
+  private:
+    struct Header {
+	uint32_t size;      // of key and data
+	uint32_t sum;       // fnv_32_buf() of key and data
+	uint8_t type;
+	uint8_t keylen;
+	uint16_t reserved;
+    };
+    struct Board {
+	int fd = -1;
+	uint64_t written = 0;   // in the file
+	std::string pending;    // appended after written
+	bool dirty = false;     // in dirty_
+    };
+    static const size_t kMaxPending = 1024 * 1024;
+    static const size_t kMaxOpen = 256;
+
+    Board *Get(const std::string &board, bool create);
+    bool Load(const std::string &board, Board *b, LoadFn fn);
+    void FlushBoard(const std::string &board, Board *b);
+
+    std::string name_, dir_;
+    std::unordered_map<std::string, Board> boards_;
+    std::vector<std::pair<const std::string *, Board *>> dirty_;
+    size_t nopen_ = 0;
+};
+
+inline bool SegmentStore::Open(const char *name, const char *dir, LoadFn fn) {
+    DIR *d;
+    struct dirent *de;
+    size_t nrec = 0;
+    uint64_t bytes = 0;
+
+    name_ = name;
+    dir_ = dir;
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+	perror(dir);
+	return false;
+    }
+    if ((d = opendir(dir)) == NULL) {
+	perror(dir);
+	return false;
+    }
+    while ((de = readdir(d)) != NULL) {
+	std::string entry = de->d_name;
+	if (entry.size() <= 4 ||
+	    entry.compare(entry.size() - 4, 4, ".seg") != 0)
+	    continue;
+	std::string board = entry.substr(0, entry.size() - 4);
+	if (!ValidBoard(board.c_str()))
+	    continue;
+	Board *b = Get(board, true);
+	if (!b || !Load(board, b, [&](const std::string &bn, const Record &r) {
+		nrec++;
+		fn(bn, r);
+	    })) {
+	    closedir(d);
+	    return false;
+	}
+	bytes += b->written;
+    }
+    closedir(d);
+    fprintf(stderr, "%s: %zu boards, %zu records, %llu bytes\n", name,
+	    boards_.size(), nrec, (unsigned long long)bytes);
+    return true;
+}
+
+// Gets the board, with its file open. Other files are closed if too many
+// are open.
+inline SegmentStore::Board *SegmentStore::Get(const std::string &board,
+					      bool create) {
+    auto it = boards_.find(board);
+    if (it == boards_.end()) {
+	if (!create)
+	    return NULL;
+	it = boards_.insert(std::make_pair(board, Board())).first;
+    }
+    Board *b = &it->second;
+    if (b->fd >= 0)
+	return b;
+
+    if (nopen_ >= kMaxOpen) {
+	Flush();
+	for (auto &kv : boards_)
+	    if (kv.second.fd >= 0) {
+		close(kv.second.fd);
+		kv.second.fd = -1;
+	    }
+	nopen_ = 0;
+    }
+    std::string path = dir_ + "/" + board + ".seg";
+    if ((b->fd = open(path.c_str(), O_RDWR | O_CREAT, 0644)) < 0) {
+	perror(path.c_str());
+	return NULL;
+    }
+    nopen_++;
+    return b;
+}
+
+inline bool SegmentStore::Load(const std::string &board, Board *b,
+			       LoadFn fn) {
+    const size_t kChunk = 1024 * 1024;
+    std::string buf;
+    uint64_t bufoff = 0, off = 0;
+    Header h;
+
+    // makes [off, off + n) of the file be in buf
+    auto fill = [&](size_t n) {
+	if (off >= bufoff && off + n <= bufoff + buf.size())
+	    return true;
+	buf.resize(n > kChunk ? n : kChunk);
+	ssize_t r = pread(b->fd, &buf[0], buf.size(), off);
+	buf.resize(r > 0 ? r : 0);
+	bufoff = off;
+	return buf.size() >= n;
+    };
+
+    while (fill(sizeof(h))) {
+	memcpy(&h, buf.data() + (off - bufoff), sizeof(h));
+	if (!h.type || !h.keylen || h.keylen > kMaxKey || h.size < h.keylen ||
+	    h.size - h.keylen > kMaxData || !fill(sizeof(h) + h.size))
+	    break;
+	const char *p = buf.data() + (off - bufoff) + sizeof(h);
+	if (fnv_32_buf(p, h.size, FNV1_32_INIT) != h.sum)
+	    break;
+
+	Record r;
+	r.type = h.type;
+	r.key.assign(p, h.keylen);
+	r.data = p + h.keylen;
+	r.len = h.size - h.keylen;
+	r.offset = off + sizeof(h) + h.keylen;
+	fn(board, r);
+	off += sizeof(h) + h.size;
+    }
+
+    b->written = lseek(b->fd, 0, SEEK_END);
+    if (off < b->written) {
+	fprintf(stderr, "%s: %s: dropped broken records after %llu\n",
+		name_.c_str(), board.c_str(), (unsigned long long)off);
+	if (ftruncate(b->fd, off) < 0) {
+	    perror("ftruncate");
+	    return false;
+	}
+	b->written = off;
+    }
+    return true;
+}
+
+inline bool SegmentStore::Append(const std::string &board, uint8_t type,
+				 const std::string &key, const void *data,
+				 size_t len, uint64_t *offset) {
+    return Append(board, type, key, {{data, len}}, offset);
+}
+
+inline bool SegmentStore::Append(
+	const std::string &board, uint8_t type, const std::string &key,
+	const std::vector<std::pair<const void *, size_t>> &parts,
+	uint64_t *offset) {
+    size_t len = 0;
+    for (const auto &part : parts)
+	len += part.second;
+    if (!type || key.empty() || key.size() > kMaxKey || len > kMaxData ||
+	!ValidBoard(board.c_str()))
+	return false;
+
+    Board *b = Get(board, true);
+    if (!b)
+	return false;
+    if (!b->dirty) {
+	b->dirty = true;
+	dirty_.push_back(std::make_pair(&boards_.find(board)->first, b));
+    }
+
+    Header h;
+    memset(&h, 0, sizeof(h));
+    h.type = type;
+    h.keylen = key.size();
+    h.size = key.size() + len;
+
+    size_t start = b->pending.size();
+    b->pending.append((const char *)&h, sizeof(h));
+    b->pending.append(key);
+    for (const auto &part : parts)
+	b->pending.append((const char *)part.first, part.second);
+    h.sum = fnv_32_buf(b->pending.data() + start + sizeof(h), h.size,
+		       FNV1_32_INIT);
+    memcpy(&b->pending[start], &h, sizeof(h));
+
+    *offset = b->written + start + sizeof(h) + key.size();
+    if (b->pending.size() >= kMaxPending)
+	FlushBoard(board, b);
+    return true;
+}
+
+inline bool SegmentStore::Read(const std::string &board, uint64_t offset,
+			       size_t len, char *buf) {
+    Board *b = Get(board, false);
+    if (!b)
+	return false;
+    if (offset < b->written) {
+	size_t n = std::min<uint64_t>(len, b->written - offset);
+	if (pread(b->fd, buf, n, offset) != (ssize_t)n)
+	    return false;
+	buf += n;
+	offset += n;
+	len -= n;
+    }
+    if (!len)
+	return true;
+    if (offset + len > b->written + b->pending.size())
+	return false;
+    memcpy(buf, b->pending.data() + (offset - b->written), len);
+    return true;
+}
+
+// Offsets given out by Append() must stay good; if the records cannot be
+// written there is nothing better to do than to start again from the file.
+inline void SegmentStore::FlushBoard(const std::string &board, Board *b) {
+    if (b->pending.empty())
+	return;
+    if (pwrite(b->fd, b->pending.data(), b->pending.size(), b->written) !=
+	(ssize_t)b->pending.size()) {
+	fprintf(stderr, "%s: %s: write: %s\n", name_.c_str(), board.c_str(),
+		strerror(errno));
+	exit(EXIT_FAILURE);
+    }
+    b->written += b->pending.size();
+    b->pending.clear();
+}
+
+inline void SegmentStore::Flush() {
+    for (const auto &d : dirty_) {
+	FlushBoard(*d.first, d.second);
+	d.second->dirty = false;
+    }
+    dirty_.clear();
+}
@@ -4,9 +4,11 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <ctype.h>
 #include <event.h>
 
 #include "bbs.h"
+#include "daemons.h"
 #include "ip_desc_db.h"
 
 const char * cfgfile = BBSHOME "/etc/domain_name_query.cidr";
@@ -20,7 +22,7 @@ static void sighup_cb(int signal, short event, void *arg)
 
 static void client_cb(int fd, short event, void *arg)
 {
-    char buf[32];
+    char buf[64];
     const char *result;
     int len;
 
@@ -31,6 +33,8 @@ static void client_cb(int fd, short event, void *arg)
     if ( (len = read(fd, buf, sizeof(buf) - 1)) <= 0 )
 	goto end;
 
+    while (len > 0 && isspace((unsigned char)buf[len - 1]))
+	len--;
     buf[len] = '\0';
 
     result = ip_desc_db_lookup(buf);
@@ -55,24 +59,87 @@ static void listen_cb(int fd, short event, void *arg)
     event_add(ev, &tv);
 }
 
+// replays the ips in iplist (one per line) rounds times, no daemon.
+static int benchmark(const char *iplist, int rounds)
+{
+    FILE *fp;
+    char buf[64], **ips = NULL;
+    int nips = 0, size = 0, i, r, found = 0;
+    struct timeval t0, t1;
+    double sec;
+
+    if (ip_desc_db_reload(cfgfile) < 0) {
+	perror(cfgfile);
+	return 1;
+    }
+    if ((fp = fopen(iplist, "r")) == NULL) {
+	perror(iplist);
+	return 1;
+    }
+    while (fgets(buf, sizeof(buf), fp)) {
+	char *ip = strtok(buf, " \t\r\n");
+	if (!ip || *ip == '#')
+	    continue;
+	if (nips == size) {
+	    size = size ? size * 2 : 1024;
+	    ips = realloc(ips, sizeof(char *) * size);
+	}
+	ips[nips++] = strdup(ip);
+    }
+    fclose(fp);
+    if (!nips) {
+	fprintf(stderr, "no ip in %s\n", iplist);
+	return 1;
+    }
+
+    gettimeofday(&t0, NULL);
+    for (r = 0; r < rounds; r++)
+	for (i = 0; i < nips; i++)
+	    if (ip_desc_db_lookup(ips[i]) != ips[i])
+		found++;
+    gettimeofday(&t1, NULL);
+    sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+
+    printf("%d ips x %d rounds, %d matched per round\n",
+	   nips, rounds, found / rounds);
+    printf("%.0f lookups/s (%.1f ns/lookup)\n",
+	   (double)nips * rounds / sec, sec * 1e9 / nips / rounds);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
-    int     ch, sfd;
+    int     ch, sfd, rounds = 100;
     char   *iface_ip = FROMD_ADDR;
+    char   *iplist = NULL;
 
     Signal(SIGPIPE, SIG_IGN);
 
-    while ( (ch = getopt(argc, argv, "i:h")) != -1 )
+    while ( (ch = getopt(argc, argv, "i:f:b:n:h")) != -1 )
 	switch( ch ){
 	case 'i':
 	    iface_ip = optarg;
 	    break;
+	case 'f':
+	    cfgfile = optarg;
+	    break;
+	case 'b':
+	    iplist = optarg;
+	    break;
+	case 'n':
+	    rounds = atoi(optarg);
+	    break;
 	case 'h':
 	default:
-	    fprintf(stderr, "usage: %s [-i [interface_ip]:port]\n", argv[0]);
+	    fprintf(stderr, "usage: %s [-i [interface_ip]:port] [-f cidr_file]\n"
+		    "       %s -b iplist [-n rounds] [-f cidr_file]"
+		    "  (benchmark)\n", argv[0], argv[0]);
 	    return 1;
 	}
 
+    if (iplist)
+	return benchmark(iplist, rounds > 0 ? rounds : 1);
+
     if ( (sfd = tobind(iface_ip)) < 0 )
 	return 1;
 
@@ -2,32 +2,232 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include "bbs.h"
 
+// The database is compiled into a path compressed binary trie (Patricia
+// trie) over 128 bit keys; IPv4 networks are stored as IPv4-mapped IPv6
+// (::ffff:a.b.c.d). A lookup walks at most one node per distinct prefix
+// length on its path and returns the longest matching prefix, so the order
+// of the lines in the config no longer matters.
+
+typedef struct {
+    uint64_t hi, lo;
+} ip_key;
+
 typedef struct {
-    uint32_t network, netmask;
-    char desc[32];
-} db_entry;
+    ip_key key;             // the prefix, bits after bitlen are zero
+    int bitlen;             // 0 - 128
+    int desc;               // index of db_desc, or -1 if only a branch
+    int child[2];           // index of db_node, 0 for none (0 is the root)
+} db_node;
 
-static db_entry *db = NULL;
-static int db_len = 0, db_size = 0;
+typedef char db_desc_t[32];
+
+typedef struct {
+    db_node *node;
+    int nodes, node_size;
+    db_desc_t *desc;
+    int descs, desc_size;
+} db_trie;
+
+static db_trie db;
 
 #define DB_INCREMENT 200
 
+static inline int
+key_bit(const ip_key *k, int i)
+{
+    return i < 64 ? (k->hi >> (63 - i)) & 1 : (k->lo >> (127 - i)) & 1;
+}
+
+static inline ip_key
+key_mask(const ip_key *k, int bitlen)
+{
+    ip_key r = *k;
+    if (bitlen <= 0)
+	r.hi = r.lo = 0;
+    else if (bitlen < 64)
+	r.hi &= ~0ULL << (64 - bitlen), r.lo = 0;
+    else if (bitlen == 64)
+	r.lo = 0;
+    else if (bitlen < 128)
+	r.lo &= ~0ULL << (128 - bitlen);
+    return r;
+}
+
+// length of the common prefix of a and b, at most limit
+static inline int
+key_common(const ip_key *a, const ip_key *b, int limit)
+{
+    uint64_t x;
+    int n;
+
+    if ((x = a->hi ^ b->hi) != 0)
+	n = __builtin_clzll(x);
+    else if ((x = a->lo ^ b->lo) != 0)
+	n = 64 + __builtin_clzll(x);
+    else
+	n = 128;
+    return n < limit ? n : limit;
+}
+
+static inline int
+key_match(const ip_key *addr, const db_node *n)
+{
+    ip_key m = key_mask(addr, n->bitlen);
+    return m.hi == n->key.hi && m.lo == n->key.lo;
+}
+
+// parses "a.b.c.d" or an IPv6 address. returns 0 on success.
+static int
+key_parse(const char *ip, ip_key *k)
+{
+    unsigned char a6[16];
+    struct in_addr a4;
+    uint32_t v4;
+    int i;
+
+    if (strchr(ip, ':')) {
+	if (inet_pton(AF_INET6, ip, a6) != 1)
+	    return -1;
+	k->hi = k->lo = 0;
+	for (i = 0; i < 8; i++) {
+	    k->hi = k->hi << 8 | a6[i];
+	    k->lo = k->lo << 8 | a6[i + 8];
+	}
+	return 0;
+    }
+
+    if (inet_pton(AF_INET, ip, &a4) == 1)
+	v4 = ntohl(a4.s_addr);
+    else
+	v4 = ipstr2int(ip); // the old lenient parser, eg. "140.112"
+    k->hi = 0;
+    k->lo = 0xFFFF00000000ULL | v4;
+    return 0;
+}
+
+static int
+trie_new_node(db_trie *t, const ip_key *key, int bitlen, int desc)
+{
+    db_node *n;
+
+    if (t->nodes == t->node_size) {
+	void *ptr;
+	if ((ptr = realloc(t->node, sizeof(db_node) *
+			   (t->node_size + DB_INCREMENT))) == NULL)
+	    return -1;
+	t->node = ptr;
+	t->node_size += DB_INCREMENT;
+    }
+    n = &t->node[t->nodes];
+    n->key = key_mask(key, bitlen);
+    n->bitlen = bitlen;
+    n->desc = desc;
+    n->child[0] = n->child[1] = 0;
+    return t->nodes++;
+}
+
+static int
+trie_new_desc(db_trie *t, const char *desc)
+{
+    if (t->descs == t->desc_size) {
+	void *ptr;
+	if ((ptr = realloc(t->desc, sizeof(db_desc_t) *
+			   (t->desc_size + DB_INCREMENT))) == NULL)
+	    return -1;
+	t->desc = ptr;
+	t->desc_size += DB_INCREMENT;
+    }
+    strlcpy(t->desc[t->descs], desc, sizeof(db_desc_t));
+    return t->descs++;
+}
+
+// adds key/bitlen. The first line of a prefix wins, like the old linear
+// table did. returns 0 on success, -1 if out of memory.
+static int
+trie_insert(db_trie *t, const ip_key *key, int bitlen, const char *desc)
+{
+    int cur = 0, next, b, common, mid, leaf, d;
+
+    for (;;) {
+	db_node *c = &t->node[cur];
+
+	if (c->bitlen == bitlen) {
+	    if (c->desc < 0) {
+		if ((d = trie_new_desc(t, desc)) < 0)
+		    return -1;
+		t->node[cur].desc = d;
+	    }
+	    return 0;
+	}
+
+	b = key_bit(key, c->bitlen);
+	if ((next = c->child[b]) == 0) {
+	    if ((d = trie_new_desc(t, desc)) < 0 ||
+		(leaf = trie_new_node(t, key, bitlen, d)) < 0)
+		return -1;
+	    t->node[cur].child[b] = leaf;
+	    return 0;
+	}
+
+	common = key_common(key, &t->node[next].key,
+			    bitlen < t->node[next].bitlen ?
+			    bitlen : t->node[next].bitlen);
+	if (common == t->node[next].bitlen) {
+	    cur = next;
+	    continue;
+	}
+
+	// split the edge cur -> next at common
+	if ((d = trie_new_desc(t, desc)) < 0)
+	    return -1;
+	if (common == bitlen) {
+	    if ((mid = trie_new_node(t, key, bitlen, d)) < 0)
+		return -1;
+	} else {
+	    if ((mid = trie_new_node(t, key, common, -1)) < 0 ||
+		(leaf = trie_new_node(t, key, bitlen, d)) < 0)
+		return -1;
+	    t->node[mid].child[key_bit(key, common)] = leaf;
+	}
+	t->node[mid].child[key_bit(&t->node[next].key, common)] = next;
+	t->node[cur].child[b] = mid;
+	return 0;
+    }
+}
+
+static void
+trie_free(db_trie *t)
+{
+    free(t->node);
+    free(t->desc);
+    memset(t, 0, sizeof(*t));
+}
+
 int ip_desc_db_reload(const char * cfgfile)
 {
     FILE *fp;
     char buf[256];
     char *ip, *mask, *strtok_p;
-    db_entry *new_db = NULL;
-    int new_db_len = 0, new_db_size = 0;
+    db_trie new_db;
+    ip_key key = {0, 0};
+    int bitlen, maxlen;
     int result = 0;
 
     if ( (fp = fopen(cfgfile, "r")) == NULL)
 	return -1;
 
+    memset(&new_db, 0, sizeof(new_db));
+    if (trie_new_node(&new_db, &key, 0, -1) < 0) {
+	fclose(fp);
+	return 1;
+    }
+
     while (fgets(buf, sizeof(buf), fp)) {
 	//skip empty lines
 	if (!buf[0] || buf[0] == '\n')
@@ -38,65 +238,57 @@ int ip_desc_db_reload(const char * cfgfile)
 	if (ip == NULL || *ip == '#' || *ip == '@')
 	    continue;
 
-	// expand database if nessecary
-	if (new_db_len == new_db_size) {
-	    void * ptr;
-	    if ( (ptr = realloc(new_db, sizeof(db_entry) *
-			    (new_db_size + DB_INCREMENT))) == NULL ) {
-		result = 1;
-		break;
-	    }
-
-	    new_db = ptr;
-	    new_db_size += DB_INCREMENT;
-	}
-
 	// netmask
+	maxlen = strchr(ip, ':') ? 128 : 32;
+	bitlen = maxlen;
 	if ( (mask = strchr(ip, '/')) != NULL ) {
-	    int shift = 32 - atoi(mask + 1);
-	    new_db[new_db_len].netmask = htonl(0xFFFFFFFFu << shift);
+	    bitlen = atoi(mask + 1);
 	    *mask = '\0';
 	}
-	else
-	    new_db[new_db_len].netmask = 0xFFFFFFFFu;
-
-	// network
-	new_db[new_db_len].network = htonl(ipstr2int(ip)) &
-	    new_db[new_db_len].netmask;
+	if (bitlen < 0 || bitlen > maxlen || key_parse(ip, &key) != 0)
+	    continue;
+	if (maxlen == 32)
+	    bitlen += 96;
 
 	// description
-	if ( (ip = strtok_r(NULL, " \t\n", &strtok_p)) == NULL ) {
-	    strcpy(new_db[new_db_len].desc, "`B");
-	}
-	else {
-	    strlcpy(new_db[new_db_len].desc, ip,
-		    sizeof(new_db[new_db_len].desc));
-	}
+	if ( (ip = strtok_r(NULL, " \t\n", &strtok_p)) == NULL )
+	    ip = "`B";
 
-	new_db_len++;
+	if (trie_insert(&new_db, &key, bitlen, ip) != 0) {
+	    result = 1;
+	    break;
+	}
     }
 
     fclose(fp);
 
-    if (new_db != NULL) {
-	free(db);
+    if (new_db.descs) {
+	trie_free(&db);
 	db = new_db;
-	db_len = new_db_len;
-	db_size = new_db_size;
-    }
+    } else
+	trie_free(&new_db);
 
     return result;
 }
 
 const char * ip_desc_db_lookup(const char * ip)
 {
-    int i;
-    uint32_t ipaddr = htonl(ipstr2int(ip));
+    ip_key addr;
+    int cur = 0, best = -1;
 
-    for (i = 0; i < db_len; i++) {
-	if (db[i].network == (ipaddr & db[i].netmask)) {
-	    return db[i].desc;
-	}
-    }
-    return ip;
+    if (!db.nodes || key_parse(ip, &addr) != 0)
+	return ip;
+
+    do {
+	const db_node *n = &db.node[cur];
+	if (!key_match(&addr, n))
+	    break;
+	if (n->desc >= 0)
+	    best = n->desc;
+	if (n->bitlen == 128)
+	    break;
+	cur = n->child[key_bit(&addr, n->bitlen)];
+    } while (cur);
+
+    return best < 0 ? ip : db.desc[best];
 }
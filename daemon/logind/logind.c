@@ -38,7 +38,9 @@
 #include <sys/resource.h>
 #include <sys/ioctl.h>
 #include <signal.h>
+#include <poll.h>
 #include <event.h>
+#include <pthread.h>
 
 #ifndef FIONWRITE
 #include <linux/sockios.h>
@@ -113,6 +115,20 @@
 #define LOGIND_MAX_RETRY_SERVICE   (15)
 #endif
 
+// threads to verify passwords, 0 to verify inside the event loop.
+#ifndef LOGIND_AUTH_THREADS
+#define LOGIND_AUTH_THREADS (4)
+#endif
+
+// failed logins are written by the logattempt daemon in batches: lines of a
+// file are kept up to this size, or this many milliseconds.
+#ifndef LOGATTEMPT_BUFFER_SIZE
+#define LOGATTEMPT_BUFFER_SIZE  (8192)
+#endif
+#ifndef LOGATTEMPT_DELAY_MS
+#define LOGATTEMPT_DELAY_MS     (1000)
+#endif
+
 // local definiions
 #define MY_SVC_NAME  "logind"
 #define LOG_PREFIX  "[logind] "
@@ -137,6 +153,7 @@ int g_opened_fd= 0;
 int g_nonblock = 1;
 int g_async_ack= 1;
 int g_async_logattempt = 1;
+int g_auth_threads = LOGIND_AUTH_THREADS;
 
 // debug and reporting
 int g_verbose  = 0;
@@ -189,6 +206,7 @@ enum {
     AUTH_RESULT_FAIL   = 0,
     AUTH_RESULT_RETRY  = AUTH_RESULT_FAIL,
     AUTH_RESULT_OK     = 1,
+    AUTH_RESULT_PENDING= 2,
 };
 
 #ifdef  CONVERT
@@ -224,6 +242,7 @@ typedef struct {
     TelnetCtx    telnet;
     VtkbdCtx     vtkbd;
     login_ctx    ctx;
+    struct auth_job *auth;  // password being verified by a worker
 } login_conn_ctx;
 
 typedef struct {
@@ -482,6 +501,49 @@ ackq_del(login_conn_ctx *conn)
     return 0;
 }
 
+///////////////////////////////////////////////////////////////////////
+// Auth Queue
+//
+// Loading user records and crypt() of passwords are too slow for the event
+// loop when many people log in at once, so auth_start() hands them to
+// g_auth_threads worker threads. A worker only runs auth_user_challenge()
+// on its own copy of login_ctx and puts the job to g_auth_done, then the
+// event loop (auth_done_cb) continues with the connection.
+
+typedef struct auth_job {
+    struct auth_job *next;
+    login_conn_ctx  *conn;      // NULL if the connection is gone meanwhile
+    login_ctx        ctx;
+    int              result;
+    struct timeval   queued;
+} auth_job;
+
+static pthread_mutex_t g_auth_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_auth_cond = PTHREAD_COND_INITIALIZER;
+static auth_job *g_auth_head, *g_auth_tail; // waiting for workers
+static auth_job *g_auth_done;               // waiting for auth_done_cb
+static int g_auth_pipe[2];                  // wakes up auth_done_cb
+
+// for regular_check(), event loop only
+static int g_auth_pending, g_auth_pending_max;
+static unsigned int g_auth_latency[LAT_BUCKETS];
+
+static void
+auth_latency_add(const struct timeval *begin)
+{
+    struct timeval end;
+    long usec;
+    int b;
+
+    gettimeofday(&end, NULL);
+    usec = (end.tv_sec - begin->tv_sec) * 1000000L +
+           (end.tv_usec - begin->tv_usec);
+    // log2 buckets, as latency_add()
+    for (b = 0; usec > 1 && b < LAT_BUCKETS - 1; b++)
+        usec >>= 1;
+    g_auth_latency[b]++;
+}
+
 ///////////////////////////////////////////////////////////////////////
 // I/O
 
@@ -1129,6 +1191,19 @@ regular_check()
             fprintf(stderr, LOG_PREFIX 
                     "modified. must update welcome screen ...\n");
     }
+
+    // report password verification since last check
+    if (g_auth_pending_max || latency_count(g_auth_latency))
+    {
+        fprintf(stderr, LOG_PREFIX "%s: auth queue %d (max %d), "
+                "%u done, latency p50 %.1fms p99 %.1fms\n",
+                Cdate(&now), g_auth_pending, g_auth_pending_max,
+                latency_count(g_auth_latency),
+                latency_percentile(g_auth_latency, 0.5) / 1000,
+                latency_percentile(g_auth_latency, 0.99) / 1000);
+        g_auth_pending_max = g_auth_pending;
+        memset(g_auth_latency, 0, sizeof(g_auth_latency));
+    }
 }
 
 static int
@@ -1294,6 +1369,68 @@ auth_user_challenge(login_ctx *ctx)
     return AUTH_RESULT_OK;
 }
 
+static void *
+auth_worker(void *arg GCC_UNUSED)
+{
+    auth_job *job;
+    int notify;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&g_auth_lock);
+        while (!g_auth_head)
+            pthread_cond_wait(&g_auth_cond, &g_auth_lock);
+        job = g_auth_head;
+        if (!(g_auth_head = job->next))
+            g_auth_tail = NULL;
+        pthread_mutex_unlock(&g_auth_lock);
+
+        job->result = auth_user_challenge(&job->ctx);
+
+        pthread_mutex_lock(&g_auth_lock);
+        job->next = g_auth_done;
+        g_auth_done = job;
+        notify = !job->next;
+        pthread_mutex_unlock(&g_auth_lock);
+
+        // auth_done_cb takes all jobs done for one byte.
+        if (notify)
+            write(g_auth_pipe[1], "", 1);
+    }
+    return NULL;
+}
+
+// Queues conn for auth_worker. Returns 0 if it must be done here instead.
+static int
+auth_submit(login_conn_ctx *conn)
+{
+    auth_job *job;
+
+    if (g_auth_threads <= 0 || (job = malloc(sizeof(auth_job))) == NULL)
+        return 0;
+
+    memset(job, 0, sizeof(auth_job));
+    job->conn = conn;
+    job->ctx  = conn->ctx;
+    gettimeofday(&job->queued, NULL);
+    // the worker has its own copy.
+    memset(conn->ctx.passwd, 0, sizeof(conn->ctx.passwd));
+    conn->auth = job;
+
+    pthread_mutex_lock(&g_auth_lock);
+    if (g_auth_tail)
+        g_auth_tail->next = job;
+    else
+        g_auth_head = job;
+    g_auth_tail = job;
+    pthread_cond_signal(&g_auth_cond);
+    pthread_mutex_unlock(&g_auth_lock);
+
+    if (++g_auth_pending > g_auth_pending_max)
+        g_auth_pending_max = g_auth_pending;
+    return 1;
+}
+
 static void
 retry_service()
 {
@@ -1471,83 +1608,97 @@ auth_precheck_userid(int fd, login_conn_ctx *conn)
     return auth_fail(fd, conn, draw_empty_userid_warn);
 }
 
-static int 
-auth_start(int fd, login_conn_ctx *conn)
+// The rest of auth_start, with the result of auth_user_challenge.
+static int
+auth_finish(int fd, login_conn_ctx *conn, int result)
 {
     login_ctx *ctx = &conn->ctx;
     int isfree = 0;
-    draw_prompt_func prompt;
+    draw_prompt_func prompt = draw_auth_fail;
 
-    draw_check_passwd(conn);
-
-    if (is_validuserid(ctx->userid))
+    switch (result)
     {
-        // ctx content may be changed.
-        prompt = draw_auth_fail;
-        switch (auth_user_challenge(ctx))
-        {
-            case AUTH_RESULT_FAIL:
-                // logattempt(ctx->userid , '-', time(0), ctx->hostip);
-                logattempt2(ctx->userid , '-', time(0), ctx->hostip);
-                break;
+        case AUTH_RESULT_FAIL:
+            // logattempt(ctx->userid , '-', time(0), ctx->hostip);
+            logattempt2(ctx->userid , '-', time(0), ctx->hostip);
+            break;
 
-            case AUTH_RESULT_FAIL_INSECURE:
-                // failure due to user setting for forcing secure connection
-                // will not be logged.
-                prompt = draw_reject_insecure_connection_msg;
-                break;
+        case AUTH_RESULT_FAIL_INSECURE:
+            // failure due to user setting for forcing secure connection
+            // will not be logged.
+            prompt = draw_reject_insecure_connection_msg;
+            break;
 
-            case AUTH_RESULT_FREEID:
-                isfree = 1;
-                // share FREEID case, no break here!
-            case AUTH_RESULT_OK:
-                if (!isfree)
-                {
-                    // do nothing. logattempt for auth-ok users is
-                    // now done in mbbsd.
-                }
-                else if (!auth_check_free_userid_allowance(ctx->userid))
-                {
-                    // XXX since the only case of free
-                    draw_reject_free_userid(conn, ctx->userid);
-                    return AUTH_RESULT_STOP;
-                }
+        case AUTH_RESULT_FREEID:
+            isfree = 1;
+            // share FREEID case, no break here!
+        case AUTH_RESULT_OK:
+            if (!isfree)
+            {
+                // do nothing. logattempt for auth-ok users is
+                // now done in mbbsd.
+            }
+            else if (!auth_check_free_userid_allowance(ctx->userid))
+            {
+                // XXX since the only case of free
+                draw_reject_free_userid(conn, ctx->userid);
+                return AUTH_RESULT_STOP;
+            }
 
-                // consider system as overloaded if tunnel is not available.
-                if (g_overload || !is_tunnel_available())
-                {
-                    // set overload again to reject all incoming connections
-                    g_overload = 1;
-                    draw_overload(conn, 1);
-                    return AUTH_RESULT_STOP;
-                }
+            // consider system as overloaded if tunnel is not available.
+            if (g_overload || !is_tunnel_available())
+            {
+                // set overload again to reject all incoming connections
+                g_overload = 1;
+                draw_overload(conn, 1);
+                return AUTH_RESULT_STOP;
+            }
 
-                draw_auth_success(conn, isfree);
-                if (!start_service(fd, conn))
-                {
-                    // too bad, we can't start service.
-                    retry_service();
-                    draw_service_failure(conn);
-                    return AUTH_RESULT_STOP;
-                }
-                STATINC(STAT_LOGIND_SERVSTART);
-                return AUTH_RESULT_OK;
+            draw_auth_success(conn, isfree);
+            if (!start_service(fd, conn))
+            {
+                // too bad, we can't start service.
+                retry_service();
+                draw_service_failure(conn);
+                return AUTH_RESULT_STOP;
+            }
+            STATINC(STAT_LOGIND_SERVSTART);
+            return AUTH_RESULT_OK;
 
-            default:
-                assert(!"unknown auth state.");
-                break;
-        }
+        default:
+            assert(!"unknown auth state.");
+            break;
     }
-    else
-        prompt = draw_empty_userid_warn;
 
     return auth_fail(fd, conn, prompt);
 }
 
+static int 
+auth_start(int fd, login_conn_ctx *conn)
+{
+    struct timeval tv;
+    int r;
+
+    draw_check_passwd(conn);
+
+    if (!is_validuserid(conn->ctx.userid))
+        return auth_fail(fd, conn, draw_empty_userid_warn);
+
+    // finished later in auth_done_cb
+    if (auth_submit(conn))
+        return AUTH_RESULT_PENDING;
+
+    // ctx content may be changed.
+    gettimeofday(&tv, NULL);
+    r = auth_user_challenge(&conn->ctx);
+    auth_latency_add(&tv);
+    return auth_finish(fd, conn, r);
+}
+
 ///////////////////////////////////////////////////////////////////////
 // Event callbacks
 
-static struct event ev_sighup, ev_tunnel, ev_ack;
+static struct event ev_sighup, ev_tunnel, ev_ack, ev_auth;
 
 static void 
 sighup_cb(int signal GCC_UNUSED, short event GCC_UNUSED, void *arg GCC_UNUSED)
@@ -1595,6 +1746,10 @@ endconn_cb(int fd, short event GCC_UNUSED, void *arg)
         ackq_del(conn);
     }
 
+    // the worker goes on, and auth_done_cb drops the result.
+    if (conn->auth)
+        conn->auth->conn = NULL;
+
     event_del(&conn->ev);
     bufferevent_free(conn->bufev);
     close(fd);
@@ -1836,6 +1991,10 @@ client_cb(int fd, short event, void *arg)
             continue;
         }
 
+        // ignore keys while the password is being verified.
+        if (conn->auth)
+            continue;
+
         // deal with context
         switch ( login_ctx_handle(&conn->ctx, c) )
         {
@@ -1917,8 +2076,9 @@ client_cb(int fd, short event, void *arg)
                 if ((r = auth_start(fd, conn)) != AUTH_RESULT_RETRY)
                 {
                     // for AUTH_RESULT_OK, the connection is handled in
-                    // login_conn_end_ack.
-                    if (r != AUTH_RESULT_OK)
+                    // login_conn_end_ack; for AUTH_RESULT_PENDING, in
+                    // auth_done_cb.
+                    if (r != AUTH_RESULT_OK && r != AUTH_RESULT_PENDING)
                         login_conn_remove(conn, fd, AUTHFAIL_SLEEP_SEC);
                     return;
                 }
@@ -1927,6 +2087,46 @@ client_cb(int fd, short event, void *arg)
     }
 }
 
+static void
+auth_done_cb(int fd, short event GCC_UNUSED, void *arg GCC_UNUSED)
+{
+    char buf[64];
+    auth_job *job, *next;
+    login_conn_ctx *conn;
+    int cfd, r;
+
+    // drain the pipe before taking the jobs, or we may miss a wake up.
+    while (read(fd, buf, sizeof(buf)) > 0);
+
+    pthread_mutex_lock(&g_auth_lock);
+    job = g_auth_done;
+    g_auth_done = NULL;
+    pthread_mutex_unlock(&g_auth_lock);
+
+    for (; job; job = next)
+    {
+        next = job->next;
+        g_auth_pending--;
+        auth_latency_add(&job->queued);
+
+        if ((conn = job->conn) != NULL)
+        {
+            conn->auth = NULL;
+            // user id may be normalized by auth_user_challenge.
+            strlcpy(conn->ctx.userid, job->ctx.userid, sizeof(conn->ctx.userid));
+            cfd = EVENT_FD(&conn->ev);
+
+            r = auth_finish(cfd, conn, job->result);
+            if (r != AUTH_RESULT_RETRY && r != AUTH_RESULT_OK)
+                login_conn_remove(conn, cfd, AUTHFAIL_SLEEP_SEC);
+        }
+
+        // may still have the password if the user is not found.
+        memset(job, 0, sizeof(auth_job));
+        free(job);
+    }
+}
+
 static void 
 listen_cb(int lfd, short event GCC_UNUSED, void *arg)
 {
@@ -2058,7 +2258,9 @@ logattempt_daemon()
 {
     int pipe_fds[2];
     int pid;
-    logattempt_ctx ctx = {0};
+    LOGBUF lb;
+    logattempt_ctx batch[64];
+    size_t buflen = 0;
 
     fprintf(stderr, LOG_PREFIX "forking logattempt daemon...\n");
     if (pipe(pipe_fds) < 0)
@@ -2086,24 +2288,91 @@ logattempt_daemon()
     close(pipe_fds[1]);
     setproctitle(MY_SVC_NAME " [logattempts]");
 
-    // TODO change to batched processing
-    DEBUG_IO(g_logattempt_pipe,
-             "before logattempt_daemon:toread(g_logattempt_pipe)");
-    while (toread(g_logattempt_pipe, &ctx, sizeof(ctx)) == sizeof(ctx))
+    // read as many attempts as there are, and write them by logbuf.
+    logbuf_init(&lb, LOGATTEMPT_BUFFER_SIZE, LOGATTEMPT_DELAY_MS);
+    for (;;)
     {
+        struct pollfd pfd = { g_logattempt_pipe, POLLIN, 0 };
+        ssize_t len;
+        size_t i, n;
+
+        if (poll(&pfd, 1, logbuf_flush(&lb, 0)) < 0 && errno != EINTR)
+            break;
+        if (!pfd.revents)
+            continue;
+
         DEBUG_IO(g_logattempt_pipe,
-                 "after  logattempt_daemon:toread(g_logattempt_pipe)");
-        if (ctx.cb != sizeof(ctx))
-        {
-            fprintf(stderr, LOG_PREFIX "broken pipe. abort.\n");
+                 "before logattempt_daemon:read(g_logattempt_pipe)");
+        len = read(g_logattempt_pipe, (char *)batch + buflen,
+                   sizeof(batch) - buflen);
+        if (len < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (len <= 0)
             break;
-        }
+        buflen += len;
 
-        logattempt(ctx.userid, '-', ctx.logtime, ctx.hostip);
+        n = buflen / sizeof(batch[0]);
+        for (i = 0; i < n; i++)
+        {
+            if (batch[i].cb != sizeof(batch[0]))
+            {
+                fprintf(stderr, LOG_PREFIX "broken pipe. abort.\n");
+                logbuf_delete(&lb);
+                exit(0);
+            }
+            logattempt_to(&lb, batch[i].userid, '-', batch[i].logtime,
+                          batch[i].hostip);
+        }
+        // keep the partial one
+        buflen -= n * sizeof(batch[0]);
+        memmove(batch, batch + n, buflen);
     }
 
+    logbuf_delete(&lb);
     exit(0);
 }
+static int
+auth_workers_start(int nthreads)
+{
+    pthread_t tid;
+    sigset_t set, oset;
+    userec_t user;
+    int i;
+
+    fprintf(stderr, LOG_PREFIX "starting %d auth workers...\n", nthreads);
+    if (pipe(g_auth_pipe) < 0)
+    {
+        perror("pipe");
+        return -1;
+    }
+    _enable_nonblock(g_auth_pipe[0]);
+    _enable_nonblock(g_auth_pipe[1]);
+
+    // passwd_query() may set up its mapping on first call; do it here
+    // before there are threads. Without the mapping it reads the file
+    // under a lock that is only safe in threads as an open file
+    // description lock.
+    passwd_query(1, &user);
+
+    // signals are for the event loop.
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oset);
+    for (i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&tid, NULL, auth_worker, NULL) != 0)
+        {
+            perror("pthread_create");
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+    event_set(&ev_auth, g_auth_pipe[0], EV_READ | EV_PERSIST, auth_done_cb, NULL);
+    event_add(&ev_auth, NULL);
+    return 0;
+}
+
 static int 
 bind_port(int port)
 {
@@ -2277,7 +2546,7 @@ main(int argc, char *argv[], char *envp[])
     Signal(SIGPIPE, SIG_IGN);
     initsetproctitle(argc, argv, envp);
 
-    while ( (ch = getopt(argc, argv, "f:p:t:l:r:P:hvTDdBbAaMm")) != -1 )
+    while ( (ch = getopt(argc, argv, "f:p:t:l:r:P:w:hvTDdBbAaMm")) != -1 )
     {
         switch( ch ){
         case 'f':
@@ -2304,6 +2573,10 @@ main(int argc, char *argv[], char *envp[])
             strlcpy(g_pidfile_path, optarg, sizeof(g_pidfile_path));
             break;
 
+        case 'w':
+            g_auth_threads = atoi(optarg);
+            break;
+
         case 'd':
             as_daemon = 1;
             break;
@@ -2347,7 +2620,7 @@ main(int argc, char *argv[], char *envp[])
         case 'h':
         default:
             fprintf(stderr,
-                    "usage: %s [-vTmMaAbBdD] [-l log_file] [-f conf] [-p port] [-t tunnel] [-P pidfile] [-c client_command]\n", argv[0]);
+                    "usage: %s [-vTmMaAbBdD] [-l log_file] [-f conf] [-p port] [-t tunnel] [-P pidfile] [-w threads] [-c client_command]\n", argv[0]);
             fprintf(stderr, 
                     "\t-v:    provide verbose messages\n"
                     "\t-T:    provide timeout connection info\n"
@@ -2356,13 +2629,15 @@ main(int argc, char *argv[], char *envp[])
                     "\t-b/-B: do/not use non-blocking socket mode (default: %s)\n"
                     "\t-m/-M: do/not use asynchronous logattempts (default: %s)\n"
                     "\t-f: read configuration from file (default: %s)\n"
-                    "\t-P: pid file (default: %s)\n",
+                    "\t-P: pid file (default: %s)\n"
+                    "\t-w: threads to verify passwords, 0 for none (default: %d)\n",
                     as_daemon   ? "true" : "false",
                     g_async_ack ? "true" : "false",
                     g_nonblock  ? "true" : "false",
                     g_async_logattempt  ? "true" : "false",
                     BBSHOME "/" FN_CONF_BINDPORTS,
-                    LOGIND_DEFAULT_PID_PATH);
+                    LOGIND_DEFAULT_PID_PATH,
+                    LOGIND_AUTH_THREADS);
             fprintf(stderr, 
                     "\t-l: log meesages into log_file\n"
                     "\t-p: bind (listen) to specific port\n"
@@ -2462,6 +2737,23 @@ main(int argc, char *argv[], char *envp[])
     signal_set(&ev_sighup, SIGHUP, sighup_cb, &ev_sighup);
     signal_add(&ev_sighup, NULL);
 
+#if !defined(USE_PASSWD_MMAP) && !defined(F_OFD_SETLKW)
+    // the workers would undo each other's process wide locks on .PASSWD
+    if (g_auth_threads > 0)
+    {
+        fprintf(stderr, LOG_PREFIX "auth workers need USE_PASSWD_MMAP or "
+                "F_OFD_SETLKW; checking passwords in the event loop.\n");
+        g_auth_threads = 0;
+    }
+#endif
+
+    // threads do not survive daemonize(), so start them here.
+    if (g_auth_threads > 0 && auth_workers_start(g_auth_threads) < 0)
+    {
+        fprintf(stderr, LOG_PREFIX "error: cannot start auth workers.\n");
+        return 5;
+    }
+
     // spawn tunnel client if specified.
     if (*tclient_cmd)
     {
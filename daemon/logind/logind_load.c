@@ -0,0 +1,163 @@
+// $Id$
+#include "bbs.h"
+#include <poll.h>
+#include <netdb.h>
+#include <sys/time.h>
+
+// Load test for logind: opens many connections at once, enters userid and
+// a wrong password on each and measures how long logind takes to say so.
+// Use an existing userid so that the password is really verified.
+
+typedef struct {
+    int    fd;
+    int    state;
+    double sent;
+    size_t got;
+    char   buf[4096];
+} conn_t;
+
+enum { ST_CONNECT, ST_WAIT, ST_DONE, ST_FAIL };
+
+static double
+now_sec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+    int nconn = 1000, timeout = 60, ch, i, n, done = 0, failed = 0;
+    const char *userid = "SYSOP", *passwd = "wrong_password";
+    char host[STRLEN], *port, req[IDLEN + PASSLEN + 4];
+    struct addrinfo hints, *ai;
+    struct pollfd *fds;
+    conn_t *conns;
+    double *lat, start;
+
+    while ((ch = getopt(argc, argv, "n:u:p:t:")) != -1) {
+	switch (ch) {
+	    case 'n': nconn = atoi(optarg); break;
+	    case 'u': userid = optarg; break;
+	    case 'p': passwd = optarg; break;
+	    case 't': timeout = atoi(optarg); break;
+	    default: nconn = 0; break;
+	}
+    }
+    if (optind >= argc || nconn <= 0 ||
+	strlcpy(host, argv[optind], sizeof(host)) >= sizeof(host) ||
+	(port = strrchr(host, ':')) == NULL) {
+	fprintf(stderr, "Usage: %s [-n connections] [-u userid] "
+		"[-p password] [-t timeout] host:port\n", argv[0]);
+	return 1;
+    }
+    *port++ = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &ai) != 0) {
+	fprintf(stderr, "cannot resolve %s\n", argv[optind]);
+	return 1;
+    }
+
+    Signal(SIGPIPE, SIG_IGN);
+    snprintf(req, sizeof(req), "%s\r%s\r", userid, passwd);
+    fds = calloc(nconn, sizeof(struct pollfd));
+    conns = calloc(nconn, sizeof(conn_t));
+    lat = calloc(nconn, sizeof(double));
+
+    start = now_sec();
+    for (i = 0; i < nconn; i++) {
+	conn_t *c = &conns[i];
+	if ((c->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+	    perror("socket");
+	    return 1;
+	}
+	fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+	if (connect(c->fd, ai->ai_addr, ai->ai_addrlen) < 0 &&
+	    errno != EINPROGRESS) {
+	    c->state = ST_FAIL;
+	    close(c->fd);
+	}
+    }
+
+    while (done + failed < nconn) {
+	for (i = n = 0; i < nconn; i++) {
+	    conn_t *c = &conns[i];
+	    fds[i].fd = (c->state == ST_CONNECT || c->state == ST_WAIT) ?
+		c->fd : -1;
+	    fds[i].events = c->state == ST_CONNECT ? POLLOUT : POLLIN;
+	    fds[i].revents = 0;
+	    if (c->state == ST_FAIL)
+		n++;
+	}
+	failed = n;
+	if (done + failed >= nconn)
+	    break;
+	if (now_sec() - start > timeout) {
+	    fprintf(stderr, "timeout\n");
+	    break;
+	}
+	if (poll(fds, nconn, 1000) < 0 && errno != EINTR) {
+	    perror("poll");
+	    break;
+	}
+
+	for (i = 0; i < nconn; i++) {
+	    conn_t *c = &conns[i];
+	    ssize_t len;
+
+	    if (!fds[i].revents)
+		continue;
+	    if (c->state == ST_CONNECT) {
+		// logind takes the keys as soon as the socket is accepted.
+		if (write(c->fd, req, strlen(req)) != (ssize_t)strlen(req)) {
+		    c->state = ST_FAIL;
+		    close(c->fd);
+		    continue;
+		}
+		c->sent = now_sec();
+		c->state = ST_WAIT;
+		continue;
+	    }
+
+	    len = read(c->fd, c->buf + c->got, sizeof(c->buf) - c->got - 1);
+	    if (len <= 0) {
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		    continue;
+		c->state = ST_FAIL;
+		close(c->fd);
+		continue;
+	    }
+	    c->got += len;
+	    if (memmem(c->buf, c->got, ERR_PASSWD, strlen(ERR_PASSWD))) {
+		lat[done++] = now_sec() - c->sent;
+		c->state = ST_DONE;
+		close(c->fd);
+	    } else if (c->got >= sizeof(c->buf) - 1) {
+		// keep the tail, the message may be split
+		memmove(c->buf, c->buf + c->got - 64, 64);
+		c->got = 64;
+	    }
+	}
+    }
+
+    printf("%d connections: %d answered, %d failed in %.2fs\n",
+	   nconn, done, failed, now_sec() - start);
+    if (done) {
+	qsort(lat, done, sizeof(double), cmp_double);
+	printf("latency p50 %.1fms p90 %.1fms p99 %.1fms max %.1fms\n",
+	       lat[done / 2] * 1e3, lat[done * 9 / 10] * 1e3,
+	       lat[done * 99 / 100] * 1e3, lat[done - 1] * 1e3);
+    }
+    return done == nconn ? 0 : 1;
+}
@@ -0,0 +1,415 @@
+// postd: posts daemon.
+//
+// Keeps the content of posts for mbbsd with USE_POSTD, and of the legacy
+// posts imported by rebuild with the comments at their end kept apart; see
+// daemons.h for the protocol, which is that of postd.py.
+//
+// Posts are appended to the segment file of the board (segstore.h) and an
+// index in memory has where the content and the comments of each file are.
+// Records imported on a connection stay in memory until TERMINATE, or until
+// a board has a few MB of them, so that an import is written in large
+// writes at the speed of the disk.
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <netinet/tcp.h>
+extern "C" {
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include "bbs.h"
+#include "daemons.h"
+#include "server.h"
+}
+#include "segstore.h"
+
+#ifndef POSTD_DB_PATH
+#define POSTD_DB_PATH   BBSHOME "/postd"
+#endif
+
+namespace {
+
+enum {
+    kRecPost = 'p',         // PostRecord and content; comments are kept
+    kRecImport = 'i',       // PostRecord, content and comments
+};
+
+// data of a record, followed by content_len bytes of content and, for
+// kRecImport, the comments as GET_CONTENT gives them
+struct PostRecord {
+    fileheader_t header;
+    PostAddExtraInfoReq extra;
+    uint32_t content_len;
+} PACKSTRUCT;
+
+struct Post {
+    uint64_t content = 0, comments = 0;     // offsets in the store
+    uint32_t content_len = 0, comments_len = 0;
+};
+
+std::unordered_map<std::string, std::unordered_map<std::string, Post>> g_index;
+SegmentStore g_store;
+
+void LoadRecord(const std::string &board, const SegmentStore::Record &r) {
+    PostRecord rec;
+    if ((r.type != kRecPost && r.type != kRecImport) || r.len < sizeof(rec))
+	return;
+    memcpy(&rec, r.data, sizeof(rec));
+    if (rec.content_len > r.len - sizeof(rec))
+	return;
+
+    Post &p = g_index[board][r.key];
+    p.content = r.offset + sizeof(rec);
+    p.content_len = rec.content_len;
+    if (r.type == kRecImport) {
+	p.comments = p.content + rec.content_len;
+	p.comments_len = r.len - sizeof(rec) - rec.content_len;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Legacy posts, as pyutil/pttpost.py parses them
+
+const char kAuthor1[] = "\xa7\x40\xaa\xcc:";            // author
+const char kAuthor2[] = "\xb5\x6f\xab\x48\xa4\x48:";    // sender
+const char kCrossPost[] = "\xa1\xb0 " ANSI_COLOR(1;32);
+const char kCrossPostTo[] = ANSI_COLOR(0;32) ":\xc2\xe0\xbf\xfd\xa6\xdc";
+// comment kinds 1, 2, 3: recommend, boo and arrow
+const char *const kCommentPrefixes[] = {
+    ANSI_COLOR(1;37) "\xb1\xc0 ",
+    ANSI_COLOR(1;31) "\xbc\x4e ",
+    ANSI_COLOR(1;31) "\xa1\xf7 ",
+};
+
+bool StartsWith(const char *s, size_t len, const char *prefix) {
+    size_t n = strlen(prefix);
+    return len >= n && memcmp(s, prefix, n) == 0;
+}
+
+// Matches kind ESC[33m author ESC[m ESC[33m: msg ESC[m trailing at the
+// first place of the line it can, and appends "<kind> author: msg trailing".
+bool ParseComment(const char *line, size_t len, std::string *out) {
+    const char *end = line + len;
+    if (end > line && end[-1] == '\n')
+	end--;
+
+    for (const char *pos = line; pos < end; pos++) {
+	for (int kind = 0; kind < 3; kind++) {
+	    const char *p = pos, *author, *author_end, *msg, *msg_end;
+	    if (!StartsWith(p, end - p, kCommentPrefixes[kind]))
+		continue;
+	    p += strlen(kCommentPrefixes[kind]);
+	    if (!StartsWith(p, end - p, ANSI_COLOR(33)))
+		continue;
+	    author = p + strlen(ANSI_COLOR(33));
+	    if (!(author_end = (const char *)memchr(author, ESC_CHR,
+						    end - author)) ||
+		!StartsWith(author_end, end - author_end,
+			    ANSI_RESET ANSI_COLOR(33) ":"))
+		continue;
+	    msg = author_end + strlen(ANSI_RESET ANSI_COLOR(33) ":");
+	    if (!(msg_end = (const char *)memchr(msg, ESC_CHR, end - msg)) ||
+		!StartsWith(msg_end, end - msg_end, ANSI_RESET))
+		continue;
+	    p = msg_end + strlen(ANSI_RESET);
+	    while (msg_end > msg && msg_end[-1] == ' ')
+		msg_end--;
+
+	    *out += "<" + std::to_string(kind + 1) + "> ";
+	    out->append(author, author_end - author);
+	    *out += ": ";
+	    out->append(msg, msg_end - msg);
+	    *out += " ";
+	    out->append(p, end - p);
+	    *out += "\n";
+	    return true;
+	}
+    }
+    return false;
+}
+
+// Splits a legacy post into the content, [*begin, *end) of data without the
+// header, and the comments at the end, skipping logs of cross posts among
+// them.
+void ParsePost(const char *data, size_t len, size_t *begin, size_t *end,
+	       std::string *comments) {
+    std::vector<std::string> found;
+    size_t b = 0, e = len;
+    int max_lines = StartsWith(data, len, kAuthor1) ? 4 :
+		    StartsWith(data, len, kAuthor2) ? 5 : 0;
+
+    // the header ends at an empty line
+    while (b < e && max_lines-- > 0) {
+	const char *eol = (const char *)memchr(data + b, '\n', e - b);
+	size_t next = eol ? eol - data + 1 : e;
+	bool empty = next - b == 1 && data[b] == '\n';
+	b = next;
+	if (empty)
+	    break;
+    }
+
+    while (b < e) {
+	// the last line, with its '\n'
+	size_t start = e - 1;
+	while (start > b && data[start - 1] != '\n')
+	    start--;
+	const char *line = data + start, *to;
+	if (StartsWith(line, e - start, kCrossPost) &&
+	    (to = (const char *)memmem(line, e - start, kCrossPostTo,
+				       strlen(kCrossPostTo))) && to > line) {
+	    e = start;
+	    continue;
+	}
+	std::string rendered;
+	if (!ParseComment(line, e - start, &rendered))
+	    break;
+	found.push_back(rendered);
+	e = start;
+    }
+
+    *begin = b;
+    *end = e;
+    comments->clear();
+    for (auto it = found.rbegin(); it != found.rend(); ++it)
+	*comments += *it;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Requests
+
+bool ValidKey(PostKeyReq *key) {
+    key->board[sizeof(key->board) - 1] = 0;
+    key->file[sizeof(key->file) - 1] = 0;
+    return SegmentStore::ValidBoard(key->board) && key->file[0] &&
+	key->file[0] != '.' && !strchr(key->file, '/');
+}
+
+bool ReadFile(const PostKeyReq &key, std::string *data) {
+    char fpath[PATHLEN];
+    struct stat st;
+    int fd;
+
+    snprintf(fpath, sizeof(fpath), BBSHOME "/boards/%c/%s/%s", key.board[0],
+	     key.board, key.file);
+    if ((fd = open(fpath, O_RDONLY)) < 0)
+	return false;
+    if (fstat(fd, &st) < 0 || st.st_size > SegmentStore::kMaxData) {
+	close(fd);
+	return false;
+    }
+    data->resize(st.st_size);
+    bool ok = read(fd, &(*data)[0], st.st_size) == st.st_size;
+    close(fd);
+    return ok;
+}
+
+bool Save(const PostAddRequest &req, uint8_t type, const char *content,
+	  size_t content_len, const std::string &comments) {
+    PostRecord rec;
+    uint64_t offset;
+
+    rec.header = req.header;
+    rec.extra = req.extra;
+    rec.content_len = content_len;
+    if (!g_store.Append(req.key.board, type, req.key.file,
+			{{&rec, sizeof(rec)},
+			 {content, content_len},
+			 {comments.data(), comments.size()}}, &offset))
+	return false;
+
+    Post &p = g_index[req.key.board][req.key.file];
+    p.content = offset + sizeof(rec);
+    p.content_len = content_len;
+    if (type == kRecImport) {
+	p.comments = p.content + content_len;
+	p.comments_len = comments.size();
+    }
+    return true;
+}
+
+bool Import(const PostAddRequest &req, const char *data, size_t len) {
+    std::string comments;
+    size_t begin, end;
+    ParsePost(data, len, &begin, &end, &comments);
+    return Save(req, kRecImport, data + begin, end - begin, comments);
+}
+
+bool GetContent(const PostKeyReq &key, std::string *data) {
+    data->clear();
+    auto b = g_index.find(key.board);
+    if (b == g_index.end())
+	return true;
+    auto f = b->second.find(key.file);
+    if (f == b->second.end())
+	return true;
+
+    const Post &p = f->second;
+    data->resize(p.content_len + p.comments_len);
+    if (p.comments == p.content + p.content_len)
+	return g_store.Read(key.board, p.content, data->size(), &(*data)[0]);
+    return g_store.Read(key.board, p.content, p.content_len, &(*data)[0]) &&
+	g_store.Read(key.board, p.comments, p.comments_len,
+		     &(*data)[p.content_len]);
+}
+
+// A request being received, and imports since the last TERMINATE.
+struct Conn {
+    uint32_t imported = 0;
+    bool remote = false;        // req is waiting for its content
+    PostAddRequest req;
+};
+
+struct RequestHeader {
+    short cb;
+    short operation;
+} PACKSTRUCT;
+
+// Returns false if the connection should be closed.
+bool ProcessRequest(struct bufferevent *bev, Conn *conn) {
+    struct evbuffer *input = bufferevent_get_input(bev);
+
+    if (!conn->remote) {
+	RequestHeader h;
+	size_t size = 0;
+
+	if (evbuffer_get_length(input) < sizeof(h))
+	    return true;
+	evbuffer_copyout(input, &h, sizeof(h));
+	switch (h.operation) {
+	    case POSTD_REQ_TERMINATE:
+		// only the header is needed; rebuild sends a PostAddRequest
+		if (h.cb >= (short)sizeof(h) && h.cb <= (short)sizeof(conn->req))
+		    size = h.cb;
+		break;
+	    case POSTD_REQ_ADD:
+	    case POSTD_REQ_IMPORT:
+	    case POSTD_REQ_IMPORT_REMOTE:
+		size = sizeof(PostAddRequest);
+		break;
+	    case POSTD_REQ_GET_CONTENT:
+		size = sizeof(PostGetContentRequest);
+		break;
+	}
+	if (!size || h.cb != (short)size)
+	    return false;
+	if (evbuffer_get_length(input) < size)
+	    return true;
+
+	if (h.operation == POSTD_REQ_TERMINATE) {
+	    evbuffer_drain(input, size);
+	    bufferevent_write(bev, &conn->imported, sizeof(conn->imported));
+	    conn->imported = 0;
+	    return true;
+	}
+	if (h.operation == POSTD_REQ_GET_CONTENT) {
+	    PostGetContentRequest req;
+	    std::string data;
+	    evbuffer_remove(input, &req, size);
+	    if (!ValidKey(&req.key) || !GetContent(req.key, &data))
+		return false;
+	    uint32_t len = data.size();
+	    bufferevent_write(bev, &len, sizeof(len));
+	    bufferevent_write(bev, data.data(), data.size());
+	    return true;
+	}
+
+	evbuffer_remove(input, &conn->req, size);
+	if (!ValidKey(&conn->req.key))
+	    return false;
+	if (h.operation == POSTD_REQ_ADD) {
+	    std::string content;
+	    uint32_t len = 0;
+	    if (ReadFile(conn->req.key, &content)) {
+		if (!Save(conn->req, kRecPost, content.data(), content.size(),
+			  ""))
+		    return false;
+		len = content.size();
+	    }
+	    bufferevent_write(bev, &len, sizeof(len));
+	    return true;
+	}
+	if (h.operation == POSTD_REQ_IMPORT) {
+	    std::string post;
+	    if (!ReadFile(conn->req.key, &post))
+		return true;
+	    if (!Import(conn->req, post.data(), post.size()))
+		return false;
+	    conn->imported++;
+	    return true;
+	}
+	conn->remote = true;
+    }
+
+    uint32_t len;
+    if (evbuffer_get_length(input) < sizeof(len))
+	return true;
+    evbuffer_copyout(input, &len, sizeof(len));
+    if (len > SegmentStore::kMaxData)
+	return false;
+    if (evbuffer_get_length(input) < sizeof(len) + len)
+	return true;
+    evbuffer_drain(input, sizeof(len));
+    const char *data = (const char *)evbuffer_pullup(input, len);
+    bool ok = Import(conn->req, data, len);
+    evbuffer_drain(input, len);
+    if (!ok)
+	return false;
+    conn->imported++;
+    conn->remote = false;
+    return true;
+}
+
+void CloseConn(struct bufferevent *bev, Conn *conn) {
+    delete conn;
+    bufferevent_free(bev);
+    g_store.Flush();
+}
+
+}  // namespace
+
+void
+client_read_cb(struct bufferevent *bev, void *ctx)
+{
+    Conn *conn = (Conn *)ctx;
+    struct evbuffer *input = bufferevent_get_input(bev);
+    size_t before;
+
+    do {
+	before = evbuffer_get_length(input);
+	if (!ProcessRequest(bev, conn)) {
+	    CloseConn(bev, conn);
+	    return;
+	}
+    } while (evbuffer_get_length(input) && evbuffer_get_length(input) < before);
+
+    // an import is written when it ends, anything else at once
+    if (!conn->imported && !conn->remote)
+	g_store.Flush();
+}
+
+void
+client_event_cb(struct bufferevent *bev, short events, void *ctx)
+{
+    if (events & (BEV_EVENT_EOF | BEV_EVENT_TIMEOUT | BEV_EVENT_ERROR))
+	CloseConn(bev, (Conn *)ctx);
+}
+
+void
+setup_client(struct event_base *base, evutil_socket_t fd,
+	struct sockaddr *address GCC_UNUSED, int socklen GCC_UNUSED)
+{
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    struct bufferevent *bev = bufferevent_socket_new(base, fd,
+	    BEV_OPT_CLOSE_ON_FREE);
+    bufferevent_setcb(bev, client_read_cb, NULL, client_event_cb, new Conn());
+    bufferevent_set_timeouts(bev, common_timeout, common_timeout);
+    bufferevent_enable(bev, EV_READ|EV_WRITE);
+}
+
+void
+setup_program()
+{
+    if (!g_store.Open("postd", POSTD_DB_PATH, LoadRecord))
+	exit(EXIT_FAILURE);
+}
@@ -8,6 +8,33 @@ const char *server = POSTD_ADDR;
 
 int verbose_level = 0;
 
+// Requests are queued and written in large writes; postd reads them as a
+// stream and only replies to the TERMINATE at the end.
+#define OUTBUF_SIZE (1024 * 1024)
+
+static char *outbuf;
+static size_t outlen;
+
+static int out_flush(int s)
+{
+    int r = outlen ? towrite(s, outbuf, outlen) : 0;
+    outlen = 0;
+    return r < 0 ? -1 : 0;
+}
+
+static int out_append(int s, const void *data, size_t len)
+{
+    if (!outbuf && !(outbuf = malloc(OUTBUF_SIZE)))
+        return -1;
+    if (outlen + len > OUTBUF_SIZE && out_flush(s) < 0)
+        return -1;
+    if (len > OUTBUF_SIZE)
+        return towrite(s, data, len) < 0 ? -1 : 0;
+    memcpy(outbuf + outlen, data, len);
+    outlen += len;
+    return 0;
+}
+
 int PostAddRecord(int s, const char *board, const fileheader_t *fhdr,
 		  FILE *fp, size_t *written_data)
 {
@@ -63,26 +90,30 @@ int PostAddRecord(int s, const char *board, const fileheader_t *fhdr,
     debug(" (userref: %s.%d)", req.extra.userid, req.extra.userref);
 
     *written_data += sizeof(req);
-    if (success && towrite(s, &req, sizeof(req)) < 0)
+    if (success && out_append(s, &req, sizeof(req)) < 0)
         success = 0;
     if (success && fp) {
+        static char *content;
+        static size_t szcontent;
+        struct stat st;
         uint32_t content_len;
-        char *content;
 
-	fseek(fp, 0, SEEK_END);
-	content_len = ftell(fp);
-	content = malloc(content_len + 1);
-        assert(content && fp);
-        // TODO replace by sendfile.
-        fread(content, content_len, 1, fp);
-        content[content_len] = 0;
+        if (fstat(fileno(fp), &st) < 0)
+            return 1;
+        content_len = st.st_size;
+        if (content_len > szcontent) {
+            szcontent = content_len;
+            content = realloc(content, szcontent);
+            assert(content);
+        }
+        if (content_len && fread(content, content_len, 1, fp) != 1)
+            return 1;
 
         *written_data += sizeof(content_len) + content_len;
-        if (towrite(s, &content_len, sizeof(content_len)) < 0 ||
-            towrite(s, content, content_len) < 0) {
+        if (out_append(s, &content_len, sizeof(content_len)) < 0 ||
+            out_append(s, content, content_len) < 0) {
             success = 0;
         }
-        free(content);
         if (success)
             debug(" (content: %d)", content_len);
     }
@@ -159,7 +190,8 @@ void rebuild_board(int bid GCC_UNUSED, boardheader_t *bp, int is_remote)
         double data_rate;
         PostAddRequest req = {0};
         req.cb = sizeof(req);
-        if (towrite(s, &req, sizeof(req)) < 0 ||
+        req.operation = POSTD_REQ_TERMINATE;
+        if (out_append(s, &req, sizeof(req)) < 0 || out_flush(s) < 0 ||
             toread(s, &num, sizeof(num)) < 0) {
             printf("Failed syncing requests. Abort.\n");
             exit(1);
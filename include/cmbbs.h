@@ -22,6 +22,14 @@ void setuserhashedfile(char *buf, const char *filename);
 // setbdir
 // setuserfile
 
+/* latency.c */
+struct timeval;
+extern const char * const latency_name[LAT_NUM];
+void latency_add(int op, const struct timeval *begin);
+void latency_merge(unsigned int hist[LAT_MAX][LAT_BUCKETS]);
+unsigned int latency_count(const unsigned int *buckets);
+double latency_percentile(const unsigned int *buckets, double q);
+
 /* money.c */
 const char* money_level(int money);
 
@@ -63,9 +71,21 @@ void *attach_shm(int shmkey, int shmsize);
 void attach_check_SHM(int version, int SHM_t_size);
 void add_to_uhash(int n, const char *id);
 void remove_from_uhash(int n);
+void remove_uhash_slot(unsigned int i);
+int  uhash_is_free(int n);
+void uhash_set_free(int n, int isfree);
 int  dosearchuser(const char *userid, char *rightid);
 int  searchuser(const char *userid, char *rightid);
 void setuserid(int num, const char *userid);
+int  shm_spin_lock(volatile int *lock);
+void shm_spin_unlock(volatile int *lock);
+void utmpindex_add(int n);
+void utmpindex_remove(int n);
+void utmpindex_rebuild(void);
+int  utmpindex_snapshot(int type, int *list);
+void friendref_link(int n);
+void friendref_unlink(int n);
+int  friendref_lookup(int uid, int *list, int max);
 userinfo_t *search_ulistn(int uid, int unum);
 userinfo_t *search_ulist_pid(int pid);
 userinfo_t *search_ulist_userid(const char *userid);
@@ -107,14 +127,37 @@ int  passwd_query (int num, userec_t *buf);
 int  passwd_load_user(const char *userid, userec_t *buf);
 int  passwd_apply (void *data, int (*fptr)(void *, int, userec_t *));
 int passwd_fast_apply(void *ctx, int(*fptr)(void *ctx, int, userec_t *));
+void passwd_flush(void);
 int passwd_require_secure_connection(const userec_t *u);
 int  checkpasswd  (const char *passwd, char *test);  // test will be destroyed
 void logattempt   (const char *uid, char type, time4_t now, const char *fromhost);
+void logattempt_to(LOGBUF *lb, const char *uid, char type, time4_t now,
+		   const char *fromhost);
 char*genpasswd    (char *pw);
 
 /* record */
 int substitute_fileheader(const char *dir_path, const void *srcptr, const void *destptr, int id);
 int delete_fileheader(const char *dir_path, const void *rptr, int id);
+int fileheader_view(const char *dir_path, const fileheader_t **pfh);
+int fileheader_find(const char *dir_path, const char *fn, int prefix);
+int fileheader_add_recommend(const char *dir_path, int ent, const char *fn,
+			     int delta, time4_t modified, int *precommend);
+
+/* srindex.c */
+#define SRI_AUTHOR  (0)
+#define SRI_TITLE   (1)
+int srindex_search(const char *dir_path, int field, const char *key, int **precs);
+int srindex_touch(const char *dir_path, int ent);
+int srindex_delete_begin(const char *dir_path);
+void srindex_delete_end(int fd, const char *dir_path, int ent);
+
+/* msgring.c */
+int  msgring_send(userinfo_t *uentp, const msgque_t *msg);
+int  msgring_count(const msgring_t *ring);
+int  msgring_peek(const msgring_t *ring, int i, msgque_t *msg);
+void msgring_pop(msgring_t *ring);
+int  msgring_wait_begin(msgring_t *ring, int shown);
+void msgring_wait_end(msgring_t *ring);
 
 
 #endif
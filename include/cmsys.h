@@ -43,6 +43,7 @@ typedef time_t time4_t;
 
 /* crypt.c */
 char *fcrypt(const char *key, const char *salt);
+char *fcrypt_r(const char *key, const char *salt, char *result);
 
 /* daemon.c */
 int daemonize(const char * pidfile, const char * logfile);
@@ -83,6 +84,7 @@ int tobindex (const char *addr, int qlen, int (*setsock)(int), int do_listen);
 int toconnect(const char *addr);
 int toconnectex(const char *addr, int timeout);
 int toconnect3(const char *addr, int timeout, int microseconds);
+int toconnect_nonblock(const char *addr);
 int toread   (int fd, void *buf, int len);
 int towrite  (int fd, const void *buf, int len);
 int torecv   (int fd, void *buf, int len, int flag);
@@ -130,6 +132,16 @@ size_t str_iconv(
 	  char *dst,		/* destination string */
 	  size_t dstlen);
 void str_decode_M3(char *str);
+/* kernels behind strip_ansi, strlen_noansi, DBCS_Status and DBCS_strcasestr */
+enum STR_KERNEL {
+    STR_KERNEL_AUTO = -1,
+    STR_KERNEL_SCALAR,
+    STR_KERNEL_SSE2,
+    STR_KERNEL_AVX2,
+};
+int str_kernel_set(int kernel);
+const char *str_kernel_name(void);
+size_t str_ascii_span(const char *s, size_t max);
 
 /* time.c */
 int is_leap_year(int year);
@@ -158,6 +170,23 @@ const char * Cdate_mdHMS(const time4_t * clock);
 int log_filef(const char *fn, int flag, const char *fmt,...) GCC_CHECK_FORMAT(3,4);
 int log_file(const char *fn, int flag, const char *msg);
 
+struct logbuf_file;
+typedef struct LOGBUF {
+    struct logbuf_file **hash;          // by path
+    struct logbuf_file *head, *tail;    // flush queue
+    size_t  bufsize;    // max bytes kept for a file
+    size_t  buffered;
+    int     delay_ms;   // max time a line is kept
+    // statistics
+    unsigned int lines, writes;
+    int     max_delay_ms;
+} LOGBUF;
+
+void logbuf_init(LOGBUF *lb, size_t bufsize, int delay_ms);
+int  logbuf_add(LOGBUF *lb, const char *path, const char *msg, size_t len);
+int  logbuf_flush(LOGBUF *lb, int force);
+void logbuf_delete(LOGBUF *lb);
+
 /* record.c */
 int get_num_records(const char *fpath, size_t size);
 int get_records_keep(const char *fpath, void *rptr, size_t size, int id, size_t number, int *fd);
@@ -179,6 +208,9 @@ int delete_record2(const char *fpath, const void *rptr, size_t size,
 int bsearch_record(const char *fpath, const void *key,
                    int (*compar)(const void *item1, const void *item2),
                    size_t size, void *buffer);
+// mmap-backed read only view; returns number of records (or -1) and sets
+// *pbase. The view is valid until the next record_view() in the thread.
+int record_view(const char *fpath, size_t size, const void **pbase);
 
 /* vector.c */
 struct Vector {
@@ -307,11 +339,21 @@ ssize_t telnet_process        (TelnetCtx *ctx, unsigned char *buf, ssize_t size)
 /* utf8.c */
 int ucs2utf(uint16_t ucs2, uint8_t *utf8);
 int utf2ucs(uint8_t *utf8, uint16_t *pucs);
+typedef struct ConvState {
+    uint8_t pending[4];	// partial character from the previous block
+    int	    npending;
+} ConvState;
+// with room for a carried over character and 3 byte table copies
+#define BIG5_TO_UTF8_MAXLEN(len)    ((len) / 2 * 3 + 4)
+#define UTF8_TO_BIG5_MAXLEN(len)    ((len) * 2)
+size_t big5_to_utf8_block(ConvState *st, const char *src, size_t len, char *dst);
+size_t utf8_to_big5_block(ConvState *st, const char *src, size_t len, char *dst);
 
 /* big5.c */
 extern const uint16_t b2u_table[];
 extern const uint16_t u2b_table[];
 extern const uint8_t  b2u_ambiguous_width[];
+extern const uint8_t  b2u_utf8_table[][4];
 
 /* buffer.c */
 #include "buffer.h"
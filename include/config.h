@@ -212,8 +212,20 @@
 #define MAX_BOARD         (8192)         /* ̤j}OӼ */
 #endif
 
-#ifndef HASH_BITS
-#define HASH_BITS         (16)           /* userid->uid hashing bits */
+#if defined(HASH_BITS) && !defined(UHASH_BITS)
+#define UHASH_BITS        HASH_BITS      /* old pttbbs.conf name */
+#endif
+
+#ifndef UHASH_BITS                      /* userid->uid hash slots, (1<<bits) >= MAX_USERS*3/2 */
+# if   MAX_USERS*3/2 <= (1<<16)
+#  define UHASH_BITS      (16)
+# elif MAX_USERS*3/2 <= (1<<18)
+#  define UHASH_BITS      (18)
+# elif MAX_USERS*3/2 <= (1<<20)
+#  define UHASH_BITS      (20)
+# else
+#  define UHASH_BITS      (22)
+# endif
 #endif
 
 #ifndef OVERLOADBLOCKFDS
@@ -10,7 +10,7 @@ typedef enum {
     CONV_UTF8,
 } ConvertMode;
 
-extern int (*convert_write)(VBUF *v, char c);
+extern ssize_t (*convert_write)(VBUF *v, int fd, ssize_t sz);
 extern int (*convert_read)(VBUF *v, const void* buf, size_t len);
 extern ConvertMode convert_mode;
 
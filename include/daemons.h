@@ -77,6 +77,7 @@ enum ANGELBEATS_OPERATIONS {
     ANGELBEATS_REQ_REG_NEW,
     ANGELBEATS_REQ_BLAME,
     ANGELBEATS_REQ_SAVE_STATE,
+    ANGELBEATS_REQ_UPDATE_STATE,
     ANGELBEATS_REQ_MAX,
 };
 
@@ -125,12 +126,53 @@ typedef struct {
 #define BRCSTORED_ADDR   ":5133"
 #endif
 
+// Requests are a command byte, the key ("userid#firstlogin") and '\n', and
+// may be sent one after another on a connection.
+//  r: replies int32_t len and len bytes of BRC, or len = -1 if none.
+//  w: followed by int32_t len and len bytes of BRC to keep.
+//  u: followed by int32_t len and len bytes of changed boards, each
+//     brcbid_t bid, brcnbrd_t num and num brc_rec (num = 0 drops it),
+//     applied to the v4 BRC kept.
+// w and u reply a byte, BRCSTORED_OK or BRCSTORED_NEED_WRITE if u could not
+// be applied and the whole BRC should be sent by w instead.
 enum BRCSTORED_OPERATIONS {
     BRCSTORED_REQ_INVALID = 0,
     BRCSTORED_REQ_READ = 'r',
     BRCSTORED_REQ_WRITE = 'w',
+    BRCSTORED_REQ_UPDATE = 'u',
 };
 
+enum BRCSTORED_REPLIES {
+    BRCSTORED_OK = 0,
+    BRCSTORED_NEED_WRITE,
+};
+
+// BRC v4, see docs/brc.txt:
+// brc4_header, brc4_dirent nboards entries sorted by bid, brc_rec nrecs
+// records which brc4_dirent.offset points to.
+#define BRC4_MAGIC      "BRC4"
+
+typedef uint32_t brcbid_t;
+typedef uint16_t brcnbrd_t;
+
+typedef struct {
+    time4_t create;
+    time4_t modified;
+} brc_rec;
+
+typedef struct {
+    char        magic[4];       /* BRC4_MAGIC */
+    uint32_t    nboards;
+    uint32_t    nrecs;
+} brc4_header;
+
+typedef struct {
+    brcbid_t    bid;
+    brcnbrd_t   num;            /* records in use, > 0 */
+    brcnbrd_t   cap;            /* records reserved in the slot */
+    uint32_t    offset;         /* index of the slot in brc_recs */
+} brc4_dirent;
+
 ///////////////////////////////////////////////////////////////////////
 // Comments Daemon
 
@@ -142,13 +184,28 @@ enum BRCSTORED_OPERATIONS {
 #define COMMENTLEN (80)
 #endif
 
+// Requests start with short cb (size of the request) and short operation,
+// and may be sent one after another on a connection. Comments of a file are
+// numbered from 0.
+//  ADD: CommentAddRequest, no reply.
+//  QUERY_COUNT: CommentQueryRequest, replies uint32_t count.
+//  QUERY_BODY: CommentQueryRequest, replies uint16_t size and the
+//      CommentBodyReq start, or size 0 if there is none.
+//  MARK_DELETED: CommentQueryRequest, replies int32_t 0, -1 if there is no
+//      comment start or -2 if it was deleted already.
+//  QUERY_RANGE: CommentRangeRequest, replies uint32_t n and n CommentBodyReq
+//      from start, n <= count and n <= COMMENTD_MAX_RANGE.
+// Deleted comments have type | 0x80000000.
 enum {
     COMMENTD_REQ_ADD = 1,
     COMMENTD_REQ_QUERY_COUNT,
     COMMENTD_REQ_QUERY_BODY,
     COMMENTD_REQ_MARK_DELETED,
+    COMMENTD_REQ_QUERY_RANGE,
 };
 
+#define COMMENTD_MAX_RANGE  (4096)
+
 typedef struct CommentBodyReq {
     time4_t time;
     time4_t ipv4;
@@ -177,6 +234,14 @@ typedef struct {
     CommentKeyReq key;
 } PACKSTRUCT CommentQueryRequest;
 
+typedef struct {
+    short cb;
+    short operation;
+    uint32_t start;
+    uint32_t count;
+    CommentKeyReq key;
+} PACKSTRUCT CommentRangeRequest;
+
 ///////////////////////////////////////////////////////////////////////
 // Posts Daemon
 //
@@ -184,8 +249,20 @@ typedef struct {
 #define POSTD_ADDR   ":5135"
 #endif
 
+// Requests start with short cb and short operation like those of commentd.
+//  ADD: PostAddRequest, keeps BBSHOME/boards/b/board/file as the content
+//      and replies uint32_t length of it.
+//  IMPORT: PostAddRequest, keeps the file as a legacy post: the comments
+//      at the end are parsed and kept apart from the content. No reply.
+//  IMPORT_REMOTE: PostAddRequest, then uint32_t len and len bytes of the
+//      legacy post, kept like IMPORT. No reply.
+//  TERMINATE: replies uint32_t number of IMPORT and IMPORT_REMOTE since
+//      the last TERMINATE on the connection.
+//  GET_CONTENT: PostGetContentRequest, replies uint32_t len and len bytes
+//      of content, then the kept comments as "<kind> author: msg trailing".
 enum {
-    POSTD_REQ_ADD = 1,
+    POSTD_REQ_TERMINATE = 0,
+    POSTD_REQ_ADD,
     POSTD_REQ_IMPORT,
     POSTD_REQ_GET_CONTENT,
     POSTD_REQ_IMPORT_REMOTE,
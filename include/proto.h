@@ -408,8 +408,10 @@ void my_send(const char *uident);
 void setupmailusage(void);
 
 /* mbbsd */
-void show_call_in(int save, int which);
+void show_call_in(int save, const msgque_t *msg);
 void write_request (int sig);
+const sigset_t *waterball_wait_begin(void);
+void waterball_wait_end(void);
 void mkuserdir(const char *userid);
 void log_usies(const char *mode, const char *mesg);
 void system_abort(void);
@@ -447,6 +449,8 @@ void m_sob_brd(char *bname,char *fromdir);
 
 /* pager */
 int more(const char *fpath, int promptend);
+int more_latency(const char *fpath, int promptend,
+		 int op, const struct timeval *begin);
 int more_inmemory(void *content, int size, int promptend);
 /* piaip's new pager, pmore.c */
 int pmore (const char *fpath, int promptend);
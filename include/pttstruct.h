@@ -318,6 +318,18 @@ typedef struct msgque_t {
     int     msgmode;
 } msgque_t;
 
+/* waterballs waiting for a session, see common/bbs/msgring.c.
+ * Any process may add (claiming head with CAS), only the owner takes.
+ * seq[] tells the state of each slot for position p (slot p % MAX_MSGS,
+ * turn p / MAX_MSGS): 2*turn if free, 2*turn+1 once the message is in. */
+typedef struct msgring_t {
+    unsigned int    head;           /* next position to add */
+    unsigned int    tail;           /* next position to take */
+    unsigned int    waiting;        /* owner sleeps for input, wake it up */
+    unsigned int    seq[MAX_MSGS];
+    msgque_t        msgs[MAX_MSGS];
+} msgring_t;
+
 #define ALERT_NEW_MAIL        (0x01)
 #define ISNEWMAIL(utmp)       (utmp->alerts & ALERT_NEW_MAIL)
 #define CLEAR_ALERT_NEWMAIL(utmp)    { utmp->alerts &= ~ALERT_NEW_MAIL; }
@@ -364,10 +376,8 @@ typedef struct userinfo_t {
     char    gap_3[4];
 
     /* messages */
-    char    msgcount;
-    char    _unused4[3];
-    msgque_t        msgs[MAX_MSGS];
-    char    gap_4[sizeof(msgque_t)];   /* avoid msgs racing and overflow */
+    msgring_t       msgring;
+    char    gap_4[4];
 
     /* user status */
     char    birth;                   /* O_Oͤ Ptt*/
@@ -485,7 +495,28 @@ typedef struct keeploc_t {
 // ѽЦnߤHz shm: 
 // (2) userinfo_t iH@ǤwΪ
 
-#define SHM_VERSION 4842
+/* uhash: open addressed userid->uid table, see common/bbs/cache.c */
+#define UHASH_KEYLEN    (16)    /* lowercased userid, zero padded */
+typedef struct {
+    uint32_t tag;   /* StringHash() of userid */
+    int32_t  uid;   /* 0 for empty slot */
+} uhash_slot_t;
+
+/* live utmp indexes in SHM->UTMPidx, see utmpindex_* in common/bbs/cache.c */
+enum UTMPIDX_TYPE {
+    UTMPIDX_USERID,
+    UTMPIDX_UID,
+    UTMPIDX_PID,
+    UTMPIDX_MAX
+};
+
+/* nodes per session in the reverse friend index (SHM->FREF*) */
+#define FREF_PER_UTMP   (MAX_FRIEND + MAX_REJECT)
+
+/* write lock stripes of the mmap'ed .PASSWD (SHM->PASSWDlock) */
+#define PASSWD_LOCK_STRIPES (1024)
+
+#define SHM_VERSION 4849
 typedef struct {
     int   version;  // SHM_VERSION   for verification
     int   size;	    // sizeof(SHM_t) for verification
@@ -494,8 +525,6 @@ typedef struct {
     /* uhash is a userid->uid hash table -- jochang */
     char    userid[MAX_USERS][IDLEN + 1];
     char    gap_1[IDLEN+1];
-    int     next_in_hash[MAX_USERS];
-    char    gap_2[sizeof(int)];
     int     money[MAX_USERS];
     char    gap_3[sizeof(int)];
     // TODO(piaip) Always have this var - no more #ifdefs in structure.
@@ -503,7 +532,11 @@ typedef struct {
     time4_t cooldowntime[MAX_USERS];
 #endif
     char    gap_4[sizeof(int)];
-    int     hash_head[1 << HASH_BITS];
+    uhash_slot_t uhash[1 << UHASH_BITS];
+    char    uhash_key[1 << UHASH_BITS][UHASH_KEYLEN]; /* parallel to uhash[] */
+    /* free passwd slots (userid ""), kept out of uhash[] */
+    uint32_t uhash_free[(MAX_USERS + 31) / 32];
+    int     uhash_nfree;
     char    gap_5[sizeof(int)];
     int     number;				/* # of users total */
     int     loaded;				/* .PASSWD has been loaded? */
@@ -521,6 +554,25 @@ typedef struct {
     char    UTMPneedsort;
     char    UTMPbusystate;
 
+    /* live indexes of uinfo[] by userid/uid/pid, updated on every
+     * login/logout (writers take UTMPidxlock, readers check UTMPidxseq) */
+    int     UTMPidxlock;    /* pid of the writer, 0 if free */
+    unsigned int UTMPidxseq;/* seqlock, odd while being updated */
+    int     UTMPidxnumber;
+    int     UTMPidx[UTMPIDX_MAX][USHM_SIZE];
+
+    /* reverse friend index: who (online) has uid as friend or reject,
+     * see friendref_* in common/bbs/cache.c */
+    int     FREFlock;       /* pid of the writer, 0 if free */
+    int     FREFhead[MAX_USERS + 1];
+    int     FREFnext[USHM_SIZE][FREF_PER_UTMP];
+    int     FREFprev[USHM_SIZE][FREF_PER_UTMP];
+
+    /* mmap'ed .PASSWD (USE_PASSWD_MMAP), see common/bbs/passwd.c:
+     * per record seqlock (odd while being written) and striped write locks */
+    unsigned int PASSWDseq[MAX_USERS];
+    int     PASSWDlock[PASSWD_LOCK_STRIPES];   /* pid of the writer, 0 if free */
+
     /* brdshm */
     char    gap_8[sizeof(int)];
     int     BMcache[MAX_BOARD][MAX_BMs];
@@ -584,6 +636,7 @@ typedef struct {
     } GV2;
     /* statistic */
     unsigned int    statistic[STAT_MAX];
+    unsigned int    latency[LAT_STRIPES][LAT_MAX][LAT_BUCKETS];
 
     // qe@Gmϥ (fromcache). {wQ daemon/fromd NC
     unsigned int    _deprecated_home_ip[MAX_FROM];
@@ -6,9 +6,10 @@
 } while(0)
 #define STATINC(X) STAT(X, ++)
 
+#include <sys/time.h>
+
 #ifdef CPU_STATS
 
-#include <sys/time.h>
 #include <sys/resource.h>
 
 #define BEGINSTAT(name) struct rusage name ## _start; getrusage(RUSAGE_SELF, &(name ## _start));
@@ -83,8 +84,33 @@ enum { // XXX description in shmctl.c
     STAT_LOGIND_SERVSTART,
     STAT_LOGIND_SERVFAIL,
     STAT_LOGIND_PASSWDPROMPT,
+    STAT_BBSLUA,
+    STAT_BBSLUA_CACHEHIT,
     /* insert here. don't forget update shmctl.c */
     STAT_NUM,
     STAT_MAX=512
 };
+
+/* Latency histograms, SHM->latency[stripe][op][bucket].
+ * Bucket b counts calls of [2^b, 2^(b+1)) microseconds (bucket 0 also takes
+ * 0us). A process adds to stripe (pid % LAT_STRIPES) with an atomic add and
+ * readers sum up the stripes, see common/bbs/latency.c. */
+#define LAT_BUCKETS (32)
+#define LAT_STRIPES (64)
+
+#define BEGINLAT(name) struct timeval name ## _lat; gettimeofday(&(name ## _lat), NULL);
+#define ENDLAT(name) latency_add(name, &(name ## _lat))
+
+enum { // XXX description in common/bbs/latency.c
+    LAT_LOGIN,
+    LAT_READPOST,
+    LAT_DOPOST,
+    LAT_RECOMMEND,
+    LAT_SELECTREAD,
+    LAT_SEARCHUSER,
+    LAT_DOUPDATE,
+    /* insert here. don't forget update latency.c */
+    LAT_NUM,
+    LAT_MAX=16
+};
 #endif
@@ -126,44 +126,11 @@ aidu_t aidc2aidu(const char *aidc)
 int search_aidu_in_bfile(const char *bfile, const aidu_t aidu)
 {
   char fn[FNLEN];
-  int fd;
-  fileheader_t fhs[64];
-  int len, i;
-  int pos = 0;
-  int found = 0;
-  int lastpos = 0;
 
   if(aidu2fn(fn, aidu) == NULL)
     return -1;
-  if((fd = open(bfile, O_RDONLY, 0)) < 0)
-    return -1;
-
-  while(!found && (len = read(fd, fhs, sizeof(fhs))) > 0)
-  {
-    len /= sizeof(fileheader_t);
-    for(i = 0; i < len; i ++)
-    {
-      int l;
-      if(strcmp(fhs[i].filename, fn) == 0 ||
-         ((aidu & 0xfff) == 0 && (l = strlen(fhs[i].filename)) > 6 &&
-          strncmp(fhs[i].filename, fn, l) == 0))
-      {
-        if(fhs[i].filemode & FILE_BOTTOM)
-        {
-          lastpos = pos;
-        }
-        else
-        {
-          found = 1;
-          break;
-        }
-      }
-      pos ++;
-    }
-  }
-  close(fd);
-
-  return (found ? pos : (lastpos ? lastpos : -1));
+  /* AIDs without the random part match the filename prefix */
+  return fileheader_find(bfile, fn, (aidu & 0xfff) == 0);
 }
 
 int search_aidu_in_board(SearchAIDResult_t *r, const char *bname, const aidu_t aidu)
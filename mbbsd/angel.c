@@ -92,8 +92,11 @@ angel_notify_activity(const char *userid) {
 void
 angel_toggle_pause()
 {
+    int old_pause;
+
     if (!HasUserPerm(PERM_ANGEL) || !currutmp)
 	return;
+    old_pause = currutmp->angelpause;
     currutmp->angelpause ++;
     currutmp->angelpause %= ANGELPAUSE_MODES;
     if (cuser.uflag & UF_NEW_ANGEL_PAGER) {
@@ -105,6 +108,9 @@ angel_toggle_pause()
             "}\t\t",
             NULL) % ANGELPAUSE_MODES;
     }
+    // angelbeats caches our state; logins are noticed but pause is not.
+    if (currutmp->angelpause != old_pause)
+        angel_beats_do_request(ANGELBEATS_REQ_UPDATE_STATE, 0, usernum);
 }
 
 void
@@ -158,6 +158,10 @@ modify_dir_lite(
     // PttLock(fd, sz, sizeof(fhdr), F_UNLCK);
 
     close(fd);
+
+    // keep the select_read() index in step with renamed posts
+    if ((title && *title) || (owner && *owner))
+	srindex_touch(direct, ent);
     return 0;
 }
 
@@ -1413,6 +1417,8 @@ do_post_article(int edflags)
 	pressanykey();
 	return FULLUPDATE;
     }
+    // from here on, no user input till the end
+    BEGINLAT(LAT_DOPOST);
     /* set owner to Anonymous for Anonymous board */
 
     // check TN_ANNOUNCE again for non-BMs...
@@ -1613,6 +1619,7 @@ do_post_article(int edflags)
         PostAddRecord(bp->brdname, &postfile, dashc(fpath));
 #endif
     }
+    ENDLAT(LAT_DOPOST);
     pressanykey();
     return FULLUPDATE;
 }
@@ -2327,6 +2334,7 @@ read_post(int ent, fileheader_t * fhdr, const char *direct)
 	return READ_SKIP;
 
     STATINC(STAT_READPOST);
+    BEGINLAT(LAT_READPOST);
     setdirpath(genbuf, direct, fhdr->filename);
 
 #ifdef USE_LIVE_ALLPOST
@@ -2371,7 +2379,8 @@ read_post(int ent, fileheader_t * fhdr, const char *direct)
     } while (0);
 #endif
 
-    more_result = more(genbuf, YEA);
+    // LAT_READPOST is taken when the first page is drawn
+    more_result = more_latency(genbuf, YEA, LAT_READPOST, &LAT_READPOST_lat);
 
     LOG_IF(LOG_CONF_CRAWLER, {
            // kcwu: log crawler
@@ -2674,16 +2683,7 @@ do_add_recommend(const char *direct, fileheader_t *fhdr,
     int     update = 0;
     int fd;
     BEGINSTAT(STAT_DORECOMMEND);
-
-    /*
-      race here:
-      F system calls , {bηe +1 gJ .DIR .
-      y
-      1.YӤɦWQ, NgɦW (yF)
-      2.SsŪ@, ҥHƥiQֺ
-      3.YɭԫeQR, N[媺
-
-     */
+    BEGINLAT(LAT_RECOMMEND);
 
     // Lock and append, (lock may be caused other add_recommend or edit_post)
     setdirpath(path, direct, fhdr->filename);
@@ -2724,30 +2724,30 @@ do_add_recommend(const char *direct, fileheader_t *fhdr,
 	goto error;
     }
 
-    // XXX do lock some day!
-
-    /* This is a solution to avoid most racing (still some), but cost four
-     * system calls.                                                        */
-
-    if(type == RECTYPE_GOOD && fhdr->recommend < MAX_RECOMMENDS )
+    if(type == RECTYPE_GOOD)
           update = 1;
-    else if(type == RECTYPE_BAD && fhdr->recommend > -MAX_RECOMMENDS)
+    else if(type == RECTYPE_BAD)
           update = -1;
-    fhdr->recommend += update;
 
     // since we want to do 'modification'...
     fhdr->modified = dasht(path);
 
     if (fhdr->modified > 0)
     {
-	if (modify_dir_lite(direct, ent, fhdr->filename,
-		fhdr->modified, NULL, NULL, NULL, update, NULL, 0, 0) < 0)
+	int recommend;
+
+	// counted on the record in .DIR under its lock, not on our copy
+	// (which may be stale), and only if it is still this article.
+	if (fileheader_add_recommend(direct, ent, fhdr->filename, update,
+		    fhdr->modified, &recommend) < 0)
 	    goto error;
+	fhdr->recommend = recommend;
 	// mark my self as "read this file".
 	brc_addlist(fhdr->filename, fhdr->modified);
     }
 
     ENDSTAT(STAT_DORECOMMEND);
+    ENDLAT(LAT_RECOMMEND);
     return 0;
 
  error:
@@ -116,6 +116,14 @@ enum {
 #define BLSCONF_PREFIX      "v1_"
 #define BLSCONF_MAXIO       32          // prevent bursting system
 
+// BBS-Lua compiled chunk cache
+#define BLCCONF_ENABLED
+#define BLCCONF_PATH        BBSHOME "/luastore/cache"
+#define BLCCONF_PREFIX      "c1_"
+#define BLCCONF_MAGIC       "BLC1"
+#define BLCCONF_MAXSIZE     (512*1024)  // larger scripts are not cached
+#define BLCCONF_TOUCH       (86400)     // refresh mtime of hit chunks, for expire
+
 // #define BBSLUA_USAGE
 
 #ifdef _WIN32
@@ -153,6 +161,12 @@ BBSLuaRT blrt = {0};
 static int bbslua_count;
 #endif
 
+enum {
+    BLC_OFF = 0,
+    BLC_HIT,
+    BLC_MISS,
+};
+
 //////////////////////////////////////////////////////////////////////////
 // UTILITIES
 //////////////////////////////////////////////////////////////////////////
@@ -1649,6 +1663,170 @@ bbslua_path2hash(const char *path)
     return fnv_32_str(path, seed);
 }
 
+//////////////////////////////////////////////////////////////////////////
+// BBSLUA Chunk Cache
+//////////////////////////////////////////////////////////////////////////
+// Compiled scripts are kept in BLCCONF_PATH, named by the hash of the
+// source text (and lineshift, which changes the line info), so every
+// mbbsd process shares them and an edited article simply gets a new
+// chunk. Stale chunks are removed by cron (see sample/crontab).
+
+#ifdef BLCCONF_ENABLED
+typedef struct {
+    char magic[4];      // BLCCONF_MAGIC
+    uint32_t srcsize;   // to double check the hash
+    int32_t lineshift;
+    uint32_t size;      // size of chunk following the header
+} BBSLuaChunkHdr;
+
+typedef struct {
+    int fd;
+    size_t size;
+} BBSLuaChunkWriter;
+
+static void
+blc_setfn(char *fn, size_t sz, const char *ps, size_t len, int lineshift)
+{
+    Fnv64_t key = fnv_64_str(LUA_RELEASE, FNV1_64_INIT);
+    key = fnv_64_buf(&lineshift, sizeof(lineshift), key);
+    key = fnv_64_buf(ps, len, key);
+    snprintf(fn, sz, BLCCONF_PATH "/" BLCCONF_PREFIX "%016llx",
+            (unsigned long long)key);
+}
+
+static int
+blc_load(lua_State *L, const char *fn, size_t len, int lineshift)
+{
+    BBSLuaChunkHdr hdr;
+    struct stat st;
+    char *buf;
+    int fd, r;
+
+    if ((fd = open(fn, O_RDONLY)) < 0)
+        return -1;
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+            memcmp(hdr.magic, BLCCONF_MAGIC, sizeof(hdr.magic)) != 0 ||
+            hdr.srcsize != len || hdr.lineshift != lineshift ||
+            hdr.size > BLCCONF_MAXSIZE ||
+            (buf = (char*) malloc(hdr.size)) == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+    if (read(fd, buf, hdr.size) != (ssize_t)hdr.size)
+    {
+        free(buf);
+        close(fd);
+        return -1;
+    }
+    if (fstat(fd, &st) == 0 && st.st_mtime + BLCCONF_TOUCH < time(NULL))
+        futimes(fd, NULL);
+    close(fd);
+
+    r = luaL_loadbuffer(L, buf, hdr.size, "BBS-Lua");
+    free(buf);
+    if (r != 0)
+    {
+        lua_pop(L, 1);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+blc_writer(lua_State *L, const void *p, size_t sz, void *ud)
+{
+    BBSLuaChunkWriter *w = (BBSLuaChunkWriter*) ud;
+    (void)L;
+
+    if (w->size + sz > BLCCONF_MAXSIZE ||
+            write(w->fd, p, sz) != (ssize_t)sz)
+        return 1;
+    w->size += sz;
+    return 0;
+}
+
+// saves the function on top of the stack
+static void
+blc_save(lua_State *L, const char *fn, size_t len, int lineshift)
+{
+    BBSLuaChunkHdr hdr;
+    BBSLuaChunkWriter w;
+    char tmpfn[PATHLEN];
+
+    snprintf(tmpfn, sizeof(tmpfn), "%s.%d", fn, (int)getpid());
+    if ((w.fd = open(tmpfn, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+        // first time here
+        mkdir(BLSCONF_GPATH, DEFAULT_FOLDER_CREATE_PERM);
+        mkdir(BLCCONF_PATH, DEFAULT_FOLDER_CREATE_PERM);
+        if ((w.fd = open(tmpfn, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+            return;
+    }
+    w.size = 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, BLCCONF_MAGIC, sizeof(hdr.magic));
+    hdr.srcsize = len;
+    hdr.lineshift = lineshift;
+
+    if (lseek(w.fd, sizeof(hdr), SEEK_SET) != sizeof(hdr) ||
+            lua_dump(L, blc_writer, &w) != 0)
+    {
+        close(w.fd);
+        unlink(tmpfn);
+        return;
+    }
+    hdr.size = w.size;
+    if (pwrite(w.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+    {
+        close(w.fd);
+        unlink(tmpfn);
+        return;
+    }
+    close(w.fd);
+
+    // others may be reading fn now, so never write it in place.
+    if (rename(tmpfn, fn) != 0)
+        unlink(tmpfn);
+}
+#endif // BLCCONF_ENABLED
+
+// same as bbslua_loadbuffer, but tries the chunk cache first.
+// *pcache is set to BLC_OFF, BLC_HIT or BLC_MISS.
+static int
+bbslua_loadcached(lua_State *L, const char *buff, size_t size,
+        int lineshift, int *pcache)
+{
+#ifdef BLCCONF_ENABLED
+    char fn[PATHLEN];
+    int r;
+
+    if (size > BLCCONF_MAXSIZE)
+    {
+        *pcache = BLC_OFF;
+        return bbslua_loadbuffer(L, buff, size, "BBS-Lua", lineshift);
+    }
+
+    blc_setfn(fn, sizeof(fn), buff, size, lineshift);
+    if (blc_load(L, fn, size, lineshift) == 0)
+    {
+        *pcache = BLC_HIT;
+        STATINC(STAT_BBSLUA_CACHEHIT);
+        return 0;
+    }
+
+    *pcache = BLC_MISS;
+    r = bbslua_loadbuffer(L, buff, size, "BBS-Lua", lineshift);
+    if (r == 0)
+        blc_save(L, fn, size, lineshift);
+    return r;
+#else // !BLCCONF_ENABLED
+    *pcache = BLC_OFF;
+    return bbslua_loadbuffer(L, buff, size, "BBS-Lua", lineshift);
+#endif // !BLCCONF_ENABLED
+}
+
 //////////////////////////////////////////////////////////////////////////
 // BBSLUA Main
 //////////////////////////////////////////////////////////////////////////
@@ -1662,10 +1840,11 @@ bbslua(const char *fpath)
     char bfpath[PATHLEN] = "";
     int sz = 0;
     int lineshift = 0;
+    int cache = BLC_OFF;
     AllocData ad;
 #ifdef BBSLUA_USAGE
     struct rusage rusage_begin, rusage_end;
-    struct timeval lua_begintime, lua_endtime;
+    struct timeval lua_begintime, lua_loadtime, lua_endtime;
     gettimeofday(&lua_begintime, NULL);
     getrusage(0, &rusage_begin);
 #endif
@@ -1680,6 +1859,7 @@ bbslua(const char *fpath)
 
     // initialize runtime
     BL_INIT_RUNTIME();
+    STATINC(STAT_BBSLUA);
 
 #ifdef BBSLUA_USAGE
     bbslua_count = 0;
@@ -1717,7 +1897,10 @@ bbslua(const char *fpath)
     bbsluaRegConst(L);
 
     // load script
-    r = bbslua_loadbuffer(L, ps, pe-ps, "BBS-Lua", lineshift);
+    r = bbslua_loadcached(L, ps, pe-ps, lineshift, &cache);
+#ifdef BBSLUA_USAGE
+    gettimeofday(&lua_loadtime, NULL);
+#endif
 
     // build hash or store name
     blrt.storename = bbslua_path2hash(fpath);
@@ -1778,9 +1961,12 @@ bbslua(const char *fpath)
         walltime = bl_tv2double(&lua_endtime) - bl_tv2double(&lua_begintime);
         load = cputime / walltime;
         log_filef("log/bbslua.log", LOG_CREAT,
-                "maxalloc=%d leak=%d op=%d cpu=%.3f Mop/s=%.1f load=%f file=%s\n",
+                "maxalloc=%d leak=%d op=%d cpu=%.3f Mop/s=%.1f load=%f "
+                "startup=%.3fms cache=%s file=%s\n",
                 (int)ad.max_alloc_size, (int)ad.alloc_size,
                 bbslua_count, cputime, bbslua_count / cputime / 1000000.0, load * 100,
+                (bl_tv2double(&lua_loadtime) - bl_tv2double(&lua_begintime)) * 1000,
+                cache == BLC_HIT ? "hit" : cache == BLC_MISS ? "miss" : "off",
                 fpath);
     }
 #endif
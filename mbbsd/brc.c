@@ -5,6 +5,9 @@
  * ɮתӸ`AШ docs/brc.txtC
  * v3: add last modified time for comment system. double max size.
  *     original time_t as 'create'.
+ * v4: boards in a directory sorted by bid, records in per-board slots.
+ *     lookup is a binary search and an update rewrites only its own slot.
+ *     v3 files are converted when loaded.
  */
 
 // WARNING: Check ../pttbbs.conf, you may have overide these value there
@@ -16,232 +19,297 @@
 
 #define BRC_BLOCKSIZE   1024
 
-// Note: BRC v3 should already support BRC_MAXSIZE > 65535,
-// but not widely tested yet.
-// MAX_BOARD >65535 is already tested on PTT2 since 2009/09/10.
-#if BRC_MAXSIZE > 65535
-#error Max number of boards or BRC_MAXSIZE cannot fit in unsigned short, \
- please rewrite brc.c (v2)
-#endif
-
-typedef uint32_t brcbid_t;
-typedef uint16_t brcnbrd_t;
-
-typedef struct {
-    time4_t create;
-    time4_t modified;
-} brc_rec;
+// A v4 directory entry takes at most twice the bytes of a v3 record
+// header, so any v3 file within BRC_MAXSIZE converts without losing boards.
+#define BRC4_MAXSIZE    (BRC_MAXSIZE * 2)
+#define BRC4_GRAIN      8       /* slots grow by this many records */
 
 /* old brc rc file form:
  * board_name     15 bytes
  * brc_num         1 byte, binary integer
  * brc_list       brc_num * sizeof(brc_rec) bytes  */
 
+/* v3 brc rc file form (.brc3), only read for conversion:
+ * bid            sizeof(brcbid_t) bytes
+ * brc_num        sizeof(brcnbrd_t) bytes
+ * brc_list       brc_num * sizeof(brc_rec) bytes
+ * repeated, the most recently updated board first. */
+
+/* v4 brc rc file form (.brc4): brc4_header and the rest in daemons.h */
+
 static char brc_initialized = 0;
 static time4_t brc_expire_time;
  /* Will be set to the time one year before login. All the files created
   * before then will be recognized read. */
 
 static int     brc_changed = 0;	/**< brc_list/brc_num changed */
-/* The below two will be filled by read_brc_buf() and brc_update() */
-static char   *brc_buf = NULL;
-static int     brc_size;
-static int     brc_alloc;
+/* The below will be filled by read_brc_buf() and brc_update() */
+static char         brc_loaded = 0;
+static brc4_dirent *brc_dir = NULL;
+static int          brc_ndir;
+static int          brc_diralloc;
+static brc_rec     *brc_recs = NULL;
+static int          brc_nrecs;
+static int          brc_recalloc;
+static int          brc_nlive;      /**< records in use, sum of num */
+static int          brc_garbage;    /**< records in abandoned slots */
 
 // read records for currbid
 static int             brc_currbid;
 static int             brc_num;
 static brc_rec         brc_list[BRC_MAXNUM];
 
-static char * const fn_brc = ".brc3";
+// boards changed since the records were loaded from or sent to brcstored
+static brcbid_t *brc_dirty = NULL;
+static int       brc_ndirty;
+static int       brc_dirtyalloc;
+static char      brc_remote_v4 = 0;    /**< brcstored has our v4 records */
+
+static char * const fn_brc = ".brc4";
+static char * const fn_brc3 = ".brc3";
 
 /**
- * find read records of bid in given buffer region
+ * binary search \a bid in the board directory
  *
- * @param[in]	begin
- * @param[in]	endp
  * @param	bid
- * @param[out]	num	number of records, which could be written for \a bid
- * 			= brc_num		if found
- * 			= 0 or dangling size	if not found
+ * @param[out]	pos	index of \a bid, or where it should be inserted
  *
- * @return	address of record. \a begin <= addr < \a endp.
- * 		0	if not found
+ * @return	1 if found, 0 if not
  */
-/* Returns the address of the record strictly between begin and endp with
- * bid equal to the parameter. Returns 0 if not found.
- * brcnbrd_t *num is an output parameter which will filled with brc_num
- * if the record is found. If not found the record, *num will be the number
- * of dangling bytes. */
-static char *
-brc_findrecord_in(char *begin, char *endp, brcbid_t bid, brcnbrd_t *num)
+static int
+brc_dir_search(brcbid_t bid, int *pos)
 {
-    char     *tmpp, *ptr = begin;
-    brcbid_t tbid;
-    while (ptr + sizeof(brcbid_t) + sizeof(brcnbrd_t) < endp) {
-	/* for each available records */
-	tmpp = ptr;
-	tbid = *(brcbid_t*)tmpp;
-	tmpp += sizeof(brcbid_t);
-	*num = *(brcnbrd_t*)tmpp;
-	tmpp += sizeof(brcnbrd_t) + *num * sizeof(brc_rec); /* end of record */
-
-	if ( tmpp > endp ){
-	    /* dangling, ignore the trailing data */
-	    *num = (brcnbrd_t)(endp - ptr); /* for brc_insert_record() */
-	    return 0;
-	}
-	if ( tbid == bid )
-	    return ptr;
-	ptr = tmpp;
+    int lo = 0, hi = brc_ndir, mid;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (brc_dir[mid].bid < bid)
+	    lo = mid + 1;
+	else
+	    hi = mid;
     }
+    *pos = lo;
+    return lo < brc_ndir && brc_dir[lo].bid == bid;
+}
 
-    *num = 0;
-    return 0;
+static int
+brc_bid_cmp(const void *a, const void *b)
+{
+    brcbid_t x = *(const brcbid_t*)a, y = *(const brcbid_t*)b;
+    return x < y ? -1 : x > y;
 }
 
-static brc_rec *
-brc_find_record(int bid, int *num)
+/**
+ * sort brc_dirty and drop the duplicates
+ */
+static void
+brc_dirty_uniq(void)
 {
-    char *p;
-    brcnbrd_t tnum;
-    p = brc_findrecord_in(brc_buf, brc_buf + brc_size, bid, &tnum);
-    *num = tnum;
-    if (p)
-	return (brc_rec*)(p + sizeof(brcbid_t) + sizeof(brcnbrd_t));
-    *num = 0;
-    return 0;
+    int i, j;
+
+    qsort(brc_dirty, brc_ndirty, sizeof(brcbid_t), brc_bid_cmp);
+    for (i = j = 0; i < brc_ndirty; i++)
+	if (j == 0 || brc_dirty[i] != brc_dirty[j - 1])
+	    brc_dirty[j++] = brc_dirty[i];
+    brc_ndirty = j;
 }
 
-static char *
-brc_putrecord(char *ptr, char *endp, brcbid_t bid,
-	      brcnbrd_t num, const brc_rec *list)
+static void
+brc_mark_dirty(brcbid_t bid)
 {
-    char * tmp;
-    if (num > 0 && list[0].create > brc_expire_time &&
-	    ptr + sizeof(brcbid_t) + sizeof(brcnbrd_t) < endp) {
-	if (num > BRC_MAXNUM)
-	    num = BRC_MAXNUM;
+    if (brc_ndirty && brc_dirty[brc_ndirty - 1] == bid)
+	return;
+    if (brc_ndirty >= brc_dirtyalloc) {
+	brc_dirty_uniq();
+	if (brc_ndirty >= brc_dirtyalloc / 2) {
+	    brc_dirtyalloc += BRC_BLOCKSIZE / sizeof(brcbid_t);
+	    brc_dirty = (brcbid_t*)realloc(brc_dirty,
+					   brc_dirtyalloc * sizeof(brcbid_t));
+	    assert(brc_dirty);
+	}
+    }
+    brc_dirty[brc_ndirty++] = bid;
+}
 
-	if (num == 0) return ptr;
+static brc_rec *
+brc_find_record(int bid, int *num)
+{
+    int pos;
 
-	*(brcbid_t*)ptr  = bid;         /* write in bid */
-	ptr += sizeof(brcbid_t);
-	*(brcnbrd_t*)ptr = num;         /* write in brc_num */
-	ptr += sizeof(brcnbrd_t);
-	tmp = ptr + num * sizeof(brc_rec);
-	if (tmp <= endp)
-	    memcpy(ptr, list, num * sizeof(brc_rec)); /* write in brc_list */
-	ptr = tmp;
+    if (!brc_dir_search(bid, &pos)) {
+	*num = 0;
+	return 0;
     }
-    return ptr;
+    *num = brc_dir[pos].num;
+    return brc_recs + brc_dir[pos].offset;
 }
 
+/**
+ * @return size of the v4 file of current records, without unused slots
+ */
 static inline int
-brc_enlarge_buf(void)
+brc_data_size(void)
 {
-    char *buffer;
-    if (brc_alloc >= BRC_MAXSIZE)
-	return 0;
+    return sizeof(brc4_header) + brc_ndir * sizeof(brc4_dirent) +
+	brc_nlive * sizeof(brc_rec);
+}
 
-#ifdef CRITICAL_MEMORY
-#define THE_MALLOC(X) MALLOC(X)
-#define THE_FREE(X) FREE(X)
-#else
-#define THE_MALLOC(X) alloca(X)
-#define THE_FREE(X) (void)(X)
-    /* alloca get memory from stack and automatically freed when
-     * function returns. */
-#endif
+/**
+ * move the slots together, dropping abandoned slots
+ *
+ * @param trim	also shrink each slot to the records in use
+ */
+static void
+brc_compact(int trim)
+{
+    brc_rec *recs;
+    int      i, n = 0;
 
-    buffer = (char*)THE_MALLOC(brc_alloc);
-    assert(buffer);
+    if (!brc_recs || (!brc_garbage && !trim))
+	return;
 
-    memcpy(buffer, brc_buf, brc_alloc);
-    free(brc_buf);
-    brc_alloc += BRC_BLOCKSIZE;
-    brc_buf = (char*)malloc(brc_alloc);
-    assert(brc_buf);
-    memcpy(brc_buf, buffer, brc_alloc - BRC_BLOCKSIZE);
+    recs = (brc_rec*)malloc(brc_recalloc * sizeof(brc_rec));
+    assert(recs);
+    for (i = 0; i < brc_ndir; i++) {
+	if (trim)
+	    brc_dir[i].cap = brc_dir[i].num;
+	memcpy(recs + n, brc_recs + brc_dir[i].offset,
+	       brc_dir[i].cap * sizeof(brc_rec));
+	brc_dir[i].offset = n;
+	n += brc_dir[i].cap;
+    }
+    free(brc_recs);
+    brc_recs = recs;
+    brc_nrecs = n;
+    brc_garbage = 0;
+}
+
+/**
+ * reserve a slot of \a cap records at the end of brc_recs
+ *
+ * @return	index of the slot
+ */
+static uint32_t
+brc_alloc_slot(int cap)
+{
+    uint32_t offset;
+
+    if (brc_nrecs + cap > brc_recalloc && brc_garbage * 4 >= brc_nrecs)
+	brc_compact(0);
+    if (brc_nrecs + cap > brc_recalloc) {
+	brc_recalloc = (brc_nrecs + cap) * sizeof(brc_rec) + BRC_BLOCKSIZE;
+	brc_recalloc = brc_recalloc / BRC_BLOCKSIZE * BRC_BLOCKSIZE /
+	    sizeof(brc_rec);
+	brc_recs = (brc_rec*)realloc(brc_recs, brc_recalloc * sizeof(brc_rec));
+	assert(brc_recs);
 
 #ifdef DEBUG
-    vmsgf("brc enlarged to %d bytes", brc_alloc);
+	vmsgf("brc enlarged to %d records", brc_recalloc);
 #endif
+    }
+    offset = brc_nrecs;
+    brc_nrecs += cap;
+    return offset;
+}
 
-    THE_FREE(buffer);
-    return 1;
+static brc4_dirent *
+brc_dir_insert(int pos, brcbid_t bid)
+{
+    if (brc_ndir >= brc_diralloc) {
+	brc_diralloc += BRC_BLOCKSIZE / sizeof(brc4_dirent);
+	brc_dir = (brc4_dirent*)realloc(brc_dir,
+					brc_diralloc * sizeof(brc4_dirent));
+	assert(brc_dir);
+    }
+    memmove(brc_dir + pos + 1, brc_dir + pos,
+	    (brc_ndir - pos) * sizeof(brc4_dirent));
+    brc_ndir++;
+    memset(brc_dir + pos, 0, sizeof(brc4_dirent));
+    brc_dir[pos].bid = bid;
+    return brc_dir + pos;
+}
 
-#undef THE_MALLOC
-#undef THE_FREE
+static void
+brc_dir_remove(int pos)
+{
+    brc_mark_dirty(brc_dir[pos].bid);
+    brc_nlive -= brc_dir[pos].num;
+    brc_garbage += brc_dir[pos].cap;
+    brc_ndir--;
+    memmove(brc_dir + pos, brc_dir + pos + 1,
+	    (brc_ndir - pos) * sizeof(brc4_dirent));
 }
 
-static inline void
-brc_get_buf(int size){
-    if (!size)
-	brc_alloc = BRC_BLOCKSIZE;
-    else
-	brc_alloc = (size + BRC_BLOCKSIZE - 1) / BRC_BLOCKSIZE * BRC_BLOCKSIZE;
-    if (brc_alloc > BRC_MAXSIZE)
-	brc_alloc = BRC_MAXSIZE;
-    brc_buf = (char*)malloc(brc_alloc);
-    assert(brc_buf);
+/**
+ * drop boards until the records fit in BRC4_MAXSIZE.
+ *
+ * The board with the oldest newest-read record goes first, which is what
+ * the user has not been reading for the longest time.
+ *
+ * @param keep	bid never dropped, the one being written
+ */
+static void
+brc_shrink(brcbid_t keep)
+{
+    int i, victim;
+
+    while (brc_data_size() > BRC4_MAXSIZE) {
+	victim = -1;
+	for (i = 0; i < brc_ndir; i++) {
+	    if (brc_dir[i].bid == keep)
+		continue;
+	    if (victim < 0 || brc_recs[brc_dir[i].offset].create <
+			      brc_recs[brc_dir[victim].offset].create)
+		victim = i;
+	}
+	if (victim < 0)
+	    break;
+	brc_dir_remove(victim);
+    }
 }
 
 static inline void
 brc_insert_record(brcbid_t bid, brcnbrd_t num, const brc_rec* list)
 {
-    char           *ptr;
-    int             new_size, end_size;
-    brcnbrd_t       tnum;
-
-    ptr = brc_findrecord_in(brc_buf, brc_buf + brc_size, bid, &tnum);
+    brc4_dirent    *d;
+    int             pos, cap;
 
     while (num > 0 && list[num - 1].create < brc_expire_time)
 	num--; /* don't write the times before brc_expire_time */
+    if (num > BRC_MAXNUM)
+	num = BRC_MAXNUM;
 
-    if (!ptr) {
-	brc_size -= (int)tnum;
-
-	/* put on the beginning */
-	if (num){
-	    new_size = sizeof(brcbid_t) + sizeof(brcnbrd_t)
-		+ num * sizeof(brc_rec);
-	    brc_size += new_size;
-	    if (brc_size > brc_alloc && !brc_enlarge_buf())
-		brc_size = BRC_MAXSIZE;
-	    if (brc_size > new_size)
-		memmove(brc_buf + new_size, brc_buf, brc_size - new_size);
-	    brc_putrecord(brc_buf, brc_buf + new_size, bid, num, list);
+    if (!brc_dir_search(bid, &pos)) {
+	if (!num) {
+	    brc_changed = 0;
+	    return;
 	}
+	d = brc_dir_insert(pos, bid);
+    } else if (!num) { /* deleting record */
+	brc_dir_remove(pos);
+	brc_changed = 0;
+	return;
     } else {
-	/* ptr points to the old current brc list.
-	 * tmpp is the end of it (exclusive).       */
-	int len = sizeof(brcbid_t) + sizeof(brcnbrd_t) + tnum * sizeof(brc_rec);
-	char *tmpp = ptr + len;
-	end_size = brc_buf + brc_size - tmpp;
-	if (num) {
-	    int sindex = ptr - brc_buf;
-	    new_size = (sizeof(brcbid_t) + sizeof(brcnbrd_t)
-			+ num * sizeof(brc_rec));
-	    brc_size += new_size - len;
-	    if (brc_size > brc_alloc) {
-		if (brc_enlarge_buf()) {
-		    ptr = brc_buf + sindex;
-		    tmpp = ptr + len;
-		} else {
-		    end_size -= brc_size - BRC_MAXSIZE;
-		    brc_size = BRC_MAXSIZE;
-		}
-	    }
-	    if (end_size > 0 && ptr + new_size != tmpp)
-		memmove(ptr + new_size, tmpp, end_size);
-	    brc_putrecord(ptr, brc_buf + brc_alloc, bid, num, list);
-	} else { /* deleting record */
-	    memmove(ptr, tmpp, end_size);
-	    brc_size -= len;
-	}
+	d = brc_dir + pos;
     }
 
+    if (num > d->cap) {
+	/* outgrown, move to a new slot. A new board gets an exact slot:
+	 * most boards only have the one record from toggling all read. */
+	cap = d->cap ? (num + BRC4_GRAIN - 1) / BRC4_GRAIN * BRC4_GRAIN : num;
+	if (cap > BRC_MAXNUM)
+	    cap = BRC_MAXNUM;
+	brc_garbage += d->cap;
+	d->cap = 0;
+	d->offset = brc_alloc_slot(cap);
+	d->cap = cap;
+    }
+    brc_nlive += num - d->num;
+    d->num = num;
+    memcpy(brc_recs + d->offset, list, num * sizeof(brc_rec));
+    brc_mark_dirty(bid);
+
+    brc_shrink(bid);
     brc_changed = 0;
 }
 
@@ -252,16 +320,28 @@ brc_insert_record(brcbid_t bid, brcnbrd_t num, const brc_rec* list)
 void
 brc_release()
 {
-    if (brc_buf) {
-	free(brc_buf);
-	brc_buf = NULL;
+    if (brc_dir) {
+	free(brc_dir);
+	brc_dir = NULL;
+    }
+    if (brc_recs) {
+	free(brc_recs);
+	brc_recs = NULL;
     }
+    if (brc_dirty) {
+	free(brc_dirty);
+	brc_dirty = NULL;
+    }
+    brc_ndirty = brc_dirtyalloc = 0;
+    brc_remote_v4 = 0;
     brc_changed = 0;
-    brc_size = brc_alloc = 0;
+    brc_loaded = 0;
+    brc_ndir = brc_diralloc = 0;
+    brc_nrecs = brc_recalloc = brc_nlive = brc_garbage = 0;
 }
 
 /**
- * write \a brc_num and \a brc_list back to \a brc_buf.
+ * write \a brc_num and \a brc_list back to the board directory.
  */
 void
 brc_update(){
@@ -271,115 +351,395 @@ brc_update(){
     }
 }
 
+/**
+ * load a v4 file
+ *
+ * Records stay empty if the file is corrupted.
+ *
+ * @return	1 if loaded, 0 if corrupted
+ */
+static int
+brc_load_v4(const char *buf, int size)
+{
+    brc4_header        h;
+    const brc4_dirent *dir;
+    uint32_t           i, used = 0;
+
+    memcpy(&h, buf, sizeof(h));
+    if (h.nboards > BRC4_MAXSIZE / sizeof(brc4_dirent) ||
+	h.nrecs > BRC4_MAXSIZE / sizeof(brc_rec) ||
+	size != (int)(sizeof(h) + h.nboards * sizeof(brc4_dirent) +
+		      h.nrecs * sizeof(brc_rec)))
+	return 0;
+
+    dir = (const brc4_dirent*)(buf + sizeof(h));
+    for (i = 0; i < h.nboards; i++) {
+	if ((i > 0 && dir[i].bid <= dir[i - 1].bid) ||
+	    dir[i].num == 0 || dir[i].num > dir[i].cap ||
+	    dir[i].offset > h.nrecs || dir[i].cap > h.nrecs - dir[i].offset)
+	    return 0;
+	used += dir[i].cap;
+    }
+    if (used > h.nrecs)
+	return 0;
+
+    brc_ndir = brc_diralloc = h.nboards;
+    if (brc_ndir) {
+	brc_dir = (brc4_dirent*)malloc(brc_ndir * sizeof(brc4_dirent));
+	assert(brc_dir);
+	memcpy(brc_dir, dir, brc_ndir * sizeof(brc4_dirent));
+    }
+    brc_nrecs = brc_recalloc = h.nrecs;
+    if (brc_nrecs) {
+	brc_recs = (brc_rec*)malloc(brc_nrecs * sizeof(brc_rec));
+	assert(brc_recs);
+	memcpy(brc_recs, dir + brc_ndir, brc_nrecs * sizeof(brc_rec));
+    }
+    brc_garbage = h.nrecs - used;
+    for (i = 0; i < h.nboards; i++) {
+	if (brc_dir[i].num > BRC_MAXNUM)
+	    brc_dir[i].num = BRC_MAXNUM;
+	brc_nlive += brc_dir[i].num;
+    }
+    return 1;
+}
+
+static int
+brc_dirent_cmp(const void *a, const void *b)
+{
+    const brc4_dirent *x = (const brc4_dirent*)a, *y = (const brc4_dirent*)b;
+
+    if (x->bid != y->bid)
+	return x->bid < y->bid ? -1 : 1;
+    /* earlier in the v3 file, newer */
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/**
+ * convert a v3 file
+ *
+ * Records are copied to the slots in file order, then the directory is
+ * sorted once. If a bid shows up twice the first (newer) one is kept.
+ */
+static void
+brc_load_v3(const char *buf, int size)
+{
+    const char *ptr = buf, *endp = buf + size;
+    brcbid_t    bid;
+    brcnbrd_t   num, n;
+    uint32_t    offset;
+    int         i, j;
+
+    while (ptr + sizeof(brcbid_t) + sizeof(brcnbrd_t) < endp) {
+	/* for each available records */
+	memcpy(&bid, ptr, sizeof(brcbid_t));
+	ptr += sizeof(brcbid_t);
+	memcpy(&num, ptr, sizeof(brcnbrd_t));
+	ptr += sizeof(brcnbrd_t);
+	if (ptr + num * sizeof(brc_rec) > endp)
+	    break; /* dangling, ignore the trailing data */
+
+	n = num > BRC_MAXNUM ? BRC_MAXNUM : num;
+	offset = brc_alloc_slot(n);
+	memcpy(brc_recs + offset, ptr, n * sizeof(brc_rec));
+	ptr += num * sizeof(brc_rec);
+
+	while (n > 0 && brc_recs[offset + n - 1].create < brc_expire_time)
+	    n--; /* don't keep the times before brc_expire_time */
+	if (!n) {
+	    brc_nrecs = offset;
+	    continue;
+	}
+	if (brc_ndir >= brc_diralloc) {
+	    brc_diralloc += BRC_BLOCKSIZE / sizeof(brc4_dirent);
+	    brc_dir = (brc4_dirent*)realloc(brc_dir,
+					    brc_diralloc * sizeof(brc4_dirent));
+	    assert(brc_dir);
+	}
+	brc_dir[brc_ndir].bid = bid;
+	brc_dir[brc_ndir].num = brc_dir[brc_ndir].cap = n;
+	brc_dir[brc_ndir].offset = offset;
+	brc_ndir++;
+    }
+
+    if (brc_ndir > 1)
+	qsort(brc_dir, brc_ndir, sizeof(brc4_dirent), brc_dirent_cmp);
+    for (i = j = 0; i < brc_ndir; i++) {
+	if (j > 0 && brc_dir[i].bid == brc_dir[j - 1].bid) {
+	    brc_garbage += brc_dir[i].cap;
+	    continue;
+	}
+	brc_dir[j++] = brc_dir[i];
+	brc_nlive += brc_dir[i].num;
+    }
+    brc_ndir = j;
+    brc_shrink(0);
+}
+
+/**
+ * load a BRC file of either version into the board directory
+ *
+ * @return	1 if it was a valid v4 file, records as they are in \a buf
+ */
+static int
+brc_load_buf(const char *buf, int size)
+{
+    int v4 = 0;
+
+    if (size >= (int)sizeof(brc4_header) &&
+	memcmp(buf, BRC4_MAGIC, sizeof(((brc4_header*)0)->magic)) == 0)
+	v4 = brc_load_v4(buf, size);
+    else
+	brc_load_v3(buf, size);
+    brc_ndirty = 0;
+    brc_loaded = 1;
+    return v4;
+}
+
+/**
+ * @param[out] size	size of the returned buffer
+ *
+ * @return	malloc()ed v4 file of the records
+ */
+static char *
+brc_serialize(int *size)
+{
+    brc4_header h;
+    char       *buf;
+
+    brc_compact(1);
+    memcpy(h.magic, BRC4_MAGIC, sizeof(h.magic));
+    h.nboards = brc_ndir;
+    h.nrecs = brc_nrecs;
+    *size = sizeof(h) + brc_ndir * sizeof(brc4_dirent) +
+	brc_nrecs * sizeof(brc_rec);
+
+    buf = (char*)malloc(*size);
+    assert(buf);
+    memcpy(buf, &h, sizeof(h));
+    if (brc_ndir)
+	memcpy(buf + sizeof(h), brc_dir, brc_ndir * sizeof(brc4_dirent));
+    if (brc_nrecs)
+	memcpy(buf + sizeof(h) + brc_ndir * sizeof(brc4_dirent), brc_recs,
+	       brc_nrecs * sizeof(brc_rec));
+    return buf;
+}
+
+
+/**
+ * @param[out] size	size of the returned buffer
+ *
+ * @return	malloc()ed BRCSTORED_REQ_UPDATE data of the changed boards
+ */
+static char *
+brc_serialize_changes(int *size)
+{
+    const brc_rec *recs;
+    brcnbrd_t      num;
+    char          *buf, *p;
+    int            i, n;
+
+    brc_dirty_uniq();
+    p = buf = (char*)malloc(brc_ndirty *
+			    (sizeof(brcbid_t) + sizeof(brcnbrd_t) +
+			     BRC_MAXNUM * sizeof(brc_rec)) + 1);
+    assert(buf);
+    for (i = 0; i < brc_ndirty; i++) {
+	recs = brc_find_record(brc_dirty[i], &n);
+	num = n;
+	memcpy(p, &brc_dirty[i], sizeof(brcbid_t));
+	p += sizeof(brcbid_t);
+	memcpy(p, &num, sizeof(brcnbrd_t));
+	p += sizeof(brcnbrd_t);
+	if (num) {
+	    memcpy(p, recs, num * sizeof(brc_rec));
+	    p += num * sizeof(brc_rec);
+	}
+    }
+    *size = p - buf;
+    return buf;
+}
+
+/* Remote BRC (USE_REMOTE_BRC)
+ *
+ * The connection to brcstored is kept for the session. Once the records
+ * are loaded from it, only the boards changed since are sent back, every
+ * BRC_REMOTE_SYNC_SEC while reading and in brc_finalize(). The whole
+ * records are sent only if brcstored did not give us v4 records.
+ */
+
+#ifndef BRC_REMOTE_TIMEOUT
+#define BRC_REMOTE_TIMEOUT      (3)     /* seconds to connect brcstored */
+#endif
+
+#ifndef BRC_REMOTE_SYNC_SEC
+#define BRC_REMOTE_SYNC_SEC     (5 * 60)
+#endif
+
+static int     brc_remote_fd = -1;
+static time4_t brc_remote_synced;
+
 #ifdef LOG_REMOTE_BRC_FAILURE
-# define BRC_FAILURE(msg) { syncnow(); \
-    log_filef("log/brc_remote_failure.log", LOG_CREAT, "%s %s ERR: %s", \
-              Cdate(&now), msg, command); break; }
+static void
+brc_remote_failure(char cmd, const char *msg)
+{
+    syncnow();
+    log_filef("log/brc_remote_failure.log", LOG_CREAT, "%s %s ERR: %c%s#%d\n",
+	      Cdate(&now), msg, cmd, cuser.userid, cuser.firstlogin);
+}
 #else
-# define BRC_FAILURE(msg) { break; }
+# define brc_remote_failure(cmd, msg) do {} while (0)
 #endif
 
+static void
+brc_remote_close(void)
+{
+    if (brc_remote_fd >= 0)
+	close(brc_remote_fd);
+    brc_remote_fd = -1;
+}
+
+/**
+ * send a request to brcstored and read the fixed size part of its reply
+ *
+ * Connects if not connected yet. If the kept connection turns out closed
+ * (brcstored restarted), connects once more and sends again; a request
+ * done twice does no harm.
+ *
+ * @param data	sent after its int32_t length, unless NULL
+ *
+ * @return	0 if done, -1 if brcstored is not available
+ */
+static int
+brc_remote_request(char cmd, const void *data, int32_t len,
+		   void *reply, int rlen)
+{
+    void (*orig_handler)(int);
+    int  tries = (brc_remote_fd >= 0) ? 2 : 1, ok = 0, size;
+    char *req;
+
+    // one write for the whole request, or it waits for delayed ACKs.
+    req = (char*)malloc(PATHLEN + sizeof(len) + (data ? len : 0));
+    assert(req);
+    size = snprintf(req, PATHLEN, "%c%s#%d\n",
+		    cmd, cuser.userid, cuser.firstlogin);
+    if (data) {
+	memcpy(req + size, &len, sizeof(len));
+	size += sizeof(len);
+	memcpy(req + size, data, len);
+	size += len;
+    }
+
+    orig_handler = Signal(SIGPIPE, SIG_IGN);
+    while (!ok && tries-- > 0) {
+	if (brc_remote_fd < 0 &&
+	    (brc_remote_fd = toconnectex(BRCSTORED_ADDR,
+					 BRC_REMOTE_TIMEOUT)) < 0) {
+	    brc_remote_failure(cmd, "connect");
+	    break;
+	}
+	ok = towrite(brc_remote_fd, req, size) >= 0 &&
+	    toread(brc_remote_fd, reply, rlen) >= 0;
+	if (!ok)
+	    brc_remote_close();
+    }
+    Signal(SIGPIPE, orig_handler);
+    free(req);
+    return ok ? 0 : -1;
+}
+
 /**
  * Use BRC data on remote daemon.
  */
 int
 load_remote_brc() {
-    int fd;
     int32_t len;
-    char command[PATHLEN];
-    int err = 1;
-
-    brc_size = 0;
-    snprintf(command, sizeof(command), "%c%s#%d\n",
-             BRCSTORED_REQ_READ, cuser.userid, cuser.firstlogin);
-
-    do {
-        int conn_retries = 10;
-        while (conn_retries-- > 0 &&
-               (fd = toconnectex(BRCSTORED_ADDR, 5)) < 0) {
-            mvprints(b_lines, 0, (conn_retries == 0) ?
-                     ANSI_COLOR(1;31)
-                     "LkJ̷sݪOwŪŪ, NϥΤWƥ... (#%d)"
-                     ANSI_RESET: "bPBݪOwŪŪ,еy... (#%d)",
-                     conn_retries + 1);
-            refresh();
-            sleep(1);
-        }
-        if (fd < 0) {
-            BRC_FAILURE("(load) connect");
-        }
-        if (towrite(fd, command, strlen(command)) < 0)
-            BRC_FAILURE("(load) send_command");
-        if (toread(fd, &len, sizeof(len)) < 0)
-            BRC_FAILURE("(load) read_len");
-        if (len < 0) // not found
-            break;
-        brc_get_buf(len);
-        if (len && toread(fd, brc_buf, len) < 0)
-            BRC_FAILURE("(load) read_data");
-        brc_size = len;
-        err = 0;
-    } while (0);
-
-    if (fd >= 0)
-        close(fd);
-
-    if (err) {
-        brc_release();
-        return 0;
+    char *buf;
+
+    if (brc_remote_request(BRCSTORED_REQ_READ, NULL, 0,
+			   &len, sizeof(len)) < 0)
+	return 0;
+    if (len < 0) // not found
+	return 0;
+    if (len > BRC4_MAXSIZE) {
+	brc_remote_failure(BRCSTORED_REQ_READ, "(load) bad_len");
+	brc_remote_close();
+	return 0;
     }
 
+    buf = (char*)malloc(len + 1);
+    assert(buf);
+    if (len && toread(brc_remote_fd, buf, len) < 0) {
+	brc_remote_failure(BRCSTORED_REQ_READ, "(load) read_data");
+	brc_remote_close();
+	free(buf);
+	return 0;
+    }
+    brc_remote_v4 = brc_load_buf(buf, len);
+    brc_remote_synced = now;
+    free(buf);
     return 1;
 }
 
 int
 save_remote_brc() {
-    int fd;
-    int32_t len;
-    char command[PATHLEN];
-    int err = 1;
-
-    snprintf(command, sizeof(command), "%c%s#%d\n",
-             BRCSTORED_REQ_WRITE, cuser.userid, cuser.firstlogin);
-    len = brc_size;
-
-    do {
-        if ((fd = toconnectex(BRCSTORED_ADDR, 10)) < 0)
-            BRC_FAILURE("(save) connect");
-        if (towrite(fd, command, strlen(command)) < 0)
-            BRC_FAILURE("(save) send_command");
-        if (towrite(fd, &len, sizeof(len)) < 0)
-            BRC_FAILURE("(save) write_len");
-        if (len && towrite(fd, brc_buf ? brc_buf : "", len) < 0)
-            BRC_FAILURE("(save) write_data");
-        err = 0;
-    } while (0);
-
-    if (fd >= 0)
-        close(fd);
-
-    if (err)
-        return 0;
+    char reply = BRCSTORED_NEED_WRITE;
+    int size;
+    char *buf;
 
+    if (brc_remote_v4) {
+	if (!brc_ndirty)
+	    return 1;
+	buf = brc_serialize_changes(&size);
+	if (brc_remote_request(BRCSTORED_REQ_UPDATE, buf, size,
+			       &reply, sizeof(reply)) < 0)
+	    reply = BRCSTORED_NEED_WRITE;
+	free(buf);
+    }
+
+    if (reply != BRCSTORED_OK) {
+	buf = brc_serialize(&size);
+	if (brc_remote_request(BRCSTORED_REQ_WRITE, buf, size,
+			       &reply, sizeof(reply)) < 0)
+	    reply = BRCSTORED_NEED_WRITE;
+	free(buf);
+	if (reply != BRCSTORED_OK) {
+	    brc_remote_failure(BRCSTORED_REQ_WRITE, "(save)");
+	    return 0;
+	}
+	brc_remote_v4 = 1;
+    }
+
+    brc_ndirty = 0;
+    brc_remote_synced = now;
     return 1;
 }
 
 int
 load_local_brc() {
     char            brcfile[STRLEN];
-    int             fd;
+    int             fd, size;
     struct stat     brcstat;
+    char           *buf;
 
-    brc_size = 0;
     setuserfile(brcfile, fn_brc);
-
-    if ((fd = open(brcfile, O_RDONLY)) == -1)
-	return 0;
+    if ((fd = open(brcfile, O_RDONLY)) == -1) {
+	/* not converted to v4 yet */
+	setuserfile(brcfile, fn_brc3);
+	if ((fd = open(brcfile, O_RDONLY)) == -1)
+	    return 0;
+    }
 
     fstat(fd, &brcstat);
-    brc_get_buf(brcstat.st_size);
-    brc_size = read(fd, brc_buf, brc_alloc);
+    size = brcstat.st_size;
+    if (size > BRC4_MAXSIZE)
+	size = BRC4_MAXSIZE;
+    buf = (char*)malloc(size + 1);
+    assert(buf);
+    size = read(fd, buf, size);
     close(fd);
+    brc_load_buf(buf, size > 0 ? size : 0);
+    free(buf);
     return 1;
 }
 
@@ -391,11 +751,13 @@ save_local_brc() {
 
     setuserfile(brcfile, fn_brc);
     snprintf(tmpfile, sizeof(tmpfile), "%s.tmp.%x", brcfile, getpid());
-    if (brc_buf != NULL) {
+    if (brc_loaded || brc_ndir) {
+	int size;
+	char *buf = brc_serialize(&size);
 	int fd = OpenCreate(tmpfile, O_WRONLY | O_TRUNC);
 	if (fd != -1) {
 	    int ok=0;
-	    if(write(fd, brc_buf, brc_size)==brc_size)
+	    if(write(fd, buf, size)==size)
 		ok=1;
 	    close(fd);
 	    if(ok)
@@ -403,6 +765,7 @@ save_local_brc() {
 	    else
 		unlink(tmpfile);
 	}
+	free(buf);
     }
     return ok;
 }
@@ -410,7 +773,7 @@ save_local_brc() {
 void
 read_brc_buf(void)
 {
-    if (brc_buf != NULL)
+    if (brc_loaded)
 	return;
 
 #ifdef USE_REMOTE_BRC
@@ -462,14 +825,11 @@ brc_initialize(){
  */
 static int
 brc_read_record(int bid, int *num, brc_rec *list){
-    char *ptr;
-    brcnbrd_t tnum;
-    ptr = brc_findrecord_in(brc_buf, brc_buf + brc_size, bid, &tnum);
-    *num = tnum;
-    if ( ptr ){
+    const brc_rec *recs;
+    recs = brc_find_record(bid, num);
+    if ( recs ){
 	assert(0 <= *num && *num <= BRC_MAXNUM);
-	memcpy(list, ptr + sizeof(brcbid_t) + sizeof(brcnbrd_t),
-	       *num * sizeof(brc_rec));
+	memcpy(list, recs, *num * sizeof(brc_rec));
 	return *num;
     }
     list[0].create = *num = 1;
@@ -490,6 +850,11 @@ brc_initial_board(const char *boardname)
     }
 
     brc_update(); /* write back first */
+#ifdef USE_REMOTE_BRC
+    if (brc_remote_v4 && brc_ndirty &&
+	now - brc_remote_synced >= BRC_REMOTE_SYNC_SEC)
+	save_remote_brc();
+#endif
     currbid = getbnum(boardname);
     if( currbid == 0 )
 	currbid = getbnum(DEFAULT_BOARD);
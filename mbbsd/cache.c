@@ -34,6 +34,7 @@ getnewutmpent(const userinfo_t * up)
 	if (!(uentp->pid)) {
 	    memcpy(uentp, up, sizeof(userinfo_t));
 	    currutmp = uentp;
+	    utmpindex_add(p);
 	    return;
 	}
     }
@@ -58,45 +59,24 @@ apply_ulist(int (*fptr) (const userinfo_t *))
 int
 count_logins(int uid, int show)
 {
-    register int    i = 0, j, start = 0, end = SHM->UTMPnumber - 1, count;
-    int *ulist;
+    int count;
     userinfo_t *u;
-    if (end == -1)
-	return 0;
-    ulist = SHM->sorted[SHM->currsorted][7];
-    for (i = ((start + end) / 2);; i = (start + end) / 2) {
-	u = &SHM->uinfo[ulist[i]];
-	j = uid - u->uid;
-	if (!j) {
-	    for (; i > 0 && uid == SHM->uinfo[ulist[i - 1]].uid; i--);
-							/* Ĥ@ */
-	    for (count = 0; (ulist[i + count] &&
-		    (u = &SHM->uinfo[ulist[i + count]]) &&
-		    uid == u->uid); count++) {
-		if (show)
-		    prints("(%d) ثeA: %-17.16s(Ӧ %s)\n",
-			   count + 1, modestring(u, 0),
-			   u->from);
-	    }
-	    return count;
-	}
-	if (end == start) {
-	    break;
-	} else if (i == start) {
-	    i = end;
-	    start = end;
-	} else if (j > 0)
-	    start = i;
-	else
-	    end = i;
+
+    for (count = 0; (u = search_ulistn(uid, count + 1)) != NULL; count++) {
+	if (show)
+	    prints("(%d) ثeA: %-17.16s(Ӧ %s)\n",
+		   count + 1, modestring(u, 0),
+		   u->from);
     }
-    return 0;
+    return count;
 }
 
 void
 purge_utmp(userinfo_t * uentp)
 {
     logout_friend_online(uentp);
+    friendref_unlink(uentp - SHM->uinfo);
+    utmpindex_remove(uentp - SHM->uinfo);
     memset(uentp, 0, sizeof(userinfo_t));
     SHM->UTMPneedsort = 1;
 }
@@ -37,6 +37,7 @@ void FormatCommentString(char *buf, size_t szbuf, int type,
 typedef struct {
     uint32_t allocated;
     uint32_t loaded;
+    int no_range;   // commentd does not know QUERY_RANGE (commentd.py)
     CommentKeyReq key;
     CommentBodyReq *resp;
 } CommentsCtx;
@@ -101,34 +102,74 @@ int CommentsClose(void *ctx)
     return 0;
 }
 
-static int CommentsLoad(CommentsCtx *c, int i)
+// Loads the comment after those loaded, one per request.
+static int CommentsLoadOne(CommentsCtx *c)
 {
     int s;
     uint16_t resp_size;
     CommentQueryRequest req = {0};
-    CommentBodyReq *resp;
 
-    if (i >= (int)c->allocated)
-        CommentsAlloc(c, i);
-    assert(c->resp);
+    if (CommentsAlloc(c, c->loaded + 1))
+        return -1;
+    memset(&c->resp[c->loaded], 0, sizeof(*c->resp));
 
-    resp = &c->resp[i];
     req.cb = sizeof(req);
     req.operation = COMMENTD_REQ_QUERY_BODY;
     strlcpy(req.key.board, c->key.board, sizeof(req.key.board));
     strlcpy(req.key.file, c->key.file, sizeof(req.key.file));
-    req.start = i;
+    req.start = c->loaded;
     s = toconnectex(COMMENTD_ADDR, 10);
     if (s < 0) {
         return -1;
     }
     if (towrite(s, &req, sizeof(req)) < 0 ||
         toread(s, &resp_size, sizeof(resp_size)) < 0 ||
-        !resp_size || toread(s, resp, resp_size) < 0) {
+        !resp_size || resp_size > sizeof(*c->resp) ||
+        toread(s, &c->resp[c->loaded], resp_size) < 0) {
         close(s);
         return -1;
     }
     close(s);
+    c->loaded++;
+    return 0;
+}
+
+// Loads the comments after those loaded, as many as commentd gives at once.
+static int CommentsLoad(CommentsCtx *c)
+{
+    int s;
+    uint32_t n;
+    CommentRangeRequest req = {0};
+
+    if (c->no_range)
+        return CommentsLoadOne(c);
+
+    req.cb = sizeof(req);
+    req.operation = COMMENTD_REQ_QUERY_RANGE;
+    strlcpy(req.key.board, c->key.board, sizeof(req.key.board));
+    strlcpy(req.key.file, c->key.file, sizeof(req.key.file));
+    req.start = c->loaded;
+    req.count = COMMENTD_MAX_RANGE;
+    s = toconnectex(COMMENTD_ADDR, 10);
+    if (s < 0) {
+        return -1;
+    }
+    if (towrite(s, &req, sizeof(req)) < 0 ||
+        toread(s, &n, sizeof(n)) < 0) {
+        // an older commentd closes the connection on requests it does not
+        // know; ask for one comment at a time from now on.
+        close(s);
+        c->no_range = 1;
+        return CommentsLoadOne(c);
+    }
+    if (!n || n > COMMENTD_MAX_RANGE ||
+        CommentsAlloc(c, c->loaded + n) ||
+        toread(s, &c->resp[c->loaded], n * sizeof(*c->resp)) < 0) {
+        close(s);
+        return -1;
+    }
+    close(s);
+    c->loaded += n;
     return 0;
 }
 
@@ -137,7 +178,7 @@ const struct CommentBodyReq *CommentsRead(void *ctx, int i)
     CommentsCtx *c = (CommentsCtx *)ctx;
 
     while (i >= (int)c->loaded) {
-        if (CommentsLoad(c, c->loaded++))
+        if (CommentsLoad(c))
             break;
     }
     if (i >= (int)c->loaded)
@@ -192,6 +233,7 @@ int CommentsGetCount(void *ctx)
         close(s);
         return 0;
     }
+    close(s);
     return num;
 }
 
@@ -1,85 +1,73 @@
 #include "bbs.h"
 
 #ifdef CONVERT
-int (*convert_write)(VBUF *v, char c) = vbuf_add;
+ssize_t (*convert_write)(VBUF *v, int fd, ssize_t sz) = vbuf_write;
 int (*convert_read)(VBUF *v, const void *buf, size_t len) = vbuf_putblk;
 ConvertMode convert_mode = CONV_NORMAL;
 
-int
-convert_write_utf8(VBUF *v, char c) {
-    static uint8_t utf8[4];
-    static union {
-        char c[2];
-        uint16_t u;
-    } trail = { .u = 0, };
-
-    // trail must be little endian.
-    if (trail.c[1]) {
-        int len, i;
-        uint16_t ucs;
-
-        trail.c[0] = c;
-        ucs = b2u_table[trail.u];
-
-        len = ucs2utf(ucs, utf8);
-        utf8[len] = 0;
-
-        // assert(len > 0 && len < 4);
-        for (i = 0; i < len; i++)
-            vbuf_add(v, utf8[i]);
-
-        trail.c[1] = 0;
-        return 1;
-    }
-
-    if (isascii(c)) {
-        vbuf_add(v, c);
-        return 1;
+// bytes converted per step
+#define CONVERT_BLOCK	(1024)
+
+/**
+ * Writes everything in v (Big5) to fd as UTF-8, one block at a time.
+ * sz must be VBUF_RWSZ_ALL.
+ */
+ssize_t
+convert_write_utf8(VBUF *v, int fd, ssize_t sz) {
+    static ConvState st;
+    char out[BIG5_TO_UTF8_MAXLEN(CONVERT_BLOCK)];
+    const char *s;
+    size_t len, n;
+    ssize_t written = 0;
+
+    assert(sz == VBUF_RWSZ_ALL);
+    len = vbuf_size(v);
+    if (!len || (s = vbuf_cstr(v)) == NULL)
+        return 0;
+
+    while (len > 0) {
+        n = len < CONVERT_BLOCK ? len : CONVERT_BLOCK;
+        sz = big5_to_utf8_block(&st, s, n, out);
+        if (sz > 0 && towrite(fd, out, sz) < 0)
+            break;
+        written += sz;
+        s += n;
+        len -= n;
     }
-
-    trail.c[1] = c;
-    return 0;
+    vbuf_clear(v);
+    return written;
 }
 
 int convert_read_utf8(VBUF *v, const void *buf, size_t len) {
-    static uint8_t trail[6];
-    static int ctrail = 0;
-    uint16_t ucs;
-    uint8_t c;
+    static ConvState st;
+    char out[UTF8_TO_BIG5_MAXLEN(CONVERT_BLOCK)];
+    const char *s = (const char *)buf;
+    size_t n, sz, i;
     int written = 0;
 
-    while (len-- > 0) {
-        c = *(uint8_t*)buf ++;
-        if (ctrail) {
-            trail[ctrail++] = c;
-            // TODO this may create invalid chars.
-            if (utf2ucs(trail, &ucs) > ctrail)
-                continue;
-            ucs = u2b_table[ucs];
-            vbuf_add(v, ucs >> 8);
-            vbuf_add(v, ucs & 0xFF);
-            written += 2;
-            ctrail = 0;
-            continue;
-        }
-
-        if (isascii(c)) {
-            vbuf_add(v, c);
-            written++;
-        } else {
-            trail[0] = c;
-            ctrail = 1;
-        }
+    while (len > 0) {
+        n = len < CONVERT_BLOCK ? len : CONVERT_BLOCK;
+        sz = utf8_to_big5_block(&st, s, n, out);
+        // the block may not fit if it ends a character; add what fits
+        if (!vbuf_putblk(v, out, sz))
+            for (i = 0; i < sz; i++)
+                vbuf_add(v, out[i]);
+        written += sz;
+        s += n;
+        len -= n;
     }
     return written;
 }
 
 void set_converting_type(ConvertMode mode)
 {
+    // output so far is still in the old encoding
+    oflush();
+
     switch(mode) {
         case CONV_NORMAL:
             convert_read = vbuf_putblk;
-            convert_write = vbuf_add;
+            convert_write = vbuf_write;
             break;
 
         case CONV_UTF8:
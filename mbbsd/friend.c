@@ -444,6 +444,7 @@ void friend_load(int type, int do_login)
     if (currutmp->friendtotal)
 	logout_friend_online(currutmp);
 
+    // login_friend_online() re-indexes the new lists.
     login_friend_online(do_login);
 }
 
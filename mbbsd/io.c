@@ -6,14 +6,6 @@
 #define OBUFSIZE  3072
 #define IBUFSIZE  128
 
-// When CONVERT is applied, we may need to write extra N bytes into buffer for
-// one character input. Currently the number is 3 (UTF8).
-#ifdef CONVERT
-# define OBUFMINSPACE (3)
-#else
-# define OBUFMINSPACE (1)
-#endif
-
 #ifdef DEBUG
 #define register
 #define inline
@@ -101,7 +93,12 @@ oflush(void)
 {
     if (!vbuf_is_empty(pvout)) {
         STATINC(STAT_SYSWRITESOCKET);
+#ifdef CONVERT
+        // converted a whole buffer at a time
+        convert_write(pvout, 1, VBUF_RWSZ_ALL);
+#else
         vbuf_write(pvout, 1, VBUF_RWSZ_ALL);
+#endif
     }
 
 #ifdef DBG_OUTRPT
@@ -122,8 +119,24 @@ oflush(void)
 inline void
 output(const char *s, int len)
 {
+#ifdef DBG_OUTRPT
     while (len-- > 0)
         ochar(*s++);
+#else
+    size_t sz;
+
+    while (len > 0) {
+        if ((sz = vbuf_space(pvout)) == 0) {
+            oflush();
+            continue;
+        }
+        if (sz > (size_t)len)
+            sz = len;
+        vbuf_putblk(pvout, s, sz);
+        s += sz;
+        len -= sz;
+    }
+#endif
 }
 
 int
@@ -136,14 +149,10 @@ ochar(int c)
     szLastOutput ++;
 #endif // DBG_OUTRPT
 
-    if (vbuf_space(pvout) < OBUFMINSPACE)
+    if (vbuf_is_full(pvout))
         oflush();
 
-#ifdef CONVERT
-    convert_write(pvout, c);
-#else
     vbuf_add(pvout, c);
-#endif
 
     return 0;
 }
@@ -189,7 +198,7 @@ process_pager_keys(int ch)
 		int my_newfd;
 		screen_backup_t old_screen;
 
-		if (!currutmp->msgs[0].pid ||
+		if (!wb_lastcall.pid ||
 		    wmofo != NOTREPLYING)
 		    break;
 
@@ -224,7 +233,7 @@ process_pager_keys(int ch)
 		return KEY_INCOMPLETE;
 	    }
 	    else if (watermode == -1 &&
-		    currutmp->msgs[0].pid)
+		    wb_lastcall.pid)
 	    {
 		/* Ĥ@ Ctrl-R (QLy) */
 		screen_backup_t old_screen;
@@ -233,26 +242,26 @@ process_pager_keys(int ch)
 
 		/* pGbtalkܥBzeLӪʥ] (hselect) */
 		my_newfd = vkey_detach();
-		show_call_in(0, 0);
+		show_call_in(0, &wb_lastcall);
 		watermode = 0;
 #ifndef PLAY_ANGEL
-		my_write(currutmp->msgs[0].pid, "yLhG ",
-			currutmp->msgs[0].userid, WATERBALL_GENERAL, NULL);
+		my_write(wb_lastcall.pid, "yLhG ",
+			wb_lastcall.userid, WATERBALL_GENERAL, NULL);
 #else
-		switch (currutmp->msgs[0].msgmode) {
+		switch (wb_lastcall.msgmode) {
 		    case MSGMODE_TALK:
 		    case MSGMODE_WRITE:
 		    case MSGMODE_ALOHA:
-			my_write(currutmp->msgs[0].pid, "yLhG ",
-				 currutmp->msgs[0].userid, WATERBALL_GENERAL, NULL);
+			my_write(wb_lastcall.pid, "yLhG ",
+				 wb_lastcall.userid, WATERBALL_GENERAL, NULL);
 			break;
 		    case MSGMODE_FROMANGEL:
-			my_write(currutmp->msgs[0].pid, "Aݤ@G ",
-				 currutmp->msgs[0].userid, WATERBALL_ANGEL, NULL);
+			my_write(wb_lastcall.pid, "Aݤ@G ",
+				 wb_lastcall.userid, WATERBALL_ANGEL, NULL);
 			break;
 		    case MSGMODE_TOANGEL:
-			my_write(currutmp->msgs[0].pid, "^pDHG ",
-				 currutmp->msgs[0].userid, WATERBALL_ANSWER, NULL);
+			my_write(wb_lastcall.pid, "^pDHG ",
+				 wb_lastcall.userid, WATERBALL_ANSWER, NULL);
 			break;
 		}
 #endif
@@ -407,7 +416,65 @@ read_vin() {
 }
 
 /*
- * dogetch() is not reentrant-safe. SIGUSR[12] might happen at any time, and
+ * wait_fds(): select() on fd 0 and i_newfd. While blocked, waterballs
+ * (SIGUSR2) interrupt the wait and are shown before waiting again, for
+ * what is left of the timeout.
+ * @param ptv: timeout, NULL for infinite
+ * @return: like select(), never EINTR
+ */
+static int
+wait_fds(fd_set *readfds, const struct timeval *ptv)
+{
+    struct timespec ts, deadline, now, *pts = NULL;
+    const sigset_t *mask = NULL;
+    int sel, nowait = 0;
+
+    if (ptv) {
+	ts.tv_sec = ptv->tv_sec;
+	ts.tv_nsec = ptv->tv_usec * 1000;
+	pts = &ts;
+	nowait = (ptv->tv_sec == 0 && ptv->tv_usec == 0);
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += ts.tv_sec;
+	if ((deadline.tv_nsec += ts.tv_nsec) >= 1000000000L) {
+	    deadline.tv_sec++;
+	    deadline.tv_nsec -= 1000000000L;
+	}
+    }
+
+    for (;;) {
+	/* jochang: modify first argument of select from FD_SETSIZE */
+	/* since we are only waiting input from fd 0 and i_newfd(>0) */
+	FD_ZERO(readfds);
+	FD_SET(0, readfds);
+	if (i_newfd)
+	    FD_SET(i_newfd, readfds);
+
+	if (!nowait && (mask = waterball_wait_begin()) == NULL)
+	    continue;
+
+	if (pts && !nowait) {
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    ts.tv_sec = deadline.tv_sec - now.tv_sec;
+	    if ((ts.tv_nsec = deadline.tv_nsec - now.tv_nsec) < 0) {
+		ts.tv_sec--;
+		ts.tv_nsec += 1000000000L;
+	    }
+	    if (ts.tv_sec < 0)
+		ts.tv_sec = ts.tv_nsec = 0;
+	}
+
+	STATINC(STAT_SYSSELECT);
+	sel = pselect(i_newfd + 1, readfds, NULL, NULL, pts, mask);
+	if (!nowait)
+	    waterball_wait_end();
+	if (sel >= 0 || errno != EINTR)
+	    return sel;
+    }
+}
+
+/*
+ * dogetch() is not reentrant-safe. SIGUSR1 might happen at any time, and
  * dogetch() might be called again, and then input buffer state may be
  * inconsistent. We try to not segfault here...
  */
@@ -419,47 +486,22 @@ dogetch(void)
     static time4_t  lastact;
 
     while (vbuf_is_empty(pvin)) {
-	refresh();
-
-	if (i_newfd) {
-
-	    struct timeval  timeout;
-	    fd_set          readfds;
-
-	    if (i_top)
-		timeout = *i_top;	/* copy it because select() might
-					 * change it */
-
-	    FD_ZERO(&readfds);
-	    FD_SET(0, &readfds);
-	    FD_SET(i_newfd, &readfds);
+	fd_set          readfds;
 
-	    /* jochang: modify first argument of select from FD_SETSIZE */
-	    /* since we are only waiting input from fd 0 and i_newfd(>0) */
-
-	    STATINC(STAT_SYSSELECT);
-	    while ((len = select(i_newfd + 1, &readfds, NULL, NULL,
-			    i_top ? &timeout : NULL)) < 0) {
-		if (errno != EINTR)
-		    abort_bbs(0);
-		/* raise(SIGHUP); */
-	    }
+	refresh();
 
-	    if (len == 0){
-		syncnow();
-		return I_TIMEOUT;
-	    }
+	if ((len = wait_fds(&readfds, i_newfd ? i_top : NULL)) < 0)
+	    abort_bbs(0);
 
-	    if (i_newfd && FD_ISSET(i_newfd, &readfds)){
-		syncnow();
-		return I_OTHERDATA;
-	    }
+	if (len == 0){
+	    syncnow();
+	    return I_TIMEOUT;
 	}
 
-#ifdef NOKILLWATERBALL
-	if( currutmp && currutmp->msgcount && !reentrant_write_request )
-	    write_request(1);
-#endif
+	if (i_newfd && FD_ISSET(i_newfd, &readfds)){
+	    syncnow();
+	    return I_OTHERDATA;
+	}
 
 	STATINC(STAT_SYSREADSOCKET);
 
@@ -572,10 +614,6 @@ wait_input(float f, int bIgnoreBuf)
     if(!bIgnoreBuf && num_in_buf() > 0)
 	return 1;
 
-    FD_ZERO(&readfds);
-    FD_SET(0, &readfds);
-    if (i_newfd) FD_SET(i_newfd, &readfds);
-
     // adjust time
     if(f > 0)
     {
@@ -592,19 +630,11 @@ wait_input(float f, int bIgnoreBuf)
 	ptv = NULL;
     }
 
-#ifdef STATINC
-    STATINC(STAT_SYSSELECT);
-#endif
-
-    do {
-	assert(i_newfd >= 0);	// if == 0, use only fd=0 => count sill u_newfd+1.
-	sel = select(i_newfd+1, &readfds, NULL, NULL, ptv);
-
-    } while (sel < 0 && errno == EINTR);
-    /* EINTR, interrupted. I don't care! */
+    assert(i_newfd >= 0);	// if == 0, use only fd=0 => count sill u_newfd+1.
+    sel = wait_fds(&readfds, ptv);
 
     // XXX should we abort? (from dogetch)
-    if (sel < 0 && errno != EINTR)
+    if (sel < 0)
     {
 	abort_bbs(0);
 	/* raise(SIGHUP); */
@@ -2,6 +2,7 @@
 #include "daemons.h"
 #include <sys/wait.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 
 #ifdef __linux__
 #    ifdef CRITICAL_MEMORY
@@ -368,7 +369,7 @@ talk_request(int sig GCC_UNUSED)
     STATINC(STAT_TALKREQUEST);
     bell();
     bell();
-    if (currutmp->msgcount) {
+    if (msgring_count(&currutmp->msgring)) {
 	syncnow();
 	move(0, 0);
 	clrtoeol();
@@ -393,25 +394,23 @@ talk_request(int sig GCC_UNUSED)
 }
 
 void
-show_call_in(int save, int which)
+show_call_in(int save, const msgque_t *msg)
 {
     char buf[200];
-    int mode = currutmp->msgs[which].msgmode;
+    int mode = msg->msgmode;
 
 #ifdef PLAY_ANGEL
     if (mode == MSGMODE_TOANGEL) {
         snprintf(buf, sizeof(buf), ANSI_COLOR(1;37;46) "%s" ANSI_COLOR(37;45)
                  " %s " ANSI_RESET,
-                 currutmp->msgs[which].userid,
-                 currutmp->msgs[which].last_call_in);
+                 msg->userid, msg->last_call_in);
         // I must be an Angel. Let's try to update angel beats info.
         // TODO maybe it's better to move this to "sender".
-        angel_notify_activity(currutmp->msgs[which].userid);
+        angel_notify_activity(msg->userid);
     } else
 #endif
     snprintf(buf, sizeof(buf), ANSI_COLOR(1;33;46) "%s" ANSI_COLOR(37;45)
-             " %s " ANSI_RESET, currutmp->msgs[which].userid,
-             currutmp->msgs[which].last_call_in);
+             " %s " ANSI_RESET, msg->userid, msg->last_call_in);
     outmsg(buf);
 
     if (save && mode != MSGMODE_ALOHA) {
@@ -493,17 +492,19 @@ add_history(const msgque_t * msg)
     return i;
 }
 
+/* messages in the ring already shown by PAGER_UI_OFO but not taken yet */
+static int wb_alreadyshow = 0;
+
 void
 write_request(int sig)
 {
-    int             i, msgcount;
+    msgring_t      *ring = &currutmp->msgring;
+    msgque_t        msg;
 
     STATINC(STAT_WRITEREQUEST);
-#ifdef NOKILLWATERBALL
-    if( reentrant_write_request ) /* kill again by shmctl */
+    if( reentrant_write_request )
 	return;
     reentrant_write_request = 1;
-#endif
     syncnow();
     check_water_init();
     if (PAGER_UI_IS(PAGER_UI_OFO)) {
@@ -512,8 +513,6 @@ write_request(int sig)
 	   sig != 0uyi, G.
 	   sig == 0ܨSyi, Le|y٨Sg water[].
 	*/
-	static  int     alreadyshow = 0;
-
 	if( sig ){ /* uyi */
 
 	    /* Yӥb REPLYING , h令 RECVINREPLYING,
@@ -522,29 +521,28 @@ write_request(int sig)
 		wmofo = RECVINREPLYING;
 
 	    /*  */
-	    for( ; alreadyshow < currutmp->msgcount && alreadyshow < MAX_MSGS
-		     ; ++alreadyshow ){
+	    for( ; msgring_peek(ring, wb_alreadyshow, &msg); ++wb_alreadyshow ){
 		bell();
-		show_call_in(1, alreadyshow);
+		show_call_in(1, &msg);
 		refresh();
 	    }
 	}
 
 	/* ݬݬOOn currutmp->msg ^ water[] (by add_history())
 	   nOb^y (NOTREPLYING) */
-	if( wmofo == NOTREPLYING &&
-	    (msgcount = currutmp->msgcount) > 0 ){
-	    for( i = 0 ; i < msgcount ; ++i )
-		add_history(&currutmp->msgs[i]);
-	    if( (currutmp->msgcount -= msgcount) < 0 )
-		currutmp->msgcount = 0;
-	    alreadyshow = 0;
+	if( wmofo == NOTREPLYING ){
+	    while( msgring_peek(ring, 0, &msg) ){
+		wb_lastcall = msg;
+		add_history(&msg);
+		msgring_pop(ring);
+	    }
+	    wb_alreadyshow = 0;
 	}
     } else {
 	if (currutmp->mode != 0 &&
 	    currutmp->pager != PAGER_OFF &&
 	    cuser.userlevel != 0 &&
-	    currutmp->msgcount != 0 &&
+	    msgring_count(ring) != 0 &&
 	    currutmp->mode != TALK &&
 	    currutmp->mode != EDITING &&
 	    currutmp->mode != CHATING &&
@@ -562,40 +560,85 @@ write_request(int sig)
 #ifdef NOKILLWATERBALL
 	    currutmp->wbtime = 0;
 #endif
-	    if( (msgcount = currutmp->msgcount) > 0 ){
-		for( i = 0 ; i < msgcount ; ++i ){
-		    bell();
-		    show_call_in(1, 0);
-		    add_history(&currutmp->msgs[0]);
-
-		    if( (--currutmp->msgcount) < 0 )
-			i = msgcount; /* force to exit for() */
-		    else if( currutmp->msgcount > 0 )
-			memmove(&currutmp->msgs[0],
-				&currutmp->msgs[1],
-				sizeof(msgque_t) * currutmp->msgcount);
-		    vkey();
-		}
+	    while( msgring_peek(ring, 0, &msg) ){
+		bell();
+		wb_lastcall = msg;
+		show_call_in(1, &msg);
+		add_history(&msg);
+		msgring_pop(ring);
+		vkey();
 	    }
 
 	    currutmp->chatid[0] = c0;
 	    currutmp->mode = mode0;
 	    currstat = currstat0;
-	} else {
+	} else if( msgring_peek(ring, 0, &msg) ){
 	    bell();
-	    show_call_in(1, 0);
-	    add_history(&currutmp->msgs[0]);
+	    wb_lastcall = msg;
+	    show_call_in(1, &msg);
+	    // only the first one shows, the others go to history directly
+	    do {
+		add_history(&msg);
+		msgring_pop(ring);
+	    } while( msgring_peek(ring, 0, &msg) );
 
 	    refresh();
-	    currutmp->msgcount = 0;
 	}
     }
-#ifdef NOKILLWATERBALL
     reentrant_write_request = 0;
+#ifdef NOKILLWATERBALL
     currutmp->wbtime = 0; /* race */
 #endif
 }
 
+/* SIGUSR2 only interrupts the wait for input, see waterball_wait_begin() */
+static sigset_t waterball_waitmask;
+
+static void
+waterball_wakeup(int sig GCC_UNUSED)
+{
+}
+
+static void
+waterball_init(void)
+{
+    sigset_t set;
+
+    signal_restart(SIGUSR2, waterball_wakeup);
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &set, &waterball_waitmask);
+    sigdelset(&waterball_waitmask, SIGUSR2);
+}
+
+/**
+ * Shows the waterballs queued, then tells senders we wait for input.
+ * Every blocking wait for input must go like
+ *	if ((mask = waterball_wait_begin())) {
+ *	    pselect(..., mask); waterball_wait_end();
+ *	}
+ * @return signal mask to wait with, or NULL if more waterballs came
+ *	   meanwhile and the caller should call again instead of waiting.
+ */
+const sigset_t *
+waterball_wait_begin(void)
+{
+    if (!currutmp || reentrant_write_request)
+	return &waterball_waitmask;
+    if (msgring_count(&currutmp->msgring) > wb_alreadyshow)
+	write_request(1);
+    if (msgring_wait_begin(&currutmp->msgring, wb_alreadyshow))
+	return NULL;
+    return &waterball_waitmask;
+}
+
+void
+waterball_wait_end(void)
+{
+    if (currutmp)
+	msgring_wait_end(&currutmp->msgring);
+}
+
 static userinfo_t*
 getotherlogin(int num)
 {
@@ -922,6 +965,67 @@ check_BM(void)
     pressanykey();
 }
 
+#ifdef FROMD
+/* resolve fromhost by fromd.
+ * The query is sent at the start of user_login() and the answer picked up
+ * after the login screens. No step waits: if fromd has not answered by
+ * then, utmp keeps the ip, same as when fromd is down. */
+static int  fromd_fd = -1;
+static char fromd_sent = 0;
+
+/* does what can be done without blocking.
+ * @param last	give up if there is no answer yet
+ */
+static void
+fromd_query_poll(int last)
+{
+    struct pollfd pfd;
+    char from[sizeof(currutmp->from)];
+    int len;
+
+    if (fromd_fd < 0)
+	return;
+
+    pfd.fd = fromd_fd;
+    if (!fromd_sent) {
+	pfd.events = POLLOUT;
+	if (poll(&pfd, 1, 0) <= 0)
+	    goto pending;
+	len = strlen(fromhost);
+	if ((pfd.revents & (POLLERR | POLLHUP)) ||
+	    write(fromd_fd, fromhost, len) != len)
+	    goto done;
+	fromd_sent = 1;
+    }
+
+    // the answer goes to utmp
+    if (!currutmp)
+	return;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 0) <= 0)
+	goto pending;
+    memset(from, 0, sizeof(from));
+    if (read(fromd_fd, from, sizeof(from) - 1) > 0 && from[0]) // keep trailing zero
+	strlcpy(currutmp->from, from, sizeof(currutmp->from));
+    goto done;
+
+pending:
+    if (!last)
+	return;
+done:
+    close(fromd_fd);
+    fromd_fd = -1;
+}
+
+static void
+fromd_query_start(void)
+{
+    fromd_sent = 0;
+    if ((fromd_fd = toconnect_nonblock(FROMD_ADDR)) >= 0)
+	fromd_query_poll(0);
+}
+#endif
+
 static void
 setup_utmp(int mode)
 {
@@ -972,23 +1076,6 @@ setup_utmp(int mode)
 
     strip_nonebig5((unsigned char *)currutmp->nickname, sizeof(currutmp->nickname));
 
-#ifdef FROMD
-    // resolve fromhost
-    {
-	int fd;
-	if ((fd = toconnect(FROMD_ADDR)) >= 0) {
-	    write(fd, fromhost, strlen(fromhost));
-	    // zero and reuse uinfo.from to check real data
-	    memset(uinfo.from, 0, sizeof(uinfo.from));
-	    read(fd, uinfo.from,  sizeof(uinfo.from) - 1); // keep trailing zero
-	    close(fd);
-	    // copy back to currutmp
-	    if (uinfo.from[0])
-		strlcpy(currutmp->from, uinfo.from, sizeof(currutmp->from));
-	}
-    }
-#endif // WHERE
-
     /* Very, very slow friend_load. */
     if( strcmp(cuser.userid, STR_GUEST) != 0 ) // guest Bzn
 	friend_load(0, 1);
@@ -1142,8 +1229,19 @@ user_login(void)
     /* NOTE! b setup_utmp e, Ӧ blocking/slow function,
      * _hiǾ race condition F multi-login */
 
+    // only the setup before the first screen; the steps before (register,
+    // user agreement, multi login) and after may wait for the user.
+    BEGINLAT(LAT_LOGIN);
+#ifdef FROMD
+    /* non-blocking, the answer is collected below */
+    fromd_query_start();
+#endif
+
     /* l uinfoBflagBmode */
     setup_utmp(LOGIN);
+#ifdef FROMD
+    fromd_query_poll(0);
+#endif
 
     /* log usies */
     log_usies("ENTER", fromhost);
@@ -1160,6 +1258,7 @@ user_login(void)
     /* mask fromhost a.b.c.d to a.b.c.* */
     strlcpy(fromhost_masked, fromhost, sizeof(fromhost_masked));
     obfuscate_ipstr(fromhost_masked);
+    ENDLAT(LAT_LOGIN);
 
 #ifndef MULTI_WELCOME_LOGIN
     more("etc/Welcome_login", NA);
@@ -1258,6 +1357,10 @@ user_login(void)
 	exit(1);
     }
 
+#ifdef FROMD
+    fromd_query_poll(1);
+#endif
+
     if(ptime.tm_yday!=lasttime.tm_yday)
 	STATINC(STAT_TODAYLOGIN_MAX);
 
@@ -1386,7 +1489,7 @@ start_client(struct ProgramOption *option)
 #endif
 
     signal_restart(SIGUSR1, talk_request);
-    signal_restart(SIGUSR2, write_request);
+    waterball_init();
 
     Signal(SIGALRM, abort_bbs);
     alarm(600);
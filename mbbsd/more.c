@@ -348,6 +348,14 @@ int more(const char *fpath, int promptend)
     return abort > 0 ? common_pager_exit_handler(abort, fpath) : 0;
 }
 
+// minimore does not report latency
+int
+more_latency(const char *fpath, int promptend,
+	     int op GCC_UNUSED, const struct timeval *begin GCC_UNUSED)
+{
+    return more(fpath, promptend);
+}
+
 #else	// USE_PMORE ////////////////////////////////////////////////////////
 
 static const char
@@ -412,6 +420,10 @@ display_hotkey_footer(const char *caption, const char *kattr, const char *vattr)
 
 #define MACROSTRLEN(x) (sizeof(x)-1)
 
+// set by more_latency(), taken at the first footer (the first page drawn)
+static int more_lat_op = -1;
+static const struct timeval *more_lat_begin;
+
 static int
 common_pmore_footer_handler(int ratio GCC_UNUSED, int width,
                             void *ctx GCC_UNUSED)
@@ -425,6 +437,13 @@ common_pmore_footer_handler(int ratio GCC_UNUSED, int width,
 #define FOOTERATTR_TEXT	     ANSI_COLOR(30)
 
     int w;
+
+    if (more_lat_begin)
+    {
+	latency_add(more_lat_op, more_lat_begin);
+	more_lat_begin = NULL;
+    }
+
     // XXX if you want to refine code here to use for-loop,
     // remember to use a pre-calculated array to hold MACROSTRLEN
     // or use real strlen(). do not pass string pointer to MACROSTRLEN.
@@ -475,6 +494,21 @@ more(const char *fpath, int promptend)
     return common_pager_exit_handler(r, fpath);
 }
 
+// more(), adding the time from begin to the first page drawn to the
+// latency histogram of op (LAT_*).
+int
+more_latency(const char *fpath, int promptend,
+	     int op, const struct timeval *begin)
+{
+    int r;
+
+    more_lat_op = op;
+    more_lat_begin = begin;
+    r = more(fpath, promptend);
+    more_lat_begin = NULL;
+    return r;
+}
+
 int
 more_inmemory(void *content, int size, int promptend)
 {
@@ -1,10 +1,10 @@
+#include "bbs.h"	// before system headers, for ppoll
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <poll.h>
 #include <errno.h>
 #include "vtkbd.h"
-#include "bbs.h"
 
 #ifdef USE_NIOS
 
@@ -209,6 +209,8 @@ cin_is_fd_empty(int fd)
  * @param fd2: skip if <= 0
  * @param ms: 0 for non-blocking, INFTIM(-1) for infinite, otherwise timeout milliseconds
  * @return: bitmask of fds having data/error, 0 for timeout, and -1 if error.
+ * While blocked, waterballs (SIGUSR2) interrupt the wait and are shown
+ * before waiting again.
  */
 #define CIN_POLL_FDS_MASK   (POLLIN|POLLERR|POLLHUP|POLLNVAL)
 // mask to check the return value of cin_poll_fds
@@ -227,12 +229,49 @@ cin_poll_fds(int fd1, int fd2, int timeout)
         { .fd = fd1, .events = POLLIN, .revents = 0, },
         { .fd = fd2, .events = POLLIN, .revents = 0, },
     };
+    struct timespec ts = { timeout / 1000, (timeout % 1000) * 1000000 };
+    struct timespec deadline, now;
+    const sigset_t *mask;
+
+    if (timeout > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += ts.tv_sec;
+        if ((deadline.tv_nsec += ts.tv_nsec) >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
 
+    if (timeout == 0) {
+#ifdef STAT_SYSSELECT
+        STATINC(STAT_SYSSELECT);
+#endif
+        while ( 0 > (r = poll(fds, CIN_IS_VALID_FD2(fd2) ? 2 : 1, 0)) &&
+                errno == EINTR);
+    } else do {
+        if ((mask = waterball_wait_begin()) == NULL) {
+            r = -1;
+            errno = EINTR;
+            continue;
+        }
+        // waterballs must not restart the full timeout
+        if (timeout > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            ts.tv_sec = deadline.tv_sec - now.tv_sec;
+            if ((ts.tv_nsec = deadline.tv_nsec - now.tv_nsec) < 0) {
+                ts.tv_sec--;
+                ts.tv_nsec += 1000000000L;
+            }
+            if (ts.tv_sec < 0)
+                ts.tv_sec = ts.tv_nsec = 0;
+        }
 #ifdef STAT_SYSSELECT
-    STATINC(STAT_SYSSELECT);
+        STATINC(STAT_SYSSELECT);
 #endif
-    while ( 0 > (r = poll(fds, CIN_IS_VALID_FD2(fd2) ? 2 : 1, timeout)) &&
-            errno == EINTR);
+        r = ppoll(fds, CIN_IS_VALID_FD2(fd2) ? 2 : 1,
+                  timeout < 0 ? NULL : &ts, mask);
+        waterball_wait_end();
+    } while (r < 0 && errno == EINTR);
     assert(r >= 0);
     if (r <= 0)
         return r;
@@ -524,18 +563,15 @@ vkey_process(int timeout, int peek)
 
         // now, try to read from fd.
         assert(1 == CIN_POLL_CINFD);    // cin_is_fd_empty() will return 1.
-        if (timeout > 0 || CIN_IS_VALID_FD2(vkctx.attached_fd))
+        // blocking reads also poll, so waterballs can come while waiting.
+        if (timeout != 0 || CIN_IS_VALID_FD2(vkctx.attached_fd))
         {
             r = cin_poll_fds(CIN_DEFAULT_FD, vkctx.attached_fd, timeout);
         }
-        else if (timeout == 0)
+        else
         {
             r = !cin_is_fd_empty(CIN_DEFAULT_FD);
         }
-        else {
-            assert(timeout == INFTIM);  // let's simply read it.
-            r = CIN_POLL_CINFD;
-        }
 
         if (r == 0) // timeout
         {
@@ -793,8 +793,8 @@ refresh(void)
     doupdate();
 }
 
-void
-doupdate(void)
+static void
+_doupdate(void)
 {
     int y, x;
     char touched = 0;
@@ -1056,6 +1056,14 @@ doupdate(void)
     ft.dirty = 0;
 }
 
+void
+doupdate(void)
+{
+    BEGINLAT(LAT_DOUPDATE);
+    _doupdate();
+    ENDLAT(LAT_DOUPDATE);
+}
+
 // cursor management
 
 void
@@ -267,9 +267,9 @@ cursor_pos(keeploc_t * locmem, int val, int from_top, int isshow)
 static int
 thread(const keeploc_t * locmem, int stypen)
 {
-    fileheader_t fh;
+    const fileheader_t *fhs, *fh;
     int     pos = locmem->crs_ln, jump = THREAD_SEARCH_RANGE, new_ln;
-    int     fd = -1, amatch = -1;
+    int     num, amatch = -1;
     int     step = (stypen & RS_FORWARD) ? 1 : -1;
     const char *key;
 
@@ -284,42 +284,42 @@ thread(const keeploc_t * locmem, int stypen)
     else
 	key = subject(headers[pos - locmem->top_ln].title );
 
+    num = fileheader_view(currdirect, &fhs);
+
     for( new_ln = pos + step ;
 	 new_ln > 0 && new_ln <= last_line && --jump > 0;
 	 new_ln += step ) {
 
-	if (get_records_keep(currdirect, &fh, sizeof(fileheader_t), new_ln, 1, &fd) <= 0)
+	if (new_ln > num)
 	{
 	    new_ln = pos;
 	    break;
 	}
+	fh = &fhs[new_ln - 1];
 
         if( stypen & RS_TITLE ){
             if( stypen & RS_FIRST ){
-		if( !strncmp(fh.title, key, PROPER_TITLE_LEN) )
+		if( !strncmp(fh->title, key, PROPER_TITLE_LEN) )
 		    break;
-		else if( !strncmp(&fh.title[4], key, PROPER_TITLE_LEN) ) {
+		else if( !strncmp(&fh->title[4], key, PROPER_TITLE_LEN) ) {
 		    amatch = new_ln;
 		    jump = THREAD_SEARCH_RANGE;
 		    /* jMPDDĤ@g, s䤣hֽg~ */
 		}
 	    }
-            else if( !strncmp(subject(fh.title), key, PROPER_TITLE_LEN) )
+            else if( !strncmp(subject(fh->title), key, PROPER_TITLE_LEN) )
 		break;
 	}
         else if( stypen & RS_NEWPOST ){
-            if( strncmp(fh.title, "Re:", 3) )
+            if( strncmp(fh->title, "Re:", 3) )
 		break;
 	}
         else{  // RS_AUTHOR
-            if( strcmp(subject(fh.owner), key) == EQUSTR )
+            if( strcmp(subject(fh->owner), key) == EQUSTR )
 		break;
 	}
     }
 
-    if( fd != -1 )
-	close(fd);
-
     if( jump <= 0 || new_ln <= 0 || new_ln > last_line )
 	new_ln = (amatch == -1 ? pos : amatch); //didn't find
 
@@ -339,10 +339,9 @@ thread(const keeploc_t * locmem, int stypen)
 static int
 search_read(const int bid, const keeploc_t * locmem, int stypen)
 {
-    fileheader_t fh;
+    const fileheader_t *fhs, *fh;
     int     pos = locmem->crs_ln;
-    int     rk;
-    int     fd = -1;
+    int     num;
     int     forward = (stypen & RS_FORWARD) ? 1 : 0;
     time4_t ftime, result;
     int     ret;
@@ -350,23 +349,25 @@ search_read(const int bid, const keeploc_t * locmem, int stypen)
 
     if( last_line <= 1 ) return pos;
 
+    num = fileheader_view(currdirect, &fhs);
+    if( num < 0 ) return pos;
+
     /* First load the timestamp of article where cursor points to */
 reload_fh:
-    rk = get_records_keep(currdirect, &fh, sizeof(fileheader_t), pos, 1, &fd);
-    if( rk < 0 ) goto out;
-    if( rk == 0 /* EOF */ ) {
+    if( pos < 1 ) return pos;
+    if( pos > num /* EOF */ ) {
         /* pGOm峹, hnN ftime ]w̤j (N̫@g٭ns)  */
         ftime = 2147483647;
     } else {
+        fh = &fhs[pos - 1];
 #ifdef SAFE_ARTICLE_DELETE
-        if (fh.filename[0] == '.' || fh.owner[0] == '-') {
+        if (fh->filename[0] == '.' || fh->owner[0] == '-') {
             /* ЩҦb峹wQR, L, UU@g峹 */
-            close(fd);
             pos += step;
             goto reload_fh;
         }
 #endif
-        ftime = atoi( &fh.filename[2] );
+        ftime = atoi( &fh->filename[2] );
     }
 
     /* given the ftime to resolve the read article */
@@ -379,13 +380,11 @@ reload_fh:
          */
         int i;
 
-        for( i = last_line; i >= 0; --i ) {
-            rk = get_records_keep(currdirect, &fh, sizeof(fileheader_t), i, 1, &fd);
-            if (rk < 0) goto out;
-            if (rk == 0) continue;
-            if( 0 == brc_unread( bid, fh.filename, 0 ) ) {
+        for( i = last_line; i > 0; --i ) {
+            if (i > num) continue;
+            if( 0 == brc_unread( bid, fhs[i - 1].filename, 0 ) ) {
                 pos = i;
-                goto out;
+                break;
             }
         }
     } else if( ret ) {
@@ -393,25 +392,22 @@ reload_fh:
         int i;
 
         /* find out the position for the article result */
-        for( i = pos; i >= 0 && i <= last_line; i += step ) {
-            rk = get_records_keep(currdirect, &fh, sizeof(fileheader_t), i, 1, &fd);
-            if (rk < 0) goto out;
-            if (rk == 0) continue;
+        for( i = pos; i > 0 && i <= last_line; i += step ) {
+            if (i > num) continue;
+            fh = &fhs[i - 1];
 #ifdef SAFE_ARTICLE_DELETE
-            if (fh.filename[0] == '.' || fh.owner[0] == '-') {
+            if (fh->filename[0] == '.' || fh->owner[0] == '-') {
                 /* og峹wQR, L, ոդU@g */
                 continue;
             }
 #endif
-            if( atoi( &fh.filename[2] ) == result ) {
+            if( atoi( &fh->filename[2] ) == result ) {
                 pos = i;
-                goto out;
+                break;
             }
         }
     }
 
-out:
-    if( fd != -1 ) close(fd);
     return pos;
 }
 
@@ -569,6 +565,35 @@ trim_blank(char *buf) {
     return *buf == 0;
 }
 
+/* whether fh meets the condition select_read() is adding */
+static int
+select_match(const fileheader_t *fh, int sr_mode, const char *keyword,
+	     int n_recommend, int n_money)
+{
+    if ((sr_mode & RS_MARK) && !(fh->filemode & FILE_MARKED))
+	return 0;
+    if ((sr_mode & RS_SOLVED) && !(fh->filemode & FILE_SOLVED))
+	return 0;
+    if ((sr_mode & RS_NEWPOST) && !strncmp(fh->title, "Re:", 3))
+	return 0;
+    if ((sr_mode & RS_AUTHOR) && !DBCS_strcasestr(fh->owner, keyword))
+	return 0;
+    if ((sr_mode & RS_KEYWORD) && !DBCS_strcasestr(fh->title, keyword))
+	return 0;
+    if ((sr_mode & RS_KEYWORD_EXCLUDE) && DBCS_strcasestr(fh->title, keyword))
+	return 0;
+    if ((sr_mode & RS_TITLE) && strcasecmp(subject(fh->title), keyword))
+	return 0;
+    if ((sr_mode & RS_RECOMMEND) &&
+	(n_recommend > 0 ? (fh->recommend < n_recommend) :
+			   (fh->recommend > n_recommend)))
+	return 0;
+    /* please put money test in last */
+    if ((sr_mode & RS_MONEY) && query_file_money(fh) < n_money)
+	return 0;
+    return 1;
+}
+
 static int
 select_read(const keeploc_t * locmem, int sr_mode)
 {
@@ -582,6 +607,7 @@ select_read(const keeploc_t * locmem, int sr_mode)
    int reload, inc;
    int len, fd, fr, i, count = 0, reference = 0;
    int filemode;
+   int *cand = NULL, ncand, use_index = 0;
    /* selection condition */
    char keyword[TTLEN + 1] = "";
    int n_recommend = 0, n_money = 0;
@@ -652,6 +678,9 @@ select_read(const keeploc_t * locmem, int sr_mode)
    else
       _mode |= sr_mode;
 
+   // no more user input below
+   BEGINLAT(LAT_SELECTREAD);
+
    snprintf(genbuf, sizeof(genbuf), "%s%X.%X.%X",
             first_select ? "SR.":p,
             sr_mode, (int)strlen(keyword), DBCS_StringHash(keyword));
@@ -712,6 +741,13 @@ select_read(const keeploc_t * locmem, int sr_mode)
    if(sr_mode & (RS_MARK | RS_RECOMMEND | RS_SOLVED))
        inc = 0;
 
+   /* author and title searches on the whole board go through srindex */
+   if (first_select && currstat != RMAIL &&
+       (sr_mode & (RS_AUTHOR | RS_KEYWORD))) {
+       setbdir(genbuf, currboard);
+       use_index = strcmp(currdirect, genbuf) == 0;
+   }
+
    if(reload) {
        if( (fr = open(currdirect, O_RDONLY, 0)) != -1 ) {
 	   if(inc) {
@@ -747,39 +783,34 @@ select_read(const keeploc_t * locmem, int sr_mode)
 #ifdef DEBUG
 	   vmsgf("search: %s", currdirect);
 #endif
+	   ncand = -1;
+	   if (use_index && !inc)
+	       ncand = srindex_search(currdirect,
+				      (sr_mode & RS_AUTHOR) ? SRI_AUTHOR : SRI_TITLE,
+				      keyword, &cand);
+	   if (ncand >= 0) {
+	       /* only read the records nominated by the index */
+	       for (i = 0; i < ncand; i++) {
+		   if (pread(fr, &fhs[0], sizeof(fileheader_t),
+			     (off_t)cand[i] * sizeof(fileheader_t)) !=
+		       sizeof(fileheader_t))
+		       break;
+		   if (!select_match(&fhs[0], sr_mode, keyword,
+				     n_recommend, n_money))
+		       continue;
+		   fhs[0].multi.refer.flag = 1;
+		   fhs[0].multi.refer.ref = cand[i] + 1;
+		   ++count;
+		   write(fd, &fhs[0], sizeof(fileheader_t));
+	       }
+	       free(cand);
+	   } else
 	   while( (len = read(fr, fhs, sizeof(fhs))) > 0 ){
 	       len /= sizeof(fileheader_t);
 	       for( i = 0 ; i < len ; ++i ){
 		   reference++;
-		   if( (sr_mode & RS_MARK)  &&
-		       !(fhs[i].filemode & FILE_MARKED) )
-		       continue;
-		   if( (sr_mode & RS_SOLVED) &&
-		       !(fhs[i].filemode & FILE_SOLVED) )
-		       continue;
-		   else if((sr_mode & RS_NEWPOST)  &&
-		      !strncmp(fhs[i].title,  "Re:", 3))
-		       continue;
-		   else if((sr_mode & RS_AUTHOR)  &&
-		      !DBCS_strcasestr(fhs[i].owner, keyword))
-		       continue;
-		   else if((sr_mode & RS_KEYWORD)  &&
-		      !DBCS_strcasestr(fhs[i].title, keyword))
-		       continue;
-                   else if(sr_mode  & RS_KEYWORD_EXCLUDE &&
-                       DBCS_strcasestr(fhs[i].title, keyword))
-		       continue;
-		   else if((sr_mode & RS_TITLE)  &&
-		      strcasecmp(subject(fhs[i].title), keyword))
-		       continue;
-		   else if ((sr_mode & RS_RECOMMEND)  &&
-		       (n_recommend > 0 ?
-		       (fhs[i].recommend < n_recommend) :
-		       (fhs[i].recommend > n_recommend) ))
-		       continue;
-		   /* please put money test in last */
-		   else if ((sr_mode & RS_MONEY) &&
-			   query_file_money(fhs+i) < n_money)
+		   if (!select_match(&fhs[i], sr_mode, keyword,
+				     n_recommend, n_money))
 		       continue;
 
                    if(first_select) {
@@ -795,6 +826,7 @@ select_read(const keeploc_t * locmem, int sr_mode)
 	   close(fd);
        }
    }
+   ENDLAT(LAT_SELECTREAD);
 
    if(count) {
        strlcpy(currdirect, newdirect, sizeof(currdirect));
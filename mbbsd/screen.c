@@ -302,8 +302,8 @@ refresh(void)
     doupdate();
 }
 
-void
-doupdate(void)
+static void
+_doupdate(void)
 {
     /* TODO remove unnecessary refresh() call, to save CPU time */
     register screenline_t *bp = big_picture;
@@ -405,6 +405,14 @@ doupdate(void)
     oflush();
 }
 
+void
+doupdate(void)
+{
+    BEGINLAT(LAT_DOUPDATE);
+    _doupdate();
+    ENDLAT(LAT_DOUPDATE);
+}
+
 void
 clear(void)
 {
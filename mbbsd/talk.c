@@ -131,17 +131,17 @@ modestring(const userinfo_t * uentp, int simple)
 	snprintf(modestr, sizeof(modestr), "yǳƤ");
     else if (
 #ifdef NOKILLWATERBALL
-	     uentp->msgcount > 0
+	     msgring_count(&uentp->msgring) > 0
 #else
 	     (!mode) && *uentp->chatid == 2
 #endif
 	     )
-	if (uentp->msgcount < 10) {
+	if (msgring_count(&uentp->msgring) < 10) {
 	    const char *cnum[10] =
 	    {"", "@", "", "T", "|", "",
 		 "", "C", "K", "E"};
 	    snprintf(modestr, sizeof(modestr),
-		     "%sy", cnum[(int)(uentp->msgcount)]);
+		     "%sy", cnum[msgring_count(&uentp->msgring)]);
 	} else
 	    snprintf(modestr, sizeof(modestr), "F @_@");
     else if (!mode)
@@ -262,6 +262,8 @@ int sync_outta_server(int sfd, int do_login)
 	log_usies("REJECTLOGIN", NULL);
         // We can't do u_exit because some resources like friends are not ready.
         currmode = 0;
+	friendref_unlink(currutmp - SHM->uinfo);
+	utmpindex_remove(currutmp - SHM->uinfo);
 	memset(currutmp, 0, sizeof(userinfo_t));
         // user will try to disconnect here and cause abort_bbs.
 	sleep(30);
@@ -297,12 +299,53 @@ int sync_outta_server(int sfd, int do_login)
 }
 #endif
 
-void login_friend_online(int do_login)
+static void
+login_friend_add(userinfo_t *uentp, int offset, unsigned char *seen)
 {
-    userinfo_t     *uentp;
-    int             i;
     unsigned int    stat, stat1;
+    int             idx = (int)(uentp - &SHM->uinfo[0]);
+
+    if (seen[idx / 8] & (1 << (idx % 8)))
+	return;
+    seen[idx / 8] |= 1 << (idx % 8);
+
+    if (uentp->uid && (stat = set_friend_bit(currutmp, uentp))) {
+	stat1 = reverse_friend_stat(stat);
+	stat <<= 24;
+	stat |= idx;
+	currutmp->friend_online[currutmp->friendtotal++] = stat;
+	if (uentp != currutmp && uentp->friendtotal < MAX_FRIEND) {
+	    stat1 <<= 24;
+	    stat1 |= offset;
+	    uentp->friend_online[uentp->friendtotal++] = stat1;
+	}
+    }
+}
+
+static void
+login_friend_visit_uid(int uid, int offset, unsigned char *seen)
+{
+    userinfo_t     *uentp;
+    int             k;
+
+    for (k = 1; currutmp->friendtotal < MAX_FRIEND &&
+	 (uentp = search_ulistn(uid, k)) != NULL; k++)
+	login_friend_add(uentp, offset, seen);
+}
+
+/*
+ * Only visits sessions that can have a relation with us: the sessions of
+ * users in our friend/reject lists, then (via the reverse friend index)
+ * the sessions having us in their lists.
+ */
+void login_friend_online(int do_login)
+{
+    int             i, n;
     int             offset = (int)(currutmp - &SHM->uinfo[0]);
+    static unsigned char seen[USHM_SIZE / 8 + 1];
+    static int      refs[USHM_SIZE];
+
+    friendref_link(offset);
 
 #ifdef UTMPD
     int sfd;
@@ -320,20 +363,17 @@ void login_friend_online(int do_login)
     }
 #endif
 
-    for (i = 0; i < SHM->UTMPnumber && currutmp->friendtotal < MAX_FRIEND; i++) {
-	uentp = (&SHM->uinfo[SHM->sorted[SHM->currsorted][0][i]]);
-	if (uentp && uentp->uid && (stat = set_friend_bit(currutmp, uentp))) {
-	    stat1 = reverse_friend_stat(stat);
-	    stat <<= 24;
-	    stat |= (int)(uentp - &SHM->uinfo[0]);
-	    currutmp->friend_online[currutmp->friendtotal++] = stat;
-	    if (uentp != currutmp && uentp->friendtotal < MAX_FRIEND) {
-		stat1 <<= 24;
-		stat1 |= offset;
-		uentp->friend_online[uentp->friendtotal++] = stat1;
-	    }
-	}
-    }
+    memset(seen, 0, sizeof(seen));
+
+    for (i = 0; i < currutmp->nFriends && i < MAX_FRIEND; i++)
+	login_friend_visit_uid(currutmp->myfriend[i], offset, seen);
+    for (i = 0; i < MAX_REJECT && currutmp->reject[i]; i++)
+	login_friend_visit_uid(currutmp->reject[i], offset, seen);
+
+    n = friendref_lookup(currutmp->uid, refs, USHM_SIZE);
+    for (i = 0; i < n && currutmp->friendtotal < MAX_FRIEND; i++)
+	if (SHM->uinfo[refs[i]].pid)
+	    login_friend_add(&SHM->uinfo[refs[i]], offset, seen);
     return;
 }
 
@@ -916,7 +956,7 @@ my_write(pid_t pid, const char *prompt, const char *id, int flag, userinfo_t * p
             return 0;
         }
     }
-    if (flag == WATERBALL_SYSOP && uin->msgcount) {
+    if (flag == WATERBALL_SYSOP && msgring_count(&uin->msgring)) {
 	/*  */
 	uin->destuip = currutmp - &SHM->uinfo[0];
 	uin->sig = 2;
@@ -943,64 +983,54 @@ my_write(pid_t pid, const char *prompt, const char *id, int flag, userinfo_t * p
 	       ) {
 	outmsg(ANSI_COLOR(1;33;41) "V|! 訾F! " ANSI_COLOR(37) "~>_<~" ANSI_RESET);
     } else {
-	int     write_pos = uin->msgcount; /* try to avoid race */
-	if ( write_pos < (MAX_MSGS - 1) ) { /* race here */
-	    unsigned char   pager0 = uin->pager;
+	msgque_t        wmsg;
+	int             queued;
 
-	    uin->msgcount = write_pos + 1;
-	    uin->pager = PAGER_DISABLE;
-	    uin->msgs[write_pos].pid = currpid;
+	memset(&wmsg, 0, sizeof(wmsg));
+	wmsg.pid = currpid;
 #ifdef PLAY_ANGEL
-	    if (flag == WATERBALL_ANSWER || flag == WATERBALL_CONFIRM_ANSWER)
-                angel_load_my_fullnick(uin->msgs[write_pos].userid,
-                                       sizeof(uin->msgs[write_pos].userid));
-	    else
+	if (flag == WATERBALL_ANSWER || flag == WATERBALL_CONFIRM_ANSWER)
+	    angel_load_my_fullnick(wmsg.userid, sizeof(wmsg.userid));
+	else
 #endif
-            strlcpy(uin->msgs[write_pos].userid, cuser.userid,
-                    sizeof(uin->msgs[write_pos].userid));
-	    strlcpy(uin->msgs[write_pos].last_call_in, msg,
-		    sizeof(uin->msgs[write_pos].last_call_in));
-	    switch (flag) {
+	strlcpy(wmsg.userid, cuser.userid, sizeof(wmsg.userid));
+	strlcpy(wmsg.last_call_in, msg, sizeof(wmsg.last_call_in));
+	switch (flag) {
 #ifdef PLAY_ANGEL
-		case WATERBALL_ANGEL:
-                    angel_log_msg_to_angel();
-		    uin->msgs[write_pos].msgmode = MSGMODE_TOANGEL;
-		    break;
+	    case WATERBALL_ANGEL:
+		angel_log_msg_to_angel();
+		wmsg.msgmode = MSGMODE_TOANGEL;
+		break;
 
-		case WATERBALL_CONFIRM_ANGEL:
-		    uin->msgs[write_pos].msgmode = MSGMODE_TOANGEL;
-		    break;
+	    case WATERBALL_CONFIRM_ANGEL:
+		wmsg.msgmode = MSGMODE_TOANGEL;
+		break;
 
-		case WATERBALL_ANSWER:
-		case WATERBALL_CONFIRM_ANSWER:
-		    uin->msgs[write_pos].msgmode = MSGMODE_FROMANGEL;
-		    break;
+	    case WATERBALL_ANSWER:
+	    case WATERBALL_CONFIRM_ANSWER:
+		wmsg.msgmode = MSGMODE_FROMANGEL;
+		break;
 #endif
-                case WATERBALL_ALOHA:
-                    uin->msgs[write_pos].msgmode = MSGMODE_ALOHA;
-                    break;
+	    case WATERBALL_ALOHA:
+		wmsg.msgmode = MSGMODE_ALOHA;
+		break;
 
-                default:
-                    uin->msgs[write_pos].msgmode = MSGMODE_WRITE;
-                    break;
-            }
-	    uin->pager = pager0;
-	} else if (flag != WATERBALL_ALOHA)
-	    outmsg(ANSI_COLOR(1;33;41) "V|! 褣F! (Ӧhy) " ANSI_COLOR(37) "@_@" ANSI_RESET);
+	    default:
+		wmsg.msgmode = MSGMODE_WRITE;
+		break;
+	}
 
-	if (uin->msgcount >= 1 &&
-#ifdef NOKILLWATERBALL
-	    !(uin->wbtime = now) /* race */
-#else
-	    (uin->pid <= 0 || kill(uin->pid, SIGUSR2) == -1)
-#endif
-	    && flag != WATERBALL_ALOHA)
-	    outmsg(ANSI_COLOR(1;33;41) "V|! S! " ANSI_COLOR(37) "~>_<~" ANSI_RESET);
-	else if (uin->msgcount == 1 && flag != WATERBALL_ALOHA)
-	    outmsg(ANSI_COLOR(1;33;44) "y{LhF! " ANSI_COLOR(37) "*^o^*" ANSI_RESET);
-	else if (uin->msgcount > 1 && uin->msgcount < MAX_MSGS &&
-		flag != WATERBALL_ALOHA)
-	    outmsg(ANSI_COLOR(1;33;44) "AɤW@! " ANSI_COLOR(37) "*^o^*" ANSI_RESET);
+	queued = msgring_send(uin, &wmsg);
+	if (flag != WATERBALL_ALOHA) {
+	    if (queued < 0)
+		outmsg(ANSI_COLOR(1;33;41) "V|! 褣F! (Ӧhy) " ANSI_COLOR(37) "@_@" ANSI_RESET);
+	    else if (uin->pid <= 0)
+		outmsg(ANSI_COLOR(1;33;41) "V|! S! " ANSI_COLOR(37) "~>_<~" ANSI_RESET);
+	    else if (queued == 1)
+		outmsg(ANSI_COLOR(1;33;44) "y{LhF! " ANSI_COLOR(37) "*^o^*" ANSI_RESET);
+	    else if (queued < MAX_MSGS)
+		outmsg(ANSI_COLOR(1;33;44) "AɤW@! " ANSI_COLOR(37) "*^o^*" ANSI_RESET);
+	}
 
 #if defined(NOKILLWATERBALL) && defined(PLAY_ANGEL)
 	/* Questioning and answering should better deliver immediately. */
@@ -1022,14 +1052,8 @@ my_write(pid_t pid, const char *prompt, const char *id, int flag, userinfo_t * p
 void
 getmessage(msgque_t msg)
 {
-    int     write_pos = currutmp->msgcount;
-    if ( write_pos < (MAX_MSGS - 1) ) {
-            unsigned char pager0 = currutmp->pager;
- 	    currutmp->msgcount = write_pos+1;
-            memcpy(&currutmp->msgs[write_pos], &msg, sizeof(msgque_t));
-            currutmp->pager = pager0;
-   	    write_request(SIGUSR1);
-        }
+    if (msgring_send(currutmp, &msg) > 0)
+	write_request(SIGUSR1);
 }
 
 void
@@ -2449,19 +2473,8 @@ userlist(void)
 			    //     can we just scan uinfo with proper checking?
 			    uentp = &SHM->uinfo[
                                       SHM->sorted[SHM->currsorted][0][i]];
-			    if (uentp->pid && kill(uentp->pid, 0) != -1){
-				int     write_pos = uentp->msgcount;
-				if( write_pos < (MAX_MSGS - 1) ){
-				    uentp->msgcount = write_pos + 1;
-				    memcpy(&uentp->msgs[write_pos], &msg,
-					   sizeof(msg));
-#ifdef NOKILLWATERBALL
-				    uentp->wbtime = now;
-#else
-				    kill(uentp->pid, SIGUSR2);
-#endif
-				}
-			    }
+			    if (uentp->pid)
+				msgring_send(uentp, &msg);
 			}
 		    } else {
 			userinfo_t     *uentp;
@@ -2853,7 +2866,6 @@ establish_talk_connection(const userinfo_t *uip)
     int                    a;
     struct sockaddr_in sin;
 
-    currutmp->msgcount = 0;
     memset(&sin, 0, sizeof(sin));
     sin.sin_family = PF_INET;
     sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
@@ -2917,11 +2929,11 @@ talkreply(void)
 	   "       (2) %sH$1000..\n\n", sig_des[sig], sig_des[sig]);
 
     getuser(uip->userid, &xuser);
-    currutmp->msgs[0].pid = uip->pid;
-    strlcpy(currutmp->msgs[0].userid, uip->userid, sizeof(currutmp->msgs[0].userid));
-    strlcpy(currutmp->msgs[0].last_call_in, "IsBIsAťЦ^ (Ctrl-R)",
-	    sizeof(currutmp->msgs[0].last_call_in));
-    currutmp->msgs[0].msgmode = MSGMODE_TALK;
+    wb_lastcall.pid = uip->pid;
+    strlcpy(wb_lastcall.userid, uip->userid, sizeof(wb_lastcall.userid));
+    strlcpy(wb_lastcall.last_call_in, "IsBIsAťЦ^ (Ctrl-R)",
+	    sizeof(wb_lastcall.last_call_in));
+    wb_lastcall.msgmode = MSGMODE_TALK;
     prints("Ӧ [%s]A" STR_LOGINDAYS " %d " STR_LOGINDAYS_QTY "A峹@ %d g\n",
 	    uip->from, xuser.numlogindays, xuser.numposts);
 
@@ -2929,7 +2941,7 @@ talkreply(void)
 	ChessShowRequest();
     else {
 	showplans(uip->userid);
-	show_call_in(0, 0);
+	show_call_in(0, &wb_lastcall);
     }
 
     snprintf(genbuf, sizeof(genbuf),
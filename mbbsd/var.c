@@ -375,6 +375,7 @@ time4_t         now;
 int             KEY_ESC_arg;
 int             watermode = -1;
 int             wmofo = NOTREPLYING;
+msgque_t        wb_lastcall;	/* the last waterball shown, for Ctrl-R */
 /*
  * PAGER_UI_IS(PAGER_UI_ORIG) | PAGER_UI_IS(PAGER_UI_NEW):
  * ????????????????????
@@ -451,9 +452,7 @@ char           *friend_file[8] = {
     FN_VISABLE
 };
 
-#ifdef NOKILLWATERBALL
 char    reentrant_write_request = 0;
-#endif
 
 #ifdef PTTBBS_UTIL
     #ifdef OUTTA_TIMER
@@ -0,0 +1,216 @@
+/* BRC benchmark: board list unread checks, v4 directory vs. v3 linear scan
+ *
+ * usage: brc_bench [-n rounds] [-r records_per_board] [.brc3 file]
+ *
+ * Without a file, builds a full size (BRC_MAXSIZE) v3 record file with as
+ * many boards as fit, like a user who pressed 'v' on every board. Then
+ * converts it to v4 the way mbbsd does at login, and times rendering a
+ * board list (one brc_unread_time() per board, tracked or not) against the
+ * v3 code it replaced. Does not touch any user data.
+ */
+#include "bbs.h"
+#include <sys/time.h>
+
+// the real thing, statics included
+#include "../mbbsd/brc.c"
+
+// what brc.c needs from the rest of mbbsd; never reached here.
+void
+setuserfile(char *buf, const char *fname)
+{
+    snprintf(buf, PATHLEN, "/dev/null/%s", fname);
+}
+
+static double
+now_sec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// v3 lookup and unread check as they were, for comparison.
+static char *
+v3_findrecord_in(char *begin, char *endp, brcbid_t bid, brcnbrd_t *num)
+{
+    char     *tmpp, *ptr = begin;
+    brcbid_t tbid;
+    while (ptr + sizeof(brcbid_t) + sizeof(brcnbrd_t) < endp) {
+	tmpp = ptr;
+	tbid = *(brcbid_t*)tmpp;
+	tmpp += sizeof(brcbid_t);
+	*num = *(brcnbrd_t*)tmpp;
+	tmpp += sizeof(brcnbrd_t) + *num * sizeof(brc_rec);
+	if (tmpp > endp) {
+	    *num = (brcnbrd_t)(endp - ptr);
+	    return 0;
+	}
+	if (tbid == bid)
+	    return ptr;
+	ptr = tmpp;
+    }
+    *num = 0;
+    return 0;
+}
+
+static int
+v3_unread_time(char *buf, int size, int bid, time4_t ftime)
+{
+    char *p;
+    brcnbrd_t bnum;
+    const brc_rec *blist;
+    int i;
+
+    if (ftime <= brc_expire_time)
+	return 0;
+    p = v3_findrecord_in(buf, buf + size, bid, &bnum);
+    if (!p)
+	return 1;
+    blist = (const brc_rec*)(p + sizeof(brcbid_t) + sizeof(brcnbrd_t));
+    for (i = 0; i < bnum; i++) {
+	if (ftime > blist[i].create)
+	    return 1;
+	else if (ftime == blist[i].create)
+	    return 0;
+    }
+    return 0;
+}
+
+static char *
+make_v3(int nrec, int *size, int *nboards)
+{
+    char *buf = (char*)malloc(BRC_MAXSIZE), *p = buf;
+    int   bid, i;
+    brcnbrd_t num = nrec;
+    brc_rec r;
+
+    srandom(1);
+    *nboards = 0;
+    // every other bid, so half the board list is not tracked
+    for (bid = 1; p + sizeof(brcbid_t) + sizeof(brcnbrd_t) +
+		  nrec * sizeof(brc_rec) <= buf + BRC_MAXSIZE; bid += 2) {
+	brcbid_t b = bid;
+	memcpy(p, &b, sizeof(b));
+	p += sizeof(b);
+	memcpy(p, &num, sizeof(num));
+	p += sizeof(num);
+	for (i = 0; i < nrec; i++) {
+	    r.create = r.modified = now - i * 600 - random() % 86400;
+	    memcpy(p, &r, sizeof(r));
+	    p += sizeof(r);
+	}
+	(*nboards)++;
+    }
+    *size = p - buf;
+    return buf;
+}
+
+static char *
+read_v3(const char *fn, int *size, int *nboards)
+{
+    char *buf = (char*)malloc(BRC_MAXSIZE), *p;
+    brcnbrd_t num;
+    int fd;
+
+    if ((fd = open(fn, O_RDONLY)) < 0) {
+	perror(fn);
+	exit(1);
+    }
+    *size = read(fd, buf, BRC_MAXSIZE);
+    close(fd);
+    if (*size < 0)
+	*size = 0;
+    *nboards = 0;
+    for (p = buf; p + sizeof(brcbid_t) + sizeof(brcnbrd_t) < buf + *size;
+	 p += sizeof(brcbid_t) + sizeof(brcnbrd_t) + num * sizeof(brc_rec)) {
+	memcpy(&num, p + sizeof(brcbid_t), sizeof(num));
+	(*nboards)++;
+    }
+    return buf;
+}
+
+int
+main(int argc, char **argv)
+{
+    int ch, i, r, rounds = 100, nrec = 1;
+    int size, v4size, nboards, nlist, maxbid = 0, mismatch = 0;
+    char *v3, *v4;
+    time4_t *ftime;
+    long sum3 = 0, sum4 = 0;
+    double t3, t4, tconv;
+
+    while ((ch = getopt(argc, argv, "n:r:")) != -1)
+	switch (ch) {
+	    case 'n':
+		rounds = atoi(optarg);
+		break;
+	    case 'r':
+		nrec = atoi(optarg);
+		break;
+	    default:
+		fprintf(stderr, "usage: %s [-n rounds] [-r records_per_board] "
+			"[.brc3 file]\n", argv[0]);
+		return 1;
+	}
+    if (rounds <= 0)
+	rounds = 1;
+    if (nrec <= 0 || nrec > BRC_MAXNUM)
+	nrec = 1;
+
+    now = time(NULL);
+    login_start_time = now;
+    brc_expire_time = login_start_time - 365 * DAY_SECONDS;
+    brc_initialized = 1;
+
+    v3 = (optind < argc) ? read_v3(argv[optind], &size, &nboards)
+			 : make_v3(nrec, &size, &nboards);
+
+    tconv = now_sec();
+    brc_load_buf(v3, size);
+    tconv = now_sec() - tconv;
+
+    // the board list: every bid up to the largest tracked one
+    for (i = 0; i < brc_ndir; i++)
+	if ((int)brc_dir[i].bid > maxbid)
+	    maxbid = brc_dir[i].bid;
+    nlist = maxbid + 1;
+    ftime = (time4_t*)malloc(nlist * sizeof(time4_t));
+    for (i = 0; i < nlist; i++)
+	ftime[i] = now - random() % (2 * 86400);
+
+    t3 = now_sec();
+    for (r = 0; r < rounds; r++)
+	for (i = 1; i < nlist; i++)
+	    sum3 += v3_unread_time(v3, size, i, ftime[i]);
+    t3 = now_sec() - t3;
+
+    t4 = now_sec();
+    for (r = 0; r < rounds; r++)
+	for (i = 1; i < nlist; i++)
+	    sum4 += brc_unread_time(i, ftime[i], 0);
+    t4 = now_sec() - t4;
+
+    for (i = 1; i < nlist; i++)
+	if (v3_unread_time(v3, size, i, ftime[i]) !=
+	    !!brc_unread_time(i, ftime[i], 0))
+	    mismatch++;
+
+    // and once more after a save / load round trip
+    v4 = brc_serialize(&v4size);
+    brc_release();
+    brc_load_buf(v4, v4size);
+    for (i = 1; i < nlist; i++)
+	if (v3_unread_time(v3, size, i, ftime[i]) !=
+	    !!brc_unread_time(i, ftime[i], 0))
+	    mismatch++;
+
+    printf("tracked boards: %d (%d records each), v4 file %d bytes\n",
+	   nboards, nrec, v4size);
+    printf("v3 -> v4 conversion: %.3f ms\n", tconv * 1e3);
+    printf("board list of %d boards x %d rounds\n", nlist - 1, rounds);
+    printf("v3 (linear scan):     %10.2f us/list\n", t3 * 1e6 / rounds);
+    printf("v4 (sorted directory):%10.2f us/list\n", t4 * 1e6 / rounds);
+    printf("unread: %ld / %ld, %d mismatches\n", sum3 / rounds,
+	   sum4 / rounds, mismatch);
+    return mismatch ? 1 : 0;
+}
@@ -18,7 +18,6 @@ int main(int argc, char *argv[])
     int i, j;
     userinfo_t *uentp;
     msgque_t msg;
-    time_t now;
     int *sorted, UTMPnumber; // SHM snapshot
 
     while ((i = getopt(argc, argv, "t:n:o:h")) != -1)
@@ -56,29 +55,16 @@ int main(int argc, char *argv[])
     strlcpy(msg.userid, owner, sizeof(msg.userid));
     snprintf(msg.last_call_in, sizeof(msg.last_call_in), "[s]%s", argv[optind]);
 
-    now = time(NULL);
-
     for (i = 0, j = 0; i < UTMPnumber; ++i, ++j) {
 	// XXX why use sorted list?
 	//     can we just scan uinfo with proper checking?
 	uentp = &SHM->uinfo[sorted[i]];
-	if (uentp->pid && kill(uentp->pid, 0) != -1){
-	    int write_pos = uentp->msgcount;
-	    if (write_pos < (MAX_MSGS - 1)){
-		uentp->msgcount = write_pos + 1;
-		memcpy(&uentp->msgs[write_pos], &msg, sizeof(msg));
-#ifdef NOKILLWATERBALL
-		uentp->wbtime = (time4_t)now;
-#else
-		kill(uentp->pid, SIGUSR2);
-#endif
-	    }
-	}
+	if (uentp->pid)
+	    msgring_send(uentp, &msg);
 
 	if (j == num_per_loop) {
 	    fprintf(stderr, "%5d/%5d\n", i + 1, UTMPnumber);
 	    j = 0;
-	    now = time(NULL);
 	    sleep(sleep_time);
 	}
     }
@@ -0,0 +1,181 @@
+/* Big5 <-> UTF-8 converter benchmark and differential test
+ *
+ * usage: convert_bench [-n rounds] capture...
+ *
+ * A capture is the raw output of a Big5 session as pfterm wrote it to
+ * the terminal (e.g. "script -q capture telnet localhost", or mbbsd -e
+ * big5 with its stdout tee'd). Each capture is converted to UTF-8 and
+ * back, both by the block converters in blocks of random size and by
+ * copies of the old byte-at-a-time converters, which must agree.
+ * Then the throughput of both is reported. Exits non-zero on mismatch.
+ */
+#include "bbs.h"
+#include <sys/time.h>
+
+static double
+now_sec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* the per byte converters that mbbsd used to call for every character */
+
+static size_t
+legacy_big5_to_utf8(const char *src, size_t len, char *dst)
+{
+    static union {
+        char c[2];
+        uint16_t u;
+    } trail = { .u = 0, };
+    uint8_t utf8[4];
+    char *d = dst;
+    int n, i;
+
+    while (len-- > 0) {
+        char c = *src++;
+        // trail must be little endian.
+        if (trail.c[1]) {
+            trail.c[0] = c;
+            n = ucs2utf(b2u_table[trail.u], utf8);
+            for (i = 0; i < n; i++)
+                *d++ = utf8[i];
+            trail.c[1] = 0;
+        } else if (isascii(c)) {
+            *d++ = c;
+        } else {
+            trail.c[1] = c;
+        }
+    }
+    return d - dst;
+}
+
+static size_t
+legacy_utf8_to_big5(const char *src, size_t len, char *dst)
+{
+    static uint8_t trail[6];
+    static int ctrail = 0;
+    uint16_t ucs;
+    uint8_t c;
+    char *d = dst;
+
+    while (len-- > 0) {
+        c = *(uint8_t*)src++;
+        if (ctrail) {
+            trail[ctrail++] = c;
+            if (utf2ucs(trail, &ucs) > ctrail)
+                continue;
+            ucs = u2b_table[ucs];
+            *d++ = ucs >> 8;
+            *d++ = ucs & 0xFF;
+            ctrail = 0;
+            continue;
+        }
+        if (isascii(c)) {
+            *d++ = c;
+        } else {
+            trail[0] = c;
+            ctrail = 1;
+        }
+    }
+    return d - dst;
+}
+
+static size_t
+block_convert(int to_utf8, const char *src, size_t len, char *dst, int split)
+{
+    static ConvState st;
+    size_t n, out = 0;
+
+    while (len > 0) {
+        n = split ? 1 + random() % 4096 : 4096;
+        if (n > len)
+            n = len;
+        out += to_utf8 ? big5_to_utf8_block(&st, src, n, dst + out) :
+                         utf8_to_big5_block(&st, src, n, dst + out);
+        src += n;
+        len -= n;
+    }
+    return out;
+}
+
+static char *
+load(const char *fn, size_t *plen)
+{
+    struct stat st;
+    char *buf;
+    int fd;
+
+    if ((fd = open(fn, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        perror(fn);
+        return NULL;
+    }
+    buf = malloc(st.st_size + 1);
+    *plen = read(fd, buf, st.st_size);
+    close(fd);
+    return buf;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int rounds = 20, c, r, errors = 0;
+    size_t total = 0, len, n1, n2;
+    char *in, *a, *b, *a2, *b2;
+    double t_legacy = 0, t_block = 0, t;
+
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+            case 'n': rounds = atoi(optarg); break;
+            default: optind = argc; break;
+        }
+    }
+    if (optind >= argc || rounds <= 0) {
+        fprintf(stderr, "usage: %s [-n rounds] capture...\n", argv[0]);
+        return 1;
+    }
+
+    srandom(1);
+    printf("string kernel: %s\n", str_kernel_name());
+    for (; optind < argc; optind++) {
+        if ((in = load(argv[optind], &len)) == NULL)
+            continue;
+        a = malloc(BIG5_TO_UTF8_MAXLEN(len));
+        b = malloc(BIG5_TO_UTF8_MAXLEN(len));
+        a2 = malloc(UTF8_TO_BIG5_MAXLEN(BIG5_TO_UTF8_MAXLEN(len)));
+        b2 = malloc(UTF8_TO_BIG5_MAXLEN(BIG5_TO_UTF8_MAXLEN(len)));
+
+        // differential: random block boundaries split characters
+        n1 = legacy_big5_to_utf8(in, len, a);
+        n2 = block_convert(1, in, len, b, 1);
+        if (n1 != n2 || memcmp(a, b, n1) != 0) {
+            fprintf(stderr, "%s: Big5 to UTF-8 differs\n", argv[optind]);
+            errors++;
+        }
+        n1 = legacy_utf8_to_big5(a, n1, a2);
+        n2 = block_convert(0, b, n2, b2, 1);
+        if (n1 != n2 || memcmp(a2, b2, n1) != 0) {
+            fprintf(stderr, "%s: UTF-8 to Big5 differs\n", argv[optind]);
+            errors++;
+        }
+
+        for (r = 0; r < rounds; r++) {
+            t = now_sec();
+            legacy_big5_to_utf8(in, len, a);
+            t_legacy += now_sec() - t;
+            t = now_sec();
+            block_convert(1, in, len, b, 0);
+            t_block += now_sec() - t;
+        }
+        total += len * rounds;
+        free(in); free(a); free(b); free(a2); free(b2);
+    }
+
+    if (total)
+        printf("Big5 to UTF-8: per byte %.1f MB/s, block %.1f MB/s\n",
+               total / t_legacy / 1e6, total / t_block / 1e6);
+    if (errors)
+        printf("%d mismatches\n", errors);
+    return errors ? 1 : 0;
+}
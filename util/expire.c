@@ -1,10 +1,16 @@
 /* ۰ʬHu{ */
 
 #include "bbs.h"
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/time.h>
 
 #define QCAST int (*)(const void *, const void *)
 
 #define	DEF_MAXP        30000
+#define	DEF_WORKERS	4
+#define	EXPIRE_CHUNK	1024	/* records per read(2) */
+#define	UNLINK_COST	4096	/* bytes charged to the I/O budget per unlink */
 
 #define	EXPIRE_CONF	BBSHOME "/etc/expire2.conf"
 #ifdef  SAFE_ARTICLE_DELETE
@@ -12,12 +18,54 @@ char    safe_delete_only = 0;
 #endif
 extern  boardheader_t *bcache;
 int     checkmode = 0;
+long long io_budget = 0;	/* bytes per second for all workers, 0: no limit */
 
 typedef struct {
     char    bname[IDLEN + 1];	/* board ID */
     int     maxp;		/* max post */
 } life_t;
 
+/* per board counters */
+typedef struct {
+    int     nKeep, nDelete, nUnlink;
+    long long rbytes, wbytes;	/* .DIR read / written */
+    long long ubytes;		/* size of the files unlinked (checkmode) */
+} expire_stat_t;
+
+/* shared by the worker processes */
+typedef struct {
+    int     next_job;
+    double  start;
+    long long io_bytes;		/* charged to io_budget so far */
+    int     boards, nKeep, nDelete, nUnlink;
+    long long rbytes, wbytes, ubytes;
+} expire_shared_t;
+
+static expire_shared_t *shared;
+
+static double
+now_sec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* accounts bytes of I/O and sleeps while all workers together are ahead of
+ * io_budget */
+static void
+io_charge(long long bytes)
+{
+    double ahead;
+
+    if (!io_budget)
+	return;
+    ahead = __sync_add_and_fetch(&shared->io_bytes, bytes) / (double)io_budget -
+	(now_sec() - shared->start);
+    if (ahead > 0)
+	usleep(ahead * 1e6);
+}
+
 void callsystem(char *s)
 {
     if( checkmode )
@@ -26,18 +74,30 @@ void callsystem(char *s)
 	system(s);
 }
 
-void callrm(char *s)
+/* removes fn relative to the board directory dfd */
+static void
+callrm(int dfd, const char *brdname, const char *fn, expire_stat_t *st)
 {
-    if( checkmode )
-	printf("\tin checkmode, skip rm %s\n", s);
-    else
-	unlink(s);
+    struct stat sb;
+
+    if( checkmode ){
+	printf("\tin checkmode, skip rm boards/%c/%s/%s\n",
+	       brdname[0], brdname, fn);
+	if (fstatat(dfd, fn, &sb, 0) == 0) {
+	    st->nUnlink++;
+	    st->ubytes += sb.st_size;
+	}
+    }
+    else if (unlinkat(dfd, fn, 0) == 0) {
+	st->nUnlink++;
+	io_charge(UNLINK_COST);
+    }
 }
 
-void cleanSR(char *brdname)
+void cleanSR(int dfd, char *brdname, expire_stat_t *st)
 {
     DIR     *dirp;
-    char    dirf[PATHLEN], fpath[PATHLEN];
+    char    dirf[PATHLEN];
     struct  dirent  *ent;
     int     nDelete = 0;
     setbpath(dirf, brdname);
@@ -46,8 +106,7 @@ void cleanSR(char *brdname)
 
     while( (ent = readdir(dirp)) != NULL )
 	if( strncmp(ent->d_name, "SR.", 3) == 0 ){
-	    setbfile(fpath, brdname, ent->d_name);
-	    callrm(fpath);
+	    callrm(dfd, brdname, ent->d_name, st);
 	    ++nDelete;
 	}
 
@@ -57,15 +116,17 @@ void cleanSR(char *brdname)
 
 void expire(life_t *brd)
 {
-    fileheader_t head;
+    fileheader_t *heads, *head, *kept;
+    expire_stat_t st;
     struct stat state;
     char lockfile[128], tmpfile[128], bakfile[128], cmd[256];
-    char fpath[128], index[128], *fname;
-    int total, bid;
-    int fdlock, fdr, fdw = 0, done, keep;
-    int ftime, nKeep = 0, nDelete = 0;
+    char bpath[128], index[128];
+    char (*rmlist)[FNLEN] = NULL;
+    int total, bid, i, n, nkept, nrm = 0, maxrm = 0;
+    int fdlock, dfd, fdr, fdw = 0, done, keep;
+    double t0 = now_sec();
 
-    printf("%s\n", brd->bname);
+    memset(&st, 0, sizeof(st));
     /* XXX: bid of cache.c's getbnum starts from 1 */
     if( (bid = getbnum(brd->bname)) == 0 ||
 	strcmp(brd->bname, bcache[bid - 1].brdname) ){
@@ -81,77 +142,102 @@ void expire(life_t *brd)
 	return;
     }
 #endif
-    cleanSR(brd->bname);
+    setbpath(bpath, brd->bname);
+    if ((dfd = open(bpath, O_RDONLY | O_DIRECTORY)) < 0) {
+	perror(bpath);
+	return;
+    }
+    cleanSR(dfd, brd->bname, &st);
 
     setbfile(index, brd->bname, ".DIR");
     sprintf(lockfile, "%s.lock", index);
     if ((fdlock = OpenCreate(lockfile, O_RDWR | O_APPEND)) == -1){
 	perror("open lock file error");
+	close(dfd);
 	return;
     }
     flock(fdlock, LOCK_EX);
 
-    strcpy(fpath, index);
-    fname = (char *) strrchr(fpath, '.');
+    heads = (fileheader_t *)malloc(sizeof(fileheader_t) * EXPIRE_CHUNK * 2);
+    kept = heads + EXPIRE_CHUNK;
 
     done = 0;
-    if( (fdr = open(index, O_RDONLY, 0)) >= 0 ){
+    if( heads && (fdr = open(index, O_RDONLY, 0)) >= 0 ){
 	fstat(fdr, &state);
-	total = state.st_size / sizeof(head);
+	total = state.st_size / sizeof(fileheader_t);
 	if( !checkmode ){
 	    sprintf(tmpfile, "%s.new", index);
 	    unlink(tmpfile);
 	}
-	// TODO use fread/fwrite to reduce system calls
 	if( checkmode ||
 	    (fdw = OpenCreate(tmpfile, O_WRONLY | O_EXCL)) >= 0 ){
 	    done = 1;
-	    while (1) {
-		int ret = read(fdr, &head, sizeof(head));
-		if (ret != sizeof(head)) {
-		    if (ret != 0)
-			done = 0;
+	    while ((n = read(fdr, heads, sizeof(fileheader_t) * EXPIRE_CHUNK)) > 0) {
+		if (n % sizeof(fileheader_t)) {
+		    done = 0;
 		    break;
 		}
-		ftime = atoi(head.filename + 2);
-                if (head.owner[0] == '-' ||
-                    (!*head.filename) ||
+		st.rbytes += n;
+		io_charge(n);
+		n /= sizeof(fileheader_t);
+
+		for (i = nkept = 0; i < n; i++) {
+		    head = &heads[i];
+		    if (head->owner[0] == '-' ||
+			(!*head->filename) ||
 #ifdef SAFE_ARTICLE_DELETE
-		    strcmp(head.filename, FN_SAFEDEL) == 0 ||
+			strcmp(head->filename, FN_SAFEDEL) == 0 ||
 #ifdef FN_SAFEDEL_PREFIX_LEN
-		    strncmp(head.filename, FN_SAFEDEL, FN_SAFEDEL_PREFIX_LEN) == 0 ||
+			strncmp(head->filename, FN_SAFEDEL, FN_SAFEDEL_PREFIX_LEN) == 0 ||
 #endif
 #endif
-                    0)
-		    keep = 0;
+			0)
+			keep = 0;
 #ifdef SAFE_ARTICLE_DELETE
-		else if (safe_delete_only)
-		    keep = 1;
+		    else if (safe_delete_only)
+			keep = 1;
 #endif
-		else if (head.filemode & FILE_MARKED)
-		    keep = 1;
-		else if (total > brd->maxp)
-		    keep = 0;
-		else
-		    keep = 1;
-
-		if( keep ){
-		    ++nKeep;
-		    if( !checkmode &&
-			write(fdw, (char *)&head, sizeof(head)) != sizeof(head) ){
-			done = 0;
-			break;
+		    else if (head->filemode & FILE_MARKED)
+			keep = 1;
+		    else if (total > brd->maxp)
+			keep = 0;
+		    else
+			keep = 1;
+
+		    if( keep ){
+			++st.nKeep;
+			kept[nkept++] = *head;
 		    }
-		}
-		else {
-		    ++nDelete;
-		    if (head.filename[0] != '\0') {
-			setbfile(fname, brd->bname, head.filename);
-			callrm(fname);
+		    else {
+			++st.nDelete;
+			if (head->filename[0] != '\0') {
+			    if (nrm == maxrm) {
+				maxrm = maxrm ? maxrm * 2 : EXPIRE_CHUNK;
+				if ((rmlist = realloc(rmlist,
+					sizeof(*rmlist) * maxrm)) == NULL) {
+				    perror("realloc");
+				    exit(1);
+				}
+			    }
+			    strlcpy(rmlist[nrm++], head->filename, FNLEN);
+			}
+			total--;
 		    }
-		    total--;
+		}
+		if (nkept == 0)
+		    continue;
+		st.wbytes += sizeof(fileheader_t) * nkept;
+		if (checkmode)
+		    continue;
+		io_charge(sizeof(fileheader_t) * nkept);
+		if (write(fdw, kept, sizeof(fileheader_t) * nkept) !=
+		    (ssize_t)(sizeof(fileheader_t) * nkept)) {
+		    done = 0;
+		    break;
 		}
 	    }
+	    if (n < 0)
+		done = 0;
 	    if (!checkmode) {
 		if (fsync(fdw) != 0) {
 		    perror("fsync");
@@ -162,24 +248,54 @@ void expire(life_t *brd)
 	}
 	close(fdr);
     }
+    free(heads);
 
     if( !checkmode && done ){
 	sprintf(bakfile, "%s.old", index);
 	if( rename(index, bakfile) == 0 ){
 	    rename(tmpfile, index);
 	    touchbtotal(bid);
-	}
+	} else
+	    done = 0;
     }
 
+    /* the files are only removed once the new index no longer has them */
+    if (checkmode || done)
+	for (i = 0; i < nrm; i++)
+	    callrm(dfd, brd->bname, rmlist[i], &st);
+    free(rmlist);
+
     printf("board %s: %d articles are kept, %d articles are deleted.\n",
-	   brd->bname, nKeep, nDelete);
+	   brd->bname, st.nKeep, st.nDelete);
+    if (checkmode)
+	printf("board %s: projected I/O: read %lld KB, write %lld KB, "
+	       "unlink %d files (%lld KB)\n", brd->bname,
+	       st.rbytes / 1024, st.wbytes / 1024, st.nUnlink, st.ubytes / 1024);
+    else
+	printf("board %s: %.3fs, read %lld KB, written %lld KB, "
+	       "%d files unlinked%s\n", brd->bname, now_sec() - t0,
+	       st.rbytes / 1024, st.wbytes / 1024, st.nUnlink,
+	       done ? "" : ", FAILED");
     flock(fdlock, LOCK_UN);
     close(fdlock);
+    close(dfd);
+
+    __sync_add_and_fetch(&shared->boards, 1);
+    __sync_add_and_fetch(&shared->nKeep, st.nKeep);
+    __sync_add_and_fetch(&shared->nDelete, st.nDelete);
+    __sync_add_and_fetch(&shared->nUnlink, st.nUnlink);
+    __sync_add_and_fetch(&shared->rbytes, st.rbytes);
+    __sync_add_and_fetch(&shared->wbytes, st.wbytes);
+    __sync_add_and_fetch(&shared->ubytes, st.ubytes);
 }
 
 int     count;
 life_t  db, table[MAX_BOARD], *key;
 
+/* boards to expire, run by the workers */
+life_t  *jobs;
+int     njobs, maxjobs;
+
 void toexpire(char *brdname)
 {
     if( brdname[0] > ' ' && brdname[0] != '.' ){
@@ -191,8 +307,16 @@ void toexpire(char *brdname)
 	if( key == NULL )
 	    key = &db;
 
-	strcpy(key->bname, brdname);
-	expire(key);
+	if (njobs == maxjobs) {
+	    maxjobs = maxjobs ? maxjobs * 2 : 1024;
+	    if ((jobs = realloc(jobs, sizeof(life_t) * maxjobs)) == NULL) {
+		perror("realloc");
+		exit(1);
+	    }
+	}
+	jobs[njobs] = *key;
+	strlcpy(jobs[njobs].bname, brdname, sizeof(jobs[njobs].bname));
+	njobs++;
     }
 }
 
@@ -215,10 +339,56 @@ void visitdir(char c)
     closedir(dirp);
 }
 
+static void
+worker(void)
+{
+    int i;
+    while ((i = __sync_fetch_and_add(&shared->next_job, 1)) < njobs)
+	expire(&jobs[i]);
+}
+
+/* expires all jobs with nworkers processes (including this one) */
+static void
+run_jobs(int nworkers)
+{
+    int i;
+
+    shared->start = now_sec();
+    fflush(stdout);
+    for (i = 1; i < nworkers && i < njobs; i++) {
+	pid_t pid = fork();
+	if (pid < 0) {
+	    perror("fork");
+	    break;
+	}
+	if (pid == 0) {
+	    worker();
+	    fflush(stdout);
+	    _exit(0);
+	}
+    }
+    worker();
+    while (wait(NULL) > 0)
+	;
+
+    if (checkmode)
+	printf("total %d boards: %d kept, %d deleted; projected I/O: "
+	       "read %lld KB, write %lld KB, unlink %d files (%lld KB)\n",
+	       shared->boards, shared->nKeep, shared->nDelete,
+	       shared->rbytes / 1024, shared->wbytes / 1024,
+	       shared->nUnlink, shared->ubytes / 1024);
+    else
+	printf("total %d boards: %d kept, %d deleted, read %lld KB, "
+	       "written %lld KB, %d files unlinked, %.1fs with %d workers\n",
+	       shared->boards, shared->nKeep, shared->nDelete,
+	       shared->rbytes / 1024, shared->wbytes / 1024,
+	       shared->nUnlink, now_sec() - shared->start, nworkers);
+}
+
 int main(int argc, char **argv)
 {
     FILE    *fin;
-    int     number, i, ch;
+    int     number, i, ch, nworkers = DEF_WORKERS;
     char    *ptr, *bname, buf[256];
     char    dirs[] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
 		      'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p',
@@ -232,7 +402,7 @@ int main(int argc, char **argv)
     /* default value */
     db.maxp = DEF_MAXP;
 
-    while( (ch = getopt(argc, argv, "M:hn"
+    while( (ch = getopt(argc, argv, "B:M:hj:n"
 #ifdef SAFE_ARTICLE_DELETE
 "D"
 #endif
@@ -243,19 +413,29 @@ int main(int argc, char **argv)
 	    safe_delete_only = 1;
 	    break;
 #endif
+	case 'B':
+	    io_budget = atoll(optarg) * 1024 * 1024;
+	    break;
 	case 'M':
 	    db.maxp = atoi(optarg);
 	    break;
+	case 'j':
+	    if ((nworkers = atoi(optarg)) < 1)
+		nworkers = 1;
+	    break;
 	case 'n':
 	    checkmode = 1;
 	    break;
 	case 'h':
 	default:
 	    fprintf(stderr,
-		    "usage: expire [-M MAXP] [board name...] [-n]\n"
+		    "usage: expire [-M MAXP] [-j workers] [-B MB/s] [board name...] [-n]\n"
 		    "deletion policy:\n"
-		    "       delete NOT MARKED articles if #articles > MAXP (default:%d)\n",
-		    DEF_MAXP);
+		    "       delete NOT MARKED articles if #articles > MAXP (default:%d)\n"
+		    "  -j   boards expired concurrently (default:%d)\n"
+		    "  -B   I/O budget of all workers in MB/s (default: no limit)\n"
+		    "  -n   check only, print the projected I/O\n",
+		    DEF_MAXP, DEF_WORKERS);
 	    return 0;
 	}
     argc -= optind;
@@ -292,6 +472,16 @@ int main(int argc, char **argv)
     if( count > 1)
 	qsort(table, count, sizeof(life_t), (QCAST)strcasecmp);
 
+    shared = (expire_shared_t *)mmap(NULL, sizeof(expire_shared_t),
+				     PROT_READ | PROT_WRITE,
+				     MAP_ANON | MAP_SHARED, -1, 0);
+    if (shared == MAP_FAILED) {
+	perror("mmap");
+	exit(1);
+    }
+    /* keep the report lines of concurrent workers whole */
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
     attach_SHM();
     if( argc > 0 ){
 	for( i = 0 ; i < argc ; ++i )
@@ -305,6 +495,7 @@ int main(int argc, char **argv)
 	for( i = 0 ; dirs[i] != 0 ; ++i )
 	    visitdir(dirs[i]);
     }
+    run_jobs(nworkers);
 
     return 0;
 }
@@ -0,0 +1,132 @@
+/* Buffered log writer benchmark and differential test
+ *
+ * usage: logbuf_bench [-n lines] [-u users] [-d delay_ms]
+ *
+ * Writes n failed login lines the way logattempt() does, a line to a public
+ * file and one to the file of one of u users, into two scratch directories
+ * under /tmp: first by log_file() which opens the file for every line, then
+ * by a LOGBUF as the logattempt daemon of logind does. The resulting files
+ * must be identical. Reports lines/s, write()s per line and how long a line
+ * waited in the buffer at most. Exits non-zero on mismatch.
+ */
+#include "bbs.h"
+#include <sys/time.h>
+
+static double
+now_sec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+make_line(int i, int nusers, char *fn, size_t szfn, char *line, size_t szline)
+{
+    snprintf(fn, szfn, "user%d", i % nusers);
+    snprintf(line, szline, "-user%-8d[%d] ?@10.0.%d.%d\n", i % nusers, i,
+	     (i >> 8) & 0xff, i & 0xff);
+}
+
+static double
+run(const char *dir, int nlines, int nusers, LOGBUF *lb)
+{
+    char path[PATHLEN], pub[PATHLEN], fn[32], line[128];
+    double t = now_sec();
+    int i;
+
+    snprintf(pub, sizeof(pub), "%s/logins.bad", dir);
+    for (i = 0; i < nlines; i++) {
+	make_line(i, nusers, fn, sizeof(fn), line, sizeof(line));
+	snprintf(path, sizeof(path), "%s/%s", dir, fn);
+	if (lb) {
+	    logbuf_add(lb, pub, line, strlen(line));
+	    logbuf_add(lb, path, line, strlen(line));
+	    logbuf_flush(lb, 0);
+	} else {
+	    log_file(pub, LOG_CREAT, line);
+	    log_file(path, LOG_CREAT, line);
+	}
+    }
+    if (lb)
+	logbuf_delete(lb);
+    return now_sec() - t;
+}
+
+static int
+compare(const char *a, const char *b, const char *fn)
+{
+    char pa[PATHLEN], pb[PATHLEN], ba[4096], bb[4096];
+    int fa, fb, errors = 0;
+    ssize_t na, nb;
+
+    snprintf(pa, sizeof(pa), "%s/%s", a, fn);
+    snprintf(pb, sizeof(pb), "%s/%s", b, fn);
+    if ((fa = open(pa, O_RDONLY)) < 0 || (fb = open(pb, O_RDONLY)) < 0) {
+	perror(fn);
+	return 1;
+    }
+    do {
+	na = read(fa, ba, sizeof(ba));
+	nb = read(fb, bb, sizeof(bb));
+	if (na != nb || (na > 0 && memcmp(ba, bb, na) != 0))
+	    errors = 1;
+    } while (na > 0 && !errors);
+    close(fa);
+    close(fb);
+    unlink(pa);
+    unlink(pb);
+    if (errors)
+	fprintf(stderr, "%s differs\n", fn);
+    return errors;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int nlines = 200000, nusers = 1000, delay = 1000, c, i, errors = 0;
+    char legacy[] = "/tmp/logbuf_bench.XXXXXX",
+	 buffered[] = "/tmp/logbuf_bench.XXXXXX", fn[32];
+    double t_legacy, t_buffered;
+    LOGBUF lb;
+
+    while ((c = getopt(argc, argv, "n:u:d:")) != -1) {
+	switch (c) {
+	    case 'n': nlines = atoi(optarg); break;
+	    case 'u': nusers = atoi(optarg); break;
+	    case 'd': delay = atoi(optarg); break;
+	    default: nlines = 0; break;
+	}
+    }
+    if (nlines <= 0 || nusers <= 0 || delay < 0) {
+	fprintf(stderr, "usage: %s [-n lines] [-u users] [-d delay_ms]\n",
+		argv[0]);
+	return 1;
+    }
+    if (!mkdtemp(legacy) || !mkdtemp(buffered)) {
+	perror("mkdtemp");
+	return 1;
+    }
+
+    t_legacy = run(legacy, nlines, nusers, NULL);
+    logbuf_init(&lb, 8192, delay);
+    t_buffered = run(buffered, nlines, nusers, &lb);
+
+    errors += compare(legacy, buffered, "logins.bad");
+    for (i = 0; i < nusers && i < nlines; i++) {
+	snprintf(fn, sizeof(fn), "user%d", i);
+	errors += compare(legacy, buffered, fn);
+    }
+    rmdir(legacy);
+    rmdir(buffered);
+
+    printf("%d lines to %d files\n", nlines * 2, nusers + 1);
+    printf("per line: %.0f lines/s, %d writes\n",
+	   nlines * 2 / t_legacy, nlines * 2);
+    printf("buffered: %.0f lines/s, %u writes (%.1f lines per write), "
+	   "waited at most %dms\n", nlines * 2 / t_buffered, lb.writes,
+	   (double)lb.lines / lb.writes, lb.max_delay_ms);
+    if (errors)
+	printf("%d files differ\n", errors);
+    return errors ? 1 : 0;
+}
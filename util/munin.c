@@ -93,6 +93,12 @@ static var_t misc_vars[] = {
     DEFINE_VAR_END,
 };
 
+static var_t bbslua_vars[] = {
+    DEFINE_VAR(COUNTER, BBSLUA),
+    DEFINE_VAR(COUNTER, BBSLUA_CACHEHIT),
+    DEFINE_VAR_END,
+};
+
 static var_t cpu_vars[] = {
     DEFINE_VAR(COUNTER, BOARDREC_SCPU),
     DEFINE_VAR(COUNTER, BOARDREC_UCPU),
@@ -113,10 +119,72 @@ static module_t modules[] = {
     {"thread",  thread_vars,  "bbs thread"},
     {"record",  record_vars,  "bbs record"},
     {"misc",    misc_vars,    "bbs misc"},
+    {"bbslua",  bbslua_vars,  "bbs bbslua"},
     {"cpu",     cpu_vars,     "bbs cpu"},
+    // no vars: p50/p99 of the latency histograms, see latency_run()
+    {"latency", NULL,         "bbs latency (ms)"},
     {NULL, NULL, NULL},
 };
 
+// latency keeps the histograms of the previous run here, so each run
+// reports the percentiles of the calls made since then.
+#define LATENCY_STATE "bbs_latency.state"
+
+static void latency_config(const module_t *m) {
+    printf("graph_title %s\n", m->title);
+    printf("graph_category bbs\n");
+    printf("graph_args --logarithmic\n");
+    for (int op = 0; op < LAT_NUM; op++) {
+	printf("%s_p50.label %s p50\n", latency_name[op], latency_name[op]);
+	printf("%s_p50.type GAUGE\n", latency_name[op]);
+	printf("%s_p99.label %s p99\n", latency_name[op], latency_name[op]);
+	printf("%s_p99.type GAUGE\n", latency_name[op]);
+    }
+}
+
+static int latency_run(void) {
+    unsigned int hist[LAT_MAX][LAT_BUCKETS], last[LAT_MAX][LAT_BUCKETS];
+    char path[PATHLEN];
+    const char *dir = getenv("MUNIN_PLUGSTATE");
+    FILE *fp;
+
+    attach_SHM();
+    latency_merge(hist);
+
+    snprintf(path, sizeof(path), "%s/" LATENCY_STATE, dir ? dir : "/tmp");
+    memset(last, 0, sizeof(last));
+    if ((fp = fopen(path, "rb")) != NULL) {
+	if (fread(last, sizeof(last), 1, fp) != 1)
+	    memset(last, 0, sizeof(last));
+	fclose(fp);
+    }
+    if ((fp = fopen(path, "wb")) != NULL) {
+	fwrite(hist, sizeof(hist), 1, fp);
+	fclose(fp);
+    }
+
+    for (int op = 0; op < LAT_NUM; op++) {
+	// the histograms were cleared (shmctl latency -c) if any went down
+	for (int b = 0; b < LAT_BUCKETS; b++)
+	    if (hist[op][b] < last[op][b]) {
+		memset(last[op], 0, sizeof(last[op]));
+		break;
+	    }
+	for (int b = 0; b < LAT_BUCKETS; b++)
+	    hist[op][b] -= last[op][b];
+	if (!latency_count(hist[op])) {
+	    printf("%s_p50.value U\n", latency_name[op]);
+	    printf("%s_p99.value U\n", latency_name[op]);
+	    continue;
+	}
+	printf("%s_p50.value %.3f\n", latency_name[op],
+	       latency_percentile(hist[op], 0.5) / 1000);
+	printf("%s_p99.value %.3f\n", latency_name[op],
+	       latency_percentile(hist[op], 0.99) / 1000);
+    }
+    return 0;
+}
+
 // find_module returns the pointer to module of the specified name.
 static const module_t *find_module(const char *name) {
     for (int i = 0; modules[i].name; i++) {
@@ -131,6 +199,10 @@ static int config(const char *mname) {
     const module_t *m = find_module(mname);
     if (!m)
 	return -1;
+    if (!m->vars) {
+	latency_config(m);
+	return 0;
+    }
     printf("graph_title %s\n", m->title);
     printf("graph_category bbs\n");
     printf("graph_order");
@@ -152,6 +224,8 @@ static int run(const char *mname) {
     const module_t *m = find_module(mname);
     if (!m)
 	return -1;
+    if (!m->vars)
+	return latency_run();
     attach_SHM();
     for (int i = 0; m->vars[i].name; i++) {
 	const var_t *v = &m->vars[i];
@@ -0,0 +1,141 @@
+/* Recommend stress test: concurrent pushes on the same .DIR records
+ *
+ * usage: recommend_bench [-p procs] [-n pushes] [-r records]
+ *
+ * Forks procs writers that all push every record of a scratch .DIR
+ * (under /tmp) n times, walking the records in the same order so they
+ * keep colliding. Runs once with the old unlocked lseek/read/lseek/write
+ * update and once with fileheader_add_recommend(), then checks that
+ * every record got exactly procs * n pushes. procs * n must not exceed
+ * MAX_RECOMMENDS, or the count saturates.
+ */
+#include "bbs.h"
+#include <sys/time.h>
+#include <sys/wait.h>
+
+static double
+now_sec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// the update do_add_recommend() did through modify_dir_lite()
+static int
+legacy_add_recommend(const char *direct, int ent, const char *fn, int delta)
+{
+    int fd;
+    off_t sz = dashs(direct);
+    fileheader_t fhdr;
+
+    if (sz < (int)sizeof(fileheader_t) * (ent) ||
+	    (fd = open(direct, O_RDWR)) < 0 )
+	return -1;
+
+    sz = (sizeof(fileheader_t) * (ent-1));
+    if (lseek(fd, sz, SEEK_SET) < 0 ||
+	read(fd, &fhdr, sizeof(fhdr)) != sizeof(fhdr) ||
+	strcmp(fhdr.filename, fn) != 0)
+    {
+	close(fd);
+	return -1;
+    }
+    fhdr.recommend += delta;
+    if (lseek(fd, sz, SEEK_SET) >= 0)
+	write(fd, &fhdr, sizeof(fhdr));
+    close(fd);
+    return 0;
+}
+
+static void
+make_dir(const char *path, int records)
+{
+    fileheader_t fh;
+    int fd, i;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+	perror(path);
+	exit(1);
+    }
+    for (i = 0; i < records; i++) {
+	memset(&fh, 0, sizeof(fh));
+	snprintf(fh.filename, sizeof(fh.filename), "M.%d.A.%03X",
+		 1300000000 + i, i & 0xfff);
+	write(fd, &fh, sizeof(fh));
+    }
+    close(fd);
+}
+
+static void
+run(const char *name, int locked, const char *path,
+    int procs, int pushes, int records)
+{
+    fileheader_t fh;
+    double t;
+    int i, j, k, fd, exact = 0, lost = 0;
+
+    make_dir(path, records);
+    t = now_sec();
+    for (i = 0; i < procs; i++) {
+	if (fork() != 0)
+	    continue;
+	for (j = 0; j < pushes; j++)
+	    for (k = 1; k <= records; k++) {
+		char fn[FNLEN];
+		snprintf(fn, sizeof(fn), "M.%d.A.%03X",
+			 1300000000 + k - 1, (k - 1) & 0xfff);
+		if (locked)
+		    fileheader_add_recommend(path, k, fn, 1, 0, NULL);
+		else
+		    legacy_add_recommend(path, k, fn, 1);
+	    }
+	_exit(0);
+    }
+    while (wait(NULL) > 0)
+	;
+    t = now_sec() - t;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+	return;
+    while (read(fd, &fh, sizeof(fh)) == sizeof(fh)) {
+	if (fh.recommend == procs * pushes)
+	    exact++;
+	lost += procs * pushes - fh.recommend;
+    }
+    close(fd);
+
+    printf("%-8s %8.0f pushes/s, %d/%d records exact, %d pushes lost\n",
+	   name, procs * pushes * records / t, exact, records, lost);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int procs = 8, pushes = 12, records = 1000, c;
+    char path[PATHLEN];
+
+    while ((c = getopt(argc, argv, "p:n:r:")) != -1) {
+	switch (c) {
+	    case 'p': procs = atoi(optarg); break;
+	    case 'n': pushes = atoi(optarg); break;
+	    case 'r': records = atoi(optarg); break;
+	    default:
+		fprintf(stderr, "usage: %s [-p procs] [-n pushes] [-r records]\n",
+			argv[0]);
+		return 1;
+	}
+    }
+    if (procs <= 0 || pushes <= 0 || records <= 0 ||
+	procs * pushes > MAX_RECOMMENDS) {
+	fprintf(stderr, "need 0 < procs * pushes <= %d\n", MAX_RECOMMENDS);
+	return 1;
+    }
+
+    snprintf(path, sizeof(path), "/tmp/recommend_bench.%d", (int)getpid());
+    printf("%d procs x %d pushes on %d records\n", procs, pushes, records);
+    run("legacy", 0, path, procs, pushes, records);
+    run("locked", 1, path, procs, pushes, records);
+    unlink(path);
+    return 0;
+}
@@ -225,6 +225,8 @@ int utmpfix(int argc, char **argv)
 	if( clean ){
 	    printf("clean %06d(%s), userid: %s\n",
 		   i, clean, SHM->uinfo[which].userid);
+	    friendref_unlink(which);
+	    utmpindex_remove(which);
 	    memset(&SHM->uinfo[which], 0, sizeof(userinfo_t));
 	    --nownum;
 	    changeflag = 1;
@@ -244,8 +246,10 @@ int utmpfix(int argc, char **argv)
 	    purge_utmp(&SHM->uinfo[killlist[i].where]);
 	}
     SHM->UTMPbusystate = 0;
-    if( changeflag )
+    if( changeflag ){
+	utmpindex_rebuild();
 	SHM->UTMPneedsort = 1;
+    }
 
     if( daemonsleep ){
 	do{
@@ -258,12 +262,6 @@ int utmpfix(int argc, char **argv)
 /* end of utmpfix ---------------------------------------------------------- */
 
 /* utmpsortd --------------------------------------------------------------- */
-static int
-cmputmpuserid(const void * i, const void * j)
-{
-    return strncasecmp(SHM->uinfo[*(int*)i].userid, SHM->uinfo[*(int*)j].userid, IDLEN);
-}
-
 static int
 cmputmpmode(const void * i, const void * j)
 {
@@ -390,20 +388,20 @@ void utmpsort(int sortall)
 #endif
     ns = (SHM->currsorted ? 0 : 1);
 
-    for (uentp = &SHM->uinfo[0], count = i = 0;
-	 i < USHM_SIZE;
-	 ++i, uentp = &SHM->uinfo[i]) {
-	if (uentp->pid)
-            SHM->sorted[ns][0][count++] = i;
+    // userid/uid/pid orders are kept live by getnewutmpent()/purge_utmp(),
+    // here we only take a snapshot for the display lists.
+    count = utmpindex_snapshot(UTMPIDX_USERID, SHM->sorted[ns][0]);
+    if (utmpindex_snapshot(UTMPIDX_UID, SHM->sorted[ns][7]) != count ||
+	utmpindex_snapshot(UTMPIDX_PID, SHM->sorted[ns][8]) != count) {
+	// index changed between snapshots; keep the lists of same length.
+	memcpy(SHM->sorted[ns][7],
+	       SHM->sorted[ns][0], sizeof(int) * count);
+	memcpy(SHM->sorted[ns][8],
+	       SHM->sorted[ns][0], sizeof(int) * count);
+	qsort(SHM->sorted[ns][7], count, sizeof(int), cmputmpuid);
+	qsort(SHM->sorted[ns][8], count, sizeof(int), cmputmppid);
     }
     SHM->UTMPnumber = count;
-    qsort(SHM->sorted[ns][0], count, sizeof(int), cmputmpuserid);
-    memcpy(SHM->sorted[ns][7],
-	   SHM->sorted[ns][0], sizeof(int) * count);
-    memcpy(SHM->sorted[ns][8],
-	   SHM->sorted[ns][0], sizeof(int) * count);
-    qsort(SHM->sorted[ns][7], count, sizeof(int), cmputmpuid);
-    qsort(SHM->sorted[ns][8], count, sizeof(int), cmputmppid);
     if( sortall ){
 	memcpy(SHM->sorted[ns][1],
 	       SHM->sorted[ns][0], sizeof(int) * count);
@@ -490,6 +488,9 @@ int utmpsortd(int argc, char **argv)
     setproctitle("shmctl utmpsortd");
 #endif
 
+    // resync live indexes in case of entries left by older binaries
+    utmpindex_rebuild();
+
     while( 1 ){
 	if( (pid = fork()) != 0 ){
 	    int     s;
@@ -1090,7 +1091,6 @@ int testgap(int argc, char *argv[])
     (void)argv;
     int i;
     TESTZERO(SHM->gap_1,0);
-    TESTZERO(SHM->gap_2,0);
     TESTZERO(SHM->gap_3,0);
     TESTZERO(SHM->gap_4,0);
     TESTZERO(SHM->gap_5,0);
@@ -1175,6 +1175,8 @@ int showstat(int argc, char *argv[])
 	"STAT_LOGIND_SERVSTART",
 	"STAT_LOGIND_SERVFAIL",
 	"STAT_LOGIND_PASSWDPROMPT",
+	"STAT_BBSLUA",
+	"STAT_BBSLUA_CACHEHIT",
     };
     (void)argc;
 
@@ -1189,6 +1191,48 @@ int showstat(int argc, char *argv[])
     return 0;
 }
 
+/* latency [-c] [-m]: percentiles of the latency histograms, in ms.
+ * -m: machine readable, one line per operation:
+ *     name count p50 p90 p99 p999 (in us) and the buckets, comma separated
+ * -c: clear them afterwards */
+int showlatency(int argc, char *argv[])
+{
+    static const double q[] = {0.5, 0.9, 0.99, 0.999};
+    unsigned int hist[LAT_MAX][LAT_BUCKETS];
+    int flag_clear = 0, flag_machine = 0;
+    int i, j, op;
+
+    for (i = 1; i < argc; i++) {
+	if (strcmp(argv[i], "-c") == 0)
+	    flag_clear = 1;
+	else if (strcmp(argv[i], "-m") == 0)
+	    flag_machine = 1;
+    }
+
+    latency_merge(hist);
+    if (!flag_machine)
+	printf("%-12s %10s %9s %9s %9s %9s\n",
+	       "(ms)", "count", "p50", "p90", "p99", "p99.9");
+    for (op = 0; op < LAT_NUM; op++) {
+	if (flag_machine) {
+	    printf("%s %u", latency_name[op], latency_count(hist[op]));
+	    for (j = 0; j < (int)(sizeof(q) / sizeof(q[0])); j++)
+		printf(" %.0f", latency_percentile(hist[op], q[j]));
+	    for (j = 0; j < LAT_BUCKETS; j++)
+		printf("%c%u", j ? ',' : ' ', hist[op][j]);
+	    printf("\n");
+	    continue;
+	}
+	printf("%-12s %10u", latency_name[op], latency_count(hist[op]));
+	for (j = 0; j < (int)(sizeof(q) / sizeof(q[0])); j++)
+	    printf(" %9.3f", latency_percentile(hist[op], q[j]) / 1000);
+	printf("\n");
+    }
+    if (flag_clear)
+	memset(SHM->latency, 0, sizeof(SHM->latency));
+    return 0;
+}
+
 int dummy(int argc, char *argv[])
 {
     (void)argc;
@@ -1227,6 +1271,7 @@ struct Cmd {
     {hotboard,   "hotboard",   "list boards of most bfriends"},
     {usermode,   "usermode",   "list #users in the same mode"},
     {showstat,   "showstat",   "show statistics"},
+    {showlatency, "latency",   "show latency percentiles [-c] [-m]"},
     {testgap,    "testgap",    "test SHM->gap zeroness"},
 
     {dummy,      "\b\b\b\bMisc:", ""},
@@ -0,0 +1,324 @@
+/* String kernel benchmark and differential test
+ *
+ * usage: string_bench [-n rounds] file...
+ *
+ * Loads the lines of the given files (real articles, e.g.
+ * boards/T/Test/M.*), checks strip_ansi(), strlen_noansi(), DBCS_Status()
+ * and DBCS_strcasestr() under every string kernel the CPU supports
+ * against copies of the original byte-at-a-time versions, then times
+ * each kernel. Exits non-zero on any mismatch.
+ */
+#include "bbs.h"
+#include <sys/time.h>
+
+#define MAX_LINES   (200000)
+#define MAX_KEYS    (256)
+
+static char *lines[MAX_LINES];
+static int nlines;
+static char *keys[MAX_KEYS];
+static int nkeys;
+
+static double
+now_sec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* ----------------------------------------------------- */
+/* the original implementations                          */
+/* ----------------------------------------------------- */
+
+static const char EscapeFlag[] = {
+    /*  0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 10 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 ,0, 0, 0, 0, 0,
+    /* 20 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 30 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0, 0, /* 0~9 ;= */
+    /* 40 */ 0, 2, 2, 2, 2, 0, 0, 0, 2, 2, 2, 2, 0, 0, 0, 0, /* ABCDHIJK */
+    /* 50 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 60 */ 0, 0, 0, 0, 0, 0, 2, 0, 2, 0, 0, 0, 2, 2, 0, 0, /* fhlm */
+    /* 70 */ 0, 0, 0, 2, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* su */
+    /* 80 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 90 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* A0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* B0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* C0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* D0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* E0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* F0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+#define isEscapeParam(X) (EscapeFlag[(unsigned char)(X)] & 1)
+#define isEscapeCommand(X) (EscapeFlag[(unsigned char)(X)] & 2)
+
+static int
+legacy_strip_ansi(char *dst, const char *src, enum STRIP_FLAG mode)
+{
+    register int    count = 0;
+
+    for(; *src; ++src)
+	if( *src != ESC_CHR ){
+	    if( dst )
+		*dst++ = *src;
+	    ++count;
+	}else{
+	    const char* p = src + 1;
+	    if( *p != '[' ){
+		++src;
+		if(*src=='\0') break;
+		continue;
+	    }
+	    while(isEscapeParam(*++p));
+	    if( (mode == NO_RELOAD && isEscapeCommand(*p)) ||
+		(mode == ONLY_COLOR && *p == 'm' )){
+		register int len = p - src + 1;
+		if( dst ){
+		    memmove(dst, src, len);
+		    dst += len;
+		}
+		count += len;
+	    }
+	    src = p;
+	    if(*src=='\0') break;
+	}
+    if( dst )
+	*dst = 0;
+    return count;
+}
+
+static int
+legacy_strlen_noansi(const char *s)
+{
+    register int count = 0, mode = 0;
+
+    if (!s || !*s)
+	return 0;
+
+    for (; *s; ++s)
+    {
+	switch (mode)
+	{
+	    case 0:
+		if (*s == ESC_CHR)
+		    mode = 1;
+		else
+		    count ++;
+		break;
+
+	    case 1:
+		if (*s == '[')
+		    mode = 2;
+		else
+		    mode = 0;
+		break;
+
+	    case 2:
+		if (isEscapeParam(*s))
+		    continue;
+		mode = 0;
+		break;
+	}
+    }
+    return count;
+}
+
+static int
+legacy_DBCS_Status(const char *dbcstr, int pos)
+{
+    int sts = DBCS_ASCII;
+    char c;
+
+    while (pos-- >= 0) {
+        c = *dbcstr++;
+        sts = DBCS_NextStatus(c, sts);
+        if (c == 0)
+            break;
+    }
+    return sts;
+}
+
+static char *
+legacy_DBCS_strcasestr(const char* pool, const char *ptr)
+{
+    int i = 0, i2 = 0, found = 0,
+        szpool = strlen(pool),
+        szptr  = strlen(ptr);
+
+    for (i = 0; i <= szpool-szptr; i++)
+    {
+        found = 1;
+        for (i2 = 0; i2 < szptr; i2++)
+        {
+            if (IS_DBCSLEAD(pool[i + i2]))
+            {
+                if (ptr[i2]   != pool[i+i2] ||
+                    ptr[i2+1] != pool[i+i2+1])
+                {
+                    found = 0;
+                    break;
+                }
+		i2 ++;
+            } else {
+                if (IS_DBCSLEAD(ptr[i2]) ||
+		    tolower(ptr[i2]) != tolower(pool[i+i2]))
+                {
+                    found = 0;
+                    break;
+                }
+            }
+        }
+        if (found)
+	    return (char *)pool+i;
+        if (IS_DBCSLEAD(pool[i]))
+            i++;
+    }
+    return NULL;
+}
+
+/* ----------------------------------------------------- */
+
+static void
+load(const char *fn)
+{
+    char buf[4096];
+    FILE *fp;
+    size_t len;
+
+    if ((fp = fopen(fn, "r")) == NULL) {
+	perror(fn);
+	return;
+    }
+    while (nlines < MAX_LINES && fgets(buf, sizeof(buf), fp)) {
+	len = strlen(buf);
+	if (len && buf[len - 1] == '\n')
+	    buf[--len] = 0;
+	lines[nlines++] = strdup(buf);
+
+	// search keys: pieces of the text, two to six bytes long
+	if (nkeys < MAX_KEYS && len > 8 && random() % 16 == 0) {
+	    size_t off = random() % (len - 6);
+	    char key[8];
+	    strlcpy(key, buf + off, 2 + random() % 5);
+	    if (random() % 2)
+		str_lower(key, key);
+	    keys[nkeys++] = strdup(key);
+	}
+    }
+    fclose(fp);
+}
+
+static int
+check(void)
+{
+    static char a[4096], b[4096];
+    int i, k, pos, len, errors = 0;
+    enum STRIP_FLAG modes[] = { STRIP_ALL, ONLY_COLOR, NO_RELOAD };
+
+    for (i = 0; i < nlines; i++) {
+	const char *s = lines[i];
+	len = strlen(s);
+
+	for (k = 0; k < 3; k++) {
+	    if (strip_ansi(a, s, modes[k]) != legacy_strip_ansi(b, s, modes[k])
+		|| strcmp(a, b) != 0) {
+		fprintf(stderr, "strip_ansi(%d) differs on line %d\n", k, i);
+		errors++;
+	    }
+	}
+	if (strlen_noansi(s) != legacy_strlen_noansi(s)) {
+	    fprintf(stderr, "strlen_noansi differs on line %d\n", i);
+	    errors++;
+	}
+	for (pos = -1; pos <= len + 1; pos++)
+	    if (DBCS_Status(s, pos) != legacy_DBCS_Status(s, pos)) {
+		fprintf(stderr, "DBCS_Status(%d) differs on line %d\n", pos, i);
+		errors++;
+		break;
+	    }
+	for (k = 0; k < nkeys; k++)
+	    if (DBCS_strcasestr(s, keys[k]) != legacy_DBCS_strcasestr(s, keys[k])) {
+		fprintf(stderr, "DBCS_strcasestr(%s) differs on line %d\n",
+			keys[k], i);
+		errors++;
+	    }
+    }
+    return errors;
+}
+
+static void
+bench(const char *kernel, int rounds, int legacy)
+{
+    static char buf[4096];
+    double t[4] = {0};
+    long sum = 0;
+    int r, i, k;
+
+    for (r = 0; r < rounds; r++) {
+	t[0] -= now_sec();
+	for (i = 0; i < nlines; i++)
+	    sum += legacy ? legacy_strip_ansi(buf, lines[i], STRIP_ALL) :
+			    strip_ansi(buf, lines[i], STRIP_ALL);
+	t[0] += now_sec();
+
+	t[1] -= now_sec();
+	for (i = 0; i < nlines; i++)
+	    sum += legacy ? legacy_strlen_noansi(lines[i]) :
+			    strlen_noansi(lines[i]);
+	t[1] += now_sec();
+
+	t[2] -= now_sec();
+	for (i = 0; i < nlines; i++)
+	    sum += legacy ?
+		    legacy_DBCS_Status(lines[i], strlen(lines[i]) - 1) :
+		    DBCS_Status(lines[i], strlen(lines[i]) - 1);
+	t[2] += now_sec();
+
+	t[3] -= now_sec();
+	for (k = 0; k < nkeys && k < 16; k++)
+	    for (i = 0; i < nlines; i++)
+		sum += (legacy ? legacy_DBCS_strcasestr(lines[i], keys[k]) :
+			 DBCS_strcasestr(lines[i], keys[k])) != NULL;
+	t[3] += now_sec();
+    }
+    printf("%-8s strip_ansi %7.2fms  strlen_noansi %7.2fms  "
+	   "DBCS_Status %7.2fms  DBCS_strcasestr %7.2fms  (%ld)\n",
+	   kernel, t[0] * 1e3 / rounds, t[1] * 1e3 / rounds,
+	   t[2] * 1e3 / rounds, t[3] * 1e3 / rounds, sum);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int rounds = 10, c, k, errors = 0;
+
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+	switch (c) {
+	    case 'n': rounds = atoi(optarg); break;
+	    default:
+		fprintf(stderr, "usage: %s [-n rounds] file...\n", argv[0]);
+		return 1;
+	}
+    }
+    if (optind >= argc || rounds <= 0) {
+	fprintf(stderr, "usage: %s [-n rounds] file...\n", argv[0]);
+	return 1;
+    }
+
+    srandom(1);
+    for (; optind < argc; optind++)
+	load(argv[optind]);
+    printf("%d lines, %d search keys, default kernel %s\n",
+	   nlines, nkeys, str_kernel_name());
+
+    bench("legacy", rounds, 1);
+    for (k = STR_KERNEL_SCALAR; k <= STR_KERNEL_AVX2; k++) {
+	if (str_kernel_set(k) < 0)
+	    continue;
+	errors += check();
+	bench(str_kernel_name(), rounds, 0);
+    }
+    if (errors)
+	printf("%d mismatches\n", errors);
+    return errors ? 1 : 0;
+}
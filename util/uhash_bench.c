@@ -0,0 +1,125 @@
+/* uhash microbenchmark: open addressed uhash vs. the old chained table
+ *
+ * usage: uhash_bench [lookups]
+ *
+ * Fills a private (non-shared) SHM_t with MAX_USERS synthetic userids and
+ * times searchuser() against the chained userid[]/next_in_hash[] layout it
+ * replaced, using the same keys. Does not touch the running BBS.
+ */
+#include "bbs.h"
+#include <sys/time.h>
+
+#define CHAIN_BITS  (16)
+
+// the chained table as it was before open addressing, for comparison.
+static int chain_head[1 << CHAIN_BITS];
+static int *chain_next;
+
+static void
+chain_add(int n, const char *id)
+{
+    int *p = &chain_head[StringHash(id) % (1 << CHAIN_BITS)];
+
+    while (*p != -1)
+	p = &chain_next[*p];
+    chain_next[*p = n] = -1;
+}
+
+static int
+chain_search(const char *userid)
+{
+    int p = chain_head[StringHash(userid) % (1 << CHAIN_BITS)];
+
+    for (; p != -1; p = chain_next[p])
+	if (strcasecmp(SHM->userid[p], userid) == 0)
+	    return p + 1;
+    return 0;
+}
+
+static double
+now_sec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+gen_userid(char *buf, int n)
+{
+    static const char cs[] = "abcdefghijklmnopqrstuvwxyz"
+			     "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    int i, len = 4 + random() % (IDLEN - 3);
+
+    buf[0] = cs[random() % 52];
+    for (i = 1; i < len; i++)
+	buf[i] = cs[random() % (sizeof(cs) - 1)];
+    buf[len] = 0;
+    // make it unique
+    if (len > 6)
+	snprintf(buf + len - 6, 7, "%06d", n % 1000000);
+}
+
+int
+main(int argc, char **argv)
+{
+    int i, n, nlookup = (argc > 1) ? atoi(argv[1]) : 5000000;
+    int hit_oa = 0, hit_chain = 0;
+    char (*keys)[IDLEN + 1];
+    double t;
+
+    if (nlookup <= 0)
+	nlookup = 5000000;
+
+    SHM = (SHM_t *)calloc(1, sizeof(SHM_t));
+    keys = malloc(sizeof(*keys) * MAX_USERS);
+    chain_next = malloc(sizeof(int) * MAX_USERS);
+    if (!SHM || !keys || !chain_next) {
+	perror("malloc");
+	return 1;
+    }
+
+    srandom(1);
+    memset(chain_head, -1, sizeof(chain_head));
+    for (n = 0; n < MAX_USERS; n++) {
+	gen_userid(keys[n], n);
+	add_to_uhash(n, keys[n]);
+	chain_add(n, keys[n]);
+    }
+
+    // random case so both sides pay for case folding; ~10% misses.
+    for (n = 0; n < MAX_USERS; n++) {
+	for (i = 0; keys[n][i]; i++)
+	    if (random() & 1)
+		keys[n][i] = toupper((unsigned char)keys[n][i]);
+	if (n % 10 == 0)
+	    keys[n][0] = '_';
+    }
+    // shuffle, then walk keys[] sequentially so only the tables miss cache
+    for (n = MAX_USERS - 1; n > 0; n--) {
+	char tmp[IDLEN + 1];
+	i = random() % (n + 1);
+	memcpy(tmp, keys[i], sizeof(tmp));
+	memcpy(keys[i], keys[n], sizeof(tmp));
+	memcpy(keys[n], tmp, sizeof(tmp));
+    }
+
+    printf("users: %d, lookups: %d, uhash slots: %d, chain heads: %d\n",
+	   MAX_USERS, nlookup, 1 << UHASH_BITS, 1 << CHAIN_BITS);
+
+    t = now_sec();
+    for (i = 0; i < nlookup; i++)
+	hit_chain += chain_search(keys[i % MAX_USERS]) > 0;
+    t = now_sec() - t;
+    printf("chained:        %8.1f ns/lookup (%d hits)\n",
+	   t * 1e9 / nlookup, hit_chain);
+
+    t = now_sec();
+    for (i = 0; i < nlookup; i++)
+	hit_oa += searchuser(keys[i % MAX_USERS], NULL) > 0;
+    t = now_sec() - t;
+    printf("open addressed: %8.1f ns/lookup (%d hits)\n",
+	   t * 1e9 / nlookup, hit_oa);
+
+    return hit_oa == hit_chain ? 0 : 1;
+}
@@ -66,25 +66,40 @@ void load_uhash(void) {
     }
 }
 
-void checkhash(int h)
+/* drop slots whose hash or key no longer match their userid, and free
+ * bits of slots that have one */
+void checkhash(void)
 {
-    int *p = &(SHM->hash_head[h]), ch, deep=0;
-    while(*p != -1)
+    unsigned int i = 0;
+    int uid;
+    char key[UHASH_KEYLEN + 1];
+
+    for (uid = 0; uid < MAX_USERS; uid++)
+	if (uhash_is_free(uid) && SHM->userid[uid][0]) {
+	    printf("remove free bit %d [%s]\n", uid, SHM->userid[uid]);
+	    uhash_set_free(uid, 0);
+	}
+
+    while (i < (1 << UHASH_BITS))
     {
-       if(*p <-1 || *p >= MAX_USERS) {*p=-1; return;}
-       ch = StringHash( SHM->userid[*p])%(1<<HASH_BITS);
-       if(ch!=h)
+       uid = SHM->uhash[i].uid;
+       if (uid == 0) { i++; continue; }
+       if (uid < 0 || uid > MAX_USERS)
+       {
+           printf("remove slot %u: bad uid %d\n", i, uid);
+           remove_uhash_slot(i);
+           continue; // slot i now holds the next entry of the cluster
+       }
+       strlcpy(key, SHM->uhash_key[i], sizeof(key));
+       if (SHM->uhash[i].tag != StringHash(SHM->userid[uid - 1]) ||
+           strcasecmp(key, SHM->userid[uid - 1]) != 0)
        {
-           printf("remove %d %d!=%d %d [%s] next:%d\n", 
-		    deep, h, ch, *p, SHM->userid[*p],
-		    SHM->next_in_hash[*p]);
-          *p = SHM->next_in_hash[*p]; //remove from link
-          // *p=-1;  Ptt: cut it?
-	  //return;
+           printf("remove slot %u: %d [%s] key [%s]\n",
+		    i, uid, SHM->userid[uid - 1], key);
+           remove_uhash_slot(i);
+           continue;
        }
-       else
-          p = &(SHM->next_in_hash[*p]);
-       deep++;
+       i++;
     }
 }
 void fill_uhash(int onfly)
@@ -92,12 +107,13 @@ void fill_uhash(int onfly)
     int fd, usernumber;
     usernumber = 0;
 
-    for (fd = 0; fd < (1 << HASH_BITS); fd++)
-      if(!onfly)
-    	  SHM->hash_head[fd] = -1;
-      else
-	  checkhash(fd);
-    
+    if(!onfly) {
+	memset(SHM->uhash, 0, sizeof(SHM->uhash));
+	memset(SHM->uhash_free, 0, sizeof(SHM->uhash_free));
+	SHM->uhash_nfree = 0;
+    } else
+	checkhash();
+
     if ((fd = open(FN_PASSWD, O_RDWR)) > 0)
     {
 	struct stat stbuf;
@@ -133,41 +149,36 @@ void fill_uhash(int onfly)
 }
 void userec_add_to_uhash(int n, userec_t *user, int onfly)
 {
-    int *p, h, l=0;
-
-    // uhash use userid="" to denote free slot for new register
-    // However, such entries will have the same hash key.
-    // So we skip most of invalid userid to prevent lots of hash collision.
-    if (!is_validuserid(user->userid)) {
-	// dirty hack, preserve few slot for new register
-	static int count = 0;
-	count++;
-	if (count > 1000)
-	    return;
-    }
+    unsigned int i;
 
-    h = StringHash(user->userid)%(1<<HASH_BITS);
-    
-    p = &(SHM->hash_head[h]);
+    // userid "" marks a free slot for new register; those are kept in
+    // SHM->uhash_free, not in the probe table.
     if(!onfly || SHM->userid[n][0] != user->userid[0] || 
 	       strncmp(SHM->userid[n], user->userid, IDLEN-1))
     {
-       strcpy(SHM->userid[n], user->userid);
+       if(onfly) {
+           printf("add %s\n", user->userid);
+	   remove_from_uhash(n);
+       }
        SHM->money[n] = user->money;
 #ifdef USE_COOLDOWN
        SHM->cooldowntime[n] = 0;
 #endif
-       if(onfly)
-           printf("add %s\n", user->userid);
     }
-    while (*p != -1)
+    else if (!user->userid[0])
+    {
+	if (uhash_is_free(n))
+	    return;
+    }
+    else
     {
-	if(onfly && *p==n )  // already in hash
-	     return;
-	l++;
-	p = &(SHM->next_in_hash[*p]);
+	// walk the probe sequence of this id looking for uid n+1
+	for (i = StringHash(user->userid) & ((1 << UHASH_BITS) - 1);
+	     SHM->uhash[i].uid; i = (i + 1) & ((1 << UHASH_BITS) - 1))
+	    if (SHM->uhash[i].uid == n + 1)  // already in hash
+		return;
     }
     if(onfly)
-       printf("add %d %d %d [%s] in hash\n", l, h, n, user->userid);
-    SHM->next_in_hash[*p = n] = -1;
+       printf("add %d [%s] in hash\n", n, user->userid);
+    add_to_uhash(n, user->userid);
 }
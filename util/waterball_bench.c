@@ -0,0 +1,179 @@
+/* Waterball queue benchmark and stress test
+ *
+ * usage: waterball_bench [-n sessions] [-r rounds] [-p senders] [-w workers]
+ *
+ * Broadcasts rounds waterballs to every one of n sessions from p sender
+ * processes at the same time, the way util/broadcast and the SYSOP
+ * broadcast in talk.c do. The sessions live in an anonymous shared
+ * mapping, not in the SHM of the running site, and are owned by w worker
+ * processes which sleep in pselect() and take their queues like mbbsd
+ * does. A sender finding a queue full retries later. Reports throughput,
+ * wakeups and full queues; exits non-zero if any message is lost,
+ * duplicated or out of order.
+ */
+#include "bbs.h"
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define MAX_SENDERS (64)
+
+typedef struct {
+    volatile int start;
+    int received, wakeups, full, errors;
+    userinfo_t uinfo[1];
+} bench_t;
+
+static bench_t *B;
+static int nsessions = 2000, rounds = 100, nsenders = 4, nworkers = 8;
+
+static double
+now_sec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+wakeup(int sig GCC_UNUSED)
+{
+}
+
+static void
+sender(int id)
+{
+    msgque_t msg;
+    int r, i, full = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.pid = id;
+    msg.msgmode = MSGMODE_WRITE;
+    strlcpy(msg.userid, "SYSOP", sizeof(msg.userid));
+    while (!B->start)
+	usleep(1000);
+
+    for (r = 0; r < rounds; r++) {
+	snprintf(msg.last_call_in, sizeof(msg.last_call_in), "%d", r);
+	for (i = 0; i < nsessions; i++)
+	    while (msgring_send(&B->uinfo[i], &msg) < 0) {
+		full++;
+		sched_yield();
+	    }
+    }
+    __sync_fetch_and_add(&B->full, full);
+}
+
+static void
+worker(int id)
+{
+    int first = nsessions * id / nworkers,
+	last = nsessions * (id + 1) / nworkers,
+	expect = (last - first) * rounds * nsenders,
+	received = 0, wakeups = 0, errors = 0, i, busy;
+    int *next = calloc((last - first) * nsenders, sizeof(int));
+    struct timespec ts = { 0, 100 * 1000000 };
+    struct sigaction sa;
+    sigset_t set, waitmask;
+    msgque_t msg;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = wakeup;
+    sigaction(SIGUSR2, &sa, NULL);
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &set, &waitmask);
+    sigdelset(&waitmask, SIGUSR2);
+    for (i = first; i < last; i++)
+	B->uinfo[i].pid = getpid();
+
+    while (received < expect) {
+	for (i = first; i < last; i++) {
+	    msgring_t *ring = &B->uinfo[i].msgring;
+	    while (msgring_peek(ring, 0, &msg)) {
+		int *n = &next[(i - first) * nsenders + msg.pid];
+		if (atoi(msg.last_call_in) != (*n)++)
+		    errors++;
+		msgring_pop(ring);
+		received++;
+	    }
+	}
+	if (received >= expect)
+	    break;
+
+	for (busy = 0, i = first; i < last && !busy; i++)
+	    busy = msgring_wait_begin(&B->uinfo[i].msgring, 0);
+	if (!busy && pselect(0, NULL, NULL, NULL, &ts, &waitmask) < 0 &&
+	    errno == EINTR)
+	    wakeups++;
+	for (i = first; i < last; i++)
+	    msgring_wait_end(&B->uinfo[i].msgring);
+    }
+
+    __sync_fetch_and_add(&B->received, received);
+    __sync_fetch_and_add(&B->wakeups, wakeups);
+    __sync_fetch_and_add(&B->errors, errors);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int c, i, status;
+    size_t sz;
+    double t;
+
+    while ((c = getopt(argc, argv, "n:r:p:w:")) != -1) {
+	switch (c) {
+	    case 'n': nsessions = atoi(optarg); break;
+	    case 'r': rounds = atoi(optarg); break;
+	    case 'p': nsenders = atoi(optarg); break;
+	    case 'w': nworkers = atoi(optarg); break;
+	    default: nsessions = 0; break;
+	}
+    }
+    if (nsessions <= 0 || rounds <= 0 || nsenders <= 0 ||
+	nsenders > MAX_SENDERS || nworkers <= 0 || nworkers > nsessions) {
+	fprintf(stderr, "usage: %s [-n sessions] [-r rounds] [-p senders] "
+		"[-w workers]\n", argv[0]);
+	return 1;
+    }
+
+    sz = sizeof(bench_t) + sizeof(userinfo_t) * (nsessions - 1);
+    B = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (B == MAP_FAILED) {
+	perror("mmap");
+	return 1;
+    }
+    memset(B, 0, sz);
+
+    for (i = 0; i < nworkers + nsenders; i++) {
+	if (fork() == 0) {
+	    if (i < nworkers)
+		worker(i);
+	    else
+		sender(i - nworkers);
+	    _exit(0);
+	}
+    }
+    // let the workers register and fall asleep first
+    sleep(1);
+    t = now_sec();
+    B->start = 1;
+    while (wait(&status) > 0)
+	;
+    t = now_sec() - t;
+
+    printf("%d sessions, %d senders x %d rounds, %d workers\n",
+	   nsessions, nsenders, rounds, nworkers);
+    printf("%d of %d delivered in %.3fs, %.0f msg/s\n", B->received,
+	   nsessions * rounds * nsenders, t, B->received / t);
+    printf("%d wakeups (one signal per message would be %d), "
+	   "%d sends found the queue full\n",
+	   B->wakeups, B->received, B->full);
+    if (B->errors || B->received != nsessions * rounds * nsenders)
+	printf("%d messages lost, %d out of order\n",
+	       nsessions * rounds * nsenders - B->received, B->errors);
+    return (B->errors ||
+	    B->received != nsessions * rounds * nsenders) ? 1 : 0;
+}
@@ -1,7 +1,10 @@
 #include "bbs.h"
 #include "xchatd.h"
 #include <sys/wait.h>
+#include <sys/uio.h>
 #include <netdb.h>
+#include <poll.h>
+#include <event2/event.h>
 
 #define SERVER_USAGE
 #undef  MONITOR                 /* ʷ chatroom ʥHѨMȯ */
@@ -23,6 +26,10 @@
  * define SELFTEST & SELFTESTER, HN[Ѽ(argc>1)N|] test child.
  * test server ȶi 100 .
  *
+ * load test: "xchatd load [users] [messages]" (SELFTESTER) logs in that
+ * many clients, all join one room, then one of them talks and the rest
+ * count what they receive. Reports the fan-out rate.
+ *
  * Hint:
  * tX valgrind M memory related bug.
  */
@@ -33,6 +40,8 @@
 // t} port
 #undef NEW_CHATPORT
 #define NEW_CHATPORT 12333
+#undef XCHATD_ADDR
+#define XCHATD_ADDR ":12333"
 // only test 100 secs
 #undef CHAT_INTERVAL
 #define CHAT_INTERVAL 100
@@ -43,6 +52,14 @@
 #define CHAT_INTERVAL   (60 * 30)
 #define SOCK_QLEN       1
 
+/* Output to a client is written directly; what the socket does not take is
+ * kept in a per-user ring of CHAT_OBUF_SIZE bytes (allocated only while
+ * there is a backlog) and flushed when writable. A client that falls
+ * further behind than that is disconnected, so a slow reader never stalls
+ * a room and messages are never silently lost. */
+#define CHAT_OBUF_SIZE  (64 * 1024)
+#define CHAT_HASH_SIZE  (4096)  /* buckets of the user/room hashes, 2^n */
+
 
 /* name of the main room (always exists) */
 
@@ -96,6 +113,9 @@ typedef struct ChatAction ChatAction;
 struct ChatUser
 {
     struct ChatUser *unext;
+    struct ChatUser *uhnext;      /* hash chain by userid */
+    struct ChatUser *chnext;      /* hash chain by chatid */
+    struct ChatUser *rnext, *rprev; /* members of the same room */
     ChatRoom *room;
     UserList *ignore;
     int sock;                     /* user socket */
@@ -109,12 +129,18 @@ struct ChatUser
     char nickname[24];		  /* BBS nickname */
     char chatid[CHATID_LEN + 1];  /* chat id */
     char ibuf[80];                /* buffer for non-blocking receiving */
+    int dead;                     /* to be logged out, see reap_users() */
+    struct event *rev, *wev;
+    char *obuf;                   /* output ring, see CHAT_OBUF_SIZE */
+    int ohead, olen;
 };
 
 
 struct ChatRoom
 {
     struct ChatRoom *next, *prev;
+    struct ChatRoom *hnext;       /* hash chain by name */
+    ChatUser *members;
     char name[IDLEN + 1];
     char topic[TOPIC_LEN + 1];    /* Let the room op to define room topic */
     int rflag;                    /* ROOM_LOCKED, ROOM_SECRET, ROOM_OPENTOPIC */
@@ -142,8 +168,11 @@ struct ChatCmd
 
 static ChatRoom mainroom;
 static ChatUser *mainuser;
-static fd_set mainfds;
-static int maxfds;              /* number of sockets to select on */
+static ChatUser *userid_hash[CHAT_HASH_SIZE];
+static ChatUser *chatid_hash[CHAT_HASH_SIZE];
+static ChatRoom *room_hash[CHAT_HASH_SIZE];
+static struct event_base *evbase;
+static int deadusers;           /* number of users with dead set */
 static int totaluser;           /* current number of connections */
 static char chatbuf[256];       /* general purpose buffer */
 static int common_client_command;
@@ -384,12 +413,71 @@ str_match(const char *s1, const char *s2)
 /* ----------------------------------------------------- */
 
 
+/* StringHash() ignores case, like str_equal() */
+#define CHAT_HASH(s)    (StringHash(s) & (CHAT_HASH_SIZE - 1))
+
+/* users are hashed once logged in (login_user) */
+static void
+cuser_hash_add(ChatUser *cu)
+{
+    ChatUser **head;
+
+    head = &userid_hash[CHAT_HASH(cu->userid)];
+    cu->uhnext = *head;
+    *head = cu;
+    head = &chatid_hash[CHAT_HASH(cu->chatid)];
+    cu->chnext = *head;
+    *head = cu;
+}
+
+
+static void
+cuser_hash_del(ChatUser *cu)
+{
+    ChatUser **p;
+
+    for (p = &userid_hash[CHAT_HASH(cu->userid)]; *p; p = &(*p)->uhnext)
+	if (*p == cu) {
+	    *p = cu->uhnext;
+	    break;
+	}
+    for (p = &chatid_hash[CHAT_HASH(cu->chatid)]; *p; p = &(*p)->chnext)
+	if (*p == cu) {
+	    *p = cu->chnext;
+	    break;
+	}
+}
+
+
+static void
+croom_hash_add(ChatRoom *room)
+{
+    ChatRoom **head = &room_hash[CHAT_HASH(room->name)];
+
+    room->hnext = *head;
+    *head = room;
+}
+
+
+static void
+croom_hash_del(ChatRoom *room)
+{
+    ChatRoom **p;
+
+    for (p = &room_hash[CHAT_HASH(room->name)]; *p; p = &(*p)->hnext)
+	if (*p == room) {
+	    *p = room->hnext;
+	    break;
+	}
+}
+
+
 static ChatUser *
 cuser_by_userid(char *userid)
 {
     register ChatUser *cu;
 
-    for (cu = mainuser; cu; cu = cu->unext)
+    for (cu = userid_hash[CHAT_HASH(userid)]; cu; cu = cu->uhnext)
     {
 	if (str_equal(userid, cu->userid))
 	    break;
@@ -403,7 +491,7 @@ cuser_by_chatid(char *chatid)
 {
     register ChatUser *cu;
 
-    for (cu = mainuser; cu; cu = cu->unext)
+    for (cu = chatid_hash[CHAT_HASH(chatid)]; cu; cu = cu->chnext)
     {
 	if (str_equal(chatid, cu->chatid))
 	    break;
@@ -419,6 +507,9 @@ fuzzy_cuser_by_chatid(char *chatid)
     int mode;
     int count=0;
 
+    if ((cu = cuser_by_chatid(chatid)))
+	return cu;
+
     xuser = NULL;
 
     for (cu = mainuser; cu; cu = cu->unext)
@@ -440,7 +531,7 @@ fuzzy_cuser_by_chatid(char *chatid)
 static ChatRoom *croom_by_roomid(char *roomid) {
     ChatRoom *room;
     
-    for(room=&mainroom; room; room=room->next)
+    for(room=room_hash[CHAT_HASH(roomid)]; room; room=room->hnext)
 	if(str_equal(roomid, room->name))
 	    break;
     return room;
@@ -554,39 +645,107 @@ list_belong_id(UserList *list, const char *userid)
 /* ------------------------------------------------------ */
 
 
+/* marks cu to be logged out by reap_users(); it may be in the middle of
+ * a room broadcast or a command, so it is not freed right away. */
 static void
-Xdo_send(int nfds, fd_set *wset, char *msg)
+cuser_drop(ChatUser *cu)
 {
-    struct timeval zerotv;   /* timeval for selecting */
-    int sr;
+    if (!cu->dead) {
+	cu->dead = 1;
+	deadusers++;
+    }
+}
 
-    /* Thor: for future reservation bug */
 
-    zerotv.tv_sec = 0;
-    zerotv.tv_usec = 16384;  /* Ptt: 令16384 קKfor loopYcpu time
-				16384 C64 */
-#ifdef SELFTEST
-    zerotv.tv_usec = 0;
-#endif
+static void
+cuser_send(ChatUser *cu, const char *msg, int len)
+{
+    int n, tail;
 
-    sr = select(nfds + 1, NULL, wset, NULL, &zerotv);
+    if (cu->dead)
+	return;
 
-    /* FIXME Y select() timeout, Φ write ready S. hi|| msg? */
-    if (sr > 0)
+    if (!cu->olen)
     {
-	register int len;
-
-	len = strlen(msg) + 1;
-	while (nfds >= 0)
+	n = send(cu->sock, msg, len, 0);
+	if (n == len)
+	    return;
+	if (n < 0)
 	{
-	    if (FD_ISSET(nfds, wset))
+	    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
 	    {
-		send(nfds, msg, len, 0);/* Thor: pGbufferF, | block */
-		if (--sr <= 0)
-		    return;
+		cuser_drop(cu);
+		return;
 	    }
-	    nfds--;
+	    n = 0;
+	}
+	msg += n;
+	len -= n;
+
+	if (!cu->obuf && !(cu->obuf = (char *) malloc(CHAT_OBUF_SIZE)))
+	{
+	    logit(cu->userid, "obuf malloc fail");
+	    cuser_drop(cu);
+	    return;
 	}
+	cu->ohead = 0;
+	event_add(cu->wev, NULL);
+    }
+
+    if (cu->olen + len > CHAT_OBUF_SIZE)
+    {
+	logit(cu->userid, "output queue full");
+	cuser_drop(cu);
+	return;
+    }
+
+    tail = (cu->ohead + cu->olen) % CHAT_OBUF_SIZE;
+    n = MIN(len, CHAT_OBUF_SIZE - tail);
+    memcpy(cu->obuf + tail, msg, n);
+    memcpy(cu->obuf, msg + n, len - n);
+    cu->olen += len;
+}
+
+
+static void reap_users(void);
+
+/* the socket is writable again: flush the output ring */
+static void
+cuser_flush(evutil_socket_t sock, short event, void *arg)
+{
+    ChatUser *cu = (ChatUser *) arg;
+    struct iovec iov[2];
+    int n, first;
+    (void)event;
+
+    first = MIN(cu->olen, CHAT_OBUF_SIZE - cu->ohead);
+    iov[0].iov_base = cu->obuf + cu->ohead;
+    iov[0].iov_len = first;
+    iov[1].iov_base = cu->obuf;
+    iov[1].iov_len = cu->olen - first;
+
+    n = writev(sock, iov, iov[1].iov_len ? 2 : 1);
+    if (n < 0)
+    {
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	    cuser_drop(cu);
+    }
+    else
+    {
+	cu->ohead = (cu->ohead + n) % CHAT_OBUF_SIZE;
+	cu->olen -= n;
+    }
+
+    if (cu->dead)
+	reap_users();
+    else if (cu->olen)
+	event_add(cu->wev, NULL);
+    else
+    {
+	/* no backlog, no ring */
+	free(cu->obuf);
+	cu->obuf = NULL;
+	cu->ohead = 0;
     }
 }
 
@@ -595,30 +754,25 @@ static void
 send_to_room(ChatRoom *room, char *msg, int userno, int number)
 {
     ChatUser *cu;
-    fd_set wset, *wptr;
-    int sock, max;
+    int len, sent = 0;
 
     if (number != MSG_MESSAGE && number)
 	return;
 
-    FD_ZERO(wptr = &wset);
-    max = -1;
+    len = strlen(msg) + 1;
 
-    for (cu = mainuser; cu; cu = cu->unext)
+    /* ROOM_ALL: everyone connected, including those not logged in yet */
+    for (cu = room ? room->members : mainuser; cu;
+	 cu = room ? cu->rnext : cu->unext)
     {
-	if (room == cu->room || room == ROOM_ALL)
+	if (!userno || !list_belong(cu->ignore, userno))
 	{
-	    if (!userno || !list_belong(cu->ignore, userno))
-	    {
-		sock = cu->sock;
-		FD_SET(sock, wptr);
-		if (max < sock)
-		    max = sock;
-	    }
+	    cuser_send(cu, msg, len);
+	    sent++;
 	}
     }
 
-    if (max < 0)
+    if (!sent)
 	return;
 
 #ifdef CHAT_MSG_LOGFILE
@@ -633,8 +787,6 @@ send_to_room(ChatRoom *room, char *msg, int userno, int number)
 	write(mlog, "\n", 1);
     }
 #endif
-
-    Xdo_send(max, wptr, msg);
 }
 
 
@@ -646,16 +798,7 @@ send_to_user(ChatUser *user, char *msg, int userno, int number)
 	return;
 
     if (!userno || !list_belong(user->ignore, userno))
-    {
-	fd_set wset, *wptr;
-	int sock;
-
-	sock = user->sock;
-	FD_ZERO(wptr = &wset);
-	FD_SET(sock, wptr);
-
-	Xdo_send(sock, wptr, msg);
-    }
+	cuser_send(user, msg, strlen(msg) + 1);
 }
 
 /* ----------------------------------------------------- */
@@ -694,6 +837,14 @@ exit_room(ChatUser *user, int mode, char *msg)
     user->room = NULL;
     user->uflag &= ~PERM_ROOMOP;
 
+    if (user->rprev)
+	user->rprev->rnext = user->rnext;
+    else
+	room->members = user->rnext;
+    if (user->rnext)
+	user->rnext->rprev = user->rprev;
+    user->rnext = user->rprev = NULL;
+
     room->occupants--;
 
     if (room->occupants > 0)
@@ -748,6 +899,7 @@ exit_room(ChatUser *user, int mode, char *msg)
 	room->prev->next = room->next;
 	if((next = room->next))
 	    next->prev = room->prev;
+	croom_hash_del(room);
 	list_free(room->invite);
 
 	free(room);
@@ -857,7 +1009,9 @@ chat_nick(ChatUser *cu, char *msg)
     if (!CLOAK(cu))               /* Thor: ѫN */
 	send_to_room(cu->room, chatbuf, cu->userno, MSG_MESSAGE);
 
+    cuser_hash_del(cu);
     strlcpy(cu->chatid, chatid, sizeof(cu->chatid));
+    cuser_hash_add(cu);
     user_changed(cu);
 
     snprintf(chatbuf, sizeof(chatbuf), "/n%s", chatid);
@@ -1260,6 +1414,10 @@ arrive_room(ChatUser *cuser, ChatRoom *room)
     send_to_room(room, chatbuf, 0, MSG_USERNOTIFY);
 
     cuser->room = room;
+    cuser->rprev = NULL;
+    if ((cuser->rnext = room->members))
+	room->members->rprev = cuser;
+    room->members = cuser;
     room->occupants++;
     rname = room->name;
 
@@ -1317,6 +1475,7 @@ enter_room(ChatUser *cuser, char *rname, char *msg)
 	room->next = mainroom.next;
 	mainroom.next = room;
 	room->prev = &mainroom;
+	croom_hash_add(room);
 
 	create = 1;
     }
@@ -1355,16 +1514,16 @@ logout_user(ChatUser *cuser)
     ChatUser *xuser, *prev;
 
     sock = cuser->sock;
+    event_free(cuser->rev);
+    event_free(cuser->wev);
     shutdown(sock, 2);
     close(sock);
 
-    FD_CLR(sock, &mainfds);
-
-#if 0   /* Thor: ]\to@ */
-    if (sock >= maxfds)
-	maxfds = sock - 1;
-#endif
-
+    if (cuser->dead)
+	deadusers--;
+    if (cuser->userid[0])
+	cuser_hash_del(cuser);
+    free(cuser->obuf);
     list_free(cuser->ignore);
 
     xuser = mainuser;
@@ -1397,6 +1556,29 @@ logout_user(ChatUser *cuser)
 }
 
 
+/* logs out the users marked by cuser_drop(). Leaving a room talks to the
+ * room, which may drop more users, so loop until there is none left. */
+static void
+reap_users(void)
+{
+    ChatUser *cu, *cunext;
+
+    while (deadusers > 0)
+    {
+	for (cu = mainuser; cu; cu = cunext)
+	{
+	    /* only cu is freed here */
+	    cunext = cu->unext;
+	    if (cu->dead)
+	    {
+		exit_room(cu, EXIT_LOSTCONN, (char *) NULL);
+		logout_user(cu);
+	    }
+	}
+    }
+}
+
+
 static void
 print_user_counts(ChatUser *cuser)
 {
@@ -1547,6 +1729,10 @@ login_user(ChatUser *cu, char *msg)
 	return 0;
     }
 
+    /* logging in again after /bye */
+    if (cu->userid[0])
+	cuser_hash_del(cu);
+
     cu->userno = utent;
     cu->uflag = level & ~(PERM_ROOMOP | PERM_CLOAK | PERM_HANDUP | PERM_SAY);
     /* Thor: iӥMROOMOP(PPERM_CHAT), CLOAK */
@@ -1557,6 +1743,7 @@ login_user(ChatUser *cu, char *msg)
     cu->numposts = acct.numposts;
     cu->numlogindays = acct.numlogindays;
     strlcpy(cu->lasthost, acct.lasthost, sizeof(cu->lasthost));
+    cuser_hash_add(cu);
 
     send_to_user(cu, CHAT_LOGIN_OK, 0, 0);
     arrive_room(cu, &mainroom);
@@ -1783,7 +1970,7 @@ chat_kick(ChatUser *cu, char *msg)
     exit_room(xuser, EXIT_KICK, (char *) NULL);
 
     if (room == &mainroom)
-	logout_user(xuser);
+	cuser_drop(xuser);
     else
 	enter_room(xuser, MAIN_NAME, (char *) NULL);
 }
@@ -2570,6 +2757,8 @@ cuser_serve(ChatUser *cu)
 
     str = buf;
     len = recv(cu->sock, str, sizeof(buf) - 1, 0);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	return 0;
     if (len <= 0)
     {
 	/* disconnected */
@@ -2590,7 +2779,7 @@ cuser_serve(ChatUser *cu)
 	    cmd[isize]='\0';
 	    isize = 0;
 
-	    if (command_execute(cu) < 0)
+	    if (command_execute(cu) < 0 || cu->dead)
 		return -1;
 
 	    continue;
@@ -2708,27 +2897,81 @@ start_daemon()
 }
 
 
+/* every CHAT_INTERVAL */
 static void
-free_resource(int fd)
+free_resource(evutil_socket_t fd, short event, void *arg)
 {
     static int loop = 0;
-    register ChatUser *user;
-    register int sock, num;
+    (void)fd;
+    (void)event;
+    (void)arg;
 
-    /* sp maxfd */
-    num = 0;
-    for (user = mainuser; user; user = user->unext)
+    sprintf(chatbuf, "%d, %d user", ++loop, totaluser);
+    logit("LOOP", chatbuf);
+
+#ifdef SELFTEST
+    event_base_loopbreak(evbase);
+#endif
+}
+
+
+static void
+cuser_recv(evutil_socket_t sock, short event, void *arg)
+{
+    ChatUser *cu = (ChatUser *) arg;
+    (void)sock;
+    (void)event;
+
+    if (cuser_serve(cu) < 0)
+	cuser_drop(cu);
+    reap_users();
+}
+
+
+static void
+accept_user(evutil_socket_t msock, short event, void *arg)
+{
+    ChatUser *cu;
+    int csock;
+    (void)event;
+    (void)arg;
+
+    csock = accept(msock, NULL, NULL);
+    if (csock < 0)
+	return;
+
+    cu = (ChatUser *) malloc(sizeof(ChatUser));
+    if (cu == NULL)
     {
-	num++;
-	sock = user->sock;
-	if (fd < sock)
-	    fd = sock;
+	close(csock);
+	logit("accept", "malloc fail");
+	return;
     }
+    memset(cu, 0, sizeof(ChatUser));
+    cu->sock = csock;
+    evutil_make_socket_nonblocking(csock);
+    cu->rev = event_new(evbase, csock, EV_READ | EV_PERSIST, cuser_recv, cu);
+    cu->wev = event_new(evbase, csock, EV_WRITE, cuser_flush, cu);
+    if (!cu->rev || !cu->wev)
+    {
+	if (cu->rev)
+	    event_free(cu->rev);
+	if (cu->wev)
+	    event_free(cu->wev);
+	close(csock);
+	free(cu);
+	logit("accept", "event_new fail");
+	return;
+    }
+    event_add(cu->rev, NULL);
 
-    sprintf(chatbuf, "%d, %d user (maxfds %d -> %d)", ++loop, num, maxfds, fd+1);
-    logit("LOOP", chatbuf);
+    cu->unext = mainuser;
+    mainuser = cu;
+    totaluser++;
 
-    maxfds = fd + 1;
+#ifdef  DEBUG
+    logit("accept", "OK");
+#endif
 }
 
 
@@ -2798,6 +3041,7 @@ reaper()
 }
 
 #ifdef SELFTESTER
+#include <sys/time.h>
 #define MAXTESTUSER 20
 
 int selftest_connect(void)
@@ -2968,23 +3212,165 @@ void selftest(void)
 
     exit(0);
 }
+
+/* load test, see the comment at the top */
+#define LOAD_MARK   "LOAD#"
+#define LOAD_SYNC   "SYNC#"
+#define LOAD_WINDOW 32          /* messages in flight */
+
+typedef struct {
+    int fd;
+    int got;                    /* LOAD_MARK messages received */
+    int sync;                   /* LOAD_SYNC messages received */
+    int len;
+    char line[512];             /* partial message */
+} LoadClient;
+
+static double
+selftest_now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* reads what is there; returns -1 on EOF */
+static int
+selftest_load_read(LoadClient *c)
+{
+    char buf[8192];
+    int n, i;
+
+    if ((n = recv(c->fd, buf, sizeof(buf), 0)) <= 0)
+	return (n < 0 && errno == EAGAIN) ? 0 : -1;
+    for (i = 0; i < n; i++) {
+	if (buf[i]) {
+	    if (c->len < (int)sizeof(c->line) - 1)
+		c->line[c->len++] = buf[i];
+	    continue;
+	}
+	c->line[c->len] = '\0';
+	if (strstr(c->line, LOAD_MARK))
+	    c->got++;
+	else if (strstr(c->line, LOAD_SYNC))
+	    c->sync++;
+	c->len = 0;
+    }
+    return 0;
+}
+
+/* polls every client once, waiting at most ms. returns the number of
+ * clients that lost their connection. */
+static int
+selftest_load_poll(LoadClient *c, struct pollfd *pfd, int n, int ms)
+{
+    int i, lost = 0;
+
+    if (poll(pfd, n, ms) <= 0)
+	return 0;
+    for (i = 0; i < n; i++) {
+	if (!pfd[i].revents)
+	    continue;
+	if (selftest_load_read(&c[i]) < 0) {
+	    close(c[i].fd);
+	    pfd[i].fd = -1;
+	    lost++;
+	}
+    }
+    return lost;
+}
+
+void selftest_load(int nusers, int nmsgs)
+{
+    LoadClient *c;
+    struct pollfd *pfd;
+    struct rlimit limit;
+    char buf[256];
+    int i, sent = 0, lost = 0, least;
+    double t, deadline;
+
+    if (nusers < 2)
+	nusers = 2;
+    if (nmsgs < 1)
+	nmsgs = 1;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    c = (LoadClient *) calloc(nusers, sizeof(LoadClient));
+    pfd = (struct pollfd *) calloc(nusers, sizeof(struct pollfd));
+    assert(c && pfd);
+
+    /* one by one, so every join is done before the talking starts */
+    t = selftest_now();
+    for (i = 0; i < nusers; i++) {
+	if ((c[i].fd = selftest_connect()) < 0) {
+	    fprintf(stderr, "only %d clients connected\n", i);
+	    nusers = i;
+	    break;
+	}
+	pfd[i].fd = c[i].fd;
+	pfd[i].events = POLLIN;
+	snprintf(buf, sizeof(buf), "/! %d u%d ", i, i);
+	selftest_send(c[i].fd, buf);
+	selftest_send(c[i].fd, "/j load");
+	/* in the room once it hears itself */
+	selftest_send(c[i].fd, LOAD_SYNC);
+	fcntl(c[i].fd, F_SETFL, O_NONBLOCK);
+	while (pfd[i].fd >= 0 && !c[i].sync)
+	    lost += selftest_load_poll(c, pfd, i + 1, 1000);
+    }
+    if (nusers < 2)
+	exit(1);
+    fprintf(stderr, "%d clients in room, %.1f s\n", nusers,
+	    selftest_now() - t);
+
+    /* c[0] talks, at most LOAD_WINDOW messages ahead of the slowest */
+    t = selftest_now();
+    deadline = t + 60;
+    for (;;) {
+	least = nmsgs;
+	for (i = 0; i < nusers; i++)
+	    if (pfd[i].fd >= 0 && c[i].got < least)
+		least = c[i].got;
+	if (least >= nmsgs || pfd[0].fd < 0 || selftest_now() > deadline)
+	    break;
+	while (sent < nmsgs && sent - least < LOAD_WINDOW) {
+	    snprintf(buf, sizeof(buf), LOAD_MARK "%d", sent++);
+	    selftest_send(c[0].fd, buf);
+	}
+	lost += selftest_load_poll(c, pfd, nusers, 1000);
+    }
+    t = selftest_now() - t;
+
+    printf("%d users, %d messages in %.3f s\n", nusers, least, t);
+    printf("%.0f messages/s, %.0f deliveries/s, %d connections lost\n",
+	   least / t, (double)least * (nusers - lost) / t, lost);
+    for (i = 0; i < nusers; i++)
+	if (pfd[i].fd >= 0)
+	    close(c[i].fd);
+    free(c);
+    free(pfd);
+}
 #endif
 
 int
 main(int argc, char *argv[])
 {
-    register int msock, csock, nfds;
-    register ChatUser *cu, *cunext;
-    register fd_set *rptr, *xptr;
-    fd_set rset, xset;
+    int msock;
+    struct event *ev_accept, *ev_maintain;
     struct timeval tv;
-    time4_t uptime, tmaintain;
     (void)argc;
     (void)argv;
 
 #ifdef SELFTESTER
     if(argc>1) {
 	Signal(SIGPIPE, SIG_IGN);
+	if (strcmp(argv[1], "load") == 0) {
+	    selftest_load(argc > 2 ? atoi(argv[2]) : 1000,
+			  argc > 3 ? atoi(argv[3]) : 1000);
+	    return 0;
+	}
       selftest();
       return 0;
     }
@@ -3017,99 +3403,33 @@ main(int argc, char *argv[])
     memset(&mainroom, 0, sizeof(mainroom));
     strcpy(mainroom.name, MAIN_NAME);
     strcpy(mainroom.topic, MAIN_TOPIC);
+    croom_hash_add(&mainroom);
 
     /* ----------------------------------- */
     /* main loop                           */
     /* ----------------------------------- */
 
-    FD_ZERO(&mainfds);
-    FD_SET(msock, &mainfds);
-    rptr = &rset;
-    xptr = &xset;
-    maxfds = msock + 1;
-    tmaintain = time(0) + CHAT_INTERVAL;
-
-    for (;;)
+    if ((evbase = event_base_new()) == NULL)
     {
-	uptime = time(0);
-	if (tmaintain < uptime)
-	{
-	    tmaintain = uptime + CHAT_INTERVAL;
-
-	    /* client/server Q ping-pong kP_ user OO٬ */
-	    /* pG client wgFAN resource */
-
-	    free_resource(msock);
-#ifdef SELFTEST
-	    break;
-#endif
-	}
-
-	memcpy(rptr, &mainfds, sizeof(fd_set));
-	memcpy(xptr, &mainfds, sizeof(fd_set));
-
-	/* Thor: for future reservation bug */
-
-	tv.tv_sec = CHAT_INTERVAL;
-	tv.tv_usec = 0;
-
-	nfds = select(maxfds, rptr, NULL, xptr, &tv);
-
-	/* free idle user & chatroom's resource when no traffic */
-	if (nfds == 0)
-	    continue;
-
-	/* check error condition */
-	if (nfds < 0)
-	    continue;
-
-	/* accept new connection */
-	if (FD_ISSET(msock, rptr)) {
-	    csock = accept(msock, NULL, NULL);
-
-	    if(csock < 0) {
-		if(errno != EINTR) {
-		    // TODO
-		}
-	    } else {
-		cu = (ChatUser *) malloc(sizeof(ChatUser));
-		if(cu == NULL) {
-		    close(csock);
-		    logit("accept", "malloc fail");
-		} else {
-		    memset(cu, 0, sizeof(ChatUser));
-		    cu->sock = csock;
-		    cu->unext = mainuser;
-		    mainuser = cu;
-
-		    totaluser++;
-		    FD_SET(csock, &mainfds);
-		    if (csock >= maxfds)
-			maxfds = csock + 1;
+	logit("main", "event_base_new fail");
+	abort_server();
+    }
+    evutil_make_socket_nonblocking(msock);
+    ev_accept = event_new(evbase, msock, EV_READ | EV_PERSIST, accept_user,
+			  NULL);
+    event_add(ev_accept, NULL);
 
-#ifdef  DEBUG
-		    logit("accept", "OK");
-#endif
-		}
-	    }
-	}
+    /* client/server Q ping-pong kP_ user OO٬ */
+    /* pG client wgFAN resource */
+    ev_maintain = event_new(evbase, -1, EV_PERSIST, free_resource, NULL);
+    tv.tv_sec = CHAT_INTERVAL;
+    tv.tv_usec = 0;
+    event_add(ev_maintain, &tv);
 
-	for (cu = mainuser; cu && nfds>0; cu = cunext) {
-	    /* logout_user() | free(cu);  cu->next OU */
-	    /* FIXME Yn cu b main room /kick cu->next, h cu->next |Q free  */
-	    cunext = cu->unext;
-	    csock = cu->sock;
-	    if (FD_ISSET(csock, xptr)) {
-		logout_user(cu);
-		nfds--;
-	    } else if (FD_ISSET(csock, rptr)) {
-		if (cuser_serve(cu) < 0)
-		    logout_user(cu);
-		nfds--;
-	    }
-	}
+    event_base_dispatch(evbase);
 
-	/* end of main loop */
-    }
+    event_free(ev_maintain);
+    event_free(ev_accept);
+    event_base_free(evbase);
     return 0;
 }